@@ -20,10 +20,23 @@ extern "C" {
  * Specific:
  * %HXMAPT_HASH:	map based on hash
  * %HXMAPT_RBTREE:	map based on red-black binary tree
+ * %HXMAPT_BTREE:	map based on B+tree with linked leaves
+ * %HXMAPT_FLATHASH:	map based on open-addressing hash with inline slots
+ * %HXMAPT_SHARDED:	hash map split into independently locked shards,
+ * 			safe for concurrent use by multiple threads
+ * %HXMAPT_RCU:		read-mostly map; lock-free readers see immutable
+ * 			snapshots which writers replace as a whole
+ * %HXMAPT_FROZEN:	immutable map with a minimal perfect hash, created by
+ * 			HXmap_freeze or HXmap_load
  */
 enum HXmap_type {
 	HXMAPT_HASH = 1,
 	HXMAPT_RBTREE,
+	HXMAPT_FLATHASH,
+	HXMAPT_SHARDED,
+	HXMAPT_RCU,
+	HXMAPT_BTREE,
+	HXMAPT_FROZEN,
 
 	/* aliases - assignments may change */
 	HXMAPT_DEFAULT = HXMAPT_HASH,
@@ -42,6 +55,18 @@ enum HXmap_type {
  * %HXMAP_CKEY:		Make a copy of the key on HXmap_add
  * %HXMAP_SDATA:	Data will be a C-style string (presets ops->d_*)
  * %HXMAP_CDATA:	Make a copy of the data on HXmap_add
+ * %HXMAP_INCREMENTAL:	Spread hash table relayouts over subsequent
+ * 			add/delete operations
+ * %HXMAP_NOSHRINK:	Never shrink hash tables on deletion
+ * %HXMAP_POOL:		Allocate element nodes from a map-private slab pool
+ * %HXMAP_POW2:		Use power-of-two hash tables, indexed without division
+ * %HXMAP_FASTRANGE:	Index prime-sized hash tables by multiply-shift
+ * %HXMAP_THREADED:	Link RB-tree elements in key order, for O(1)
+ * 			traversal steps that survive deletions
+ * %HXMAP_INLINE:	Store copies of fixed-size keys and values
+ * 			(%HXMAP_CKEY, %HXMAP_CDATA) inside the element node
+ * %HXMAP_IKEY:		Key is a 32- or 64-bit unsigned integer (key_size 4
+ * 			or 8), copied into the map and ordered numerically
  */
 enum {
 	HXMAP_NONE      = 0,
@@ -51,6 +76,14 @@ enum {
 	HXMAP_CKEY      = 1 << 3,
 	HXMAP_SDATA     = 1 << 4,
 	HXMAP_CDATA     = 1 << 5,
+	HXMAP_INCREMENTAL = 1 << 6,
+	HXMAP_NOSHRINK  = 1 << 7,
+	HXMAP_POOL      = 1 << 8,
+	HXMAP_POW2      = 1 << 9,
+	HXMAP_FASTRANGE = 1 << 10,
+	HXMAP_THREADED  = 1 << 11,
+	HXMAP_INLINE    = 1 << 12,
+	HXMAP_IKEY      = 1 << 13,
 
 	HXMAP_SCKEY     = HXMAP_SKEY | HXMAP_CKEY,
 	HXMAP_SCDATA    = HXMAP_SDATA | HXMAP_CDATA,
@@ -66,7 +99,31 @@ enum {
 	HXMAP_DTRAV     = 1 << 0,
 };
 
+/**
+ * Positioning modes for HXmap_travseek
+ * %HXMAP_SEEK_GE:	before the first element not less than the key
+ * %HXMAP_SEEK_GT:	before the first element greater than the key
+ */
+enum {
+	HXMAP_SEEK_GE   = 0,
+	HXMAP_SEEK_GT   = 1 << 0,
+};
+
+struct HXmap_pool;
 struct HXmap_trav;
+struct HXstrpool;
+
+/**
+ * Storage for a traverser in caller-provided memory (HXmap_travinit_at).
+ * The contents are private.
+ */
+struct HXmap_iter {
+	union {
+		void *ptr;
+		unsigned long long ull;
+		char buf[640];
+	} u;
+};
 
 /**
  * @items:	number of items in the map
@@ -88,6 +145,62 @@ struct HXmap_ops {
 	unsigned long (*k_hash)(const void *, size_t);
 };
 
+/**
+ * Optional initialization parameters for HXmap_init6. Zero-valued
+ * members select the defaults.
+ * @expected:	number of elements to reserve room for
+ * @max_load:	load factor (in percent) at which a hash table is grown
+ * @min_load:	load factor (in percent) below which a hash table is shrunk
+ * @pool:	node pool to share with other maps (see HXmap_pool_init);
+ * 		not thread-safe, so only among maps used by one thread
+ * @shards:	number of shards for %HXMAPT_SHARDED (power of two)
+ * @seed:	seed for the default hash function (0: pick a random one)
+ * @strpool:	string pool to intern %HXMAP_SCKEY keys in (see HXstrpool_init);
+ * 		excludes custom k_clone/k_free
+ */
+struct HXmap_params {
+	size_t expected;
+	unsigned int max_load, min_load;
+	struct HXmap_pool *pool;
+	unsigned int shards;
+	unsigned long seed;
+	struct HXstrpool *strpool;
+};
+
+enum {
+	/* Number of entries in HXmap_stats.chains */
+	HXMAP_CHAIN_HIST = 16,
+};
+
+/**
+ * Figures reported by HXmap_stats. Members which do not apply to a map's
+ * type are zero.
+ * @items:	number of elements
+ * @buckets:	number of buckets (hash maps) or slots (flat and frozen maps)
+ * @load_pct:	@items per bucket or slot, in percent
+ * @chains:	histogram of bucket chain lengths; the last entry also counts
+ * 		all longer chains. For %HXMAPT_FLATHASH, the number of
+ * 		elements found that many probe steps from their home group.
+ * @max_chain:	longest chain or probe sequence
+ * @relayouts:	number of table rebuilds (growing, shrinking, reseeding)
+ * @tombstones:	deleted slots not yet reclaimed (%HXMAPT_FLATHASH)
+ * @height:	number of tree levels
+ * @black_height: black nodes on each root-to-leaf path (%HXMAPT_RBTREE)
+ * @table_bytes: memory for bucket arrays, slot arrays or frozen images
+ * @node_bytes:	memory for element nodes or tree nodes
+ * @key_bytes:	memory for copies of keys (%HXMAP_CKEY)
+ * @data_bytes:	memory for copies of values (%HXMAP_CDATA)
+ */
+struct HXmap_stats {
+	size_t items, buckets;
+	unsigned int load_pct;
+	size_t chains[HXMAP_CHAIN_HIST], max_chain;
+	unsigned long relayouts;
+	size_t tombstones;
+	unsigned int height, black_height;
+	size_t table_bytes, node_bytes, key_bytes, data_bytes;
+};
+
 struct HXmap_node {
 	union {
 		void *key;
@@ -102,22 +215,60 @@ struct HXmap_node {
 extern struct HXmap *HXmap_init(enum HXmap_type, unsigned int);
 extern struct HXmap *HXmap_init5(enum HXmap_type, unsigned int,
 	const struct HXmap_ops *, size_t, size_t);
+extern struct HXmap *HXmap_init6(enum HXmap_type, unsigned int,
+	const struct HXmap_ops *, size_t, size_t, const struct HXmap_params *);
+extern int HXmap_reserve(struct HXmap *, size_t);
+extern struct HXmap_pool *HXmap_pool_init(void);
+extern void HXmap_pool_free(struct HXmap_pool *);
+extern struct HXstrpool *HXstrpool_init(void);
+extern void HXstrpool_free(struct HXstrpool *);
+extern const char *HXstrpool_intern(struct HXstrpool *, const char *);
 
 extern int HXmap_add(struct HXmap *, const void *, const void *);
+extern int HXmap_build_sorted(struct HXmap *, const struct HXmap_node *,
+	size_t);
 extern const struct HXmap_node *HXmap_find(const struct HXmap *, const void *);
+extern size_t HXmap_find_many(const struct HXmap *, const void *const *,
+	size_t, const struct HXmap_node **);
+extern const struct HXmap_node *HXmap_find_n(const struct HXmap *,
+	const void *, size_t);
+extern struct HXmap_node *HXmap_find_or_insert(struct HXmap *, const void *,
+	bool *);
 extern void *HXmap_get(const struct HXmap *, const void *);
+extern int HXmap_visit(const struct HXmap *, const void *,
+	void (*)(const struct HXmap_node *, void *), void *);
 extern void *HXmap_del(struct HXmap *, const void *);
 extern struct HXmap_node *HXmap_keysvalues(const struct HXmap *);
 extern struct HXmap_trav *HXmap_travinit(const struct HXmap *, unsigned int);
+extern struct HXmap_trav *HXmap_travinit_at(struct HXmap_iter *,
+	const struct HXmap *, unsigned int);
 extern const struct HXmap_node *HXmap_traverse(struct HXmap_trav *);
+extern const struct HXmap_node *HXmap_traverse_prev(struct HXmap_trav *);
+extern size_t HXmap_traverse_many(struct HXmap_trav *, struct HXmap_node *,
+	size_t);
+extern int HXmap_travseek(struct HXmap_trav *, const void *, unsigned int);
 extern void HXmap_travfree(struct HXmap_trav *);
 extern void HXmap_qfe(const struct HXmap *,
 	bool (*)(const struct HXmap_node *, void *), void *);
+extern int HXmap_qfe_parallel(const struct HXmap *,
+	bool (*)(const struct HXmap_node *, void *), void *, unsigned int);
 extern void HXmap_free(struct HXmap *);
+extern int HXmap_publish(struct HXmap *, struct HXmap *);
+extern struct HXmap *HXmap_freeze(const struct HXmap *);
+extern int HXmap_save(const struct HXmap *, const char *);
+extern struct HXmap *HXmap_load(const char *);
+extern int HXmap_stats(const struct HXmap *, struct HXmap_stats *);
 
 extern unsigned long HXhash_jlookup3(const void *, size_t);
 extern unsigned long HXhash_jlookup3s(const void *, size_t);
 extern unsigned long HXhash_djb2(const void *, size_t);
+extern unsigned long HXhash_djb2_n(const void *, size_t);
+extern unsigned long HXhash_wy(const void *, size_t);
+extern unsigned long HXhash_wys(const void *, size_t);
+extern unsigned long HXhash_wy_seed(const void *, size_t, unsigned long);
+extern unsigned long HXhash_crc32c(const void *, size_t);
+extern unsigned long HXhash_crc32cs(const void *, size_t);
+extern unsigned long HXhash_crc32c_seed(const void *, size_t, unsigned long);
 
 #ifdef __cplusplus
 } /* extern "C" */
@@ -0,0 +1,748 @@
+#ifndef LIBHX_MAP_HPP
+#define LIBHX_MAP_HPP 1
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <tuple>
+#include <utility>
+
+/*
+ * Typed counterparts of HXMAPT_HASH and HXMAPT_RBTREE. The algorithms are
+ * those of map.c, but the hash/compare operations are template parameters
+ * rather than HXmap_ops function pointers, so that they can be inlined, and
+ * keys and values are stored in the element nodes by value.
+ */
+namespace HX {
+
+namespace map_detail {
+
+/*
+ * Same bucket reduction as HXUMAP_BK_POW2: the upper bits of the product
+ * with the golden ratio, so that std::hash's identity hash for integers
+ * still spreads across the table.
+ */
+inline size_t pow2_index(size_t hash, unsigned int shift)
+{
+	return (static_cast<uint64_t>(hash) *
+	       UINT64_C(0x9E3779B97F4A7C15)) >> (64 - shift);
+}
+
+} /* namespace map_detail */
+
+template<typename K, typename V, typename Hash = std::hash<K>,
+         typename Eq = std::equal_to<K>> class hash_map {
+	public:
+	using key_type    = K;
+	using mapped_type = V;
+	using value_type  = std::pair<const K, V>;
+	using size_type   = size_t;
+
+	private:
+	struct node {
+		template<typename KK, typename... A>
+		node(size_t h, KK &&k, A &&...args) :
+			hash(h), kv(std::piecewise_construct,
+			std::forward_as_tuple(std::forward<KK>(k)),
+			std::forward_as_tuple(std::forward<A>(args)...))
+		{}
+		node *next = nullptr;
+		size_t hash;
+		value_type kv;
+	};
+
+	template<bool C> class basic_iterator {
+		public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = typename hash_map::value_type;
+		using difference_type = ptrdiff_t;
+		using pointer   = std::conditional_t<C, const value_type *, value_type *>;
+		using reference = std::conditional_t<C, const value_type &, value_type &>;
+
+		basic_iterator() = default;
+		template<bool D, typename = std::enable_if_t<C && !D>>
+		basic_iterator(const basic_iterator<D> &o) :
+			m_map(o.m_map), m_idx(o.m_idx), m_node(o.m_node)
+		{}
+		reference operator*() const { return m_node->kv; }
+		pointer operator->() const { return &m_node->kv; }
+		basic_iterator &operator++()
+		{
+			m_node = m_node->next;
+			if (m_node == nullptr)
+				m_node = m_map->first_from(m_idx + 1, m_idx);
+			return *this;
+		}
+		basic_iterator operator++(int) { auto r = *this; ++*this; return r; }
+		bool operator==(const basic_iterator &o) const { return m_node == o.m_node; }
+		bool operator!=(const basic_iterator &o) const { return m_node != o.m_node; }
+
+		private:
+		basic_iterator(const hash_map *m, size_t i, node *n) :
+			m_map(m), m_idx(i), m_node(n)
+		{}
+		const hash_map *m_map = nullptr;
+		size_t m_idx = 0;
+		node *m_node = nullptr;
+		friend class hash_map;
+		template<bool> friend class basic_iterator;
+	};
+
+	public:
+	using iterator       = basic_iterator<false>;
+	using const_iterator = basic_iterator<true>;
+
+	hash_map() = default;
+	explicit hash_map(size_t expected) { reserve(expected); }
+	hash_map(const hash_map &) = delete;
+	hash_map(hash_map &&o) noexcept { swap(o); }
+	~hash_map() { clear(); delete[] m_bk; }
+	void operator=(const hash_map &) = delete;
+	hash_map &operator=(hash_map &&o) noexcept
+	{
+		hash_map(std::move(o)).swap(*this);
+		return *this;
+	}
+
+	void swap(hash_map &o) noexcept
+	{
+		std::swap(m_bk, o.m_bk);
+		std::swap(m_shift, o.m_shift);
+		std::swap(m_min_shift, o.m_min_shift);
+		std::swap(m_items, o.m_items);
+		std::swap(m_hash, o.m_hash);
+		std::swap(m_eq, o.m_eq);
+	}
+
+	size_t size() const { return m_items; }
+	bool empty() const { return m_items == 0; }
+	size_t bucket_count() const { return m_bk != nullptr ? size_t(1) << m_shift : 0; }
+
+	iterator begin() { size_t i = 0; node *n = first_from(0, i); return {this, i, n}; }
+	iterator end() { return {}; }
+	const_iterator begin() const { size_t i = 0; node *n = first_from(0, i); return {this, i, n}; }
+	const_iterator end() const { return {}; }
+	const_iterator cbegin() const { return begin(); }
+	const_iterator cend() const { return end(); }
+
+	/**
+	 * Size the table such that @n elements fit without a relayout, and do
+	 * not shrink below that later on (cf. HXmap_reserve).
+	 */
+	void reserve(size_t n)
+	{
+		unsigned int shift = MIN_SHIFT;
+		while (max_load(shift) < n)
+			++shift;
+		m_min_shift = shift;
+		if (m_bk == nullptr || shift > m_shift)
+			layout(shift);
+	}
+
+	void clear() noexcept
+	{
+		if (m_bk == nullptr)
+			return;
+		for (size_t i = 0; i < bucket_count(); ++i) {
+			for (node *n = m_bk[i], *next; n != nullptr; n = next) {
+				next = n->next;
+				delete n;
+			}
+			m_bk[i] = nullptr;
+		}
+		m_items = 0;
+	}
+
+	iterator find(const K &key)
+	{
+		size_t h = m_hash(key), idx = 0;
+		node *n = lookup(key, h, idx);
+		return n != nullptr ? iterator(this, idx, n) : end();
+	}
+	const_iterator find(const K &key) const
+	{
+		return const_cast<hash_map *>(this)->find(key);
+	}
+	bool contains(const K &key) const { return find(key) != end(); }
+
+	/**
+	 * Constructs the value from @args if @key is not present yet. Like
+	 * HXmap_find_or_insert, one hash and one lookup serve both cases.
+	 */
+	template<typename... A>
+	std::pair<iterator, bool> try_emplace(const K &key, A &&...args)
+	{
+		return emplace_key(key, std::forward<A>(args)...);
+	}
+	template<typename... A>
+	std::pair<iterator, bool> try_emplace(K &&key, A &&...args)
+	{
+		return emplace_key(std::move(key), std::forward<A>(args)...);
+	}
+
+	/* HXmap_add semantics: an existing element's value is replaced. */
+	template<typename M>
+	std::pair<iterator, bool> insert_or_assign(const K &key, M &&value)
+	{
+		auto r = emplace_key(key, std::forward<M>(value));
+		if (!r.second)
+			r.first->second = std::forward<M>(value);
+		return r;
+	}
+	template<typename M>
+	std::pair<iterator, bool> insert_or_assign(K &&key, M &&value)
+	{
+		auto r = emplace_key(std::move(key), std::forward<M>(value));
+		if (!r.second)
+			r.first->second = std::forward<M>(value);
+		return r;
+	}
+
+	V &operator[](const K &key) { return try_emplace(key).first->second; }
+	V &operator[](K &&key) { return try_emplace(std::move(key)).first->second; }
+
+	size_t erase(const K &key)
+	{
+		if (m_bk == nullptr)
+			return 0;
+		size_t h = m_hash(key);
+		for (node **pp = &m_bk[index(h)]; *pp != nullptr; pp = &(*pp)->next) {
+			if ((*pp)->hash != h || !m_eq(key, (*pp)->kv.first))
+				continue;
+			unlink(pp);
+			return 1;
+		}
+		return 0;
+	}
+
+	/*
+	 * Returns the iterator following @pos. The table is not shrunk here,
+	 * so that erasing while iterating visits every element once.
+	 */
+	iterator erase(const_iterator pos)
+	{
+		iterator next(this, pos.m_idx, pos.m_node);
+		node **pp = &m_bk[pos.m_idx];
+
+		++next;
+		while (*pp != pos.m_node)
+			pp = &(*pp)->next;
+		unlink(pp, false);
+		return next;
+	}
+
+	private:
+	enum { MIN_SHIFT = 4 };
+
+	/* Grow at 70%, shrink below 25% - the HXMAPT_HASH defaults */
+	static size_t max_load(unsigned int shift) { return (size_t(1) << shift) * 70 / 100; }
+	static size_t min_load(unsigned int shift) { return (size_t(1) << shift) * 25 / 100; }
+
+	size_t index(size_t hash) const { return map_detail::pow2_index(hash, m_shift); }
+
+	node *first_from(size_t i, size_t &idx) const
+	{
+		for (; i < bucket_count(); ++i)
+			if (m_bk[i] != nullptr) {
+				idx = i;
+				return m_bk[i];
+			}
+		return nullptr;
+	}
+
+	node *lookup(const K &key, size_t h, size_t &idx) const
+	{
+		if (m_bk == nullptr)
+			return nullptr;
+		idx = index(h);
+		/* Comparing the full hash first saves most Eq calls. */
+		for (node *n = m_bk[idx]; n != nullptr; n = n->next)
+			if (n->hash == h && m_eq(key, n->kv.first))
+				return n;
+		return nullptr;
+	}
+
+	template<typename KK, typename... A>
+	std::pair<iterator, bool> emplace_key(KK &&key, A &&...args)
+	{
+		size_t h = m_hash(key), idx = 0;
+		node *n = lookup(key, h, idx);
+		if (n != nullptr)
+			return {iterator(this, idx, n), false};
+		if (m_bk == nullptr)
+			layout(m_min_shift);
+		else if (m_items >= max_load(m_shift))
+			layout(m_shift + 1);
+		n = new node(h, std::forward<KK>(key), std::forward<A>(args)...);
+		idx = index(h);
+		n->next = m_bk[idx];
+		m_bk[idx] = n;
+		++m_items;
+		return {iterator(this, idx, n), true};
+	}
+
+	void unlink(node **pp, bool may_shrink = true)
+	{
+		node *n = *pp;
+		*pp = n->next;
+		delete n;
+		--m_items;
+		if (!may_shrink || m_shift <= m_min_shift ||
+		    m_items >= min_load(m_shift))
+			return;
+		try {
+			layout(m_shift - 1);
+		} catch (const std::bad_alloc &) {
+			/* The current table remains usable. */
+		}
+	}
+
+	void layout(unsigned int shift)
+	{
+		size_t old_count = bucket_count();
+		node **old = m_bk;
+		m_bk    = new node *[size_t(1) << shift]();
+		m_shift = shift;
+		for (size_t i = 0; i < old_count; ++i) {
+			for (node *n = old[i], *next; n != nullptr; n = next) {
+				next = n->next;
+				size_t idx = index(n->hash);
+				n->next = m_bk[idx];
+				m_bk[idx] = n;
+			}
+		}
+		delete[] old;
+	}
+
+	node **m_bk = nullptr;
+	unsigned int m_shift = 0, m_min_shift = MIN_SHIFT;
+	size_t m_items = 0;
+	Hash m_hash;
+	Eq m_eq;
+};
+
+template<typename K, typename V, typename Cmp = std::less<K>>
+class ordered_map {
+	public:
+	using key_type    = K;
+	using mapped_type = V;
+	using value_type  = std::pair<const K, V>;
+	using size_type   = size_t;
+
+	private:
+	enum { LEFT = 0, RIGHT = 1, RED = 0, BLACK = 1, MAXDEP = 48 };
+
+	/* Tree linkage; the head's sub[LEFT] is the root (cf. HXrbtree_add) */
+	struct base {
+		base *sub[2] = {nullptr, nullptr};
+		unsigned char color = RED;
+	};
+	/* In-order links as with HXMAP_THREADED, for O(1) iterator steps */
+	struct node : base {
+		template<typename KK, typename... A>
+		node(KK &&k, A &&...args) :
+			kv(std::piecewise_construct,
+			std::forward_as_tuple(std::forward<KK>(k)),
+			std::forward_as_tuple(std::forward<A>(args)...))
+		{}
+		node *link[2] = {nullptr, nullptr};
+		value_type kv;
+	};
+
+	template<bool C> class basic_iterator {
+		public:
+		using iterator_category = std::bidirectional_iterator_tag;
+		using value_type = typename ordered_map::value_type;
+		using difference_type = ptrdiff_t;
+		using pointer   = std::conditional_t<C, const value_type *, value_type *>;
+		using reference = std::conditional_t<C, const value_type &, value_type &>;
+
+		basic_iterator() = default;
+		template<bool D, typename = std::enable_if_t<C && !D>>
+		basic_iterator(const basic_iterator<D> &o) :
+			m_map(o.m_map), m_node(o.m_node)
+		{}
+		reference operator*() const { return m_node->kv; }
+		pointer operator->() const { return &m_node->kv; }
+		basic_iterator &operator++() { m_node = m_node->link[RIGHT]; return *this; }
+		basic_iterator &operator--()
+		{
+			m_node = m_node != nullptr ? m_node->link[LEFT] : m_map->m_last;
+			return *this;
+		}
+		basic_iterator operator++(int) { auto r = *this; ++*this; return r; }
+		basic_iterator operator--(int) { auto r = *this; --*this; return r; }
+		bool operator==(const basic_iterator &o) const { return m_node == o.m_node; }
+		bool operator!=(const basic_iterator &o) const { return m_node != o.m_node; }
+
+		private:
+		basic_iterator(const ordered_map *m, node *n) : m_map(m), m_node(n) {}
+		const ordered_map *m_map = nullptr;
+		node *m_node = nullptr;
+		friend class ordered_map;
+		template<bool> friend class basic_iterator;
+	};
+
+	public:
+	using iterator       = basic_iterator<false>;
+	using const_iterator = basic_iterator<true>;
+
+	ordered_map() = default;
+	ordered_map(const ordered_map &) = delete;
+	ordered_map(ordered_map &&o) noexcept { swap(o); }
+	~ordered_map() { clear(); }
+	void operator=(const ordered_map &) = delete;
+	ordered_map &operator=(ordered_map &&o) noexcept
+	{
+		ordered_map(std::move(o)).swap(*this);
+		return *this;
+	}
+
+	void swap(ordered_map &o) noexcept
+	{
+		std::swap(m_head.sub[LEFT], o.m_head.sub[LEFT]);
+		std::swap(m_first, o.m_first);
+		std::swap(m_last, o.m_last);
+		std::swap(m_items, o.m_items);
+		std::swap(m_cmp, o.m_cmp);
+	}
+
+	size_t size() const { return m_items; }
+	bool empty() const { return m_items == 0; }
+
+	/* end() is distinct per map, so that --end() finds the last element. */
+	iterator begin() { return {this, m_first}; }
+	iterator end() { return {this, nullptr}; }
+	const_iterator begin() const { return {this, m_first}; }
+	const_iterator end() const { return {this, nullptr}; }
+	const_iterator cbegin() const { return begin(); }
+	const_iterator cend() const { return end(); }
+
+	void clear() noexcept
+	{
+		for (node *n = m_first, *next; n != nullptr; n = next) {
+			next = n->link[RIGHT];
+			delete n;
+		}
+		m_head.sub[LEFT] = nullptr;
+		m_first = m_last = nullptr;
+		m_items = 0;
+	}
+
+	iterator find(const K &key)
+	{
+		node *n = lower(key, false);
+		return n != nullptr && !m_cmp(key, n->kv.first) ? iterator(this, n) : end();
+	}
+	const_iterator find(const K &key) const
+	{
+		return const_cast<ordered_map *>(this)->find(key);
+	}
+	bool contains(const K &key) const { return find(key) != end(); }
+
+	/* HXMAP_SEEK_GE and HXMAP_SEEK_GT */
+	iterator lower_bound(const K &key) { return {this, lower(key, false)}; }
+	iterator upper_bound(const K &key) { return {this, lower(key, true)}; }
+	const_iterator lower_bound(const K &key) const { return {this, lower(key, false)}; }
+	const_iterator upper_bound(const K &key) const { return {this, lower(key, true)}; }
+
+	template<typename... A>
+	std::pair<iterator, bool> try_emplace(const K &key, A &&...args)
+	{
+		return emplace_key(key, std::forward<A>(args)...);
+	}
+	template<typename... A>
+	std::pair<iterator, bool> try_emplace(K &&key, A &&...args)
+	{
+		return emplace_key(std::move(key), std::forward<A>(args)...);
+	}
+
+	template<typename M>
+	std::pair<iterator, bool> insert_or_assign(const K &key, M &&value)
+	{
+		auto r = emplace_key(key, std::forward<M>(value));
+		if (!r.second)
+			r.first->second = std::forward<M>(value);
+		return r;
+	}
+	template<typename M>
+	std::pair<iterator, bool> insert_or_assign(K &&key, M &&value)
+	{
+		auto r = emplace_key(std::move(key), std::forward<M>(value));
+		if (!r.second)
+			r.first->second = std::forward<M>(value);
+		return r;
+	}
+
+	V &operator[](const K &key) { return try_emplace(key).first->second; }
+	V &operator[](K &&key) { return try_emplace(std::move(key)).first->second; }
+
+	size_t erase(const K &key)
+	{
+		iterator it = find(key);
+		if (it == end())
+			return 0;
+		erase(it);
+		return 1;
+	}
+
+	/* Returns the iterator following @pos. */
+	iterator erase(const_iterator pos)
+	{
+		base *path[MAXDEP];
+		unsigned char dir[MAXDEP];
+		unsigned int depth = descend(pos.m_node->kv.first, path, dir);
+		node *n = pos.m_node, *next = n->link[RIGHT];
+
+		/* Port of HXrbtree_del */
+		path[depth] = n;
+		if (n->sub[RIGHT] == nullptr)
+			path[depth-1]->sub[dir[depth-1]] = n->sub[LEFT];
+		else if (n->sub[LEFT] == nullptr)
+			path[depth-1]->sub[dir[depth-1]] = n->sub[RIGHT];
+		else
+			depth = del_mm(path, dir, depth);
+		if (n->color == BLACK)
+			dmov(path, dir, depth);
+		if (n->link[LEFT] != nullptr)
+			n->link[LEFT]->link[RIGHT] = next;
+		else
+			m_first = next;
+		if (next != nullptr)
+			next->link[LEFT] = n->link[LEFT];
+		else
+			m_last = n->link[LEFT];
+		--m_items;
+		delete n;
+		return {this, next};
+	}
+
+	private:
+	node *root() const { return static_cast<node *>(m_head.sub[LEFT]); }
+
+	/* The first element not less than (@gt: greater than) @key */
+	node *lower(const K &key, bool gt) const
+	{
+		node *n = root(), *res = nullptr;
+		while (n != nullptr) {
+			bool right = gt ? !m_cmp(key, n->kv.first) : m_cmp(n->kv.first, key);
+			if (!right)
+				res = n;
+			n = static_cast<node *>(n->sub[right]);
+		}
+		return res;
+	}
+
+	/*
+	 * Record the path to @key (which must be present). One comparison per
+	 * level; equality is recognized by the key being neither less than
+	 * nor greater than the node's.
+	 */
+	unsigned int descend(const K &key, base **path, unsigned char *dir)
+	{
+		unsigned int depth = 0;
+		path[depth]  = &m_head;
+		dir[depth++] = LEFT;
+		for (node *n = root(); n != nullptr; ) {
+			if (m_cmp(key, n->kv.first)) {
+				path[depth] = n;
+				dir[depth++] = LEFT;
+			} else if (m_cmp(n->kv.first, key)) {
+				path[depth] = n;
+				dir[depth++] = RIGHT;
+			} else {
+				break;
+			}
+			n = static_cast<node *>(n->sub[dir[depth-1]]);
+		}
+		return depth;
+	}
+
+	template<typename KK, typename... A>
+	std::pair<iterator, bool> emplace_key(KK &&key, A &&...args)
+	{
+		base *path[MAXDEP];
+		unsigned char dir[MAXDEP];
+		unsigned int depth = 0;
+		node *n = root(), *cand = nullptr;
+
+		path[depth]  = &m_head;
+		dir[depth++] = LEFT;
+		/*
+		 * Descend with a single comparison per level. The last node
+		 * at which the path turned right is the only one that can
+		 * equal @key.
+		 */
+		while (n != nullptr) {
+			unsigned char res = !m_cmp(key, n->kv.first);
+			if (res == RIGHT)
+				cand = n;
+			path[depth]  = n;
+			dir[depth++] = res;
+			n = static_cast<node *>(n->sub[res]);
+		}
+		if (cand != nullptr && !m_cmp(cand->kv.first, key))
+			return {iterator(this, cand), false};
+
+		n = new node(std::forward<KK>(key), std::forward<A>(args)...);
+		path[depth-1]->sub[dir[depth-1]] = n;
+		++m_items;
+		thread(n, depth > 1 ? static_cast<node *>(path[depth-1]) : nullptr,
+		       dir[depth-1]);
+		if (depth >= 3 && path[depth-1]->color == RED)
+			amov(path, dir, depth);
+		root()->color = BLACK;
+		return {iterator(this, n), true};
+	}
+
+	/* HXrbtree_thread */
+	void thread(node *n, node *parent, unsigned char side)
+	{
+		node *prev = nullptr, *next = nullptr;
+		if (parent != nullptr && side == LEFT) {
+			next = parent;
+			prev = parent->link[LEFT];
+		} else if (parent != nullptr) {
+			prev = parent;
+			next = parent->link[RIGHT];
+		}
+		n->link[LEFT]  = prev;
+		n->link[RIGHT] = next;
+		if (prev != nullptr)
+			prev->link[RIGHT] = n;
+		else
+			m_first = n;
+		if (next != nullptr)
+			next->link[LEFT] = n;
+		else
+			m_last = n;
+	}
+
+	/* HXrbtree_amov */
+	static void amov(base **path, const unsigned char *dir, unsigned int depth)
+	{
+		base *uncle, *parent, *grandp, *newnode;
+		do {
+			unsigned int LR = dir[depth-2];
+			grandp = path[depth-2];
+			parent = path[depth-1];
+			uncle  = grandp->sub[!LR];
+			if (uncle != nullptr && uncle->color == RED) {
+				parent->color = BLACK;
+				uncle->color  = BLACK;
+				grandp->color = RED;
+				depth        -= 2;
+				continue;
+			}
+			if (dir[depth-1] != LR) {
+				newnode          = parent->sub[!LR];
+				parent->sub[!LR] = newnode->sub[LR];
+				newnode->sub[LR] = parent;
+				grandp->sub[LR]  = newnode;
+				parent           = grandp->sub[LR];
+			}
+			grandp->sub[LR]  = parent->sub[!LR];
+			parent->sub[!LR] = grandp;
+			path[depth-3]->sub[dir[depth-3]] = parent;
+			grandp->color    = RED;
+			parent->color    = BLACK;
+			break;
+		} while (depth >= 3 && path[depth-1]->color == RED);
+	}
+
+	/* HXrbtree_del_mm */
+	static unsigned int del_mm(base **path, unsigned char *dir, unsigned int depth)
+	{
+		base *io_node, *io_parent, *orig_node = path[depth];
+		unsigned char color;
+		unsigned int spos;
+
+		io_node    = orig_node->sub[RIGHT];
+		dir[depth] = RIGHT;
+		if (io_node->sub[LEFT] == nullptr) {
+			io_node->sub[LEFT] = orig_node->sub[LEFT];
+			color              = io_node->color;
+			io_node->color     = orig_node->color;
+			orig_node->color   = color;
+			path[depth-1]->sub[dir[depth-1]] = io_node;
+			path[depth++] = io_node;
+			return depth;
+		}
+		spos = depth++;
+		do {
+			io_parent    = io_node;
+			path[depth]  = io_parent;
+			dir[depth++] = LEFT;
+			io_node      = io_parent->sub[LEFT];
+		} while (io_node->sub[LEFT] != nullptr);
+
+		path[spos-1]->sub[dir[spos-1]] = path[spos] = io_node;
+		io_parent->sub[LEFT] = io_node->sub[RIGHT];
+		io_node->sub[LEFT]   = orig_node->sub[LEFT];
+		io_node->sub[RIGHT]  = orig_node->sub[RIGHT];
+		color            = io_node->color;
+		io_node->color   = orig_node->color;
+		orig_node->color = color;
+		return depth;
+	}
+
+	/* HXrbtree_dmov */
+	static void dmov(base **path, unsigned char *dir, unsigned int depth)
+	{
+		base *w, *x;
+
+		while (true) {
+			unsigned char LR = dir[depth-1];
+			x = path[depth-1]->sub[LR];
+			if (x != nullptr && x->color == RED) {
+				x->color = BLACK;
+				break;
+			}
+			if (depth < 2)
+				break;
+			w = path[depth-1]->sub[!LR];
+			if (w->color == RED) {
+				w->color = BLACK;
+				path[depth-1]->color = RED;
+				path[depth-1]->sub[!LR] = w->sub[LR];
+				w->sub[LR] = path[depth-1];
+				path[depth-2]->sub[dir[depth-2]] = w;
+				path[depth] = path[depth-1];
+				dir[depth]  = LR;
+				path[depth-1] = w;
+				w = path[++depth-1]->sub[!LR];
+			}
+			if ((w->sub[LR] == nullptr || w->sub[LR]->color == BLACK) &&
+			    (w->sub[!LR] == nullptr || w->sub[!LR]->color == BLACK)) {
+				w->color = RED;
+				--depth;
+				continue;
+			}
+			if (w->sub[!LR] == nullptr || w->sub[!LR]->color == BLACK) {
+				base *y = w->sub[LR];
+				y->color = BLACK;
+				w->color = RED;
+				w->sub[LR] = y->sub[!LR];
+				y->sub[!LR] = w;
+				w = path[depth-1]->sub[!LR] = y;
+			}
+			w->color = path[depth-1]->color;
+			path[depth-1]->color = BLACK;
+			w->sub[!LR]->color = BLACK;
+			path[depth-1]->sub[!LR] = w->sub[LR];
+			w->sub[LR] = path[depth-1];
+			path[depth-2]->sub[dir[depth-2]] = w;
+			break;
+		}
+	}
+
+	base m_head;
+	node *m_first = nullptr, *m_last = nullptr;
+	size_t m_items = 0;
+	Cmp m_cmp;
+};
+
+} /* namespace HX */
+
+#endif /* LIBHX_MAP_HPP */
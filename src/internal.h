@@ -57,5 +57,6 @@ struct timeval;
 extern char **HXdeque_to_vec_strdup(const struct HXdeque *, size_t *);
 extern hxmc_t *HXparse_dequote_fmt(const char *, const char *, const char **);
 extern size_t HX_substr_helper(size_t, long, long, size_t *);
+extern uint64_t HXrand_seed64(void);
 
 #endif /* LIBHX_INTERNAL_H */
@@ -8,23 +8,50 @@
  *	either version 2.1 or (at your option) any later version.
  *
  *	Incorporates Public Domain code from Bob Jenkins's lookup3 (May 2006)
+ *	and from Wang Yi's wyhash (final version 4)
  */
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#ifndef _WIN32
+#	include <sys/mman.h>
+#	include <unistd.h>
+#endif
+#include <libHX/io.h>
 #include <libHX/list.h>
 #include <libHX/map.h>
 #include <libHX/string.h>
 #include "internal.h"
 #include "map_int.h"
+#ifndef O_CLOEXEC
+#	define O_CLOEXEC 0
+#endif
 #define N_LEFT  sub[RBT_LEFT]
 #define N_RIGHT sub[RBT_RIGHT]
 
 typedef void *(*clonefunc_t)(const void *, size_t);
+typedef int (*cmpfunc_t)(const void *, const void *, size_t);
+
+enum {
+	/* Old buckets to migrate per operation with %HXMAP_INCREMENTAL */
+	HXUMAP_MIGRATE_STEP = 4,
+	/* Bucket chain length at which a seeded hash map picks a new seed */
+	HXUMAP_MAXCHAIN = 32,
+	/* Keys resolved together by HXmap_find_many */
+	HXMAP_BATCH = 16,
+	/* Shard count limits for %HXMAPT_SHARDED */
+	HXSMAP_DEFSHARDS = 16,
+	HXSMAP_MAXSHARDS = 1024,
+};
 
 #ifdef NONPRIME_HASH
 /*
@@ -53,26 +80,310 @@ EXPORT_SYMBOL const unsigned int HXhash_primes[] = {
 };
 #endif
 
-static void HXumap_free(struct HXumap *hmap)
+/* Bucket counts for %HXMAP_POW2; same number of steps as HXhash_primes */
+static const unsigned int HXumap_pow2_sizes[] = {
+	1 <<  4, 1 <<  5, 1 <<  6,  1 <<  7,
+	1 <<  8, 1 <<  9, 1 << 10,  1 << 11,
+	1 << 12, 1 << 13, 1 << 14,  1 << 15,
+	1 << 16, 1 << 17, 1 << 18,  1 << 19,
+	1 << 20, 1 << 21, 1 << 22,  1 << 23,
+	1 << 24, 1 << 25, 1 << 26,  1 << 27,
+	1 << 28, 1 << 29, 1 << 30, 1U << 31,
+};
+
+/*
+ * Node pool. Slabs are carved into equal-sized elements; released elements
+ * go onto a free list. Slabs are only returned to the system when the pool
+ * is destroyed, which makes HXmap_free of a pool-owning map O(slabs) rather
+ * than O(elements). There is no locking; all maps using a pool must be
+ * modified from one thread at a time.
+ */
+enum {
+	HXPOOL_SLAB_SIZE = 64 * 1024,
+	HXPOOL_MIN_NODES = 16,
+	/* Slab header; also keeps the elements suitably aligned */
+	HXPOOL_HDR_SIZE  = 16,
+};
+
+EXPORT_SYMBOL struct HXmap_pool *HXmap_pool_init(void)
+{
+	struct HXmap_pool *pool;
+
+	if ((pool = calloc(1, sizeof(*pool))) == NULL)
+		return NULL;
+	pool->refcount = 1;
+	return pool;
+}
+
+EXPORT_SYMBOL void HXmap_pool_free(struct HXmap_pool *pool)
+{
+	void *slab, *next;
+
+	if (pool == NULL || --pool->refcount > 0)
+		return;
+	for (slab = pool->slabs; slab != NULL; slab = next) {
+		next = *static_cast(void **, slab);
+		free(slab);
+	}
+	free(pool);
+}
+
+static int HXmap_pool_attach(struct HXmap_private *map,
+    struct HXmap_pool *pool)
+{
+	/* Keep uint64_t/double members of trailing storage aligned */
+	size_t node_size = (map->node_size + 7) & ~static_cast(size_t, 7);
+
+	if (map->node_size == 0)
+		/* Type without element nodes */
+		return 1;
+	if (pool->node_size == 0) {
+		pool->node_size  = node_size;
+		pool->slab_nodes = (HXPOOL_SLAB_SIZE - HXPOOL_HDR_SIZE) /
+		                   node_size;
+		if (pool->slab_nodes < HXPOOL_MIN_NODES)
+			pool->slab_nodes = HXPOOL_MIN_NODES;
+	} else if (pool->node_size != node_size) {
+		return -EINVAL;
+	}
+	++pool->refcount;
+	map->pool = pool;
+	return 1;
+}
+
+static void *HXmap_pool_get(struct HXmap_pool *pool)
+{
+	char *slab, *node;
+	size_t i;
+
+	if (pool->free_list == NULL) {
+		slab = malloc(HXPOOL_HDR_SIZE +
+		       pool->slab_nodes * pool->node_size);
+		if (slab == NULL)
+			return NULL;
+		*reinterpret_cast(void **, slab) = pool->slabs;
+		pool->slabs = slab;
+		node = slab + HXPOOL_HDR_SIZE;
+		for (i = 0; i < pool->slab_nodes; ++i) {
+			*reinterpret_cast(void **, node) = pool->free_list;
+			pool->free_list = node;
+			node += pool->node_size;
+		}
+	}
+	node = pool->free_list;
+	pool->free_list = *reinterpret_cast(void **, node);
+	return node;
+}
+
+static __inline__ void *HXmap_node_alloc(const struct HXmap_private *map)
+{
+	if (map->pool != NULL)
+		return HXmap_pool_get(map->pool);
+	return malloc(map->node_size);
+}
+
+static __inline__ void HXmap_node_free(const struct HXmap_private *map,
+    void *node)
+{
+	if (map->pool == NULL) {
+		free(node);
+		return;
+	}
+	*static_cast(void **, node) = map->pool->free_list;
+	map->pool->free_list = node;
+}
+
+/**
+ * HXmap_free_bulk - whether per-element teardown can be skipped
+ *
+ * True if the map is the sole owner of its pool (all nodes vanish with the
+ * pool), and there are no keys or values to release either.
+ */
+static __inline__ bool HXmap_free_bulk(const struct HXmap_private *map)
+{
+	return map->pool != NULL && map->pool->refcount == 1 &&
+	       (map->ops.k_free == NULL || map->key_off != 0 ||
+	       map->strpool != NULL) &&
+	       (map->ops.d_free == NULL || map->data_off != 0);
+}
+
+/**
+ * HXmap_kclone - make the key copy an element node owns
+ * @node:	element node the copy is for
+ *
+ * With inline storage (%HXMAP_INLINE), the copy lives in @node itself.
+ * With a string pool, it is the pool's copy, shared with other elements.
+ */
+static __inline__ void *HXmap_kclone(const struct HXmap_private *map,
+    void *node, const void *key)
+{
+	if (map->key_off == 0 && map->strpool == NULL)
+		return map->ops.k_clone(key, map->key_size);
+	if (key == NULL)
+		return NULL;
+	if (map->strpool != NULL)
+		return const_cast1(char *, HXstrpool_intern(map->strpool, key));
+	return memcpy(static_cast(char *, node) + map->key_off, key,
+	       map->key_size);
+}
+
+/*
+ * Stands in for the value of elements created by HXmap_find_or_insert in
+ * maps which copy fixed-size values; such elements start out zero-filled.
+ */
+static const char HXmap_zero[1];
+
+static __inline__ void *HXmap_dclone(const struct HXmap_private *map,
+    void *node, const void *value)
+{
+	if (map->data_off == 0 && value == HXmap_zero)
+		return calloc(1, map->data_size);
+	if (map->data_off == 0)
+		return map->ops.d_clone(value, map->data_size);
+	if (value == NULL)
+		return NULL;
+	if (value == HXmap_zero)
+		return memset(static_cast(char *, node) + map->data_off, 0,
+		       map->data_size);
+	return memcpy(static_cast(char *, node) + map->data_off, value,
+	       map->data_size);
+}
+
+static __inline__ void HXmap_kfree(const struct HXmap_private *map, void *key)
+{
+	if (map->key_off == 0 && map->strpool == NULL &&
+	    map->ops.k_free != NULL)
+		map->ops.k_free(key);
+}
+
+static __inline__ void HXmap_dfree(const struct HXmap_private *map,
+    void *value)
+{
+	if (map->data_off == 0 && map->ops.d_free != NULL)
+		map->ops.d_free(value);
+}
+
+/**
+ * HXumap_bkidx - map hash value to bucket index
+ * @hmap:	hash map
+ * @hash:	hash value
+ * @power:	index into @hmap->bk_sizes
+ */
+static __inline__ unsigned int HXumap_bkidx(const struct HXumap *hmap,
+    unsigned long hash, unsigned int power)
+{
+	/*
+	 * Both alternative reductions use the upper half of the product with
+	 * the golden ratio, to which all hash bits contribute, so even weak
+	 * hashes (djb2) spread well without an integer division.
+	 */
+	uint64_t h = static_cast(uint64_t, hash) * UINT64_C(0x9E3779B97F4A7C15);
+
+	switch (hmap->bk_mode) {
+	case HXUMAP_BK_POW2:
+		return h >> (64 - HXUMAP_POW2_SHIFT - power);
+	case HXUMAP_BK_FASTRANGE:
+		return ((h >> 32) * hmap->bk_sizes[power]) >> 32;
+	default:
+#ifdef NONPRIME_HASH
+		return hash & (HXhash_primes[power] - 1);
+#else
+		return hash % HXhash_primes[power];
+#endif
+	}
+}
+
+/**
+ * HXumap_bucket - find the bucket a key with the given hash lives in
+ * @hmap:	hash map
+ * @hash:	hash value of the key
+ *
+ * While an incremental relayout is in progress, keys whose old bucket has
+ * not been migrated yet are still to be found in @hmap->old_array.
+ */
+static struct HXlist_head *HXumap_bucket(const struct HXumap *hmap,
+    unsigned long hash)
+{
+	if (hmap->old_array != NULL) {
+		unsigned int idx = HXumap_bkidx(hmap, hash, hmap->old_power);
+		if (idx >= hmap->mig_idx)
+			return &hmap->old_array[idx];
+	}
+	return &hmap->bk_array[HXumap_bkidx(hmap, hash, hmap->power)];
+}
+
+static void HXumap_free_bk(struct HXumap *hmap, struct HXlist_head *bk_array,
+    unsigned int bk_number)
 {
 	struct HXumap_node *drop, *dnext;
 	unsigned int i;
 
-	for (i = 0; i < HXhash_primes[hmap->power]; ++i) {
-		HXlist_for_each_entry_safe(drop, dnext,
-		    &hmap->bk_array[i], anchor) {
-			if (hmap->super.ops.k_free != NULL)
-				hmap->super.ops.k_free(drop->key);
-			if (hmap->super.ops.d_free != NULL)
-				hmap->super.ops.d_free(drop->data);
-			free(drop);
+	if (HXmap_free_bulk(&hmap->super)) {
+		free(bk_array);
+		return;
+	}
+	for (i = 0; i < bk_number; ++i) {
+		HXlist_for_each_entry_safe(drop, dnext, &bk_array[i], anchor) {
+			HXmap_kfree(&hmap->super, drop->key);
+			HXmap_dfree(&hmap->super, drop->data);
+			HXmap_node_free(&hmap->super, drop);
 		}
 	}
+	free(bk_array);
+}
 
-	free(hmap->bk_array);
+static void HXumap_free(struct HXumap *hmap)
+{
+	if (hmap->bk_array != NULL)
+		HXumap_free_bk(hmap, hmap->bk_array,
+			hmap->bk_sizes[hmap->power]);
+	if (hmap->old_array != NULL)
+		HXumap_free_bk(hmap, hmap->old_array,
+			hmap->bk_sizes[hmap->old_power]);
+	HXmap_pool_free(hmap->super.pool);
+	HXstrpool_free(hmap->super.strpool);
 	free(hmap);
 }
 
+static void HXfmap_free(struct HXfmap *fmap)
+{
+	size_t i;
+
+	for (i = 0; i < fmap->capacity; ++i) {
+		if (fmap->ctrl[i] & HXFMAP_EMPTY)
+			continue;
+		HXmap_kfree(&fmap->super, fmap->slots[i].key);
+		if (fmap->super.ops.d_free != NULL)
+			fmap->super.ops.d_free(fmap->slots[i].data);
+	}
+
+	free(fmap->ctrl);
+	free(fmap->slots);
+	HXstrpool_free(fmap->super.strpool);
+	free(fmap);
+}
+
+static void HXsmap_free(struct HXsmap *smap)
+{
+	unsigned int i;
+
+	for (i = 0; i < smap->nshards; ++i) {
+		if (smap->shards[i].hmap != NULL)
+			HXumap_free(smap->shards[i].hmap);
+		pthread_rwlock_destroy(&smap->shards[i].lock);
+	}
+	free(smap->shards);
+	free(smap);
+}
+
+static void HXrmap_free(struct HXrmap *rmap)
+{
+	HXmap_free(static_cast(void *, rmap->snap));
+	pthread_mutex_destroy(&rmap->wlock);
+	free(rmap->slots);
+	free(rmap);
+}
+
 static void HXrbtree_free_dive(const struct HXrbtree *btree,
     struct HXrbnode *node)
 {
@@ -86,20 +397,64 @@ static void HXrbtree_free_dive(const struct HXrbtree *btree,
 		HXrbtree_free_dive(btree, node->N_LEFT);
 	if (node->N_RIGHT != NULL)
 		HXrbtree_free_dive(btree, node->N_RIGHT);
-	if (btree->super.ops.k_free != NULL)
-		btree->super.ops.k_free(node->key);
-	if (btree->super.ops.d_free != NULL)
-		btree->super.ops.d_free(node->data);
-	free(node);
+	HXmap_kfree(&btree->super, node->key);
+	HXmap_dfree(&btree->super, node->data);
+	HXmap_node_free(&btree->super, node);
 }
 
 static void HXrbtree_free(struct HXrbtree *btree)
 {
-	if (btree->root != NULL)
+	if (btree->root != NULL && !HXmap_free_bulk(&btree->super))
 		HXrbtree_free_dive(btree, btree->root);
+	HXmap_pool_free(btree->super.pool);
+	HXstrpool_free(btree->super.strpool);
+	pthread_mutex_destroy(&btree->travs_lock);
 	free(btree);
 }
 
+static void HXbptree_free_dive(struct HXbpnode *node)
+{
+	const struct HXbpinner *in = static_cast(void *, node);
+	unsigned int i;
+
+	if (!node->leaf)
+		for (i = 0; i < in->hdr.count; ++i)
+			HXbptree_free_dive(in->child[i]);
+	free(node);
+}
+
+static void HXbptree_free(struct HXbptree *bt)
+{
+	const struct HXbpleaf *leaf;
+	unsigned int i;
+
+	if (bt->super.ops.k_free != NULL || bt->super.ops.d_free != NULL)
+		for (leaf = bt->first; leaf != NULL; leaf = leaf->next)
+			for (i = 0; i < leaf->hdr.count; ++i) {
+				HXmap_kfree(&bt->super, leaf->elem[i].key);
+				if (bt->super.ops.d_free != NULL)
+					bt->super.ops.d_free(leaf->elem[i].data);
+			}
+	if (bt->root != NULL)
+		HXbptree_free_dive(bt->root);
+	HXstrpool_free(bt->super.strpool);
+	free(bt);
+}
+
+static void HXzmap_free(struct HXzmap *zmap)
+{
+	/* Keys and values are part of the image. */
+	free(zmap->nodes);
+#ifndef _WIN32
+	if (zmap->mapped)
+		munmap(const_cast1(void *, static_cast(const void *, zmap->hdr)),
+			zmap->size);
+	else
+#endif
+		free(const_cast1(void *, static_cast(const void *, zmap->hdr)));
+	free(zmap);
+}
+
 EXPORT_SYMBOL void HXmap_free(struct HXmap *xmap)
 {
 	if (xmap == NULL)
@@ -112,6 +467,16 @@ EXPORT_SYMBOL void HXmap_free(struct HXmap *xmap)
 		return HXumap_free(vmap);
 	case HXMAPT_RBTREE:
 		return HXrbtree_free(vmap);
+	case HXMAPT_FLATHASH:
+		return HXfmap_free(vmap);
+	case HXMAPT_SHARDED:
+		return HXsmap_free(vmap);
+	case HXMAPT_RCU:
+		return HXrmap_free(vmap);
+	case HXMAPT_BTREE:
+		return HXbptree_free(vmap);
+	case HXMAPT_FROZEN:
+		return HXzmap_free(vmap);
 	default:
 		break;
 	}
@@ -127,6 +492,27 @@ static int HXmap_valuecmp(const void *pa, const void *pb, size_t len)
 	return (pa > pb) ? 1 : (pa < pb) ? -1 : 0;
 }
 
+/**
+ * HXmap_u32cmp, HXmap_u64cmp - compare %HXMAP_IKEY keys numerically
+ */
+static int HXmap_u32cmp(const void *pa, const void *pb, size_t len)
+{
+	uint32_t a, b;
+
+	memcpy(&a, pa, sizeof(a));
+	memcpy(&b, pb, sizeof(b));
+	return (a > b) ? 1 : (a < b) ? -1 : 0;
+}
+
+static int HXmap_u64cmp(const void *pa, const void *pb, size_t len)
+{
+	uint64_t a, b;
+
+	memcpy(&a, pa, sizeof(a));
+	memcpy(&b, pb, sizeof(b));
+	return (a > b) ? 1 : (a < b) ? -1 : 0;
+}
+
 static void *HXmap_valuecpy(const void *p, size_t len)
 {
 	return const_cast1(void *, p);
@@ -185,11 +571,6 @@ EXPORT_SYMBOL unsigned long HXhash_jlookup3(const void *vkey, size_t length)
 	return c;
 }
 
-static unsigned long HXhash_jlookup3v(const void *p, size_t z)
-{
-	return HXhash_jlookup3(&p, sizeof(p));
-}
-
 EXPORT_SYMBOL unsigned long HXhash_jlookup3s(const void *p, size_t z)
 {
 	return HXhash_jlookup3(p, strlen(p));
@@ -208,1212 +589,6311 @@ EXPORT_SYMBOL unsigned long HXhash_djb2(const void *p, size_t z)
 }
 
 /**
- * Set up the operations for a map based on flags, and then override with
- * user-specified functions.
+ * HXhash_djb2_n - djb2 of a byte range
+ *
+ * Equals HXhash_djb2 of the same bytes as a C string.
  */
-static void HXmap_ops_setup(struct HXmap_private *super,
-    const struct HXmap_ops *new_ops)
+EXPORT_SYMBOL unsigned long HXhash_djb2_n(const void *p, size_t z)
 {
-	struct HXmap_ops *ops = &super->ops;
-
-	ops->k_clone = HXmap_valuecpy;
-	ops->d_clone = HXmap_valuecpy;
-
-	if (super->flags & HXMAP_SKEY)
-		ops->k_compare = static_cast(void *, strcmp);
-	else if (super->key_size == 0)
-		ops->k_compare = HXmap_valuecmp;
-	else
-		ops->k_compare = memcmp;
-
-	if (super->flags & HXMAP_CKEY) {
-		ops->k_clone = (super->flags & HXMAP_SKEY) ?
-		               reinterpret_cast(clonefunc_t, HX_strdup) :
-		               HX_memdup;
-		ops->k_free  = free;
-	}
-	if (super->flags & HXMAP_CDATA) {
-		ops->d_clone = (super->flags & HXMAP_SDATA) ?
-		               reinterpret_cast(clonefunc_t, HX_strdup) :
-		               HX_memdup;
-		ops->d_free  = free;
-	}
+	const char *c = p;
+	unsigned long v = 5381;
 
-	if (super->type == HXMAPT_HASH) {
-		if (super->flags & HXMAP_SKEY)
-			ops->k_hash = HXhash_djb2;
-		else if (super->key_size != 0)
-			ops->k_hash = HXhash_jlookup3;
-		else
-			ops->k_hash = HXhash_jlookup3v;
-	}
+	while (z-- > 0)
+		v = ((v << 5) + v) ^ *c++;
+	return v;
+}
 
-	if (new_ops == NULL)
-		return;
+/*
+ * wyhash-style hash (after Wang Yi's public domain wyhash, final version 4):
+ * reads 8 bytes at a time and folds them with 64x64->128-bit multiplies.
+ */
+static const uint64_t HXhash_wy_secret[] = {
+	UINT64_C(0x2d358dccaa6c78a5), UINT64_C(0x8bb84b93962eacc9),
+	UINT64_C(0x4b33a62ed433d4a3), UINT64_C(0x4d5a2da51de1aa47),
+};
 
-	/* Update with user-supplied functions */
-	if (new_ops->k_compare != NULL)
-		ops->k_compare = new_ops->k_compare;
-	if (new_ops->k_clone != NULL)
-		ops->k_clone   = new_ops->k_clone;
-	if (new_ops->k_free != NULL)
-		ops->k_free    = new_ops->k_free;
-	if (new_ops->d_clone != NULL)
-		ops->d_clone   = new_ops->d_clone;
-	if (new_ops->d_free != NULL)
-		ops->d_free    = new_ops->d_free;
-	if (super->type == HXMAPT_HASH && new_ops->k_hash != NULL)
-		ops->k_hash    = new_ops->k_hash;
+static __inline__ void HXhash_mum(uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = static_cast(__uint128_t, *a) * *b;
+	*a = static_cast(uint64_t, r);
+	*b = static_cast(uint64_t, r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32;
+	uint64_t la = static_cast(uint32_t, *a), lb = static_cast(uint32_t, *b);
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl, lo;
+
+	lo = t + (rm1 << 32);
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
 }
 
-/**
- * @n:	nominator of fraction
- * @d:	denominator of fraction
- * @v:	value
- *
- * Calculates @v * (@n / @d) without floating point or risk of overflow
- * (when @n <= @d).
- */
-static __inline__ unsigned int
-x_frac(unsigned int n, unsigned int d, unsigned int v)
+static __inline__ uint64_t HXhash_mix(uint64_t a, uint64_t b)
 {
-	return (v / d) * n + (v % d) * n / d;
+	HXhash_mum(&a, &b);
+	return a ^ b;
 }
 
-/**
- * HXumap_move - move elements from one map to another
- * @bk_array:	target bucket array
- * @bk_number:	number of buckets
- * @hmap:	old hash table
- */
-static void HXumap_move(struct HXlist_head *bk_array, unsigned int bk_number,
-    struct HXumap *hmap)
+static __inline__ uint64_t HXhash_r8(const uint8_t *p)
 {
-	struct HXumap_node *drop, *dnext;
-	unsigned int bk_idx, i;
+	uint64_t v;
 
-#ifdef NONPRIME_HASH
-	--bk_number;
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
 #endif
-	for (i = 0; i < HXhash_primes[hmap->power]; ++i)
-		HXlist_for_each_entry_safe(drop, dnext,
-		    &hmap->bk_array[i], anchor) {
-#ifdef NONPRIME_HASH
-			bk_idx = hmap->super.ops.k_hash(drop->key,
-			         hmap->super.key_size) & bk_number;
-#else
-			bk_idx = hmap->super.ops.k_hash(drop->key,
-			         hmap->super.key_size) % bk_number;
+	return v;
+}
+
+static __inline__ uint64_t HXhash_r4(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
 #endif
-			HXlist_del(&drop->anchor);
-			HXlist_add_tail(&bk_array[bk_idx], &drop->anchor);
+	return v;
+}
+
+EXPORT_SYMBOL unsigned long HXhash_wy_seed(const void *vkey, size_t length,
+    unsigned long useed)
+{
+	const uint64_t *s = HXhash_wy_secret;
+	const uint8_t *p = vkey;
+	uint64_t seed = useed, a, b;
+	size_t i = length;
+
+	seed ^= HXhash_mix(seed ^ s[0], s[1]);
+	if (length <= 16) {
+		if (length >= 4) {
+			/* Overlapping 4-byte reads cover every length in 4..16 */
+			size_t q = (length >> 3) << 2;
+			a = (HXhash_r4(p) << 32) | HXhash_r4(p + q);
+			b = (HXhash_r4(p + length - 4) << 32) |
+			    HXhash_r4(p + length - 4 - q);
+		} else if (length > 0) {
+			a = (static_cast(uint64_t, p[0]) << 16) |
+			    (static_cast(uint64_t, p[length>>1]) << 8) |
+			    p[length-1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		if (i >= 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = HXhash_mix(HXhash_r8(p) ^ s[1],
+				       HXhash_r8(p + 8) ^ seed);
+				see1 = HXhash_mix(HXhash_r8(p + 16) ^ s[2],
+				       HXhash_r8(p + 24) ^ see1);
+				see2 = HXhash_mix(HXhash_r8(p + 32) ^ s[3],
+				       HXhash_r8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i >= 48);
+			seed ^= see1 ^ see2;
 		}
+		for (; i > 16; i -= 16, p += 16)
+			seed = HXhash_mix(HXhash_r8(p) ^ s[1],
+			       HXhash_r8(p + 8) ^ seed);
+		/* Last 16 bytes, possibly overlapping the previous block */
+		a = HXhash_r8(p + i - 16);
+		b = HXhash_r8(p + i - 8);
+	}
+	a ^= s[1];
+	b ^= seed;
+	HXhash_mum(&a, &b);
+	return HXhash_mix(a ^ s[0] ^ length, b ^ s[1]);
 }
 
-/**
- * HXumap_layout - resize and rehash table
- * @hmap:	hash map
- * @prime_idx:	requested new table size (prime power thereof)
- */
-static int HXumap_layout(struct HXumap *hmap, unsigned int power)
+EXPORT_SYMBOL unsigned long HXhash_wy(const void *p, size_t z)
 {
-	const unsigned int bk_number = HXhash_primes[power];
-	struct HXlist_head *bk_array, *old_array = NULL;
-	unsigned int i;
+	return HXhash_wy_seed(p, z, 0);
+}
 
-	bk_array = malloc(bk_number * sizeof(*bk_array));
-	if (bk_array == NULL)
-		return -errno;
-	for (i = 0; i < bk_number; ++i)
-		HXlist_init(&bk_array[i]);
-	if (hmap->bk_array != NULL) {
-		HXumap_move(bk_array, bk_number, hmap);
-		old_array = hmap->bk_array;
-		/*
-		 * It is ok to increment the TID this late. @map->bk_array is
-		 * only emptied, and the new @bk_array is not yet visible to
-		 * traversers, so no elements appear twice.
-		 */
-		++hmap->tid;
-	}
-	hmap->power    = power;
-	hmap->min_load = (power != 0) ? HXhash_primes[power] / 4 : 0;
-	hmap->max_load = x_frac(7, 10, HXhash_primes[power]);
-	hmap->bk_array = bk_array;
-	free(old_array);
-	return 1;
+EXPORT_SYMBOL unsigned long HXhash_wys(const void *p, size_t z)
+{
+	return HXhash_wy_seed(p, strlen(p), 0);
 }
 
-static struct HXmap *HXhashmap_init4(unsigned int flags,
-    const struct HXmap_ops *ops, size_t key_size, size_t data_size)
+/* CRC-32C (Castagnoli), reflected polynomial 0x82F63B78 */
+static const uint32_t HXhash_crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4,
+	0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+	0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+	0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b,
+	0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54,
+	0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+	0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+	0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+	0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5,
+	0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45,
+	0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+	0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+	0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+	0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48,
+	0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687,
+	0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+	0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+	0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+	0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8,
+	0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096,
+	0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+	0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+	0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+	0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9,
+	0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36,
+	0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+	0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+	0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+	0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043,
+	0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3,
+	0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+	0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+	0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+	0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652,
+	0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d,
+	0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+	0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+	0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+	0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2,
+	0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530,
+	0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+	0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+	0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+	0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f,
+	0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90,
+	0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+	0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+	0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+	0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321,
+	0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81,
+	0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+	0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+
+static uint32_t HXhash_crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
 {
-	struct HXmap_private *super;
-	struct HXumap *hmap;
-	int saved_errno;
+	while (len-- > 0)
+		crc = HXhash_crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
 
-	if ((hmap = calloc(1, sizeof(*hmap))) == NULL)
-		return NULL;
+#if defined(__GNUC__) && defined(__x86_64__)
+#	define HXHASH_CRC32C_HW 1
+__attribute__((target("sse4.2")))
+static uint32_t HXhash_crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c = crc, v;
 
-	super            = &hmap->super;
-	super->flags     = flags;
-	super->items     = 0;
-	super->type      = HXMAPT_HASH;
-	super->key_size  = key_size;
-	super->data_size = data_size;
-	HXmap_ops_setup(super, ops);
-	hmap->tid = 1;
-	errno = HXumap_layout(hmap, 0);
-	if (hmap->bk_array == NULL)
-		goto out;
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	crc = c;
+	while (len-- > 0)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
 
-	errno = 0;
-	return static_cast(void *, hmap);
+static __inline__ bool HXhash_crc32c_hwcap(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#	include <arm_acle.h>
+#	define HXHASH_CRC32C_HW 1
+static uint32_t HXhash_crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t v;
 
- out:
-	saved_errno = errno;
-	HXumap_free(hmap);
-	errno = saved_errno;
-	return NULL;
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+	}
+	while (len-- > 0)
+		crc = __crc32cb(crc, *p++);
+	return crc;
 }
 
-static struct HXmap *HXrbtree_init4(unsigned int flags,
-    const struct HXmap_ops *ops, size_t key_size, size_t data_size)
+static __inline__ bool HXhash_crc32c_hwcap(void)
 {
-	struct HXmap_private *super;
-	struct HXrbtree *btree;
+	return true;
+}
+#endif
 
-	BUILD_BUG_ON(offsetof(struct HXrbtree, root) +
-	             offsetof(struct HXrbnode, sub[0]) !=
-	             offsetof(struct HXrbtree, root));
+/**
+ * HXhash_crc32c_seed - CRC-32C of a buffer
+ * @seed:	CRC of preceding data (0 to start a new checksum)
+ *
+ * Uses the SSE4.2 or ARMv8 CRC instructions where available. The CRC is
+ * linear in @seed, so keys that collide do so for every seed; this is not
+ * a keyed hash for untrusted input.
+ */
+EXPORT_SYMBOL unsigned long HXhash_crc32c_seed(const void *p, size_t z,
+    unsigned long seed)
+{
+	uint32_t crc = ~static_cast(uint32_t, seed);
 
-	if ((btree = calloc(1, sizeof(*btree))) == NULL)
-		return NULL;
+#ifdef HXHASH_CRC32C_HW
+	if (HXhash_crc32c_hwcap())
+		return ~HXhash_crc32c_hw(crc, p, z);
+#endif
+	return ~HXhash_crc32c_sw(crc, p, z);
+}
 
-	super            = &btree->super;
-	super->type      = HXMAPT_RBTREE;
-	super->flags     = flags;
-	super->items     = 0;
-	super->key_size  = key_size;
-	super->data_size = data_size;
-	HXmap_ops_setup(super, ops);
+EXPORT_SYMBOL unsigned long HXhash_crc32c(const void *p, size_t z)
+{
+	return HXhash_crc32c_seed(p, z, 0);
+}
 
-	/*
-	 * TID must not be zero, otherwise the traverser functions will not
-	 * start off correctly, since trav->tid is 0, but trav->tid must not
-	 * equal btree->transact because that would mean the traverser is in
-	 * sync with the tree.
-	 */
-	btree->tid  = 1;
-	btree->root = NULL;
-	return static_cast(void *, btree);
+EXPORT_SYMBOL unsigned long HXhash_crc32cs(const void *p, size_t z)
+{
+	return HXhash_crc32c_seed(p, strlen(p), 0);
 }
 
-EXPORT_SYMBOL struct HXmap *HXmap_init5(enum HXmap_type type,
-    unsigned int flags, const struct HXmap_ops *ops, size_t key_size,
-    size_t data_size)
+static unsigned long HXhash_wys_seed(const void *p, size_t z,
+    unsigned long seed)
 {
-	if ((flags & HXMAP_SINGULAR) &&
-	    (flags & (HXMAP_CDATA | HXMAP_SDATA) || data_size != 0))
-		fprintf(stderr, "WARNING: libHX-map: When HXMAP_SINGULAR is "
-		        "set, HXMAP_CDATA, HXMAP_SDATA and/or data_size != 0 "
-		        "has no effect.\n");
+	return HXhash_wy_seed(p, strlen(p), seed);
+}
 
-	switch (type) {
-	case HXMAPT_HASH:
-		return HXhashmap_init4(flags, ops, key_size, data_size);
-	case HXMAPT_RBTREE:
-		return HXrbtree_init4(flags, ops, key_size, data_size);
-	default:
-		errno = -ENOENT;
-		return NULL;
-	}
+/* For maps whose keys are the pointer values themselves */
+static unsigned long HXhash_ptr_seed(const void *p, size_t z,
+    unsigned long seed)
+{
+	return HXhash_mix(reinterpret_cast(uintptr_t, p) ^ HXhash_wy_secret[0],
+	       seed ^ HXhash_wy_secret[1]);
 }
 
-EXPORT_SYMBOL struct HXmap *HXmap_init(enum HXmap_type type,
-    unsigned int flags)
+/* For %HXMAP_IKEY maps: one multiply, instead of a generic byte hash */
+static unsigned long HXhash_u32_seed(const void *p, size_t z,
+    unsigned long seed)
 {
-	/*
-	 * We cannot check this in HXmap_init5, since a custom ops may
-	 * allow key_size==0/data_size==0.
-	 */
-	if ((flags & HXMAP_SCKEY) == HXMAP_CKEY) {
-		fprintf(stderr, "%s: zero key_size with standard memcpy ops "
-		        "won't work.\n", __func__);
-		errno = EINVAL;
-		return NULL;
-	}
-	if ((flags & HXMAP_SCDATA) == HXMAP_CDATA) {
-		fprintf(stderr, "%s: zero data_size with standard memcpy ops "
-		        "won't work.\n", __func__);
-		errno = EINVAL;
-		return NULL;
-	}
-	return HXmap_init5(type, flags, NULL, 0, 0);
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return HXhash_mix(v ^ HXhash_wy_secret[0], seed ^ HXhash_wy_secret[1]);
 }
 
-static struct HXumap_node *HXumap_find(const struct HXumap *hmap,
-    const void *key)
+static unsigned long HXhash_u64_seed(const void *p, size_t z,
+    unsigned long seed)
 {
-	struct HXumap_node *drop;
-	unsigned int bk_idx;
+	uint64_t v;
 
-#ifdef NONPRIME_HASH
-	bk_idx = hmap->super.ops.k_hash(key, hmap->super.key_size) &
-	         (HXhash_primes[hmap->power] - 1);
-#else
-	bk_idx = hmap->super.ops.k_hash(key, hmap->super.key_size) %
-	         HXhash_primes[hmap->power];
-#endif
-	HXlist_for_each_entry(drop, &hmap->bk_array[bk_idx], anchor)
-		if (hmap->super.ops.k_compare(key, drop->key,
-		    hmap->super.key_size) == 0)
-			return drop;
-	return NULL;
+	memcpy(&v, p, sizeof(v));
+	return HXhash_mix(v ^ HXhash_wy_secret[0], seed ^ HXhash_wy_secret[1]);
 }
 
-static const struct HXmap_node *HXrbtree_find(const struct HXrbtree *btree,
-    const void *key)
+static uint64_t HXmap_seed_base;
+static unsigned long HXmap_seed_count;
+static pthread_once_t HXmap_seed_once = PTHREAD_ONCE_INIT;
+
+static void HXmap_seed_init(void)
 {
-	struct HXrbnode *node = btree->root;
-	int res;
+	HXmap_seed_base = HXrand_seed64();
+}
 
-	while (node != NULL) {
-		if ((res = btree->super.ops.k_compare(key,
-		    node->key, btree->super.key_size)) == 0)
-			return static_cast(const void *, &node->key);
-		node = node->sub[res > 0];
-	}
+/**
+ * HXmap_seed_new - pick a hash seed for a map
+ *
+ * The entropy source is only read once per process so that creating maps
+ * stays cheap; mixing in a counter makes every map's seed different.
+ */
+static unsigned long HXmap_seed_new(void)
+{
+	unsigned long n;
 
-	return NULL;
+	pthread_once(&HXmap_seed_once, HXmap_seed_init);
+	n = __atomic_add_fetch(&HXmap_seed_count, 1, __ATOMIC_RELAXED);
+	return HXhash_mix(HXmap_seed_base ^ HXhash_wy_secret[2],
+	       n ^ HXhash_wy_secret[3]);
 }
 
-EXPORT_SYMBOL const struct HXmap_node *
-HXmap_find(const struct HXmap *xmap, const void *key)
+/*
+ * String pool. Interned strings are packed into arena chunks and indexed by
+ * an open-addressing table. They stay until the pool is destroyed, so the
+ * pointers handed out are stable, and equal strings share one address.
+ */
+enum {
+	HXSTRPOOL_CHUNK  = 64 * 1024,
+	HXSTRPOOL_MINCAP = 64,
+};
+
+EXPORT_SYMBOL struct HXstrpool *HXstrpool_init(void)
 {
-	const void *vmap = xmap;
-	const struct HXmap_private *map = vmap;
+	struct HXstrpool *sp;
+	int ret;
 
-	switch (map->type) {
-	case HXMAPT_HASH: {
-		const struct HXumap_node *node = HXumap_find(vmap, key);
-		if (node == NULL)
-			return NULL;
-		return static_cast(const void *, &node->key);
-	}
-	case HXMAPT_RBTREE:
-		return HXrbtree_find(vmap, key);
-	default:
-		errno = EINVAL;
+	if ((sp = calloc(1, sizeof(*sp))) == NULL)
+		return NULL;
+	if ((ret = pthread_mutex_init(&sp->lock, NULL)) != 0) {
+		free(sp);
+		errno = ret;
 		return NULL;
 	}
+	sp->refcount = 1;
+	sp->seed     = HXmap_seed_new();
+	return sp;
 }
 
-EXPORT_SYMBOL void *HXmap_get(const struct HXmap *map, const void *key)
+static void HXstrpool_get(struct HXstrpool *sp)
 {
-	const struct HXmap_node *node;
+	pthread_mutex_lock(&sp->lock);
+	++sp->refcount;
+	pthread_mutex_unlock(&sp->lock);
+}
 
-	if ((node = HXmap_find(map, key)) == NULL) {
-		errno = ENOENT;
-		return NULL;
+EXPORT_SYMBOL void HXstrpool_free(struct HXstrpool *sp)
+{
+	void *chunk, *next;
+	unsigned int left;
+
+	if (sp == NULL)
+		return;
+	pthread_mutex_lock(&sp->lock);
+	left = --sp->refcount;
+	pthread_mutex_unlock(&sp->lock);
+	if (left > 0)
+		return;
+	for (chunk = sp->chunks; chunk != NULL; chunk = next) {
+		next = *static_cast(void **, chunk);
+		free(chunk);
 	}
-	errno = 0;
-	return node->data;
+	free(sp->table);
+	pthread_mutex_destroy(&sp->lock);
+	free(sp);
 }
 
-/**
- * HXumap_replace - replace value in a drop
- */
-static int HXumap_replace(const struct HXumap *hmap, struct HXumap_node *drop,
-    const void *value)
+static int HXstrpool_grow(struct HXstrpool *sp)
 {
-	void *old_value, *new_value;
-
-	if (hmap->super.flags & HXMAP_NOREPLACE)
-		return -EEXIST;
+	size_t cap = sp->capacity == 0 ? HXSTRPOOL_MINCAP : 2 * sp->capacity;
+	struct HXstrpool_slot *table;
+	size_t i, j;
 
-	new_value = hmap->super.ops.d_clone(value, hmap->super.data_size);
-	if (new_value == NULL && value != NULL)
+	if ((table = calloc(cap, sizeof(*table))) == NULL)
 		return -errno;
-	old_value  = drop->data;
-	drop->data = new_value;
-	if (hmap->super.ops.d_free != NULL)
-		hmap->super.ops.d_free(old_value);
+	for (i = 0; i < sp->capacity; ++i) {
+		if (sp->table[i].str == NULL)
+			continue;
+		for (j = sp->table[i].hash & (cap - 1); table[j].str != NULL;
+		     j = (j + 1) & (cap - 1))
+			;
+		table[j] = sp->table[i];
+	}
+	free(sp->table);
+	sp->table    = table;
+	sp->capacity = cap;
 	return 1;
 }
 
-static int HXumap_add(struct HXumap *hmap, const void *key, const void *value)
+/**
+ * HXstrpool_alloc - take room for a string from the arena
+ *
+ * Strings larger than a quarter chunk get a chunk of their own, so that the
+ * remainder of the current chunk is not wasted.
+ */
+static char *HXstrpool_alloc(struct HXstrpool *sp, size_t size)
 {
-	struct HXumap_node *drop;
-	unsigned int bk_idx;
-	int ret, saved_errno;
-
-	if ((drop = HXumap_find(hmap, key)) != NULL)
-		return HXumap_replace(hmap, drop, value);
-
-	if (hmap->super.items >= hmap->max_load &&
-	    hmap->power < ARRAY_SIZE(HXhash_primes) - 1) {
-		if ((ret = HXumap_layout(hmap, hmap->power + 1)) <= 0)
-			return ret;
-	} else if (hmap->super.items < hmap->min_load && hmap->power > 0) {
-		if ((ret = HXumap_layout(hmap, hmap->power - 1)) <= 0)
-			return ret;
+	size_t csize = HXSTRPOOL_CHUNK;
+	char *chunk;
+
+	if (size <= sp->arena_left) {
+		chunk = sp->arena;
+		sp->arena      += size;
+		sp->arena_left -= size;
+		return chunk;
 	}
+	if (size > HXSTRPOOL_CHUNK / 4)
+		csize = sizeof(void *) + size;
+	if ((chunk = malloc(csize)) == NULL)
+		return NULL;
+	*reinterpret_cast(void **, chunk) = sp->chunks;
+	sp->chunks = chunk;
+	chunk += sizeof(void *);
+	if (csize == HXSTRPOOL_CHUNK) {
+		sp->arena      = chunk + size;
+		sp->arena_left = csize - sizeof(void *) - size;
+	}
+	return chunk;
+}
 
-	/* New node */
-	if ((drop = malloc(sizeof(*drop))) == NULL)
-		return -errno;
-	HXlist_init(&drop->anchor);
-	drop->key = hmap->super.ops.k_clone(key, hmap->super.key_size);
-	if (drop->key == NULL && key != NULL)
+/**
+ * HXstrpool_intern - get the pool's copy of a string
+ * @sp:	string pool
+ * @s:	string to look up and add if necessary
+ *
+ * Returns the address of the pool's copy, which is the same for all equal
+ * strings and valid until the pool is destroyed, or %NULL on error.
+ */
+EXPORT_SYMBOL const char *HXstrpool_intern(struct HXstrpool *sp,
+    const char *s)
+{
+	size_t len = strlen(s), i, mask;
+	unsigned long hash = HXhash_wy_seed(s, len, sp->seed);
+	char *copy = NULL;
+	int saved_errno = 0;
+
+	pthread_mutex_lock(&sp->lock);
+	/* Linear probing, at most half full */
+	if (2 * (sp->items + 1) > sp->capacity && HXstrpool_grow(sp) <= 0) {
+		saved_errno = errno;
 		goto out;
-	drop->data = hmap->super.ops.d_clone(value, hmap->super.data_size);
-	if (drop->data == NULL && value != NULL)
+	}
+	mask = sp->capacity - 1;
+	for (i = hash & mask; sp->table[i].str != NULL; i = (i + 1) & mask)
+		if (sp->table[i].hash == hash &&
+		    strcmp(sp->table[i].str, s) == 0) {
+			copy = sp->table[i].str;
+			goto out;
+		}
+	if ((copy = HXstrpool_alloc(sp, len + 1)) == NULL) {
+		saved_errno = errno;
 		goto out;
-
-#ifdef NONPRIME_HASH
-	bk_idx = hmap->super.ops.k_hash(key, hmap->super.key_size) &
-	         (HXhash_primes[hmap->power] - 1);
-#else
-	bk_idx = hmap->super.ops.k_hash(key, hmap->super.key_size) %
-	         HXhash_primes[hmap->power];
-#endif
-	HXlist_add_tail(&hmap->bk_array[bk_idx], &drop->anchor);
-	++hmap->super.items;
-	return 1;
-
+	}
+	memcpy(copy, s, len + 1);
+	sp->table[i].str  = copy;
+	sp->table[i].hash = hash;
+	++sp->items;
  out:
-	saved_errno = errno;
-	if (hmap->super.ops.k_free != NULL)
-		hmap->super.ops.k_free(drop->key);
-	free(drop);
-	return -(errno = saved_errno);
+	pthread_mutex_unlock(&sp->lock);
+	if (copy == NULL)
+		errno = saved_errno;
+	return copy;
+}
+
+/*
+ * Two keys from the same pool are equal exactly if their addresses are.
+ * Lookup keys need not come from the pool, so only equality is decided
+ * early.
+ */
+static int HXstrpool_cmp(const void *a, const void *b, size_t z)
+{
+	return a == b ? 0 : strcmp(static_cast(const char *, a),
+	       static_cast(const char *, b));
 }
 
 /**
- * HXrbtree_amov - do balance (move) after addition of a node
- * @path:	path from the root to the new node
- * @dir:	direction vectors
- * @depth:	current index in @path and @dir
- * @tid:	pointer to transaction ID which may need updating
+ * Set up the operations for a map based on flags, and then override with
+ * user-specified functions.
  */
-static void HXrbtree_amov(struct HXrbnode **path,
-    const unsigned char *dir, unsigned int depth, unsigned int *tid)
+static void HXmap_ops_setup(struct HXmap_private *super,
+    const struct HXmap_ops *new_ops)
 {
-	struct HXrbnode *uncle, *parent, *grandp, *newnode;
+	struct HXmap_ops *ops = &super->ops;
 
-	/*
-	 * The newly inserted node (or the last rebalanced node) at
-	 * @path[depth-1] is red, so the parent must not be.
-	 *
-	 * Use an iterative approach to not waste time with recursive function
-	 * calls. The @LR variable is used to handle the symmetric case without
-	 * code duplication.
-	 */
-	do {
-		unsigned int LR = dir[depth-2];
+	ops->k_clone = HXmap_valuecpy;
+	ops->d_clone = HXmap_valuecpy;
 
-		grandp = path[depth-2];
-		parent = path[depth-1];
+	if (super->flags & HXMAP_SKEY)
+		ops->k_compare = static_cast(void *, strcmp);
+	else if (super->flags & HXMAP_IKEY)
+		ops->k_compare = super->key_size == sizeof(uint32_t) ?
+		                 HXmap_u32cmp : HXmap_u64cmp;
+	else if (super->key_size == 0)
+		ops->k_compare = HXmap_valuecmp;
+	else
+		ops->k_compare = memcmp;
+
+	if (super->flags & HXMAP_CKEY) {
+		ops->k_clone = (super->flags & HXMAP_SKEY) ?
+		               reinterpret_cast(clonefunc_t, HX_strdup) :
+		               HX_memdup;
+		ops->k_free  = free;
+	}
+	if (super->flags & HXMAP_CDATA) {
+		ops->d_clone = (super->flags & HXMAP_SDATA) ?
+		               reinterpret_cast(clonefunc_t, HX_strdup) :
+		               HX_memdup;
+		ops->d_free  = free;
+	}
+
+	if (super->type == HXMAPT_HASH || super->type == HXMAPT_FLATHASH ||
+	    super->type == HXMAPT_SHARDED) {
+		/* The defaults are keyed with a per-map seed, see HXmap_hash. */
+		if (super->flags & HXMAP_SKEY)
+			super->k_shash = HXhash_wys_seed;
+		else if (super->flags & HXMAP_IKEY)
+			super->k_shash = super->key_size == sizeof(uint32_t) ?
+			                 HXhash_u32_seed : HXhash_u64_seed;
+		else if (super->key_size != 0)
+			super->k_shash = HXhash_wy_seed;
+		else
+			super->k_shash = HXhash_ptr_seed;
+		super->seed = HXmap_seed_new();
+	}
+
+	if (new_ops == NULL)
+		return;
+
+	/* Update with user-supplied functions */
+	if (new_ops->k_compare != NULL)
+		ops->k_compare = new_ops->k_compare;
+	if (new_ops->k_clone != NULL)
+		ops->k_clone   = new_ops->k_clone;
+	if (new_ops->k_free != NULL)
+		ops->k_free    = new_ops->k_free;
+	if (new_ops->d_clone != NULL)
+		ops->d_clone   = new_ops->d_clone;
+	if (new_ops->d_free != NULL)
+		ops->d_free    = new_ops->d_free;
+	if ((super->type == HXMAPT_HASH || super->type == HXMAPT_FLATHASH ||
+	    super->type == HXMAPT_SHARDED) && new_ops->k_hash != NULL) {
+		ops->k_hash    = new_ops->k_hash;
+		super->k_shash = NULL;
+	}
+}
+
+/**
+ * HXmap_inline_setup - make room for key and value copies in element nodes
+ *
+ * For %HXMAP_INLINE, the fixed-size copies which %HXMAP_CKEY and
+ * %HXMAP_CDATA call for are stored behind the element node, saving one
+ * allocation each. %HXMAP_IKEY keys are always stored that way.
+ * User-supplied clone/free functions take precedence.
+ * Must be called once @super->node_size and @super->ops are final.
+ */
+static void HXmap_inline_setup(struct HXmap_private *super)
+{
+	/* Keep uint64_t/double members of trailing storage aligned */
+	static const size_t align = 7;
+	const struct HXmap_ops *ops = &super->ops;
+
+	if (!(super->flags & (HXMAP_INLINE | HXMAP_IKEY)))
+		return;
+	if (ops->k_clone == HX_memdup && ops->k_free == free &&
+	    super->key_size != 0) {
+		super->key_off   = (super->node_size + align) & ~align;
+		super->node_size = super->key_off + super->key_size;
+	}
+	if ((super->flags & HXMAP_INLINE) &&
+	    ops->d_clone == HX_memdup && ops->d_free == free &&
+	    super->data_size != 0) {
+		super->data_off  = (super->node_size + align) & ~align;
+		super->node_size = super->data_off + super->data_size;
+	}
+}
+
+/**
+ * HXmap_hash - hash a key with the map's hash function
+ */
+static __inline__ unsigned long
+HXmap_hash(const struct HXmap_private *map, const void *key)
+{
+	if (map->k_shash != NULL)
+		return map->k_shash(key, map->key_size, map->seed);
+	return map->ops.k_hash(key, map->key_size);
+}
+
+/**
+ * @n:	nominator of fraction
+ * @d:	denominator of fraction
+ * @v:	value
+ *
+ * Calculates @v * (@n / @d) without floating point or risk of overflow
+ * (when @n <= @d).
+ */
+static __inline__ unsigned int
+x_frac(unsigned int n, unsigned int d, unsigned int v)
+{
+	return (v / d) * n + (v % d) * n / d;
+}
+
+/**
+ * z_frac - like x_frac, for size_t
+ */
+static __inline__ size_t z_frac(unsigned int n, unsigned int d, size_t v)
+{
+	return (v / d) * n + (v % d) * n / d;
+}
+
+static void HXumap_setload(struct HXumap *hmap)
+{
+	hmap->min_load = x_frac(hmap->super.min_pct, 100,
+	                 hmap->bk_sizes[hmap->power]);
+	hmap->max_load = x_frac(hmap->super.max_pct, 100,
+	                 hmap->bk_sizes[hmap->power]);
+}
+
+/*
+ * A relayout that becomes due while an incremental one is still underway
+ * waits for it to finish, rather than completing it in one go.
+ */
+static __inline__ bool HXumap_may_grow(const struct HXumap *hmap)
+{
+	return hmap->super.items >= hmap->max_load &&
+	       hmap->power < ARRAY_SIZE(HXhash_primes) - 1 &&
+	       hmap->old_array == NULL;
+}
+
+static __inline__ bool HXumap_may_shrink(const struct HXumap *hmap)
+{
+	return hmap->old_array == NULL &&
+	       hmap->super.items < hmap->min_load &&
+	       hmap->power > hmap->min_power &&
+	       !(hmap->super.flags & HXMAP_NOSHRINK);
+}
+
+/**
+ * HXumap_move - move elements from one map to another
+ * @hmap:	hash map (for the indexing mode)
+ * @bk_array:	target bucket array
+ * @power:	index into @hmap->bk_sizes for @bk_array
+ * @src:	source buckets
+ * @src_number:	number of buckets in @src
+ *
+ * Uses the cached hashes; keys are not looked at.
+ */
+static void HXumap_move(const struct HXumap *hmap,
+    struct HXlist_head *bk_array, unsigned int power,
+    struct HXlist_head *src, unsigned int src_number)
+{
+	struct HXumap_node *drop, *dnext;
+	unsigned int bk_idx, i;
+
+	for (i = 0; i < src_number; ++i)
+		HXlist_for_each_entry_safe(drop, dnext, &src[i], anchor) {
+			bk_idx = HXumap_bkidx(hmap, drop->hash, power);
+			HXlist_del(&drop->anchor);
+			HXlist_add_tail(&bk_array[bk_idx], &drop->anchor);
+		}
+}
+
+/**
+ * HXumap_migrate - advance an incremental relayout
+ * @hmap:	hash map
+ * @count:	maximum number of old buckets to process
+ */
+static void HXumap_migrate(struct HXumap *hmap, unsigned int count)
+{
+	unsigned int old_number;
+
+	if (hmap->old_array == NULL)
+		return;
+	old_number = hmap->bk_sizes[hmap->old_power];
+	if (count > old_number - hmap->mig_idx)
+		count = old_number - hmap->mig_idx;
+	HXumap_move(hmap, hmap->bk_array, hmap->power,
+		&hmap->old_array[hmap->mig_idx], count);
+	hmap->mig_idx += count;
+	/* Elements moved into buckets that traversers may have passed. */
+	++hmap->tid;
+	if (hmap->mig_idx < old_number)
+		return;
+	free(hmap->old_array);
+	hmap->old_array = NULL;
+	hmap->mig_idx   = 0;
+}
+
+/**
+ * HXumap_read_step - advance an incremental relayout from a lookup
+ *
+ * Otherwise, read-mostly workloads would search two bucket arrays for a
+ * long time. Nothing is moved while a traversal or HXmap_qfe walks the
+ * buckets.
+ */
+static __inline__ void HXumap_read_step(const struct HXumap *hmap)
+{
+	if (hmap->old_array != NULL &&
+	    __atomic_load_n(&hmap->pins, __ATOMIC_RELAXED) == 0)
+		HXumap_migrate(const_cast1(struct HXumap *, hmap),
+			HXUMAP_MIGRATE_STEP);
+}
+
+static __inline__ void HXumap_pin(const struct HXumap *hmap)
+{
+	__atomic_add_fetch(&const_cast1(struct HXumap *, hmap)->pins, 1,
+		__ATOMIC_RELAXED);
+}
+
+static __inline__ void HXumap_unpin(const struct HXumap *hmap)
+{
+	__atomic_sub_fetch(&const_cast1(struct HXumap *, hmap)->pins, 1,
+		__ATOMIC_RELAXED);
+}
+
+/**
+ * HXumap_layout - resize and rehash table
+ * @hmap:	hash map
+ * @prime_idx:	requested new table size (prime power thereof)
+ *
+ * With %HXMAP_INCREMENTAL, the elements are not moved right away, but
+ * the old bucket array is kept around and drained by subsequent adds,
+ * deletions and lookups.
+ */
+static int HXumap_layout(struct HXumap *hmap, unsigned int power)
+{
+	const unsigned int bk_number = hmap->bk_sizes[power];
+	struct HXlist_head *bk_array, *old_array = NULL;
+	unsigned int i;
+
+	/* Only one relayout can be in flight. */
+	HXumap_migrate(hmap, UINT_MAX);
+	bk_array = malloc(bk_number * sizeof(*bk_array));
+	if (bk_array == NULL)
+		return -errno;
+	for (i = 0; i < bk_number; ++i)
+		HXlist_init(&bk_array[i]);
+	if (hmap->bk_array != NULL && (hmap->super.flags & HXMAP_INCREMENTAL)) {
+		hmap->old_array = hmap->bk_array;
+		hmap->old_power = hmap->power;
+		hmap->mig_idx   = 0;
+		++hmap->tid;
+		++hmap->relayouts;
+	} else if (hmap->bk_array != NULL) {
+		HXumap_move(hmap, bk_array, power, hmap->bk_array,
+			hmap->bk_sizes[hmap->power]);
+		old_array = hmap->bk_array;
+		/*
+		 * It is ok to increment the TID this late. @map->bk_array is
+		 * only emptied, and the new @bk_array is not yet visible to
+		 * traversers, so no elements appear twice.
+		 */
+		++hmap->tid;
+		++hmap->relayouts;
+	}
+	hmap->power    = power;
+	hmap->bk_array = bk_array;
+	HXumap_setload(hmap);
+	free(old_array);
+	return 1;
+}
+
+/*
+ * The open-addressing map probes %HXFMAP_GROUP control bytes at once, using
+ * SWAR bit tricks on a 64-bit word. A control byte is either
+ * %HXFMAP_EMPTY, %HXFMAP_DELETED, or the 7-bit fingerprint ("H2") of the
+ * occupying key; the remaining hash bits ("H1") select the start group.
+ */
+#define HXFMAP_LSBS UINT64_C(0x0101010101010101)
+#define HXFMAP_MSBS UINT64_C(0x8080808080808080)
+
+static __inline__ uint64_t HXfmap_mix(unsigned long hash)
+{
+	/* User hashes (e.g. djb2) can be weak in the upper bits. */
+	uint64_t h = static_cast(uint64_t, hash) * UINT64_C(0x9E3779B97F4A7C15);
+	return h ^ (h >> 29);
+}
+
+/**
+ * HXsmap_shard - select the shard responsible for a hash value
+ *
+ * The sub-maps index their buckets with the low-order hash bits, so the
+ * shard is taken from the upper half of the mixed hash to keep the two
+ * choices independent.
+ */
+static __inline__ struct HXsmap_shard *
+HXsmap_shard(const struct HXsmap *smap, unsigned long hash)
+{
+	return &smap->shards[(HXfmap_mix(hash) >> 32) & smap->shard_mask];
+}
+
+static __inline__ uint64_t HXfmap_group(const unsigned char *p)
+{
+	uint64_t g;
+
+	memcpy(&g, p, sizeof(g));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	g = __builtin_bswap64(g);
+#endif
+	return g;
+}
+
+/*
+ * Yields the MSB of every byte in @g equal to @h2. Bytes above a match may be
+ * false positives (borrow propagation), but those are always occupied slots,
+ * so the subsequent key comparison sorts them out.
+ */
+static __inline__ uint64_t HXfmap_match(uint64_t g, unsigned int h2)
+{
+	uint64_t x = g ^ (HXFMAP_LSBS * h2);
+	return (x - HXFMAP_LSBS) & ~x & HXFMAP_MSBS;
+}
+
+static __inline__ uint64_t HXfmap_match_empty(uint64_t g)
+{
+	/* 0x80 has bit 1 clear, 0xFE has it set */
+	return g & ~(g << 6) & HXFMAP_MSBS;
+}
+
+static __inline__ unsigned int HXfmap_lowest(uint64_t m)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(m) / 8;
+#else
+	unsigned int i = 0;
+	for (; !(m & 0x80); m >>= 8)
+		++i;
+	return i;
+#endif
+}
+
+static __inline__ void HXfmap_setctrl(struct HXfmap *fmap, size_t idx,
+    unsigned char c)
+{
+	fmap->ctrl[idx] = c;
+	if (idx < HXFMAP_GROUP)
+		fmap->ctrl[fmap->capacity + idx] = c;
+}
+
+/**
+ * HXfmap_find_free - find the first empty or deleted slot in probe sequence
+ * @fmap:	flat hash map
+ * @h:		mixed hash of the key
+ */
+static size_t HXfmap_find_free(const struct HXfmap *fmap, uint64_t h)
+{
+	size_t mask = fmap->capacity - 1, pos = (h >> 7) & mask, stride = 0;
+	uint64_t m;
+
+	while ((m = HXfmap_group(&fmap->ctrl[pos]) & HXFMAP_MSBS) == 0) {
+		stride += HXFMAP_GROUP;
+		pos = (pos + stride) & mask;
+	}
+	return (pos + HXfmap_lowest(m)) & mask;
+}
+
+/**
+ * HXfmap_budget - number of slots that may be occupied (including
+ * tombstones) before a table of the given size needs to be rehashed
+ */
+static __inline__ size_t HXfmap_budget(const struct HXfmap *fmap,
+    size_t capacity)
+{
+	return z_frac(fmap->super.max_pct, 100, capacity);
+}
+
+/**
+ * HXfmap_layout - resize and rehash table
+ * @fmap:	flat hash map
+ * @capacity:	new number of slots (power of two, >= %HXFMAP_MINCAP)
+ *
+ * Also used with an unchanged capacity to flush out tombstones.
+ */
+static int HXfmap_layout(struct HXfmap *fmap, size_t capacity)
+{
+	unsigned char *ctrl, *old_ctrl = fmap->ctrl;
+	struct HXmap_node *slots, *old_slots = fmap->slots;
+	size_t old_cap = fmap->capacity, i, j;
+	int saved_errno;
+
+	ctrl = malloc(capacity + HXFMAP_GROUP);
+	if (ctrl == NULL)
+		return -errno;
+	slots = malloc(capacity * sizeof(*slots));
+	if (slots == NULL) {
+		saved_errno = errno;
+		free(ctrl);
+		return -(errno = saved_errno);
+	}
+	memset(ctrl, HXFMAP_EMPTY, capacity + HXFMAP_GROUP);
+	fmap->ctrl        = ctrl;
+	fmap->slots       = slots;
+	fmap->capacity    = capacity;
+	fmap->tombstones  = 0;
+	fmap->growth_left = HXfmap_budget(fmap, capacity) - fmap->super.items;
+
+	for (i = 0; i < old_cap; ++i) {
+		uint64_t h;
+
+		if (old_ctrl[i] & HXFMAP_EMPTY)
+			continue;
+		h = HXfmap_mix(HXmap_hash(&fmap->super, old_slots[i].key));
+		j = HXfmap_find_free(fmap, h);
+		HXfmap_setctrl(fmap, j, h & 0x7F);
+		slots[j].key  = old_slots[i].key;
+		slots[j].data = old_slots[i].data;
+	}
+	++fmap->tid;
+	if (old_cap != 0)
+		++fmap->relayouts;
+	free(old_ctrl);
+	free(old_slots);
+	return 1;
+}
+
+static struct HXmap *HXhashmap_init4(unsigned int flags,
+    const struct HXmap_ops *ops, size_t key_size, size_t data_size)
+{
+	struct HXmap_private *super;
+	struct HXumap *hmap;
+	int saved_errno;
+
+	if ((hmap = calloc(1, sizeof(*hmap))) == NULL)
+		return NULL;
+
+	super            = &hmap->super;
+	super->flags     = flags;
+	super->items     = 0;
+	super->type      = HXMAPT_HASH;
+	super->key_size  = key_size;
+	super->data_size = data_size;
+	super->node_size = sizeof(struct HXumap_node);
+	super->max_pct   = 70;
+	super->min_pct   = 25;
+	HXmap_ops_setup(super, ops);
+	HXmap_inline_setup(super);
+	hmap->tid = 1;
+	BUILD_BUG_ON(ARRAY_SIZE(HXumap_pow2_sizes) !=
+	             ARRAY_SIZE(HXhash_primes));
+	hmap->bk_sizes = HXhash_primes;
+	if (flags & HXMAP_POW2) {
+		hmap->bk_sizes = HXumap_pow2_sizes;
+		hmap->bk_mode  = HXUMAP_BK_POW2;
+	} else if (flags & HXMAP_FASTRANGE) {
+		hmap->bk_mode  = HXUMAP_BK_FASTRANGE;
+	}
+	errno = HXumap_layout(hmap, 0);
+	if (hmap->bk_array == NULL)
+		goto out;
+
+	errno = 0;
+	return static_cast(void *, hmap);
+
+ out:
+	saved_errno = errno;
+	HXumap_free(hmap);
+	errno = saved_errno;
+	return NULL;
+}
+
+static struct HXmap *HXfmap_init4(unsigned int flags,
+    const struct HXmap_ops *ops, size_t key_size, size_t data_size)
+{
+	struct HXmap_private *super;
+	struct HXfmap *fmap;
+	int ret;
+
+	if ((fmap = calloc(1, sizeof(*fmap))) == NULL)
+		return NULL;
+
+	super            = &fmap->super;
+	super->flags     = flags;
+	super->items     = 0;
+	super->type      = HXMAPT_FLATHASH;
+	super->key_size  = key_size;
+	super->data_size = data_size;
+	super->max_pct   = 87;
+	super->min_pct   = 25;
+	HXmap_ops_setup(super, ops);
+	fmap->tid = 1;
+	fmap->min_capacity = HXFMAP_MINCAP;
+	ret = HXfmap_layout(fmap, HXFMAP_MINCAP);
+	if (ret <= 0) {
+		free(fmap);
+		errno = -ret;
+		return NULL;
+	}
+	errno = 0;
+	return static_cast(void *, fmap);
+}
+
+static struct HXmap *HXrbtree_init4(unsigned int flags,
+    const struct HXmap_ops *ops, size_t key_size, size_t data_size)
+{
+	struct HXmap_private *super;
+	struct HXrbtree *btree;
+	int ret;
+
+	BUILD_BUG_ON(offsetof(struct HXrbtree, root) +
+	             offsetof(struct HXrbnode, sub[0]) !=
+	             offsetof(struct HXrbtree, root));
+
+	if ((btree = calloc(1, sizeof(*btree))) == NULL)
+		return NULL;
+	if ((ret = pthread_mutex_init(&btree->travs_lock, NULL)) != 0) {
+		free(btree);
+		errno = ret;
+		return NULL;
+	}
+
+	super            = &btree->super;
+	super->type      = HXMAPT_RBTREE;
+	super->flags     = flags;
+	super->items     = 0;
+	super->key_size  = key_size;
+	super->data_size = data_size;
+	super->node_size = (flags & HXMAP_THREADED) ?
+	                   sizeof(struct HXrbtnode) : sizeof(struct HXrbnode);
+	HXmap_ops_setup(super, ops);
+	HXmap_inline_setup(super);
+
+	/*
+	 * TID must not be zero, otherwise the traverser functions will not
+	 * start off correctly, since trav->tid is 0, but trav->tid must not
+	 * equal btree->transact because that would mean the traverser is in
+	 * sync with the tree.
+	 */
+	btree->tid  = 1;
+	btree->root = NULL;
+	HXlist_init(&btree->travs);
+	return static_cast(void *, btree);
+}
+
+/**
+ * HXmap_pool_private - give a map its own node pool (%HXMAP_POOL)
+ */
+static int HXmap_pool_private(struct HXmap_private *map)
+{
+	struct HXmap_pool *pool;
+	int ret;
+
+	if ((pool = HXmap_pool_init()) == NULL)
+		return -errno;
+	ret = HXmap_pool_attach(map, pool);
+	HXmap_pool_free(pool);
+	return ret;
+}
+
+static struct HXmap *HXsmap_init4(unsigned int flags,
+    const struct HXmap_ops *ops, size_t key_size, size_t data_size,
+    unsigned int nshards)
+{
+	struct HXmap_private *super;
+	struct HXsmap_shard *shard;
+	struct HXsmap *smap;
+	unsigned int i;
+	int ret;
+
+	if (nshards == 0)
+		nshards = HXSMAP_DEFSHARDS;
+	if (nshards > HXSMAP_MAXSHARDS || (nshards & (nshards - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((smap = calloc(1, sizeof(*smap))) == NULL)
+		return NULL;
+
+	super            = &smap->super;
+	super->flags     = flags;
+	super->items     = 0;
+	super->type      = HXMAPT_SHARDED;
+	super->key_size  = key_size;
+	super->data_size = data_size;
+	super->max_pct   = 70;
+	super->min_pct   = 25;
+	HXmap_ops_setup(super, ops);
+	smap->shards = calloc(nshards, sizeof(*smap->shards));
+	if (smap->shards == NULL) {
+		ret = -errno;
+		goto out;
+	}
+	for (i = 0; i < nshards; ++i) {
+		shard = &smap->shards[i];
+		ret = pthread_rwlock_init(&shard->lock, NULL);
+		if (ret != 0) {
+			ret = -ret;
+			goto out;
+		}
+		smap->nshards = i + 1;
+		/* Sub-maps share the fully resolved ops of the outer map. */
+		shard->hmap = static_cast(void *, HXhashmap_init4(flags &
+		              ~HXMAP_POOL, &super->ops, key_size, data_size));
+		if (shard->hmap == NULL) {
+			ret = -errno;
+			goto out;
+		}
+		/* The outer map computes the hashes for all shards. */
+		shard->hmap->super.seed = super->seed;
+		/* Pools are not thread-safe, so each shard gets its own. */
+		if (flags & HXMAP_POOL) {
+			ret = HXmap_pool_private(&shard->hmap->super);
+			if (ret <= 0)
+				goto out;
+		}
+	}
+	smap->shard_mask = nshards - 1;
+	errno = 0;
+	return static_cast(void *, smap);
+
+ out:
+	HXsmap_free(smap);
+	errno = -ret;
+	return NULL;
+}
+
+static struct HXmap *HXrmap_init4(unsigned int flags,
+    const struct HXmap_ops *ops, size_t key_size, size_t data_size)
+{
+	struct HXmap_private *super;
+	struct HXrmap *rmap;
+	int ret;
+
+	if ((rmap = calloc(1, sizeof(*rmap))) == NULL)
+		return NULL;
+
+	super            = &rmap->super;
+	super->flags     = flags;
+	super->items     = 0;
+	super->type      = HXMAPT_RCU;
+	super->key_size  = key_size;
+	super->data_size = data_size;
+	rmap->slots = calloc(HXRMAP_SLOTS, sizeof(*rmap->slots));
+	if (rmap->slots == NULL) {
+		free(rmap);
+		return NULL;
+	}
+	ret = pthread_mutex_init(&rmap->wlock, NULL);
+	if (ret != 0) {
+		free(rmap->slots);
+		free(rmap);
+		errno = ret;
+		return NULL;
+	}
+	/* Snapshots are never modified after publication; favor lookups. */
+	rmap->snap = static_cast(void *, HXmap_init5(HXMAPT_FLATHASH, flags,
+	             ops, key_size, data_size));
+	if (rmap->snap == NULL) {
+		ret = errno;
+		HXrmap_free(rmap);
+		errno = ret;
+		return NULL;
+	}
+	errno = 0;
+	return static_cast(void *, rmap);
+}
+
+static struct HXmap *HXbptree_init4(unsigned int flags,
+    const struct HXmap_ops *ops, size_t key_size, size_t data_size)
+{
+	struct HXmap_private *super;
+	struct HXbptree *bt;
+
+	if ((bt = calloc(1, sizeof(*bt))) == NULL)
+		return NULL;
+
+	super            = &bt->super;
+	super->type      = HXMAPT_BTREE;
+	super->flags     = flags;
+	super->items     = 0;
+	super->key_size  = key_size;
+	super->data_size = data_size;
+	HXmap_ops_setup(super, ops);
+	/* Traversers start with tid 0 so that they position themselves. */
+	bt->tid = 1;
+	errno = 0;
+	return static_cast(void *, bt);
+}
+
+/**
+ * HXmap_ikey_flags - check %HXMAP_IKEY and add the flags it implies
+ *
+ * Integer keys are 32 or 64 bits wide, and always copied into the map.
+ */
+static bool HXmap_ikey_flags(unsigned int *flags, size_t key_size)
+{
+	if (!(*flags & HXMAP_IKEY))
+		return true;
+	if ((*flags & HXMAP_SKEY) || (key_size != sizeof(uint32_t) &&
+	    key_size != sizeof(uint64_t)))
+		return false;
+	*flags |= HXMAP_CKEY;
+	return true;
+}
+
+EXPORT_SYMBOL struct HXmap *HXmap_init5(enum HXmap_type type,
+    unsigned int flags, const struct HXmap_ops *ops, size_t key_size,
+    size_t data_size)
+{
+	struct HXmap_private *map;
+	int ret;
+
+	if ((flags & HXMAP_SINGULAR) &&
+	    (flags & (HXMAP_CDATA | HXMAP_SDATA) || data_size != 0))
+		fprintf(stderr, "WARNING: libHX-map: When HXMAP_SINGULAR is "
+		        "set, HXMAP_CDATA, HXMAP_SDATA and/or data_size != 0 "
+		        "has no effect.\n");
+
+	if ((flags & (HXMAP_POW2 | HXMAP_FASTRANGE)) ==
+	    (HXMAP_POW2 | HXMAP_FASTRANGE) ||
+	    !HXmap_ikey_flags(&flags, key_size)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	switch (type) {
+	case HXMAPT_HASH:
+		map = static_cast(void *, HXhashmap_init4(flags, ops,
+		      key_size, data_size));
+		break;
+	case HXMAPT_RBTREE:
+		map = static_cast(void *, HXrbtree_init4(flags, ops,
+		      key_size, data_size));
+		break;
+	case HXMAPT_FLATHASH:
+		return HXfmap_init4(flags, ops, key_size, data_size);
+	case HXMAPT_SHARDED:
+		return HXsmap_init4(flags, ops, key_size, data_size, 0);
+	case HXMAPT_RCU:
+		return HXrmap_init4(flags, ops, key_size, data_size);
+	case HXMAPT_BTREE:
+		/* Elements live inside the leaves; there are no nodes to pool. */
+		return HXbptree_init4(flags, ops, key_size, data_size);
+	case HXMAPT_FROZEN:
+		/* Only made by HXmap_freeze and HXmap_load */
+		errno = EINVAL;
+		return NULL;
+	default:
+		errno = -ENOENT;
+		return NULL;
+	}
+	if (map == NULL || !(flags & HXMAP_POOL))
+		return static_cast(void *, map);
+	ret = HXmap_pool_private(map);
+	if (ret <= 0) {
+		HXmap_free(static_cast(void *, map));
+		errno = -ret;
+		return NULL;
+	}
+	errno = 0;
+	return static_cast(void *, map);
+}
+
+static int HXumap_reserve(struct HXumap *hmap, size_t n)
+{
+	unsigned int power = 0;
+	int ret;
+
+	while (power < ARRAY_SIZE(HXhash_primes) - 1 &&
+	       x_frac(hmap->super.max_pct, 100, hmap->bk_sizes[power]) < n)
+		++power;
+	if (power > hmap->min_power)
+		hmap->min_power = power;
+	if (power <= hmap->power)
+		return 1;
+	ret = HXumap_layout(hmap, power);
+	if (ret <= 0)
+		return ret;
+	/* Reservations happen ahead of bulk loads; finish right away. */
+	HXumap_migrate(hmap, UINT_MAX);
+	return 1;
+}
+
+static int HXfmap_reserve(struct HXfmap *fmap, size_t n)
+{
+	size_t cap = HXFMAP_MINCAP;
+
+	while (HXfmap_budget(fmap, cap) < n) {
+		if (cap > SIZE_MAX / 2 / sizeof(struct HXmap_node))
+			return -(errno = ENOMEM);
+		cap *= 2;
+	}
+	if (cap > fmap->min_capacity)
+		fmap->min_capacity = cap;
+	if (cap <= fmap->capacity)
+		return 1;
+	return HXfmap_layout(fmap, cap);
+}
+
+static int HXsmap_reserve(struct HXsmap *smap, size_t n)
+{
+	/* Keys do not spread perfectly evenly; leave some headroom. */
+	size_t per_shard = n / smap->nshards;
+	unsigned int i;
+	int ret = 1;
+
+	per_shard += per_shard / 8 + 1;
+	for (i = 0; i < smap->nshards && ret > 0; ++i) {
+		pthread_rwlock_wrlock(&smap->shards[i].lock);
+		ret = HXumap_reserve(smap->shards[i].hmap, per_shard);
+		pthread_rwlock_unlock(&smap->shards[i].lock);
+	}
+	return ret;
+}
+
+/*
+ * Read-side sections of %HXMAPT_RCU maps: a reader announces itself in one
+ * of two counters, selected by the parity of @rmap->epoch, and re-checks
+ * the parity afterwards. A writer, after publishing a new snapshot, flips
+ * the parity and waits for the old counters to drain. Readers that entered
+ * after the flip can only have seen the new snapshot.
+ */
+static const struct HXmap_private *
+HXrmap_enter(const struct HXrmap *rmap, unsigned int *token)
+{
+	/*
+	 * Threads run on different stacks, so the token's address makes for
+	 * a cheap way to spread them over the slots.
+	 */
+	unsigned int slot = (HXfmap_mix(reinterpret_cast(uintptr_t,
+	                    token) >> 12) >> 32) % HXRMAP_SLOTS;
+	unsigned long *count;
+	unsigned int par;
+
+	while (true) {
+		par   = __atomic_load_n(&rmap->epoch, __ATOMIC_SEQ_CST) & 1;
+		count = &rmap->slots[slot].count[par];
+		__atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+		if ((__atomic_load_n(&rmap->epoch, __ATOMIC_SEQ_CST) & 1) == par)
+			break;
+		/* A writer flipped the epoch in between; retry. */
+		__atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST);
+	}
+	*token = slot << 1 | par;
+	return __atomic_load_n(&rmap->snap, __ATOMIC_SEQ_CST);
+}
+
+static __inline__ void HXrmap_leave(const struct HXrmap *rmap,
+    unsigned int token)
+{
+	__atomic_sub_fetch(&rmap->slots[token >> 1].count[token & 1], 1,
+		__ATOMIC_RELEASE);
+}
+
+/**
+ * HXrmap_free_shallow - free a snapshot, but not its keys and values
+ *
+ * For snapshots made by HXrmap_clone, which share keys and values (other
+ * than inline copies) with the snapshot they were cloned from.
+ */
+static void HXrmap_free_shallow(struct HXmap_private *snap)
+{
+	snap->ops.k_free = NULL;
+	snap->ops.d_free = NULL;
+	HXmap_free(static_cast(void *, snap));
+}
+
+/**
+ * HXrmap_replace - publish a snapshot and free the previous one
+ * @shared:	whether @snap shares keys and values with the previous
+ * 		snapshot (made by HXrmap_clone), which then must not be freed
+ *
+ * Must be called with @rmap->wlock held.
+ */
+static void HXrmap_replace(struct HXrmap *rmap, struct HXmap_private *snap,
+    bool shared)
+{
+	struct HXmap_private *old = rmap->snap;
+	unsigned int i, par;
+
+	__atomic_store_n(&rmap->snap, snap, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&rmap->super.items, snap->items, __ATOMIC_RELAXED);
+	par = __atomic_fetch_xor(&rmap->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+	for (i = 0; i < HXRMAP_SLOTS; ++i)
+		while (__atomic_load_n(&rmap->slots[i].count[par],
+		       __ATOMIC_ACQUIRE) != 0)
+			sched_yield();
+	if (shared)
+		HXrmap_free_shallow(old);
+	else
+		HXmap_free(static_cast(void *, old));
+}
+
+static bool HXrmap_clone_one(const struct HXmap_node *node, void *arg)
+{
+	return HXmap_add(arg, node->key, node->data) > 0;
+}
+
+/**
+ * HXrmap_clone - copy a snapshot for modification
+ * @extra:	room to reserve for additional elements
+ *
+ * The copy takes over the keys and values of the snapshot as they are,
+ * without k_clone/d_clone: readers may still be using the snapshot, so
+ * freeing of elements is left to whoever removes them from the copy.
+ */
+static struct HXmap *HXrmap_clone(const struct HXrmap *rmap, size_t extra)
+{
+	const struct HXmap_private *snap = rmap->snap;
+	struct HXmap_params params = {};
+	struct HXmap_private *cpriv;
+	struct HXmap *copy;
+
+	params.expected = snap->items + extra;
+	params.max_load = snap->max_pct;
+	params.min_load = snap->min_pct;
+	copy = HXmap_init6(snap->type, snap->flags & ~HXMAP_NOREPLACE,
+	       &snap->ops, snap->key_size, snap->data_size, &params);
+	if (copy == NULL)
+		return NULL;
+	cpriv = static_cast(void *, copy);
+	/*
+	 * Not passed through @params, since HXmap_init6 rejects pools along
+	 * with the (already resolved) k_clone of @snap->ops.
+	 */
+	if (snap->strpool != NULL) {
+		HXstrpool_get(snap->strpool);
+		cpriv->strpool = snap->strpool;
+	}
+	cpriv->ops.k_clone = HXmap_valuecpy;
+	cpriv->ops.d_clone = HXmap_valuecpy;
+	HXmap_qfe(static_cast(const void *, snap), HXrmap_clone_one, copy);
+	cpriv->ops.k_clone = snap->ops.k_clone;
+	cpriv->ops.d_clone = snap->ops.d_clone;
+	if (copy->items != snap->items) {
+		HXrmap_free_shallow(cpriv);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return copy;
+}
+
+static int HXrmap_reserve(struct HXrmap *rmap, size_t n)
+{
+	struct HXmap *copy;
+	int ret = 1;
+
+	pthread_mutex_lock(&rmap->wlock);
+	if (n > rmap->snap->items) {
+		copy = HXrmap_clone(rmap, n - rmap->snap->items);
+		if (copy == NULL)
+			ret = -errno;
+		else
+			HXrmap_replace(rmap, static_cast(void *, copy), true);
+	}
+	pthread_mutex_unlock(&rmap->wlock);
+	return ret;
+}
+
+EXPORT_SYMBOL int HXmap_reserve(struct HXmap *xmap, size_t n)
+{
+	void *vmap = xmap;
+	struct HXmap_private *map = vmap;
+
+	switch (map->type) {
+	case HXMAPT_HASH:
+		return HXumap_reserve(vmap, n);
+	case HXMAPT_FLATHASH:
+		return HXfmap_reserve(vmap, n);
+	case HXMAPT_SHARDED:
+		return HXsmap_reserve(vmap, n);
+	case HXMAPT_RCU:
+		return HXrmap_reserve(vmap, n);
+	case HXMAPT_RBTREE:
+	case HXMAPT_BTREE:
+		/* Nothing to preallocate */
+		return 1;
+	case HXMAPT_FROZEN:
+		return -EPERM;
+	default:
+		return -EINVAL;
+	}
+}
+
+/**
+ * HXmap_params_apply - set up tunables after construction
+ */
+static int HXmap_params_apply(struct HXmap_private *map,
+    const struct HXmap_params *params)
+{
+	if (params->max_load != 0)
+		map->max_pct = params->max_load;
+	if (params->min_load != 0)
+		map->min_pct = params->min_load;
+	else if (params->max_load != 0)
+		map->min_pct = params->max_load / 4;
+	if (params->seed != 0)
+		map->seed = params->seed;
+
+	if (map->type == HXMAPT_SHARDED) {
+		const struct HXsmap *smap = static_cast(void *, map);
+		struct HXmap_params sub = *params;
+		unsigned int i;
+		int ret;
+
+		/* HXmap_reserve distributes the reservation itself. */
+		sub.expected = 0;
+		for (i = 0; i < smap->nshards; ++i) {
+			ret = HXmap_params_apply(&smap->shards[i].hmap->super,
+			      &sub);
+			if (ret <= 0)
+				return ret;
+		}
+		if (params->expected != 0)
+			return HXmap_reserve(static_cast(void *, map),
+			       params->expected);
+		return 1;
+	} else if (map->type == HXMAPT_RCU) {
+		/* No readers exist yet, so the snapshot can be tuned in place. */
+		return HXmap_params_apply(
+		       static_cast(struct HXrmap *, static_cast(void *, map))->snap,
+		       params);
+	}
+
+	switch (map->type) {
+	case HXMAPT_HASH:
+		HXumap_setload(static_cast(void *, map));
+		break;
+	case HXMAPT_FLATHASH: {
+		struct HXfmap *fmap = static_cast(void *, map);
+		size_t budget = HXfmap_budget(fmap, fmap->capacity);
+		size_t used   = map->items + fmap->tombstones;
+		fmap->growth_left = budget > used ? budget - used : 0;
+		break;
+	}
+	default:
+		break;
+	}
+	if (params->strpool != NULL) {
+		HXstrpool_get(params->strpool);
+		map->strpool = params->strpool;
+		if (static_cast(void *, map->ops.k_compare) ==
+		    static_cast(void *, strcmp))
+			map->ops.k_compare = HXstrpool_cmp;
+	}
+	if (params->pool != NULL) {
+		int ret;
+
+		/* Map is still empty, so the private pool can just go. */
+		HXmap_pool_free(map->pool);
+		map->pool = NULL;
+		ret = HXmap_pool_attach(map, params->pool);
+		if (ret <= 0)
+			return ret;
+	}
+	if (params->expected != 0)
+		return HXmap_reserve(static_cast(void *, map), params->expected);
+	return 1;
+}
+
+EXPORT_SYMBOL struct HXmap *HXmap_init6(enum HXmap_type type,
+    unsigned int flags, const struct HXmap_ops *ops, size_t key_size,
+    size_t data_size, const struct HXmap_params *params)
+{
+	struct HXmap *map;
+	int ret;
+
+	if (params != NULL) {
+		/*
+		 * Chained tables could go beyond 100%, but x_frac is not
+		 * overflow-safe for that. Open addressing needs free slots
+		 * to terminate probe sequences.
+		 */
+		unsigned int max_load = params->max_load != 0 ?
+		                        params->max_load :
+		                        type == HXMAPT_FLATHASH ? 87 : 70;
+		/* The default min_load is derived from max_load, always valid */
+		if (max_load > (type == HXMAPT_FLATHASH ? 95 : 100) ||
+		    (params->min_load != 0 &&
+		    2 * params->min_load >= max_load)) {
+			errno = EINVAL;
+			return NULL;
+		}
+		/* Pools are not thread-safe and cannot be shared. */
+		if ((type == HXMAPT_SHARDED || type == HXMAPT_RCU) &&
+		    params->pool != NULL) {
+			errno = EINVAL;
+			return NULL;
+		}
+		/*
+		 * String pools hold copies of string keys, in place of
+		 * k_clone/k_free, which would otherwise be bypassed.
+		 */
+		if (params->strpool != NULL &&
+		    ((flags & HXMAP_SCKEY) != HXMAP_SCKEY || (ops != NULL &&
+		    (ops->k_clone != NULL || ops->k_free != NULL)))) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+	if (!HXmap_ikey_flags(&flags, key_size)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (type == HXMAPT_SHARDED && params != NULL)
+		map = HXsmap_init4(flags, ops, key_size, data_size,
+		      params->shards);
+	else
+		map = HXmap_init5(type, flags, ops, key_size, data_size);
+	if (map == NULL || params == NULL)
+		return map;
+	ret = HXmap_params_apply(static_cast(void *, map), params);
+	if (ret <= 0) {
+		HXmap_free(map);
+		errno = -ret;
+		return NULL;
+	}
+	errno = 0;
+	return map;
+}
+
+EXPORT_SYMBOL struct HXmap *HXmap_init(enum HXmap_type type,
+    unsigned int flags)
+{
+	/*
+	 * We cannot check this in HXmap_init5, since a custom ops may
+	 * allow key_size==0/data_size==0.
+	 */
+	if ((flags & HXMAP_SCKEY) == HXMAP_CKEY) {
+		fprintf(stderr, "%s: zero key_size with standard memcpy ops "
+		        "won't work.\n", __func__);
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((flags & HXMAP_SCDATA) == HXMAP_CDATA) {
+		fprintf(stderr, "%s: zero data_size with standard memcpy ops "
+		        "won't work.\n", __func__);
+		errno = EINVAL;
+		return NULL;
+	}
+	return HXmap_init5(type, flags, NULL, 0, 0);
+}
+
+/**
+ * HXumap_lookup_cmp - find an element, with a custom comparison
+ * @cmp:	compares @key with stored keys, like k_compare
+ * @ksize:	size argument for @cmp
+ */
+static struct HXumap_node *HXumap_lookup_cmp(const struct HXumap *hmap,
+    const void *key, unsigned long hash, cmpfunc_t cmp, size_t ksize)
+{
+	struct HXumap_node *drop;
+
+	/* Comparing the full hash first saves most k_compare calls. */
+	HXlist_for_each_entry(drop, HXumap_bucket(hmap, hash), anchor)
+		if (drop->hash == hash && cmp(key, drop->key, ksize) == 0)
+			return drop;
+	return NULL;
+}
+
+static __inline__ struct HXumap_node *
+HXumap_lookup(const struct HXumap *hmap, const void *key, unsigned long hash)
+{
+	return HXumap_lookup_cmp(hmap, key, hash, hmap->super.ops.k_compare,
+	       hmap->super.key_size);
+}
+
+static struct HXumap_node *HXumap_find(const struct HXumap *hmap,
+    const void *key)
+{
+	HXumap_read_step(hmap);
+	return HXumap_lookup(hmap, key,
+	       HXmap_hash(&hmap->super, key));
+}
+
+static struct HXmap_node *HXfmap_lookup_cmp(const struct HXfmap *fmap,
+    const void *key, uint64_t h, cmpfunc_t cmp, size_t ksize)
+{
+	size_t mask = fmap->capacity - 1, pos = (h >> 7) & mask, stride = 0;
+	unsigned int h2 = h & 0x7F;
+
+	while (true) {
+		uint64_t g = HXfmap_group(&fmap->ctrl[pos]), m;
+
+		for (m = HXfmap_match(g, h2); m != 0; m &= m - 1) {
+			size_t idx = (pos + HXfmap_lowest(m)) & mask;
+			if (cmp(key, fmap->slots[idx].key, ksize) == 0)
+				return &fmap->slots[idx];
+		}
+		/* An empty slot terminates every probe sequence. */
+		if (HXfmap_match_empty(g) != 0)
+			return NULL;
+		stride += HXFMAP_GROUP;
+		pos = (pos + stride) & mask;
+	}
+}
+
+static __inline__ struct HXmap_node *
+HXfmap_lookup(const struct HXfmap *fmap, const void *key, uint64_t h)
+{
+	return HXfmap_lookup_cmp(fmap, key, h, fmap->super.ops.k_compare,
+	       fmap->super.key_size);
+}
+
+static struct HXmap_node *HXfmap_find(const struct HXfmap *fmap,
+    const void *key)
+{
+	return HXfmap_lookup(fmap, key, HXfmap_mix(
+	       HXmap_hash(&fmap->super, key)));
+}
+
+static __inline__ const struct HXmap_node *
+HXrbtree_find_cmp(const struct HXrbtree *btree, const void *key,
+    cmpfunc_t cmp, size_t ksize)
+{
+	struct HXrbnode *node = btree->root;
+	int res;
+
+	while (node != NULL) {
+		if ((res = cmp(key, node->key, ksize)) == 0)
+			return static_cast(const void *, &node->key);
+		node = node->sub[res > 0];
+	}
+
+	return NULL;
+}
+
+static __inline__ const struct HXmap_node *
+HXrbtree_find(const struct HXrbtree *btree, const void *key)
+{
+	cmpfunc_t cmp = btree->super.ops.k_compare;
+
+	/* With a constant comparator, the compiler inlines it into the loop */
+	if (cmp == HXmap_u64cmp)
+		return HXrbtree_find_cmp(btree, key, HXmap_u64cmp,
+		       sizeof(uint64_t));
+	if (cmp == HXmap_u32cmp)
+		return HXrbtree_find_cmp(btree, key, HXmap_u32cmp,
+		       sizeof(uint32_t));
+	return HXrbtree_find_cmp(btree, key, cmp, btree->super.key_size);
+}
+
+/**
+ * HXsmap_find - look up a key in a sharded map
+ *
+ * The node is only guaranteed to stay valid as long as no other thread
+ * deletes or replaces it; HXmap_visit has no such restriction.
+ */
+static const struct HXmap_node *HXsmap_find(const struct HXsmap *smap,
+    const void *key)
+{
+	unsigned long hash = HXmap_hash(&smap->super, key);
+	struct HXsmap_shard *shard = HXsmap_shard(smap, hash);
+	const struct HXumap_node *drop;
+
+	pthread_rwlock_rdlock(&shard->lock);
+	drop = HXumap_lookup(shard->hmap, key, hash);
+	pthread_rwlock_unlock(&shard->lock);
+	if (drop == NULL)
+		return NULL;
+	return static_cast(const void *, &drop->key);
+}
+
+/**
+ * @node:	inner nodes visited on the way down
+ * @idx:	index of the child taken in each @node
+ */
+struct HXbppath {
+	struct HXbpinner *node[HXBPT_MAXDEP];
+	unsigned int idx[HXBPT_MAXDEP];
+};
+
+/**
+ * HXbpinner_pos - select the child to descend into
+ *
+ * Returns the number of separators that are less than or equal to @key.
+ */
+static __inline__ unsigned int HXbpinner_pos_cmp(const struct HXbpinner *in,
+    const void *key, cmpfunc_t cmp, size_t ksize)
+{
+	unsigned int lo = 0, hi = in->hdr.count - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cmp(key, in->key[mid], ksize) < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+static __inline__ unsigned int HXbpinner_pos(const struct HXbptree *bt,
+    const struct HXbpinner *in, const void *key)
+{
+	return HXbpinner_pos_cmp(in, key, bt->super.ops.k_compare,
+	       bt->super.key_size);
+}
+
+/**
+ * HXbpleaf_pos_cmp - find the first element not less than @key
+ * @found:	set to whether that element's key equals @key
+ */
+static __inline__ unsigned int HXbpleaf_pos_cmp(const struct HXbpleaf *leaf,
+    const void *key, bool *found, cmpfunc_t cmp, size_t ksize)
+{
+	unsigned int lo = 0, hi = leaf->hdr.count, mid;
+	int ret;
+
+	*found = false;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		ret = cmp(key, leaf->elem[mid].key, ksize);
+		if (ret > 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+			if (ret == 0)
+				*found = true;
+		}
+	}
+	return lo;
+}
+
+static __inline__ unsigned int HXbpleaf_pos(const struct HXbptree *bt,
+    const struct HXbpleaf *leaf, const void *key, bool *found)
+{
+	return HXbpleaf_pos_cmp(leaf, key, found, bt->super.ops.k_compare,
+	       bt->super.key_size);
+}
+
+/**
+ * HXbptree_descend - find the leaf responsible for @key
+ * @path:	receives the inner nodes along the way, may be %NULL
+ *
+ * The tree must not be empty.
+ */
+static struct HXbpleaf *HXbptree_descend(const struct HXbptree *bt,
+    const void *key, struct HXbppath *path)
+{
+	struct HXbpnode *node = bt->root;
+	struct HXbpinner *in;
+	unsigned int lv, i;
+
+	for (lv = 0; lv < bt->height; ++lv) {
+		in = static_cast(void *, node);
+		i  = HXbpinner_pos(bt, in, key);
+		if (path != NULL) {
+			path->node[lv] = in;
+			path->idx[lv]  = i;
+		}
+		node = in->child[i];
+	}
+	return static_cast(void *, node);
+}
+
+static __inline__ struct HXmap_node *HXbptree_find_cmp(const struct HXbptree *bt,
+    const void *key, cmpfunc_t cmp, size_t ksize)
+{
+	struct HXbpnode *node = bt->root;
+	const struct HXbpinner *in;
+	struct HXbpleaf *leaf;
+	unsigned int lv, pos;
+	bool found;
+
+	if (node == NULL)
+		return NULL;
+	for (lv = 0; lv < bt->height; ++lv) {
+		in   = static_cast(const void *, node);
+		node = in->child[HXbpinner_pos_cmp(in, key, cmp, ksize)];
+	}
+	leaf = static_cast(void *, node);
+	pos  = HXbpleaf_pos_cmp(leaf, key, &found, cmp, ksize);
+	return found ? &leaf->elem[pos] : NULL;
+}
+
+static __inline__ struct HXmap_node *
+HXbptree_find(const struct HXbptree *bt, const void *key)
+{
+	cmpfunc_t cmp = bt->super.ops.k_compare;
+
+	/* As in HXrbtree_find */
+	if (cmp == HXmap_u64cmp)
+		return HXbptree_find_cmp(bt, key, HXmap_u64cmp,
+		       sizeof(uint64_t));
+	if (cmp == HXmap_u32cmp)
+		return HXbptree_find_cmp(bt, key, HXmap_u32cmp,
+		       sizeof(uint32_t));
+	return HXbptree_find_cmp(bt, key, cmp, bt->super.key_size);
+}
+
+/**
+ * HXzmap_kbytes - get the bytes that make up a key of a frozen map
+ * @key:	pointer to the key
+ * @len:	receives the number of bytes
+ *
+ * Pointer-valued keys are hashed and compared by their own representation.
+ */
+static __inline__ const void *HXzmap_kbytes(const struct HXmap_private *map,
+    const void *const *key, size_t *len)
+{
+	if (map->flags & HXMAP_SKEY) {
+		*len = strlen(*key);
+		return *key;
+	} else if (map->key_size != 0) {
+		*len = map->key_size;
+		return *key;
+	}
+	*len = sizeof(*key);
+	return key;
+}
+
+/**
+ * HXzmap_range - scale a 64-bit hash into [0, @n) without division
+ */
+static __inline__ uint64_t HXzmap_range(uint64_t hash, uint64_t n)
+{
+	HXhash_mum(&hash, &n);
+	return n;
+}
+
+/**
+ * HXzmap_pos - slot of a key in a frozen map
+ * @hash:	hash of the key
+ * @pilot:	pilot value of the key's bucket
+ * @n:	number of slots
+ */
+static __inline__ uint64_t HXzmap_pos(uint64_t hash, uint32_t pilot,
+    uint64_t n)
+{
+	return HXzmap_range(HXhash_mix(hash ^ HXhash_wy_secret[2],
+	       pilot ^ HXhash_wy_secret[3]), n);
+}
+
+/**
+ * HXzmap_node - element of a frozen map, as struct HXmap_node
+ *
+ * The image holds offsets only; the node is filled in when first needed.
+ * Concurrent readers may do so simultaneously, but write the same values.
+ * Returns %NULL if the slot points outside the image.
+ */
+static const struct HXmap_node *HXzmap_node(const struct HXzmap *zmap,
+    size_t pos)
+{
+	const struct HXzmap_slot *slot = &zmap->slots[pos];
+	const struct HXmap_private *map = &zmap->super;
+	const char *base = static_cast(const void *, zmap->hdr);
+	struct HXmap_node *node = &zmap->nodes[pos];
+	size_t klen = map->key_size != 0 || (map->flags & HXMAP_SKEY) ?
+	              slot->klen : sizeof(void *);
+	size_t dlen = map->data_size != 0 ? map->data_size :
+	              (map->flags & HXMAP_SDATA) ? 1 : sizeof(void *);
+	void *key, *data = NULL;
+
+	if (__atomic_load_n(&node->key, __ATOMIC_ACQUIRE) != NULL)
+		return node;
+	if (klen > zmap->size || slot->key > zmap->size - klen ||
+	    (slot->data != 0 && slot->data > zmap->size - dlen))
+		return NULL;
+	if (map->key_size != 0 || (map->flags & HXMAP_SKEY))
+		key = const_cast1(char *, base + slot->key);
+	else
+		memcpy(&key, base + slot->key, sizeof(key));
+	if (slot->data == 0)
+		;
+	else if (map->data_size != 0 || (map->flags & HXMAP_SDATA))
+		data = const_cast1(char *, base + slot->data);
+	else
+		memcpy(&data, base + slot->data, sizeof(data));
+	__atomic_store_n(&node->data, data, __ATOMIC_RELAXED);
+	/* A NULL pointer key leaves the node "empty"; harmless. */
+	__atomic_store_n(&node->key, key, __ATOMIC_RELEASE);
+	return node;
+}
+
+/**
+ * HXzmap_lookup - find a key of a frozen map by its bytes
+ * @kp:		key bytes, as from HXzmap_kbytes
+ */
+static const struct HXmap_node *HXzmap_lookup(const struct HXzmap *zmap,
+    const void *kp, size_t len)
+{
+	const char *base = static_cast(const void *, zmap->hdr);
+	const struct HXzmap_slot *slot;
+	uint64_t hash;
+
+	if (zmap->super.items == 0)
+		return NULL;
+	hash = HXhash_wy_seed(kp, len, zmap->super.seed);
+	slot = &zmap->slots[HXzmap_pos(hash,
+	       zmap->pilots[HXzmap_range(hash, zmap->buckets)],
+	       zmap->super.items)];
+	if (slot->fp != static_cast(uint32_t, hash) || slot->klen != len ||
+	    len > zmap->size || slot->key > zmap->size - len ||
+	    memcmp(base + slot->key, kp, len) != 0)
+		return NULL;
+	return HXzmap_node(zmap, slot - zmap->slots);
+}
+
+static __inline__ const struct HXmap_node *
+HXzmap_find(const struct HXzmap *zmap, const void *key)
+{
+	const void *kp;
+	size_t len;
+
+	kp = HXzmap_kbytes(&zmap->super, &key, &len);
+	return HXzmap_lookup(zmap, kp, len);
+}
+
+EXPORT_SYMBOL const struct HXmap_node *
+HXmap_find(const struct HXmap *xmap, const void *key)
+{
+	const void *vmap = xmap;
+	const struct HXmap_private *map = vmap;
+
+	switch (map->type) {
+	case HXMAPT_HASH: {
+		const struct HXumap_node *node = HXumap_find(vmap, key);
+		if (node == NULL)
+			return NULL;
+		return static_cast(const void *, &node->key);
+	}
+	case HXMAPT_RBTREE:
+		return HXrbtree_find(vmap, key);
+	case HXMAPT_FLATHASH:
+		return HXfmap_find(vmap, key);
+	case HXMAPT_BTREE:
+		return HXbptree_find(vmap, key);
+	case HXMAPT_FROZEN:
+		return HXzmap_find(vmap, key);
+	case HXMAPT_SHARDED:
+		return HXsmap_find(vmap, key);
+	case HXMAPT_RCU: {
+		const struct HXrmap *rmap = vmap;
+		const struct HXmap_node *node;
+		unsigned int token;
+
+		/* Node remains valid only until the next write. */
+		node = HXmap_find(static_cast(const void *,
+		       HXrmap_enter(rmap, &token)), key);
+		HXrmap_leave(rmap, token);
+		return node;
+	}
+	default:
+		errno = EINVAL;
+		return NULL;
+	}
+}
+
+/**
+ * HXmap_strncmp - compare a byte range with a C string key
+ * @range:	lookup key, not NUL-terminated
+ * @skey:	stored key
+ * @len:	length of @range
+ *
+ * Orders like strcmp would if @range were NUL-terminated, and never reads
+ * past the end of @skey.
+ */
+static int HXmap_strncmp(const void *range, const void *skey, size_t len)
+{
+	size_t n = strnlen(skey, len);
+	int ret = memcmp(range, skey, n);
+
+	if (ret != 0)
+		return ret;
+	if (n < len)
+		/* @skey is a proper prefix of @range */
+		return 1;
+	return static_cast(const char *, skey)[len] == '\0' ? 0 : -1;
+}
+
+/**
+ * HXmap_strkeys - whether string keys are ordered by strcmp
+ */
+static __inline__ bool HXmap_strkeys(const struct HXmap_private *map)
+{
+	return static_cast(void *, map->ops.k_compare) ==
+	       static_cast(void *, strcmp) ||
+	       map->ops.k_compare == HXstrpool_cmp;
+}
+
+/**
+ * HXmap_hash_n - hash a byte range like the map hashes its string keys
+ *
+ * Only possible for the built-in string hashes, whose results do not
+ * depend on where the length comes from.
+ */
+static bool HXmap_hash_n(const struct HXmap_private *map, const void *key,
+    size_t len, unsigned long *hash)
+{
+	if (map->k_shash == HXhash_wys_seed)
+		*hash = HXhash_wy_seed(key, len, map->seed);
+	else if (map->k_shash != NULL)
+		return false;
+	else if (map->ops.k_hash == HXhash_wys)
+		*hash = HXhash_wy(key, len);
+	else if (map->ops.k_hash == HXhash_jlookup3s)
+		*hash = HXhash_jlookup3(key, len);
+	else if (map->ops.k_hash == HXhash_crc32cs)
+		*hash = HXhash_crc32c(key, len);
+	else if (map->ops.k_hash == HXhash_djb2)
+		*hash = HXhash_djb2_n(key, len);
+	else
+		return false;
+	return true;
+}
+
+/**
+ * HXmap_find_copy - HXmap_find_n for maps with custom string functions
+ */
+static const struct HXmap_node *HXmap_find_copy(const struct HXmap *xmap,
+    const char *key, size_t len)
+{
+	const struct HXmap_node *node;
+	char buf[256], *copy = buf;
+	int saved_errno;
+
+	/* Would be cut short by the NUL, and match the wrong key */
+	if (memchr(key, '\0', len) != NULL)
+		return NULL;
+	if (len >= sizeof(buf) && (copy = malloc(len + 1)) == NULL)
+		return NULL;
+	memcpy(copy, key, len);
+	copy[len] = '\0';
+	node = HXmap_find(xmap, copy);
+	if (copy != buf) {
+		saved_errno = errno;
+		free(copy);
+		errno = saved_errno;
+	}
+	return node;
+}
+
+/**
+ * HXmap_find_n - look up a string key given as a byte range
+ * @key:	key bytes, need not be NUL-terminated
+ * @len:	number of bytes in @key
+ *
+ * For %HXMAP_SKEY maps. With the default or a built-in string hash and
+ * strcmp ordering, the range is hashed and compared in place.
+ */
+EXPORT_SYMBOL const struct HXmap_node *
+HXmap_find_n(const struct HXmap *xmap, const void *key, size_t len)
+{
+	const void *vmap = xmap;
+	const struct HXmap_private *map = vmap;
+	unsigned long hash = 0;
+
+	if (!(map->flags & HXMAP_SKEY)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (map->type == HXMAPT_RCU) {
+		const struct HXrmap *rmap = vmap;
+		const struct HXmap_node *node;
+		unsigned int token;
+
+		/* Node remains valid only until the next write. */
+		node = HXmap_find_n(static_cast(const void *,
+		       HXrmap_enter(rmap, &token)), key, len);
+		HXrmap_leave(rmap, token);
+		return node;
+	}
+	if (!HXmap_strkeys(map) || ((map->type == HXMAPT_HASH ||
+	    map->type == HXMAPT_FLATHASH || map->type == HXMAPT_SHARDED) &&
+	    !HXmap_hash_n(map, key, len, &hash)))
+		return HXmap_find_copy(xmap, key, len);
+
+	switch (map->type) {
+	case HXMAPT_HASH: {
+		const struct HXumap_node *node;
+
+		HXumap_read_step(vmap);
+		node = HXumap_lookup_cmp(vmap, key, hash, HXmap_strncmp, len);
+		if (node == NULL)
+			return NULL;
+		return static_cast(const void *, &node->key);
+	}
+	case HXMAPT_RBTREE:
+		return HXrbtree_find_cmp(vmap, key, HXmap_strncmp, len);
+	case HXMAPT_FLATHASH:
+		return HXfmap_lookup_cmp(vmap, key, HXfmap_mix(hash),
+		       HXmap_strncmp, len);
+	case HXMAPT_BTREE:
+		return HXbptree_find_cmp(vmap, key, HXmap_strncmp, len);
+	case HXMAPT_FROZEN:
+		/* Keys are stored by content, without the NUL */
+		return HXzmap_lookup(vmap, key, len);
+	case HXMAPT_SHARDED: {
+		const struct HXsmap *smap = vmap;
+		struct HXsmap_shard *shard = HXsmap_shard(smap, hash);
+		const struct HXumap_node *drop;
+
+		pthread_rwlock_rdlock(&shard->lock);
+		drop = HXumap_lookup_cmp(shard->hmap, key, hash,
+		       HXmap_strncmp, len);
+		pthread_rwlock_unlock(&shard->lock);
+		if (drop == NULL)
+			return NULL;
+		return static_cast(const void *, &drop->key);
+	}
+	default:
+		errno = EINVAL;
+		return NULL;
+	}
+}
+
+#ifdef __GNUC__
+#	define HXmap_prefetch(p) __builtin_prefetch(p)
+#else
+#	define HXmap_prefetch(p) ((void)(p))
+#endif
+
+/*
+ * The batch lookup helpers below handle at most %HXMAP_BATCH keys. Each
+ * issues prefetches for all keys of the batch before it touches the memory
+ * for the first one, so that the cache misses overlap.
+ */
+static size_t HXumap_find_many(const struct HXumap *hmap,
+    const void *const *keys, size_t n, const struct HXmap_node **res)
+{
+	const struct HXlist_head *bk[HXMAP_BATCH];
+	unsigned long hash[HXMAP_BATCH];
+	const struct HXumap_node *drop;
+	size_t i, hits = 0;
+
+	HXumap_read_step(hmap);
+	for (i = 0; i < n; ++i) {
+		hash[i] = HXmap_hash(&hmap->super, keys[i]);
+		bk[i]   = HXumap_bucket(hmap, hash[i]);
+		HXmap_prefetch(bk[i]);
+	}
+	for (i = 0; i < n; ++i)
+		HXmap_prefetch(bk[i]->next);
+	for (i = 0; i < n; ++i) {
+		res[i] = NULL;
+		HXlist_for_each_entry(drop, bk[i], anchor)
+			if (drop->hash == hash[i] && hmap->super.ops.k_compare(
+			    keys[i], drop->key, hmap->super.key_size) == 0) {
+				res[i] = static_cast(const void *, &drop->key);
+				++hits;
+				break;
+			}
+	}
+	return hits;
+}
+
+static size_t HXfmap_find_many(const struct HXfmap *fmap,
+    const void *const *keys, size_t n, const struct HXmap_node **res)
+{
+	size_t mask = fmap->capacity - 1, i, hits = 0;
+	uint64_t h[HXMAP_BATCH];
+
+	for (i = 0; i < n; ++i) {
+		h[i] = HXfmap_mix(HXmap_hash(&fmap->super, keys[i]));
+		HXmap_prefetch(&fmap->ctrl[(h[i] >> 7) & mask]);
+		HXmap_prefetch(&fmap->slots[(h[i] >> 7) & mask]);
+	}
+	for (i = 0; i < n; ++i)
+		if ((res[i] = HXfmap_lookup(fmap, keys[i], h[i])) != NULL)
+			++hits;
+	return hits;
+}
+
+/**
+ * HXrbtree_find_many - descend for all keys in lockstep
+ */
+static size_t HXrbtree_find_many(const struct HXrbtree *btree,
+    const void *const *keys, size_t n, const struct HXmap_node **res)
+{
+	const struct HXrbnode *node[HXMAP_BATCH];
+	size_t i, active = n, hits = 0;
+	int cmp;
+
+	for (i = 0; i < n; ++i) {
+		node[i] = btree->root;
+		res[i]  = NULL;
+	}
+	while (active > 0) {
+		active = 0;
+		for (i = 0; i < n; ++i) {
+			if (node[i] == NULL)
+				continue;
+			cmp = btree->super.ops.k_compare(keys[i], node[i]->key,
+			      btree->super.key_size);
+			if (cmp == 0) {
+				res[i]  = static_cast(const void *, &node[i]->key);
+				node[i] = NULL;
+				++hits;
+				continue;
+			}
+			node[i] = node[i]->sub[cmp > 0];
+			if (node[i] != NULL) {
+				HXmap_prefetch(node[i]);
+				++active;
+			}
+		}
+	}
+	return hits;
+}
+
+/**
+ * HXbptree_find_many - descend for all keys in lockstep
+ *
+ * All leaves are at the same depth, so every key takes the same number of
+ * steps.
+ */
+static size_t HXbptree_find_many(const struct HXbptree *bt,
+    const void *const *keys, size_t n, const struct HXmap_node **res)
+{
+	const struct HXbpnode *node[HXMAP_BATCH];
+	const struct HXbpinner *in;
+	const struct HXbpleaf *leaf;
+	unsigned int lv, pos;
+	size_t i, hits = 0;
+	bool found;
+
+	if (bt->root == NULL) {
+		for (i = 0; i < n; ++i)
+			res[i] = NULL;
+		return 0;
+	}
+	for (i = 0; i < n; ++i)
+		node[i] = bt->root;
+	for (lv = 0; lv < bt->height; ++lv)
+		for (i = 0; i < n; ++i) {
+			in = static_cast(const void *, node[i]);
+			node[i] = in->child[HXbpinner_pos(bt, in, keys[i])];
+			HXmap_prefetch(node[i]);
+		}
+	for (i = 0; i < n; ++i) {
+		leaf = static_cast(const void *, node[i]);
+		pos  = HXbpleaf_pos(bt, leaf, keys[i], &found);
+		res[i] = found ? &leaf->elem[pos] : NULL;
+		hits  += found;
+	}
+	return hits;
+}
+
+/**
+ * HXmap_find_many - look up several keys at once
+ * @xmap:	map to search
+ * @keys:	keys to look for
+ * @n:		number of keys
+ * @res:	receives the element for each key, or %NULL if not present
+ *
+ * Returns the number of keys found.
+ */
+EXPORT_SYMBOL size_t HXmap_find_many(const struct HXmap *xmap,
+    const void *const *keys, size_t n, const struct HXmap_node **res)
+{
+	const void *vmap = xmap;
+	const struct HXmap_private *map = vmap;
+	size_t i, chunk, hits = 0;
+
+	if (map->type == HXMAPT_RCU) {
+		const struct HXrmap *rmap = vmap;
+		unsigned int token;
+
+		/* Nodes remain valid only until the next write. */
+		hits = HXmap_find_many(static_cast(const void *,
+		       HXrmap_enter(rmap, &token)), keys, n, res);
+		HXrmap_leave(rmap, token);
+		return hits;
+	}
+	for (i = 0; i < n; i += chunk) {
+		chunk = n - i < HXMAP_BATCH ? n - i : HXMAP_BATCH;
+		switch (map->type) {
+		case HXMAPT_HASH:
+			hits += HXumap_find_many(vmap, &keys[i], chunk, &res[i]);
+			break;
+		case HXMAPT_RBTREE:
+			hits += HXrbtree_find_many(vmap, &keys[i], chunk,
+			        &res[i]);
+			break;
+		case HXMAPT_FLATHASH:
+			hits += HXfmap_find_many(vmap, &keys[i], chunk, &res[i]);
+			break;
+		case HXMAPT_BTREE:
+			hits += HXbptree_find_many(vmap, &keys[i], chunk,
+			        &res[i]);
+			break;
+		default:
+			for (chunk = 0; i + chunk < n; ++chunk)
+				if ((res[i+chunk] = HXmap_find(xmap,
+				    keys[i+chunk])) != NULL)
+					++hits;
+			break;
+		}
+	}
+	return hits;
+}
+
+static void HXmap_visit_get(const struct HXmap_node *node, void *arg)
+{
+	*static_cast(void **, arg) = node->data;
+}
+
+EXPORT_SYMBOL void *HXmap_get(const struct HXmap *xmap, const void *key)
+{
+	const void *vmap = xmap;
+	const struct HXmap_private *map = vmap;
+	const struct HXmap_node *node;
+	void *data = NULL;
+
+	if (map->type == HXMAPT_SHARDED || map->type == HXMAPT_RCU) {
+		/* Read the value while the element is still protected. */
+		if (HXmap_visit(xmap, key, HXmap_visit_get, &data) == 0) {
+			errno = ENOENT;
+			return NULL;
+		}
+		errno = 0;
+		return data;
+	}
+	if ((node = HXmap_find(xmap, key)) == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	errno = 0;
+	return node->data;
+}
+
+/**
+ * HXmap_visit - look up a key and inspect the element in place
+ * @xmap:	map to search
+ * @key:	key to look for
+ * @fn:	function to call with the element
+ * @arg:	argument to @fn
+ *
+ * For %HXMAPT_SHARDED, @fn runs with the shard read-locked, and for
+ * %HXMAPT_RCU within a read-side section, so the element cannot be deleted
+ * or replaced concurrently. @fn must not modify the map.
+ * Returns 1 if @key was found, 0 if not, or a negative errno code.
+ */
+EXPORT_SYMBOL int HXmap_visit(const struct HXmap *xmap, const void *key,
+    void (*fn)(const struct HXmap_node *, void *), void *arg)
+{
+	const void *vmap = xmap;
+	const struct HXmap_private *map = vmap;
+	const struct HXmap_node *node;
+
+	if (map->type == HXMAPT_SHARDED) {
+		const struct HXsmap *smap = vmap;
+		unsigned long hash = HXmap_hash(map, key);
+		struct HXsmap_shard *shard = HXsmap_shard(smap, hash);
+		const struct HXumap_node *drop;
+
+		pthread_rwlock_rdlock(&shard->lock);
+		drop = HXumap_lookup(shard->hmap, key, hash);
+		if (drop != NULL)
+			fn(static_cast(const void *, &drop->key), arg);
+		pthread_rwlock_unlock(&shard->lock);
+		return drop != NULL;
+	} else if (map->type == HXMAPT_RCU) {
+		const struct HXrmap *rmap = vmap;
+		unsigned int token;
+
+		node = HXmap_find(static_cast(const void *,
+		       HXrmap_enter(rmap, &token)), key);
+		if (node != NULL)
+			fn(node, arg);
+		HXrmap_leave(rmap, token);
+		return node != NULL;
+	}
+	errno = 0;
+	if ((node = HXmap_find(xmap, key)) == NULL)
+		return errno == 0 ? 0 : -errno;
+	fn(node, arg);
+	return 1;
+}
+
+/**
+ * HXumap_replace - replace value in a drop
+ */
+static int HXumap_replace(const struct HXumap *hmap, struct HXumap_node *drop,
+    const void *value)
+{
+	void *old_value, *new_value;
+
+	if (hmap->super.flags & HXMAP_NOREPLACE)
+		return -EEXIST;
+
+	new_value = HXmap_dclone(&hmap->super, drop, value);
+	if (new_value == NULL && value != NULL)
+		return -errno;
+	old_value  = drop->data;
+	drop->data = new_value;
+	HXmap_dfree(&hmap->super, old_value);
+	return 1;
+}
+
+/**
+ * HXumap_add_hash - add or replace an element
+ * @nodep:	if not %NULL, an existing element is left alone rather than
+ * 		replaced (returning 0), and @*nodep receives the element
+ */
+static int HXumap_add_hash(struct HXumap *hmap, const void *key,
+    const void *value, unsigned long hash, struct HXmap_node **nodep)
+{
+	struct HXumap_node *drop;
+	int ret, saved_errno;
+
+	HXumap_migrate(hmap, HXUMAP_MIGRATE_STEP);
+	if ((drop = HXumap_lookup(hmap, key, hash)) != NULL) {
+		if (nodep == NULL)
+			return HXumap_replace(hmap, drop, value);
+		*nodep = static_cast(void *, &drop->key);
+		return 0;
+	}
+
+	if (HXumap_may_grow(hmap)) {
+		if ((ret = HXumap_layout(hmap, hmap->power + 1)) <= 0)
+			return ret;
+	} else if (HXumap_may_shrink(hmap)) {
+		if ((ret = HXumap_layout(hmap, hmap->power - 1)) <= 0)
+			return ret;
+	}
+
+	/* New node */
+	if ((drop = HXmap_node_alloc(&hmap->super)) == NULL)
+		return -errno;
+	HXlist_init(&drop->anchor);
+	drop->key = HXmap_kclone(&hmap->super, drop, key);
+	if (drop->key == NULL && key != NULL)
+		goto out;
+	drop->data = HXmap_dclone(&hmap->super, drop, value);
+	if (drop->data == NULL && value != NULL)
+		goto out;
+
+	drop->hash = hash;
+	HXlist_add_tail(HXumap_bucket(hmap, hash), &drop->anchor);
+	++hmap->super.items;
+	if (nodep != NULL)
+		*nodep = static_cast(void *, &drop->key);
+	return 1;
+
+ out:
+	saved_errno = errno;
+	HXmap_kfree(&hmap->super, drop->key);
+	HXmap_node_free(&hmap->super, drop);
+	return -(errno = saved_errno);
+}
+
+/**
+ * HXumap_reseed - switch to a new hash seed and rehash all elements
+ *
+ * With a seeded hash, an abnormally long bucket chain means the keys
+ * collide for this particular seed, which a new seed resolves.
+ */
+static int HXumap_reseed(struct HXumap *hmap)
+{
+	const unsigned int bk_number = hmap->bk_sizes[hmap->power];
+	struct HXlist_head *bk_array;
+	struct HXumap_node *drop;
+	unsigned int i;
+
+	HXumap_migrate(hmap, UINT_MAX);
+	bk_array = malloc(bk_number * sizeof(*bk_array));
+	if (bk_array == NULL)
+		return -errno;
+	for (i = 0; i < bk_number; ++i)
+		HXlist_init(&bk_array[i]);
+	hmap->super.seed = HXmap_seed_new();
+	for (i = 0; i < bk_number; ++i)
+		HXlist_for_each_entry(drop, &hmap->bk_array[i], anchor)
+			drop->hash = HXmap_hash(&hmap->super, drop->key);
+	HXumap_move(hmap, bk_array, hmap->power, hmap->bk_array, bk_number);
+	free(hmap->bk_array);
+	hmap->bk_array  = bk_array;
+	hmap->reseed_at = hmap->super.items;
+	++hmap->tid;
+	++hmap->relayouts;
+	return 1;
+}
+
+static int HXumap_add(struct HXumap *hmap, const void *key, const void *value,
+    struct HXmap_node **nodep)
+{
+	unsigned long hash = HXmap_hash(&hmap->super, key);
+	const struct HXlist_head *bk, *pos;
+	unsigned int chain = 0;
+	int ret;
+
+	ret = HXumap_add_hash(hmap, key, value, hash, nodep);
+	/*
+	 * Chain-length guard. Only the built-in hashes can be reseeded.
+	 * Requiring the map to double in size between reseeds bounds the
+	 * rehashing work should the keys collide under every seed.
+	 */
+	if (ret <= 0 || hmap->super.k_shash == NULL ||
+	    hmap->super.items < 2 * hmap->reseed_at + HXUMAP_MAXCHAIN)
+		return ret;
+	bk = HXumap_bucket(hmap, hash);
+	for (pos = bk->next; pos != bk; pos = pos->next)
+		if (++chain > HXUMAP_MAXCHAIN) {
+			/*
+			 * The element is in either way. Should there be no
+			 * memory for the new bucket array, the map stays
+			 * intact under the old seed, and the next attempt is
+			 * put off like after a successful reseed.
+			 */
+			if (HXumap_reseed(hmap) <= 0)
+				hmap->reseed_at = hmap->super.items;
+			break;
+		}
+	return ret;
+}
+
+/**
+ * HXsmap_sync_flags - pass runtime flags of the outer map on to a shard
+ *
+ * %HXMAP_NOREPLACE and %HXMAP_NOSHRINK may be toggled at runtime on the
+ * outer map. Must be called with the shard's write lock held.
+ */
+static __inline__ void HXsmap_sync_flags(const struct HXsmap *smap,
+    struct HXumap *hmap)
+{
+	static const unsigned int mask = HXMAP_NOREPLACE | HXMAP_NOSHRINK;
+
+	hmap->super.flags = (hmap->super.flags & ~mask) |
+	                    (__atomic_load_n(&smap->super.flags,
+	                    __ATOMIC_RELAXED) & mask);
+}
+
+static int HXsmap_add(struct HXsmap *smap, const void *key, const void *value,
+    struct HXmap_node **nodep)
+{
+	unsigned long hash = HXmap_hash(&smap->super, key);
+	struct HXsmap_shard *shard = HXsmap_shard(smap, hash);
+	struct HXumap *hmap = shard->hmap;
+	size_t items;
+	int ret;
+
+	/*
+	 * No chain-length guard here: the seed also selects the shard, so
+	 * a new one would have to be switched to under all shard locks.
+	 */
+	pthread_rwlock_wrlock(&shard->lock);
+	HXsmap_sync_flags(smap, hmap);
+	items = hmap->super.items;
+	ret = HXumap_add_hash(hmap, key, value, hash, nodep);
+	if (hmap->super.items != items)
+		__atomic_add_fetch(&smap->super.items, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&shard->lock);
+	return ret;
+}
+
+static int HXrmap_add(struct HXrmap *rmap, const void *key, const void *value)
+{
+	const struct HXmap_node *node;
+	struct HXmap_private *cpriv;
+	void *old_value = NULL;
+	struct HXmap *copy;
+	int ret;
+
+	pthread_mutex_lock(&rmap->wlock);
+	/* Avoid the copy when it would be thrown away anyway. */
+	if ((rmap->super.flags & HXMAP_NOREPLACE) &&
+	    HXmap_find(static_cast(void *, rmap->snap), key) != NULL) {
+		ret = -EEXIST;
+		goto out;
+	}
+	if ((copy = HXrmap_clone(rmap, 1)) == NULL) {
+		ret = -errno;
+		goto out;
+	}
+	/*
+	 * A replaced value is still visible in the old snapshot; free it
+	 * only after the grace period.
+	 */
+	cpriv = static_cast(void *, copy);
+	node  = HXmap_find(copy, key);
+	if (node != NULL)
+		old_value = node->data;
+	cpriv->ops.d_free = NULL;
+	ret = HXmap_add(copy, key, value);
+	cpriv->ops.d_free = rmap->snap->ops.d_free;
+	if (ret <= 0) {
+		HXrmap_free_shallow(cpriv);
+		goto out;
+	}
+	HXrmap_replace(rmap, cpriv, true);
+	if (node != NULL)
+		HXmap_dfree(cpriv, old_value);
+ out:
+	pthread_mutex_unlock(&rmap->wlock);
+	return ret;
+}
+
+static int HXfmap_replace(const struct HXfmap *fmap, struct HXmap_node *slot,
+    const void *value)
+{
+	void *old_value, *new_value;
+
+	if (fmap->super.flags & HXMAP_NOREPLACE)
+		return -EEXIST;
+
+	new_value = fmap->super.ops.d_clone(value, fmap->super.data_size);
+	if (new_value == NULL && value != NULL)
+		return -errno;
+	old_value  = slot->data;
+	slot->data = new_value;
+	if (fmap->super.ops.d_free != NULL)
+		fmap->super.ops.d_free(old_value);
+	return 1;
+}
+
+static int HXfmap_add(struct HXfmap *fmap, const void *key, const void *value,
+    struct HXmap_node **nodep)
+{
+	struct HXmap_node *slot;
+	void *new_key, *new_value;
+	uint64_t h;
+	size_t idx;
+	int ret, saved_errno;
+
+	h = HXfmap_mix(HXmap_hash(&fmap->super, key));
+	if ((slot = HXfmap_lookup(fmap, key, h)) != NULL) {
+		if (nodep == NULL)
+			return HXfmap_replace(fmap, slot, value);
+		*nodep = slot;
+		return 0;
+	}
+
+	if (fmap->growth_left == 0) {
+		/*
+		 * The budget is used up by elements and tombstones. If the
+		 * tombstones make up most of it, a same-size rehash clears
+		 * them and suffices.
+		 */
+		size_t cap = fmap->capacity;
+		if (fmap->tombstones < fmap->super.items)
+			cap *= 2;
+		if ((ret = HXfmap_layout(fmap, cap)) <= 0)
+			return ret;
+	}
+
+	new_key = HXmap_kclone(&fmap->super, NULL, key);
+	if (new_key == NULL && key != NULL)
+		return -errno;
+	new_value = HXmap_dclone(&fmap->super, NULL, value);
+	if (new_value == NULL && value != NULL) {
+		saved_errno = errno;
+		HXmap_kfree(&fmap->super, new_key);
+		return -(errno = saved_errno);
+	}
+
+	idx = HXfmap_find_free(fmap, h);
+	if (fmap->ctrl[idx] == HXFMAP_DELETED)
+		--fmap->tombstones;
+	else
+		--fmap->growth_left;
+	HXfmap_setctrl(fmap, idx, h & 0x7F);
+	fmap->slots[idx].key  = new_key;
+	fmap->slots[idx].data = new_value;
+	++fmap->super.items;
+	if (nodep != NULL)
+		*nodep = &fmap->slots[idx];
+	return 1;
+}
+
+/**
+ * HXrbtree_amov - do balance (move) after addition of a node
+ * @path:	path from the root to the new node
+ * @dir:	direction vectors
+ * @depth:	current index in @path and @dir
+ * @tid:	pointer to transaction ID which may need updating
+ */
+static void HXrbtree_amov(struct HXrbnode **path,
+    const unsigned char *dir, unsigned int depth, unsigned int *tid)
+{
+	struct HXrbnode *uncle, *parent, *grandp, *newnode;
+
+	/*
+	 * The newly inserted node (or the last rebalanced node) at
+	 * @path[depth-1] is red, so the parent must not be.
+	 *
+	 * Use an iterative approach to not waste time with recursive function
+	 * calls. The @LR variable is used to handle the symmetric case without
+	 * code duplication.
+	 */
+	do {
+		unsigned int LR = dir[depth-2];
+
+		grandp = path[depth-2];
+		parent = path[depth-1];
 		uncle  = grandp->sub[!LR];
 
-		if (uncle != NULL && uncle->color == RBT_RED) {
+		if (uncle != NULL && uncle->color == RBT_RED) {
+			/*
+			 * Case 3 (WP): Only colors have to be swapped to keep
+			 * the black height. But rebalance needs to continue.
+			 */
+			parent->color = RBT_BLACK;
+			uncle->color  = RBT_BLACK;
+			grandp->color = RBT_RED;
+			depth        -= 2;
+			continue;
+		}
+
+		/*
+		 * Case 4 (WP): New node is the right child of its parent, and
+		 * the parent is the left child of the grandparent. A left
+		 * rotate is done at the parent to transform it into a case 5.
+		 */
+		if (dir[depth-1] != LR) {
+			newnode          = parent->sub[!LR];
+			parent->sub[!LR] = newnode->sub[LR];
+			newnode->sub[LR] = parent;
+			grandp->sub[LR]  = newnode;
+			/* relabel */
+			parent  = grandp->sub[LR];
+			/* unused assignment: newnode = parent->sub[LR]; */
+		} else {
+			/* unused assignment: newnode = path[depth]; */
+		}
+
+		/*
+		 * Case 5: New node is the @LR child of its parent which is
+		 * the @LR child of the grandparent. A right rotation on
+		 * @grandp is performed.
+		 */
+		grandp->sub[LR]  = parent->sub[!LR];
+		parent->sub[!LR] = grandp;
+		path[depth-3]->sub[dir[depth-3]] = parent;
+		grandp->color    = RBT_RED;
+		parent->color    = RBT_BLACK;
+		++*tid;
+		break;
+	} while (depth >= 3 && path[depth-1]->color == RBT_RED);
+}
+
+/**
+ * HXrbnode_link - in-order links of a node of an %HXMAP_THREADED tree
+ */
+static __inline__ struct HXrbnode **HXrbnode_link(struct HXrbnode *node)
+{
+	return reinterpret_cast(struct HXrbtnode *, node)->link;
+}
+
+/**
+ * HXrbtree_thread - link a new node into the in-order list
+ * @parent:	node @node was attached to (%NULL for the root)
+ * @side:	which child of @parent @node is
+ *
+ * A left child comes right before its parent, a right child right after it.
+ */
+static void HXrbtree_thread(struct HXrbtree *btree, struct HXrbnode *node,
+    struct HXrbnode *parent, unsigned char side)
+{
+	struct HXrbnode *prev = NULL, *next = NULL;
+
+	if (parent != NULL && side == RBT_LEFT) {
+		next = parent;
+		prev = HXrbnode_link(parent)[RBT_LEFT];
+	} else if (parent != NULL) {
+		prev = parent;
+		next = HXrbnode_link(parent)[RBT_RIGHT];
+	}
+	HXrbnode_link(node)[RBT_LEFT]  = prev;
+	HXrbnode_link(node)[RBT_RIGHT] = next;
+	if (prev != NULL)
+		HXrbnode_link(prev)[RBT_RIGHT] = node;
+	else
+		btree->first = node;
+	if (next != NULL)
+		HXrbnode_link(next)[RBT_LEFT] = node;
+	else
+		btree->last = node;
+}
+
+static int HXrbtree_replace(const struct HXrbtree *btree,
+    struct HXrbnode *node, const void *value)
+{
+	void *old_value, *new_value;
+
+	if (!(btree->super.flags & HXMAP_NOREPLACE))
+		return -(errno = EEXIST);
+
+	new_value = HXmap_dclone(&btree->super, node, value);
+	if (new_value == NULL && value != NULL)
+		return -errno;
+	old_value  = node->data;
+	node->data = new_value;
+	HXmap_dfree(&btree->super, old_value);
+	return 1;
+}
+
+static int HXrbtree_add(struct HXrbtree *btree,
+    const void *key, const void *value, struct HXmap_node **nodep)
+{
+	struct HXrbnode *node, *path[RBT_MAXDEP];
+	unsigned char dir[RBT_MAXDEP];
+	unsigned int depth = 0;
+	int saved_errno;
+
+	/*
+	 * Since our struct HXrbnode runs without a ->parent pointer,
+	 * the path "upwards" from @node needs to be recorded somehow,
+	 * here with @path. Another array, @dir is used to speedup direction
+	 * decisions. (WP's "n->parent == grandparent(n)->left" is just slow.)
+	 */
+	path[depth]  = reinterpret_cast(struct HXrbnode *, &btree->root);
+	dir[depth++] = 0;
+	node = btree->root;
+
+	while (node != NULL) {
+		int res = btree->super.ops.k_compare(key,
+		          node->key, btree->super.key_size);
+		if (res == 0 && nodep != NULL) {
+			*nodep = static_cast(void *, &node->key);
+			return 0;
+		} else if (res == 0) {
+			/*
+			 * The node already exists (found the key), overwrite
+			 * the data.
+			 */
+			return HXrbtree_replace(btree, node, value);
+		}
+
+		res          = res > 0;
+		path[depth]  = node;
+		dir[depth++] = res;
+		node         = node->sub[res];
+	}
+
+	if ((node = HXmap_node_alloc(&btree->super)) == NULL)
+		return -errno;
+
+	/* New node, push data into it */
+	node->key = HXmap_kclone(&btree->super, node, key);
+	if (node->key == NULL && key != NULL)
+		goto out;
+	node->data = HXmap_dclone(&btree->super, node, value);
+	if (node->data == NULL && value != NULL)
+		goto out;
+
+	/*
+	 * Add the node to the tree. In trying not to hit a rule 2 violation
+	 * (each simple path has the same number of black nodes), it is colored
+	 * red so that below we only need to check for rule 1 violations.
+	 */
+	node->N_LEFT = node->N_RIGHT = NULL;
+	node->color = RBT_RED;
+	path[depth-1]->sub[dir[depth-1]] = node;
+	++btree->super.items;
+	if (btree->super.flags & HXMAP_THREADED)
+		HXrbtree_thread(btree, node, depth > 1 ? path[depth-1] : NULL,
+		                dir[depth-1]);
+
+	/*
+	 * WP: [[Red-black_tree]] says:
+	 * Case 1: @node is root node - just color it black (see below).
+	 * Case 2: @parent is black - no action needed (skip).
+	 * No rebalance needed for a 2-node tree.
+	 */
+	if (depth >= 3 && path[depth-1]->color == RBT_RED)
+		HXrbtree_amov(path, dir, depth, &btree->tid);
+
+	btree->root->color = RBT_BLACK;
+	if (nodep != NULL)
+		*nodep = static_cast(void *, &node->key);
+	return 1;
+
+ out:
+	saved_errno = errno;
+	HXmap_kfree(&btree->super, node->key);
+	HXmap_node_free(&btree->super, node);
+	return -(errno = saved_errno);
+}
+
+static int HXbptree_replace(const struct HXbptree *bt,
+    struct HXmap_node *elem, const void *value)
+{
+	void *new_value;
+
+	if (bt->super.flags & HXMAP_NOREPLACE)
+		return -EEXIST;
+	new_value = bt->super.ops.d_clone(value, bt->super.data_size);
+	if (new_value == NULL && value != NULL)
+		return -errno;
+	if (bt->super.ops.d_free != NULL)
+		bt->super.ops.d_free(elem->data);
+	elem->data = new_value;
+	return 1;
+}
+
+static void HXbpinner_insert(struct HXbpinner *in, unsigned int i,
+    const void *sep, struct HXbpnode *right)
+{
+	memmove(&in->key[i+1], &in->key[i],
+	        (in->hdr.count - 1 - i) * sizeof(*in->key));
+	memmove(&in->child[i+2], &in->child[i+1],
+	        (in->hdr.count - 1 - i) * sizeof(*in->child));
+	in->key[i]     = sep;
+	in->child[i+1] = right;
+	++in->hdr.count;
+}
+
+/**
+ * HXbptree_insert_parent - hook a new right sibling into the tree
+ * @level:	depth of @left (0 being the root)
+ * @spare:	preallocated inner nodes for splits, consumed from the end
+ *
+ * Splits full inner nodes on the way up as needed.
+ */
+static void HXbptree_insert_parent(struct HXbptree *bt,
+    const struct HXbppath *path, unsigned int level, struct HXbpnode *left,
+    const void *sep, struct HXbpnode *right, struct HXbpinner **spare,
+    unsigned int *nspare)
+{
+	const void *keys[HXBPT_INNER_MAX];
+	struct HXbpnode *kids[HXBPT_INNER_MAX+1];
+	struct HXbpinner *in, *rin;
+	unsigned int i, half = (HXBPT_INNER_MAX + 1) / 2;
+
+	while (true) {
+		if (level == 0) {
+			in = spare[--*nspare];
+			in->hdr.leaf  = false;
+			in->hdr.count = 2;
+			in->key[0]    = sep;
+			in->child[0]  = left;
+			in->child[1]  = right;
+			bt->root = &in->hdr;
+			++bt->height;
+			return;
+		}
+		in = path->node[level-1];
+		i  = path->idx[level-1];
+		if (in->hdr.count < HXBPT_INNER_MAX) {
+			HXbpinner_insert(in, i, sep, right);
+			return;
+		}
+
+		/* Merge the new separator in, then cut in half. */
+		memcpy(keys, in->key, i * sizeof(*keys));
+		keys[i] = sep;
+		memcpy(&keys[i+1], &in->key[i],
+		       (HXBPT_INNER_MAX - 1 - i) * sizeof(*keys));
+		memcpy(kids, in->child, (i + 1) * sizeof(*kids));
+		kids[i+1] = right;
+		memcpy(&kids[i+2], &in->child[i+1],
+		       (HXBPT_INNER_MAX - 1 - i) * sizeof(*kids));
+
+		rin = spare[--*nspare];
+		rin->hdr.leaf  = false;
+		rin->hdr.count = HXBPT_INNER_MAX + 1 - half;
+		memcpy(rin->key, &keys[half], (rin->hdr.count - 1) * sizeof(*keys));
+		memcpy(rin->child, &kids[half], rin->hdr.count * sizeof(*kids));
+		in->hdr.count = half;
+		memcpy(in->key, keys, (half - 1) * sizeof(*keys));
+		memcpy(in->child, kids, half * sizeof(*kids));
+
+		left  = &in->hdr;
+		sep   = keys[half-1];
+		right = &rin->hdr;
+		--level;
+	}
+}
+
+/**
+ * HXbptree_split - make room in a full leaf
+ * @leafp:	leaf to split; updated to the half that receives @*posp
+ * @posp:	insertion position; updated for the new leaf
+ *
+ * All nodes are allocated up front, so that the tree is never left
+ * half-split on allocation failure.
+ */
+static int HXbptree_split(struct HXbptree *bt, const struct HXbppath *path,
+    struct HXbpleaf **leafp, unsigned int *posp)
+{
+	struct HXbpinner *spare[HXBPT_MAXDEP+1];
+	struct HXbpleaf *leaf = *leafp, *right;
+	unsigned int half = HXBPT_LEAF_MAX / 2, nspare = 0, need = 0;
+	int lv;
+
+	/* One node per full ancestor, plus a new root if all are full */
+	for (lv = bt->height - 1; lv >= 0; --lv) {
+		if (path->node[lv]->hdr.count < HXBPT_INNER_MAX)
+			break;
+		++need;
+	}
+	if (lv < 0) {
+		if (bt->height >= HXBPT_MAXDEP)
+			return -E2BIG;
+		++need;
+	}
+	for (; nspare < need; ++nspare)
+		if ((spare[nspare] = malloc(sizeof(**spare))) == NULL)
+			goto out;
+	if ((right = malloc(sizeof(*right))) == NULL)
+		goto out;
+
+	right->hdr.leaf  = true;
+	right->hdr.count = HXBPT_LEAF_MAX - half;
+	memcpy(right->elem, &leaf->elem[half],
+	       right->hdr.count * sizeof(*right->elem));
+	leaf->hdr.count = half;
+	right->prev = leaf;
+	right->next = leaf->next;
+	if (leaf->next != NULL)
+		leaf->next->prev = right;
+	else
+		bt->last = right;
+	leaf->next = right;
+	HXbptree_insert_parent(bt, path, bt->height, &leaf->hdr,
+		right->elem[0].key, &right->hdr, spare, &nspare);
+	if (*posp > half) {
+		*leafp = right;
+		*posp -= half;
+	}
+	return 1;
+
+ out:
+	while (nspare > 0)
+		free(spare[--nspare]);
+	return -ENOMEM;
+}
+
+static int HXbptree_add(struct HXbptree *bt, const void *key,
+    const void *value, struct HXmap_node **nodep)
+{
+	struct HXbppath path;
+	struct HXbpleaf *leaf;
+	unsigned int pos;
+	void *new_key, *new_value;
+	bool found;
+	int ret;
+
+	if (bt->root == NULL) {
+		if ((leaf = calloc(1, sizeof(*leaf))) == NULL)
+			return -errno;
+		leaf->hdr.leaf = true;
+		bt->root  = &leaf->hdr;
+		bt->first = bt->last = leaf;
+	}
+	leaf = HXbptree_descend(bt, key, &path);
+	pos  = HXbpleaf_pos(bt, leaf, key, &found);
+	if (found && nodep != NULL) {
+		*nodep = &leaf->elem[pos];
+		return 0;
+	} else if (found) {
+		return HXbptree_replace(bt, &leaf->elem[pos], value);
+	}
+
+	new_key = HXmap_kclone(&bt->super, NULL, key);
+	if (new_key == NULL && key != NULL)
+		return -errno;
+	new_value = HXmap_dclone(&bt->super, NULL, value);
+	if (new_value == NULL && value != NULL) {
+		ret = -errno;
+		goto out;
+	}
+	if (leaf->hdr.count == HXBPT_LEAF_MAX) {
+		ret = HXbptree_split(bt, &path, &leaf, &pos);
+		if (ret <= 0)
+			goto out_data;
+	}
+	/*
+	 * pos==0 only happens on the leftmost path, where no separator refers
+	 * to the leaf's first key.
+	 */
+	memmove(&leaf->elem[pos+1], &leaf->elem[pos],
+	        (leaf->hdr.count - pos) * sizeof(*leaf->elem));
+	leaf->elem[pos].key  = new_key;
+	leaf->elem[pos].data = new_value;
+	++leaf->hdr.count;
+	++bt->super.items;
+	++bt->tid;
+	if (nodep != NULL)
+		*nodep = &leaf->elem[pos];
+	return 1;
+
+ out_data:
+	if (bt->super.ops.d_free != NULL)
+		bt->super.ops.d_free(new_value);
+ out:
+	HXmap_kfree(&bt->super, new_key);
+	return ret;
+}
+
+EXPORT_SYMBOL int HXmap_add(struct HXmap *xmap,
+    const void *key, const void *value)
+{
+	void *vmap = xmap;
+	struct HXmap_private *map = vmap;
+
+	if ((map->flags & HXMAP_SINGULAR) && value != NULL) {
+		fprintf(stderr, "libHX-map: adding value!=NULL "
+		        "into a set not allowed\n");
+		return -EINVAL;
+	}
+
+	switch (map->type) {
+	case HXMAPT_HASH:
+		return HXumap_add(vmap, key, value, NULL);
+	case HXMAPT_RBTREE:
+		return HXrbtree_add(vmap, key, value, NULL);
+	case HXMAPT_FLATHASH:
+		return HXfmap_add(vmap, key, value, NULL);
+	case HXMAPT_SHARDED:
+		return HXsmap_add(vmap, key, value, NULL);
+	case HXMAPT_RCU:
+		return HXrmap_add(vmap, key, value);
+	case HXMAPT_BTREE:
+		return HXbptree_add(vmap, key, value, NULL);
+	case HXMAPT_FROZEN:
+		return -EPERM;
+	default:
+		return -EINVAL;
+	}
+}
+
+/**
+ * HXmap_find_or_insert - look up a key, adding it if it is not present
+ * @inserted:	if not %NULL, set to whether the element was newly added
+ *
+ * Does a single lookup for both cases. The value of a new element is a
+ * zero-filled copy for maps which copy fixed-size values (%HXMAP_CDATA),
+ * and %NULL otherwise. Returns the element, which the caller may update in
+ * place until the map is next modified, or %NULL with errno set.
+ */
+EXPORT_SYMBOL struct HXmap_node *
+HXmap_find_or_insert(struct HXmap *xmap, const void *key, bool *inserted)
+{
+	void *vmap = xmap;
+	struct HXmap_private *map = vmap;
+	struct HXmap_node *node = NULL;
+	const void *value = NULL;
+	int ret;
+
+	if (map->ops.d_clone == HX_memdup && map->data_size != 0)
+		value = HXmap_zero;
+
+	switch (map->type) {
+	case HXMAPT_HASH:
+		ret = HXumap_add(vmap, key, value, &node);
+		break;
+	case HXMAPT_RBTREE:
+		ret = HXrbtree_add(vmap, key, value, &node);
+		break;
+	case HXMAPT_FLATHASH:
+		ret = HXfmap_add(vmap, key, value, &node);
+		break;
+	case HXMAPT_SHARDED:
+		ret = HXsmap_add(vmap, key, value, &node);
+		break;
+	case HXMAPT_BTREE:
+		ret = HXbptree_add(vmap, key, value, &node);
+		break;
+	case HXMAPT_RCU:
+	case HXMAPT_FROZEN:
+		/* Published snapshots must not be modified in place. */
+		errno = EPERM;
+		return NULL;
+	default:
+		errno = EINVAL;
+		return NULL;
+	}
+	if (ret < 0) {
+		errno = -ret;
+		return NULL;
+	}
+	if (inserted != NULL)
+		*inserted = ret > 0;
+	return node;
+}
+
+/**
+ * HXrbtree_build - link a subtree from sorted elements
+ * @depth:	depth of the subtree's root
+ * @red_depth:	depth at which nodes are colored red
+ * @err:	receives the error code, if any
+ *
+ * Taking the middle element as root makes the two subtrees differ in size by
+ * at most one, so all leaves are at the two deepest levels. Coloring the
+ * deepest level red yields the same black height on every path.
+ */
+static struct HXrbnode *HXrbtree_build(const struct HXrbtree *btree,
+    const struct HXmap_node *nodes, size_t count, unsigned int depth,
+    unsigned int red_depth, int *err)
+{
+	const struct HXmap_private *super = &btree->super;
+	struct HXrbnode *node;
+	size_t mid = count / 2;
+
+	if (count == 0)
+		return NULL;
+	if ((node = HXmap_node_alloc(super)) == NULL) {
+		*err = -errno;
+		return NULL;
+	}
+	node->key = HXmap_kclone(super, node, nodes[mid].key);
+	if (node->key == NULL && nodes[mid].key != NULL) {
+		*err = -errno;
+		HXmap_node_free(super, node);
+		return NULL;
+	}
+	node->data = HXmap_dclone(super, node, nodes[mid].data);
+	if (node->data == NULL && nodes[mid].data != NULL) {
+		*err = -errno;
+		goto out;
+	}
+	node->color = depth == red_depth ? RBT_RED : RBT_BLACK;
+	node->sub[RBT_LEFT] = HXrbtree_build(btree, nodes, mid, depth + 1,
+	                      red_depth, err);
+	if (*err != 0)
+		goto out_data;
+	node->sub[RBT_RIGHT] = HXrbtree_build(btree, &nodes[mid+1],
+	                       count - mid - 1, depth + 1, red_depth, err);
+	if (*err != 0) {
+		if (node->sub[RBT_LEFT] != NULL)
+			HXrbtree_free_dive(btree, node->sub[RBT_LEFT]);
+		goto out_data;
+	}
+	return node;
+
+ out_data:
+	HXmap_dfree(super, node->data);
+ out:
+	HXmap_kfree(super, node->key);
+	HXmap_node_free(super, node);
+	return NULL;
+}
+
+/**
+ * HXrbtree_thread_all - set up the in-order links of a whole tree
+ */
+static void HXrbtree_thread_all(struct HXrbtree *btree)
+{
+	struct HXrbnode *stack[RBT_MAXDEP], *node = btree->root, *prev = NULL;
+	unsigned int depth = 0;
+
+	btree->first = NULL;
+	while (node != NULL || depth > 0) {
+		while (node != NULL) {
+			stack[depth++] = node;
+			node = node->N_LEFT;
+		}
+		node = stack[--depth];
+		HXrbnode_link(node)[RBT_LEFT] = prev;
+		if (prev != NULL)
+			HXrbnode_link(prev)[RBT_RIGHT] = node;
+		else
+			btree->first = node;
+		prev = node;
+		node = node->N_RIGHT;
+	}
+	if (prev != NULL)
+		HXrbnode_link(prev)[RBT_RIGHT] = NULL;
+	btree->last = prev;
+}
+
+static int HXrbtree_build_sorted(struct HXrbtree *btree,
+    const struct HXmap_node *nodes, size_t count)
+{
+	unsigned int max_depth = 0;
+	int err = 0;
+
+	while ((count >> (max_depth + 1)) != 0)
+		++max_depth;
+	if (max_depth >= RBT_MAXDEP)
+		return -E2BIG;
+	/* A lone root stays black. */
+	btree->root = HXrbtree_build(btree, nodes, count, 0,
+	              max_depth > 0 ? max_depth : UINT_MAX, &err);
+	if (err != 0)
+		return err;
+	if (btree->super.flags & HXMAP_THREADED)
+		HXrbtree_thread_all(btree);
+	btree->super.items = count;
+	++btree->tid;
+	return 1;
+}
+
+/**
+ * HXmap_build_sorted - populate an empty map from sorted elements
+ * @xmap:	map to fill
+ * @nodes:	key-value pairs in strictly ascending key order (k_compare)
+ * @count:	number of elements in @nodes
+ *
+ * Keys and values are cloned as with HXmap_add. Red-black trees are linked
+ * up directly in O(n); other map types fall back to HXmap_add. On error,
+ * the map is left empty. For %HXMAPT_RCU, build a separate map and use
+ * HXmap_publish instead.
+ */
+EXPORT_SYMBOL int HXmap_build_sorted(struct HXmap *xmap,
+    const struct HXmap_node *nodes, size_t count)
+{
+	void *vmap = xmap;
+	struct HXmap_private *map = vmap;
+	size_t i;
+	int ret;
+
+	if (map->items != 0 || map->type == HXMAPT_RCU)
+		return -EINVAL;
+	for (i = 0; i < count; ++i) {
+		if ((map->flags & HXMAP_SINGULAR) && nodes[i].data != NULL)
+			return -EINVAL;
+		if (i > 0 && map->ops.k_compare(nodes[i-1].key, nodes[i].key,
+		    map->key_size) >= 0)
+			return -EINVAL;
+	}
+	if (count == 0)
+		return 1;
+	if (map->type == HXMAPT_RBTREE)
+		return HXrbtree_build_sorted(vmap, nodes, count);
+
+	ret = HXmap_reserve(xmap, count);
+	if (ret <= 0)
+		return ret;
+	for (i = 0; i < count; ++i) {
+		ret = HXmap_add(xmap, nodes[i].key, nodes[i].data);
+		if (ret <= 0) {
+			while (i-- > 0)
+				HXmap_del(xmap, nodes[i].key);
+			return ret;
+		}
+	}
+	return 1;
+}
+
+static void *HXumap_del_hash(struct HXumap *hmap, const void *key,
+    unsigned long hash)
+{
+	struct HXumap_node *drop;
+	void *value;
+
+	HXumap_migrate(hmap, HXUMAP_MIGRATE_STEP);
+	if ((drop = HXumap_lookup(hmap, key, hash)) == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	HXlist_del(&drop->anchor);
+	++hmap->tid;
+	--hmap->super.items;
+	if (HXumap_may_shrink(hmap))
+		/*
+		 * Ignore return value. If it failed, it will continue to use
+		 * the current bk_array.
+		 */
+		HXumap_layout(hmap, hmap->power - 1);
+
+	value = drop->data;
+	HXmap_kfree(&hmap->super, drop->key);
+	HXmap_dfree(&hmap->super, drop->data);
+	HXmap_node_free(&hmap->super, drop);
+	errno = 0;
+	return value;
+}
+
+static __inline__ void *HXumap_del(struct HXumap *hmap, const void *key)
+{
+	return HXumap_del_hash(hmap, key,
+	       HXmap_hash(&hmap->super, key));
+}
+
+static void *HXsmap_del(struct HXsmap *smap, const void *key)
+{
+	unsigned long hash = HXmap_hash(&smap->super, key);
+	struct HXsmap_shard *shard = HXsmap_shard(smap, hash);
+	void *value;
+	int saved_errno;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	HXsmap_sync_flags(smap, shard->hmap);
+	value = HXumap_del_hash(shard->hmap, key, hash);
+	saved_errno = errno;
+	if (saved_errno == 0)
+		__atomic_sub_fetch(&smap->super.items, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&shard->lock);
+	errno = saved_errno;
+	return value;
+}
+
+static void *HXrmap_del(struct HXrmap *rmap, const void *key)
+{
+	const struct HXmap_node *node;
+	struct HXmap_private *cpriv;
+	void *old_key, *value = NULL;
+	int saved_errno = ENOENT;
+	struct HXmap *copy;
+
+	pthread_mutex_lock(&rmap->wlock);
+	if (HXmap_find(static_cast(void *, rmap->snap), key) == NULL)
+		goto out;
+	if ((copy = HXrmap_clone(rmap, 0)) == NULL) {
+		saved_errno = errno;
+		goto out;
+	}
+	/* As in HXrmap_add, the element is freed after the grace period. */
+	cpriv   = static_cast(void *, copy);
+	node    = HXmap_find(copy, key);
+	old_key = node->key;
+	cpriv->ops.k_free = NULL;
+	cpriv->ops.d_free = NULL;
+	value = HXmap_del(copy, key);
+	saved_errno = errno;
+	cpriv->ops.k_free = rmap->snap->ops.k_free;
+	cpriv->ops.d_free = rmap->snap->ops.d_free;
+	HXrmap_replace(rmap, cpriv, true);
+	HXmap_kfree(cpriv, old_key);
+	HXmap_dfree(cpriv, value);
+ out:
+	pthread_mutex_unlock(&rmap->wlock);
+	errno = saved_errno;
+	return value;
+}
+
+static void *HXfmap_del(struct HXfmap *fmap, const void *key)
+{
+	struct HXmap_node *slot;
+	void *old_key, *value;
+
+	if ((slot = HXfmap_find(fmap, key)) == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	/*
+	 * The slot may be part of some other key's probe sequence, so it
+	 * cannot simply become empty again.
+	 */
+	HXfmap_setctrl(fmap, slot - fmap->slots, HXFMAP_DELETED);
+	++fmap->tombstones;
+	--fmap->super.items;
+	old_key = slot->key;
+	value   = slot->data;
+	if (fmap->super.items < z_frac(fmap->super.min_pct, 100,
+	    fmap->capacity) && fmap->capacity > fmap->min_capacity &&
+	    !(fmap->super.flags & HXMAP_NOSHRINK) &&
+	    __atomic_load_n(&fmap->dtravs, __ATOMIC_RELAXED) == 0)
+		/* Ignore return value, the current table remains usable. */
+		HXfmap_layout(fmap, fmap->capacity / 2);
+
+	HXmap_kfree(&fmap->super, old_key);
+	if (fmap->super.ops.d_free != NULL)
+		fmap->super.ops.d_free(value);
+	errno = 0;
+	return value;
+}
+
+static unsigned int HXrbtree_del_mm(struct HXrbnode **path,
+    unsigned char *dir, unsigned int depth)
+{
+	/* Both subtrees exist */
+	struct HXrbnode *io_node, *io_parent, *orig_node = path[depth];
+	unsigned char color;
+	unsigned int spos;
+
+	io_node    = orig_node->N_RIGHT;
+	dir[depth] = RBT_RIGHT;
+
+	if (io_node->N_LEFT == NULL) {
+		/* Right subtree node is direct inorder */
+		io_node->N_LEFT = orig_node->N_LEFT;
+		color                = io_node->color;
+		io_node->color       = orig_node->color;
+		orig_node->color     = color;
+
+		path[depth-1]->sub[dir[depth-1]] = io_node;
+		path[depth++]        = io_node;
+		return depth;
+	}
+
+	/*
+	 * Walk down to the leftmost element, keep track of inorder node
+	 * and its parent.
+	 */
+	spos = depth++;
+
+	do {
+		io_parent    = io_node;
+		path[depth]  = io_parent;
+		dir[depth++] = RBT_LEFT;
+		io_node      = io_parent->N_LEFT;
+	} while (io_node->N_LEFT != NULL);
+
+	/* move node up */
+	path[spos-1]->sub[dir[spos-1]] = path[spos] = io_node;
+	io_parent->N_LEFT         = io_node->N_RIGHT;
+	io_node->N_LEFT           = orig_node->N_LEFT;
+	io_node->N_RIGHT          = orig_node->N_RIGHT;
+
+	color          = io_node->color;
+	io_node->color = orig_node->color;
+
+	/*
+	 * The nodes (@io_node and @orig_node) have been swapped. While
+	 * @orig_node has no pointers to it, it still exists and decisions are
+	 * made upon its properties in HXrbtree_del() and btree_dmov() until it
+	 * is freed later. Hence we need to keep the color.
+	 */
+	orig_node->color = color;
+	return depth;
+}
+
+static void HXrbtree_dmov(struct HXrbnode **path, unsigned char *dir,
+    unsigned int depth)
+{
+	struct HXrbnode *w, *x;
+
+	while (true) {
+		unsigned char LR = dir[depth - 1];
+		x = path[depth - 1]->sub[LR];
+
+		if (x != NULL && x->color == RBT_RED) {
+			/* (WP) "delete_one_child" */
+			x->color = RBT_BLACK;
+			break;
+		}
+
+		if (depth < 2)
+			/* Case 1 */
+			break;
+
+		/* @w is the sibling of @x (the current node). */
+		w = path[depth - 1]->sub[!LR];
+		if (w->color == RBT_RED) {
+			/*
+			 * Case 2. @w is of color red. In order to collapse
+			 * cases, a left rotate is performed at @x's parent and
+			 * colors are swapped to make @w a black node.
+			 */
+			w->color = RBT_BLACK;
+			path[depth - 1]->color = RBT_RED;
+			path[depth - 1]->sub[!LR] = w->sub[LR];
+			w->sub[LR] = path[depth - 1];
+			path[depth - 2]->sub[dir[depth - 2]] = w;
+			path[depth] = path[depth - 1];
+			dir[depth]  = LR;
+			path[depth - 1] = w;
+			w = path[++depth - 1]->sub[!LR];
+		}
+
+		if ((w->sub[LR] == NULL || w->sub[LR]->color == RBT_BLACK) &&
+		   (w->sub[!LR] == NULL || w->sub[!LR]->color == RBT_BLACK)) {
+			/* Case 3/4: @w has no red children. */
+			w->color = RBT_RED;
+			--depth;
+			continue;
+		}
+
+		if (w->sub[!LR] == NULL || w->sub[!LR]->color == RBT_BLACK) {
+			/* Case 5 */
+			struct HXrbnode *y = w->sub[LR];
+			y->color = RBT_BLACK;
+			w->color = RBT_RED;
+			w->sub[LR] = y->sub[!LR];
+			y->sub[!LR] = w;
+			w = path[depth - 1]->sub[!LR] = y;
+		}
+
+		/* Case 6 */
+		w->color = path[depth - 1]->color;
+		path[depth - 1]->color = RBT_BLACK;
+		w->sub[!LR]->color = RBT_BLACK;
+		path[depth - 1]->sub[!LR] = w->sub[LR];
+		w->sub[LR] = path[depth - 1];
+		path[depth - 2]->sub[dir[depth - 2]] = w;
+		break;
+	}
+}
+
+/**
+ * HXrbtree_unthread - take a node out of the in-order list
+ *
+ * Registered traversers that stand on @node are moved in front of its
+ * successor, so that they neither return it again nor have to search.
+ */
+static void HXrbtree_unthread(struct HXrbtree *btree, struct HXrbnode *node)
+{
+	struct HXrbnode *prev = HXrbnode_link(node)[RBT_LEFT];
+	struct HXrbnode *next = HXrbnode_link(node)[RBT_RIGHT];
+	struct HXrbtrav *trav;
+
+	if (prev != NULL)
+		HXrbnode_link(prev)[RBT_RIGHT] = next;
+	else
+		btree->first = next;
+	if (next != NULL)
+		HXrbnode_link(next)[RBT_LEFT] = prev;
+	else
+		btree->last = prev;
+
+	HXlist_for_each_entry(trav, &btree->travs, anchor) {
+		if (trav->current != node)
+			continue;
+		trav->current = next;
+		trav->gap     = next != NULL;
+		trav->at_end  = next == NULL;
+	}
+}
+
+static void *HXrbtree_del(struct HXrbtree *btree, const void *key)
+{
+	struct HXrbnode *path[RBT_MAXDEP], *node;
+	unsigned char dir[RBT_MAXDEP];
+	unsigned int depth = 0;
+	void *itemptr;
+
+	if (btree->root == NULL)
+		return NULL;
+
+	path[depth]  = reinterpret_cast(struct HXrbnode *, &btree->root);
+	dir[depth++] = 0;
+	node         = btree->root;
+
+	while (node != NULL) {
+		int res = btree->super.ops.k_compare(key,
+		          node->key, btree->super.key_size);
+		if (res == 0)
+			break;
+		res          = res > 0;
+		path[depth]  = node;
+		dir[depth++] = res;
+		node         = node->sub[res];
+	}
+
+	if (node == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	/*
+	 * Return the data for the node. But it is not going to be useful
+	 * if ARBtree was directed to copy it (because it will be released
+	 * below.)
+	 */
+	itemptr = node->data;
+	/* Removal of the node from the tree */
+	--btree->super.items;
+	++btree->tid;
+
+	path[depth] = node;
+	if (node->N_RIGHT == NULL)
+		/* Simple case: No right subtree, replace by left subtree. */
+		path[depth-1]->sub[dir[depth-1]] = node->N_LEFT;
+	else if (node->N_LEFT == NULL)
+		/* Simple case: No left subtree, replace by right subtree. */
+		path[depth-1]->sub[dir[depth-1]] = node->N_RIGHT;
+	else
+		/*
+		 * Find minimum/maximum element in right/left subtree and
+		 * do appropriate deletion while updating @path and @depth.
+		 */
+		depth = HXrbtree_del_mm(path, dir, depth);
+
+	/*
+	 * Deleting a red node does not violate either of the rules, so it is
+	 * not necessary to rebalance in such a case.
+	 */
+	if (node->color == RBT_BLACK)
+		HXrbtree_dmov(path, dir, depth);
+	if (btree->super.flags & HXMAP_THREADED)
+		HXrbtree_unthread(btree, node);
+
+	HXmap_kfree(&btree->super, node->key);
+	HXmap_dfree(&btree->super, node->data);
+	HXmap_node_free(&btree->super, node);
+	errno = 0;
+	/*
+	 * In case %HXBT_CDATA was specified, the @itemptr value will be
+	 * useless in most cases as it points to freed memory.
+	 */
+	return itemptr;
+}
+
+static void HXbpinner_remove(struct HXbpinner *in, unsigned int kidx,
+    unsigned int cidx)
+{
+	memmove(&in->key[kidx], &in->key[kidx+1],
+	        (in->hdr.count - 2 - kidx) * sizeof(*in->key));
+	memmove(&in->child[cidx], &in->child[cidx+1],
+	        (in->hdr.count - 1 - cidx) * sizeof(*in->child));
+	--in->hdr.count;
+}
+
+static void HXbpleaf_unlink(struct HXbptree *bt, struct HXbpleaf *leaf)
+{
+	if (leaf->prev != NULL)
+		leaf->prev->next = leaf->next;
+	else
+		bt->first = leaf->next;
+	if (leaf->next != NULL)
+		leaf->next->prev = leaf->prev;
+	else
+		bt->last = leaf->prev;
+	free(leaf);
+}
+
+/**
+ * HXbptree_rebalance_inner - fix underfull inner nodes bottom-up
+ * @lv:	depth of the inner node that lost a child
+ */
+static void HXbptree_rebalance_inner(struct HXbptree *bt,
+    const struct HXbppath *path, unsigned int lv)
+{
+	struct HXbpinner *in, *parent, *sib;
+	unsigned int ci;
+
+	while (true) {
+		in = path->node[lv];
+		if (lv == 0) {
+			if (in->hdr.count == 1) {
+				bt->root = in->child[0];
+				--bt->height;
+				free(in);
+			}
+			return;
+		}
+		if (in->hdr.count >= HXBPT_INNER_MIN)
+			return;
+		parent = path->node[lv-1];
+		ci     = path->idx[lv-1];
+		if (ci > 0) {
+			sib = static_cast(void *, parent->child[ci-1]);
+			if (sib->hdr.count > HXBPT_INNER_MIN) {
+				/* Rotate the left sibling's last child over */
+				memmove(&in->key[1], in->key,
+				        (in->hdr.count - 1) * sizeof(*in->key));
+				memmove(&in->child[1], in->child,
+				        in->hdr.count * sizeof(*in->child));
+				in->key[0]   = parent->key[ci-1];
+				in->child[0] = sib->child[sib->hdr.count-1];
+				parent->key[ci-1] = sib->key[sib->hdr.count-2];
+				--sib->hdr.count;
+				++in->hdr.count;
+				return;
+			}
+			/* Merge into the left sibling */
+			sib->key[sib->hdr.count-1] = parent->key[ci-1];
+			memcpy(&sib->key[sib->hdr.count], in->key,
+			       (in->hdr.count - 1) * sizeof(*in->key));
+			memcpy(&sib->child[sib->hdr.count], in->child,
+			       in->hdr.count * sizeof(*in->child));
+			sib->hdr.count += in->hdr.count;
+			free(in);
+			HXbpinner_remove(parent, ci - 1, ci);
+		} else {
+			sib = static_cast(void *, parent->child[1]);
+			if (sib->hdr.count > HXBPT_INNER_MIN) {
+				/* Rotate the right sibling's first child over */
+				in->key[in->hdr.count-1] = parent->key[0];
+				in->child[in->hdr.count] = sib->child[0];
+				++in->hdr.count;
+				parent->key[0] = sib->key[0];
+				HXbpinner_remove(sib, 0, 0);
+				return;
+			}
+			/* Merge the right sibling in */
+			in->key[in->hdr.count-1] = parent->key[0];
+			memcpy(&in->key[in->hdr.count], sib->key,
+			       (sib->hdr.count - 1) * sizeof(*sib->key));
+			memcpy(&in->child[in->hdr.count], sib->child,
+			       sib->hdr.count * sizeof(*sib->child));
+			in->hdr.count += sib->hdr.count;
+			free(sib);
+			HXbpinner_remove(parent, 0, 1);
+		}
+		--lv;
+	}
+}
+
+static void HXbptree_rebalance(struct HXbptree *bt,
+    const struct HXbppath *path, struct HXbpleaf *leaf)
+{
+	struct HXbpinner *parent;
+	struct HXbpleaf *sib;
+	unsigned int ci;
+
+	if (bt->height == 0) {
+		if (leaf->hdr.count == 0) {
+			HXbpleaf_unlink(bt, leaf);
+			bt->root = NULL;
+		}
+		return;
+	}
+	if (leaf->hdr.count >= HXBPT_LEAF_MIN)
+		return;
+	parent = path->node[bt->height-1];
+	ci     = path->idx[bt->height-1];
+	if (ci > 0) {
+		sib = static_cast(void *, parent->child[ci-1]);
+		if (sib->hdr.count > HXBPT_LEAF_MIN) {
+			memmove(&leaf->elem[1], leaf->elem,
+			        leaf->hdr.count * sizeof(*leaf->elem));
+			--sib->hdr.count;
+			memcpy(&leaf->elem[0], &sib->elem[sib->hdr.count],
+			       sizeof(*leaf->elem));
+			++leaf->hdr.count;
+			parent->key[ci-1] = leaf->elem[0].key;
+			return;
+		}
+		memcpy(&sib->elem[sib->hdr.count], leaf->elem,
+		       leaf->hdr.count * sizeof(*leaf->elem));
+		sib->hdr.count += leaf->hdr.count;
+		HXbpleaf_unlink(bt, leaf);
+		HXbpinner_remove(parent, ci - 1, ci);
+	} else {
+		sib = static_cast(void *, parent->child[1]);
+		if (sib->hdr.count > HXBPT_LEAF_MIN) {
+			memcpy(&leaf->elem[leaf->hdr.count], &sib->elem[0],
+			       sizeof(*leaf->elem));
+			++leaf->hdr.count;
+			--sib->hdr.count;
+			memmove(sib->elem, &sib->elem[1],
+			        sib->hdr.count * sizeof(*sib->elem));
+			parent->key[0] = sib->elem[0].key;
+			return;
+		}
+		memcpy(&leaf->elem[leaf->hdr.count], sib->elem,
+		       sib->hdr.count * sizeof(*sib->elem));
+		leaf->hdr.count += sib->hdr.count;
+		HXbpleaf_unlink(bt, sib);
+		HXbpinner_remove(parent, 0, 1);
+	}
+	HXbptree_rebalance_inner(bt, path, bt->height - 1);
+}
+
+static void *HXbptree_del(struct HXbptree *bt, const void *key)
+{
+	struct HXbppath path;
+	struct HXbpleaf *leaf;
+	void *old_key, *value;
+	unsigned int pos, lv;
+	bool found;
+
+	if (bt->root == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	leaf = HXbptree_descend(bt, key, &path);
+	pos  = HXbpleaf_pos(bt, leaf, key, &found);
+	if (!found) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	old_key = leaf->elem[pos].key;
+	value   = leaf->elem[pos].data;
+	--leaf->hdr.count;
+	memmove(&leaf->elem[pos], &leaf->elem[pos+1],
+	        (leaf->hdr.count - pos) * sizeof(*leaf->elem));
+	/*
+	 * If the leaf's smallest key went away, the one separator that refers
+	 * to it (at the lowest ancestor not reached via child 0) must follow.
+	 */
+	if (pos == 0 && leaf->hdr.count > 0)
+		for (lv = bt->height; lv-- > 0; )
+			if (path.idx[lv] > 0) {
+				path.node[lv]->key[path.idx[lv]-1] =
+					leaf->elem[0].key;
+				break;
+			}
+	HXbptree_rebalance(bt, &path, leaf);
+	--bt->super.items;
+	++bt->tid;
+
+	HXmap_kfree(&bt->super, old_key);
+	if (bt->super.ops.d_free != NULL)
+		bt->super.ops.d_free(value);
+	errno = 0;
+	return value;
+}
+
+EXPORT_SYMBOL void *HXmap_del(struct HXmap *xmap, const void *key)
+{
+	void *vmap = xmap;
+	struct HXmap_private *map = vmap;
+
+	switch (map->type) {
+	case HXMAPT_HASH:
+		return HXumap_del(vmap, key);
+	case HXMAPT_RBTREE:
+		return HXrbtree_del(vmap, key);
+	case HXMAPT_FLATHASH:
+		return HXfmap_del(vmap, key);
+	case HXMAPT_SHARDED:
+		return HXsmap_del(vmap, key);
+	case HXMAPT_RCU:
+		return HXrmap_del(vmap, key);
+	case HXMAPT_BTREE:
+		return HXbptree_del(vmap, key);
+	case HXMAPT_FROZEN:
+		errno = EPERM;
+		return NULL;
+	default:
+		errno = EINVAL;
+		return NULL;
+	}
+}
+
+static struct HXmap_node *HXumap_keysvalues_bk(
+    const struct HXlist_head *bk_array, unsigned int bk_number,
+    struct HXmap_node *array)
+{
+	const struct HXumap_node *node;
+	unsigned int i;
+
+	for (i = 0; i < bk_number; ++i)
+		HXlist_for_each_entry(node, &bk_array[i], anchor) {
+			array->key  = node->key;
+			array->data = node->data;
+			++array;
+		}
+	return array;
+}
+
+static void HXumap_keysvalues(const struct HXumap *hmap,
+    struct HXmap_node *array)
+{
+	array = HXumap_keysvalues_bk(hmap->bk_array,
+	        hmap->bk_sizes[hmap->power], array);
+	if (hmap->old_array != NULL)
+		HXumap_keysvalues_bk(hmap->old_array,
+			hmap->bk_sizes[hmap->old_power], array);
+}
+
+static void HXfmap_keysvalues(const struct HXfmap *fmap,
+    struct HXmap_node *array)
+{
+	size_t i;
+
+	for (i = 0; i < fmap->capacity; ++i) {
+		if (fmap->ctrl[i] & HXFMAP_EMPTY)
+			continue;
+		array->key  = fmap->slots[i].key;
+		array->data = fmap->slots[i].data;
+		++array;
+	}
+}
+
+static void HXzmap_keysvalues(const struct HXzmap *zmap,
+    struct HXmap_node *array)
+{
+	const struct HXmap_node *node;
+	size_t i;
+
+	for (i = 0; i < zmap->super.items; ++i) {
+		if ((node = HXzmap_node(zmap, i)) == NULL)
+			continue;
+		array->key  = node->key;
+		array->data = node->data;
+		++array;
+	}
+}
+
+static void HXbptree_keysvalues(const struct HXbptree *bt,
+    struct HXmap_node *array)
+{
+	const struct HXbpleaf *leaf;
+
+	for (leaf = bt->first; leaf != NULL; leaf = leaf->next) {
+		memcpy(array, leaf->elem, leaf->hdr.count * sizeof(*array));
+		array += leaf->hdr.count;
+	}
+}
+
+static struct HXmap_node *HXrbtree_keysvalues(const struct HXrbnode *node,
+    struct HXmap_node *array)
+{
+	if (node->sub[0] != NULL)
+		array = HXrbtree_keysvalues(node->sub[0], array);
+	array->key  = node->key;
+	array->data = node->data;
+	++array;
+	if (node->sub[1] != NULL)
+		array = HXrbtree_keysvalues(node->sub[1], array);
+	return array;
+}
+
+/**
+ * HXmap_publish - replace the contents of a read-mostly map
+ * @xmap:	%HXMAPT_RCU map
+ * @newmap:	freshly built map of another type, ownership is transferred
+ *
+ * Waits until no reader can be using the previous contents anymore, then
+ * frees them.
+ */
+EXPORT_SYMBOL int HXmap_publish(struct HXmap *xmap, struct HXmap *newmap)
+{
+	void *vmap = xmap, *vnew = newmap;
+	struct HXmap_private *map = vmap, *snap = vnew;
+	struct HXrmap *rmap = vmap;
+
+	if (map->type != HXMAPT_RCU)
+		return -EINVAL;
+	switch (snap->type) {
+	case HXMAPT_HASH:
+	case HXMAPT_RBTREE:
+	case HXMAPT_FLATHASH:
+	case HXMAPT_BTREE:
+		break;
+	default:
+		return -EINVAL;
+	}
+	pthread_mutex_lock(&rmap->wlock);
+	HXrmap_replace(rmap, snap, false);
+	pthread_mutex_unlock(&rmap->wlock);
+	return 1;
+}
+
+static void HXsmap_rdlock_all(const struct HXsmap *smap)
+{
+	unsigned int i;
+
+	/* Always in ascending order, so that lockers cannot deadlock. */
+	for (i = 0; i < smap->nshards; ++i)
+		pthread_rwlock_rdlock(&smap->shards[i].lock);
+}
+
+static void HXsmap_unlock_all(const struct HXsmap *smap)
+{
+	unsigned int i;
+
+	for (i = smap->nshards; i-- > 0; )
+		pthread_rwlock_unlock(&smap->shards[i].lock);
+}
+
+static struct HXmap_node *HXsmap_keysvalues(const struct HXsmap *smap)
+{
+	struct HXmap_node *array, *p;
+	unsigned int i;
+	size_t items = 0;
+
+	HXsmap_rdlock_all(smap);
+	for (i = 0; i < smap->nshards; ++i)
+		items += smap->shards[i].hmap->super.items;
+	array = p = malloc(sizeof(*array) * items);
+	if (array != NULL)
+		for (i = 0; i < smap->nshards; ++i) {
+			HXumap_keysvalues(smap->shards[i].hmap, p);
+			p += smap->shards[i].hmap->super.items;
+		}
+	HXsmap_unlock_all(smap);
+	return array;
+}
+
+EXPORT_SYMBOL struct HXmap_node *HXmap_keysvalues(const struct HXmap *xmap)
+{
+	const void *vmap = xmap;
+	const struct HXmap_private *map = vmap;
+	struct HXmap_node *array;
+
+	switch (map->type) {
+	case HXMAPT_HASH:
+	case HXMAPT_RBTREE:
+	case HXMAPT_FLATHASH:
+	case HXMAPT_BTREE:
+	case HXMAPT_FROZEN:
+		break;
+	case HXMAPT_SHARDED:
+		/* The element count has to be taken under the locks. */
+		return HXsmap_keysvalues(vmap);
+	case HXMAPT_RCU: {
+		unsigned int token;
+
+		array = HXmap_keysvalues(static_cast(const void *,
+		        HXrmap_enter(vmap, &token)));
+		HXrmap_leave(vmap, token);
+		return array;
+	}
+	default:
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((array = malloc(sizeof(*array) * map->items)) == NULL)
+		return NULL;
+
+	switch (map->type) {
+	case HXMAPT_HASH:
+		HXumap_keysvalues(vmap, array);
+		break;
+	case HXMAPT_RBTREE:
+		HXrbtree_keysvalues(
+			static_cast(const struct HXrbtree *, vmap)->root,
+			array);
+		break;
+	case HXMAPT_FLATHASH:
+		HXfmap_keysvalues(vmap, array);
+		break;
+	case HXMAPT_BTREE:
+		HXbptree_keysvalues(vmap, array);
+		break;
+	case HXMAPT_FROZEN:
+		HXzmap_keysvalues(vmap, array);
+		break;
+	default:
+		break;
+	}
+	return array;
+}
+
+static void HXumap_travsetup(struct HXumap_trav *trav,
+    const struct HXumap *hmap, unsigned int flags)
+{
+	/* We cannot offer DTRAV. */
+	trav->super.flags = flags & ~HXMAP_DTRAV;
+	trav->super.type = HXMAPT_HASH;
+	trav->hmap = hmap;
+	trav->head = NULL;
+	trav->bk_current = 0;
+	trav->tid = hmap->tid;
+}
+
+static void HXsmap_travsetup(struct HXsmap_trav *trav,
+    const struct HXsmap *smap, unsigned int flags)
+{
+	/* Modifying the map while traversing it would deadlock. */
+	trav->super.flags = flags & ~HXMAP_DTRAV;
+	trav->super.type = HXMAPT_SHARDED;
+	trav->smap = smap;
+	trav->shard = 0;
+	HXsmap_rdlock_all(smap);
+	HXumap_travsetup(&trav->sub, smap->shards[0].hmap, flags);
+}
+
+static void HXfmap_travsetup(struct HXfmap_trav *trav,
+    const struct HXfmap *fmap, unsigned int flags)
+{
+	/*
+	 * Deletion leaves tombstones, so slots stay in place unless the
+	 * table shrinks. Readers may create traversers concurrently.
+	 */
+	trav->super.flags = flags;
+	trav->super.type = HXMAPT_FLATHASH;
+	trav->fmap = fmap;
+	trav->idx = 0;
+	if (flags & HXMAP_DTRAV)
+		__atomic_add_fetch(&const_cast1(struct HXfmap *, fmap)->dtravs,
+			1, __ATOMIC_RELAXED);
+}
+
+static void HXzmap_travsetup(struct HXzmap_trav *trav,
+    const struct HXzmap *zmap, unsigned int flags)
+{
+	trav->super.flags = flags & ~HXMAP_DTRAV;
+	trav->super.type = HXMAPT_FROZEN;
+	trav->zmap = zmap;
+	trav->idx = 0;
+}
+
+static void HXrbtrav_setup(struct HXrbtrav *trav,
+    const struct HXrbtree *btree, unsigned int flags)
+{
+	memset(trav, 0, sizeof(*trav));
+	trav->super.flags = flags;
+	trav->super.type = HXMAPT_RBTREE;
+	trav->tree = btree;
+	if ((flags & HXMAP_DTRAV) && (btree->super.flags & HXMAP_THREADED)) {
+		/* Several readers may set up traversers at the same time. */
+		struct HXrbtree *wtree = const_cast1(struct HXrbtree *, btree);
+		pthread_mutex_lock(&wtree->travs_lock);
+		HXlist_add_tail(&wtree->travs, &trav->anchor);
+		pthread_mutex_unlock(&wtree->travs_lock);
+		trav->tracked = true;
+	}
+}
+
+static void HXbptrav_setup(struct HXbptrav *trav,
+    const struct HXbptree *bt, unsigned int flags)
+{
+	memset(trav, 0, sizeof(*trav));
+	trav->super.type  = HXMAPT_BTREE;
+	trav->super.flags = flags;
+	trav->tree = bt;
+}
+
+/**
+ * HXmap_travsize - size of the traverser structure for a map
+ *
+ * Returns 0 for maps that cannot be traversed.
+ */
+static size_t HXmap_travsize(const struct HXmap_private *map)
+{
+	switch (map->type) {
+	case HXMAPT_HASH:
+		return sizeof(struct HXumap_trav);
+	case HXMAPT_RBTREE:
+		return sizeof(struct HXrbtrav);
+	case HXMAPT_FLATHASH:
+		return sizeof(struct HXfmap_trav);
+	case HXMAPT_SHARDED:
+		return sizeof(struct HXsmap_trav);
+	case HXMAPT_RCU:
+		return sizeof(struct HXrmap_trav);
+	case HXMAPT_BTREE:
+		return sizeof(struct HXbptrav);
+	case HXMAPT_FROZEN:
+		return sizeof(struct HXzmap_trav);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * HXmap_travsetup - initialize a traverser in place
+ * @trav:	memory of at least HXmap_travsize(@map) bytes
+ * @embedded:	whether HXmap_travfree must leave the memory alone
+ */
+static void HXmap_travsetup(void *trav, const struct HXmap_private *map,
+    unsigned int flags, bool embedded)
+{
+	const void *vmap = map;
+
+	switch (map->type) {
+	case HXMAPT_HASH:
+		HXumap_travsetup(trav, vmap, flags);
+		HXumap_pin(vmap);
+		break;
+	case HXMAPT_RBTREE:
+		HXrbtrav_setup(trav, vmap, flags);
+		break;
+	case HXMAPT_FLATHASH:
+		HXfmap_travsetup(trav, vmap, flags);
+		break;
+	case HXMAPT_SHARDED:
+		HXsmap_travsetup(trav, vmap, flags);
+		break;
+	case HXMAPT_RCU: {
+		struct HXrmap_trav *rtrav = trav;
+		const struct HXrmap *rmap = vmap;
+
+		/* The snapshot stays alive until HXmap_travfree. */
+		rtrav->super.flags = flags & ~HXMAP_DTRAV;
+		rtrav->super.type = HXMAPT_RCU;
+		rtrav->rmap = rmap;
+		HXmap_travsetup(&rtrav->sub, HXrmap_enter(rmap, &rtrav->token),
+			rtrav->super.flags, true);
+		break;
+	}
+	case HXMAPT_BTREE:
+		HXbptrav_setup(trav, vmap, flags);
+		break;
+	case HXMAPT_FROZEN:
+		HXzmap_travsetup(trav, vmap, flags);
+		break;
+	default:
+		return;
+	}
+	static_cast(struct HXmap_trav *, trav)->embedded = embedded;
+}
+
+EXPORT_SYMBOL struct HXmap_trav *HXmap_travinit(const struct HXmap *xmap,
+    unsigned int flags)
+{
+	const void *vmap = xmap;
+	size_t size = HXmap_travsize(vmap);
+	void *trav;
+
+	if (size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((trav = malloc(size)) == NULL)
+		return NULL;
+	HXmap_travsetup(trav, vmap, flags, false);
+	return trav;
+}
+
+/**
+ * HXmap_travinit_at - set up a traverser in caller-provided memory
+ * @iter:	storage, e.g. on the stack; must outlive the traversal
+ *
+ * Like HXmap_travinit, but without allocating. HXmap_travfree must still be
+ * called to release locks or snapshots, but leaves @iter itself alone.
+ */
+EXPORT_SYMBOL struct HXmap_trav *HXmap_travinit_at(struct HXmap_iter *iter,
+    const struct HXmap *xmap, unsigned int flags)
+{
+	const void *vmap = xmap;
+
+	BUILD_BUG_ON(sizeof(struct HXrmap_trav) > sizeof(*iter));
+	BUILD_BUG_ON(sizeof(struct HXsmap_trav) > sizeof(*iter));
+	BUILD_BUG_ON(sizeof(struct HXzmap_trav) > sizeof(*iter));
+	if (HXmap_travsize(vmap) == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	HXmap_travsetup(iter, vmap, flags, true);
+	return static_cast(void *, iter);
+}
+
+/**
+ * HXumap_travbucket - get bucket by traversal index
+ *
+ * The buckets of @hmap->old_array (if any) logically follow those of
+ * @hmap->bk_array.
+ */
+static const struct HXlist_head *
+HXumap_travbucket(const struct HXumap *hmap, unsigned int idx)
+{
+	if (idx < hmap->bk_sizes[hmap->power])
+		return &hmap->bk_array[idx];
+	idx -= hmap->bk_sizes[hmap->power];
+	if (hmap->old_array != NULL && idx < hmap->bk_sizes[hmap->old_power])
+		return &hmap->old_array[idx];
+	return NULL;
+}
+
+static const struct HXmap_node *HXumap_traverse(struct HXumap_trav *trav)
+{
+	const struct HXumap *hmap = trav->hmap;
+	const struct HXumap_node *drop;
+	const struct HXlist_head *bk;
+
+	if (trav->head == NULL) {
+		bk = HXumap_travbucket(hmap, trav->bk_current);
+		trav->head = bk->next;
+	} else if (trav->tid != hmap->tid) {
+		bk = HXumap_travbucket(hmap, trav->bk_current);
+		if (bk == NULL)
+			/* bk_array shrunk underneath us, we're done */
+			return NULL;
+		/*
+		 * Reset head so that the while loop will be entered and we
+		 * advance to the next bucket.
+		 */
+		trav->head = bk;
+		trav->tid  = hmap->tid;
+	} else {
+		bk = HXumap_travbucket(hmap, trav->bk_current);
+		trav->head = trav->head->next;
+	}
+
+	while (trav->head == bk) {
+		bk = HXumap_travbucket(hmap, ++trav->bk_current);
+		if (bk == NULL)
+			return NULL;
+		trav->head = bk->next;
+	}
+
+	drop = HXlist_entry(trav->head, struct HXumap_node, anchor);
+	return static_cast(const void *, &drop->key);
+}
+
+static const struct HXmap_node *HXfmap_traverse(struct HXfmap_trav *trav)
+{
+	const struct HXfmap *fmap = trav->fmap;
+
+	/* A relayout may reorder slots; elements may be seen twice or never. */
+	for (; trav->idx < fmap->capacity; ++trav->idx)
+		if (!(fmap->ctrl[trav->idx] & HXFMAP_EMPTY))
+			return &fmap->slots[trav->idx++];
+	return NULL;
+}
+
+static const struct HXmap_node *HXzmap_traverse(struct HXzmap_trav *trav)
+{
+	const struct HXmap_node *node;
+
+	while (trav->idx < trav->zmap->super.items)
+		if ((node = HXzmap_node(trav->zmap, trav->idx++)) != NULL)
+			return node;
+	return NULL;
+}
+
+static const struct HXmap_node *HXsmap_traverse(struct HXsmap_trav *trav)
+{
+	const struct HXsmap *smap = trav->smap;
+	const struct HXmap_node *node;
+
+	while ((node = HXumap_traverse(&trav->sub)) == NULL) {
+		if (trav->shard + 1 >= smap->nshards)
+			return NULL;
+		++trav->shard;
+		HXumap_travsetup(&trav->sub, smap->shards[trav->shard].hmap,
+			trav->super.flags);
+	}
+	return node;
+}
+
+/**
+ * HXbptrav_checkpoint - remember the key of the element just handed out
+ * @copy:	@key does not belong to an element, and must be copied
+ *
+ * Without %HXMAP_DTRAV, an element's key is referenced directly, since the
+ * element must not be deleted until the traverser has moved on.
+ */
+static void HXbptrav_checkpoint(struct HXbptrav *trav, const void *key,
+    bool copy)
+{
+	const struct HXbptree *bt = trav->tree;
+	void *old_key = trav->owned ? trav->checkpoint : NULL;
+
+	/* With DTRAV, the element may be deleted before the next call. */
+	trav->owned = copy || (trav->super.flags & HXMAP_DTRAV);
+	if (trav->owned)
+		trav->checkpoint = bt->super.ops.k_clone(key, bt->super.key_size);
+	else
+		trav->checkpoint = const_cast1(void *, key);
+	if (old_key != NULL && bt->super.ops.k_free != NULL)
+		bt->super.ops.k_free(old_key);
+	trav->started = true;
+}
+
+/**
+ * HXbptrav_reseek - recompute leaf position from the checkpoint
+ *
+ * Leaves may have been split, merged or freed since the traverser last ran.
+ */
+static void HXbptrav_reseek(struct HXbptrav *trav)
+{
+	const struct HXbptree *bt = trav->tree;
+	bool found;
+
+	trav->tid = bt->tid;
+	if (!trav->started || bt->root == NULL) {
+		trav->leaf = bt->first;
+		trav->idx  = 0;
+		trav->at_elem = false;
+		return;
+	}
+	trav->leaf = HXbptree_descend(bt, trav->checkpoint, NULL);
+	trav->idx  = HXbpleaf_pos(bt, trav->leaf, trav->checkpoint, &found);
+	if (trav->at_elem) {
+		if (found)
+			++trav->idx;
+		else
+			/* Current element is gone, leave a gap in its place. */
+			trav->at_elem = false;
+	} else if (found && trav->after) {
+		++trav->idx;
+	}
+}
+
+static const struct HXmap_node *HXbptree_traverse(struct HXbptrav *trav)
+{
+	const struct HXmap_node *node;
+
+	if (trav->tid != trav->tree->tid)
+		HXbptrav_reseek(trav);
+	if (trav->leaf == NULL)
+		return NULL;
+	while (trav->idx >= trav->leaf->hdr.count) {
+		if (trav->leaf->next == NULL) {
+			/* Stay on the last leaf so that HXmap_traverse_prev works */
+			if (trav->at_elem)
+				trav->after = true;
+			trav->at_elem = false;
+			return NULL;
+		}
+		trav->leaf = trav->leaf->next;
+		trav->idx  = 0;
+	}
+
+	node = &trav->leaf->elem[trav->idx++];
+	trav->at_elem = true;
+	HXbptrav_checkpoint(trav, node->key, false);
+	return node;
+}
+
+static const struct HXmap_node *HXbptree_traverse_prev(struct HXbptrav *trav)
+{
+	const struct HXbpleaf *leaf;
+	const struct HXmap_node *node;
+	unsigned int idx, back;
+
+	if (trav->tid != trav->tree->tid)
+		HXbptrav_reseek(trav);
+	if (trav->leaf == NULL)
+		return NULL;
+	/* The target is the @back-th element to the left of the gap. */
+	back = trav->at_elem ? 2 : 1;
+	leaf = trav->leaf;
+	idx  = trav->idx;
+	while (idx < back) {
+		if (leaf->prev == NULL) {
+			/* Ran off the front; stay in the gap before the first */
+			if (trav->at_elem) {
+				--trav->idx;
+				trav->at_elem = false;
+				trav->after   = false;
+			}
+			return NULL;
+		}
+		back -= idx;
+		leaf  = leaf->prev;
+		idx   = leaf->hdr.count;
+	}
+	trav->leaf = leaf;
+	trav->idx  = idx - back + 1;
+
+	node = &trav->leaf->elem[trav->idx-1];
+	trav->at_elem = true;
+	HXbptrav_checkpoint(trav, node->key, false);
+	return node;
+}
+
+/**
+ * HXbptrav_seek - position traverser in front of @key
+ */
+static int HXbptrav_seek(struct HXbptrav *trav, const void *key,
+    unsigned int flags)
+{
+	/* The caller's key need not outlive the call. */
+	HXbptrav_checkpoint(trav, key, true);
+	trav->at_elem = false;
+	trav->after   = flags & HXMAP_SEEK_GT;
+	HXbptrav_reseek(trav);
+	if (trav->leaf == NULL)
+		return 0;
+	return trav->idx < trav->leaf->hdr.count || trav->leaf->next != NULL;
+}
+
+static void HXrbtrav_checkpoint(struct HXrbtrav *trav,
+    const struct HXrbnode *node)
+{
+	const struct HXrbtree *tree = trav->tree;
+
+	if (tree->super.flags & HXMAP_DTRAV) {
+		void *old_key = trav->checkpoint;
+
+		trav->checkpoint = tree->super.ops.k_clone(node->key,
+		                   tree->super.key_size);
+		if (tree->super.ops.k_free != NULL)
+			tree->super.ops.k_free(old_key);
+	} else {
+		trav->checkpoint = node->key;
+	}
+}
+
+static struct HXrbnode *HXrbtrav_next(struct HXrbtrav *trav)
+{
+	if (trav->current->N_RIGHT != NULL) {
+		/* Got a right child */
+		struct HXrbnode *node;
+
+		trav->path[trav->depth]  = trav->current;
+		trav->dir[trav->depth++] = RBT_RIGHT;
+		node = trav->current->N_RIGHT;
+
+		/* Which might have left childs (our inorder successors!) */
+		while (node != NULL) {
+			trav->path[trav->depth] = node;
+			node = node->N_LEFT;
+			trav->dir[trav->depth++] = RBT_LEFT;
+		}
+		trav->current = trav->path[--trav->depth];
+	} else if (trav->depth == 0) {
+		/* No right child, no more parents */
+		return trav->current = NULL;
+	} else if (trav->dir[trav->depth-1] == RBT_LEFT) {
+		/* We are the left child of the parent, move on to parent */
+		trav->current = trav->path[--trav->depth];
+	} else if (trav->dir[trav->depth-1] == RBT_RIGHT) {
+		/*
+		 * There is no right child, and we are the right child of the
+		 * parent, so move on to the next inorder node (a distant
+		 * parent). This works by walking up the path until we are the
+		 * left child of a parent.
+		 */
+		while (true) {
+			if (trav->depth == 0)
+				/* No more parents */
+				return trav->current = NULL;
+			if (trav->dir[trav->depth-1] != RBT_RIGHT)
+				break;
+			--trav->depth;
+		}
+		trav->current = trav->path[--trav->depth];
+	}
+
+	HXrbtrav_checkpoint(trav, trav->current);
+	return trav->current;
+}
+
+/**
+ * HXrbtrav_prev - step to the in-order predecessor
+ *
+ * Mirror image of HXrbtrav_next. The path must include the right turns,
+ * which are the nodes to come back to.
+ */
+static struct HXrbnode *HXrbtrav_prev(struct HXrbtrav *trav)
+{
+	struct HXrbnode *node = trav->current->N_LEFT;
+
+	if (node != NULL) {
+		/* Rightmost node of the left subtree */
+		trav->path[trav->depth]  = trav->current;
+		trav->dir[trav->depth++] = RBT_LEFT;
+		while (node != NULL) {
+			trav->path[trav->depth]  = node;
+			trav->dir[trav->depth++] = RBT_RIGHT;
+			node = node->N_RIGHT;
+		}
+		trav->current = trav->path[--trav->depth];
+	} else {
+		/* Closest ancestor that we are in the right subtree of */
+		while (trav->depth > 0 && trav->dir[trav->depth-1] != RBT_RIGHT)
+			--trav->depth;
+		if (trav->depth == 0)
+			return trav->current = NULL;
+		trav->current = trav->path[--trav->depth];
+	}
+
+	HXrbtrav_checkpoint(trav, trav->current);
+	return trav->current;
+}
+
+static struct HXrbnode *HXrbtrav_rewalk(struct HXrbtrav *trav)
+{
+	/*
+	 * When the binary tree has been distorted (or the traverser is
+	 * uninitilaized), by either addition or deletion of an object, our
+	 * path recorded so far is (probably) invalid too. rewalk() will go and
+	 * find the node we were last at.
+	 */
+	const struct HXrbtree *btree = trav->tree;
+	struct HXrbnode *node   = btree->root;
+	bool go_next = false;
+
+	trav->depth = 0;
+
+	if (trav->current == NULL) {
+		/* Walk down the tree to the smallest element */
+		while (node != NULL) {
+			trav->path[trav->depth] = node;
+			node = node->N_LEFT;
+			trav->dir[trav->depth++] = RBT_LEFT;
+		}
+	} else {
+		/* Search for the specific node to rebegin traversal at. */
+		unsigned int left_depth = 0;
+		int res;
+		bool found = false;
+
+		while (node != NULL) {
+			trav->path[trav->depth] = node;
+			res = btree->super.ops.k_compare(trav->checkpoint,
+			      node->key, btree->super.key_size);
+			if (res == 0) {
+				++trav->depth;
+				found = true;
+				break;
+			}
+			res = res > 0;
+			trav->dir[trav->depth++] = res;
 			/*
-			 * Case 3 (WP): Only colors have to be swapped to keep
-			 * the black height. But rebalance needs to continue.
+			 * The in-order successor of a node that is not in the
+			 * tree is the last node at which we turned left.
 			 */
-			parent->color = RBT_BLACK;
-			uncle->color  = RBT_BLACK;
-			grandp->color = RBT_RED;
-			depth        -= 2;
-			continue;
+			if (res == RBT_LEFT)
+				left_depth = trav->depth;
+			node = node->sub[res];
 		}
 
-		/*
-		 * Case 4 (WP): New node is the right child of its parent, and
-		 * the parent is the left child of the grandparent. A left
-		 * rotate is done at the parent to transform it into a case 5.
-		 */
-		if (dir[depth-1] != LR) {
-			newnode          = parent->sub[!LR];
-			parent->sub[!LR] = newnode->sub[LR];
-			newnode->sub[LR] = parent;
-			grandp->sub[LR]  = newnode;
-			/* relabel */
-			parent  = grandp->sub[LR];
-			/* unused assignment: newnode = parent->sub[LR]; */
+		if (found) {
+			/*
+			 * We found the node, but which HXbtraverse() has
+			 * already returned. Advance to the next inorder node.
+			 * (Code needs to come after @current assignment.)
+			 */
+			go_next = true;
 		} else {
-			/* unused assignment: newnode = path[depth]; */
+			/*
+			 * If the node travp->current is actually deleted (@res
+			 * will never be 0 above), traversal re-begins at the
+			 * next inorder node, which happens to be the last node
+			 * we turned left at. The path above it stays intact.
+			 */
+			trav->depth = left_depth;
 		}
+	}
 
-		/*
-		 * Case 5: New node is the @LR child of its parent which is
-		 * the @LR child of the grandparent. A right rotation on
-		 * @grandp is performed.
-		 */
-		grandp->sub[LR]  = parent->sub[!LR];
-		parent->sub[!LR] = grandp;
-		path[depth-3]->sub[dir[depth-3]] = parent;
-		grandp->color    = RBT_RED;
-		parent->color    = RBT_BLACK;
-		++*tid;
-		break;
-	} while (depth >= 3 && path[depth-1]->color == RBT_RED);
+	if (trav->depth == 0) {
+		/* no more elements */
+		trav->current = NULL;
+	} else {
+		trav->current = trav->path[--trav->depth];
+		if (trav->current == NULL)
+			fprintf(stderr, "btrav_rewalk: problem: current==NULL\n");
+		else
+			HXrbtrav_checkpoint(trav, trav->current);
+	}
+
+	trav->tid = btree->tid;
+	if (trav->current != nullptr && go_next)
+		return HXrbtrav_next(trav);
+	else
+		return trav->current;
 }
 
-static int HXrbtree_replace(const struct HXrbtree *btree,
-    struct HXrbnode *node, const void *value)
+/**
+ * HXrbtrav_descend - position traverser by searching from the root
+ * @key:	search key (unused for %HXRBT_LAST)
+ * @mode:	which element relative to @key to stop at
+ *
+ * Sets up @trav->path from the root to the found node, which it makes the
+ * current one (or %NULL), so that HXrbtrav_next and HXrbtrav_prev can
+ * continue from there.
+ */
+static struct HXrbnode *HXrbtrav_descend(struct HXrbtrav *trav,
+    const void *key, unsigned int mode)
 {
-	void *old_value, *new_value;
+	const struct HXrbtree *btree = trav->tree;
+	struct HXrbnode *node = btree->root, *cand = NULL;
+	unsigned int cand_depth = 0;
+	unsigned char side;
+	bool match;
+	int res = 0;
 
-	if (!(btree->super.flags & HXMAP_NOREPLACE))
-		return -(errno = EEXIST);
+	trav->depth = 0;
+	while (node != NULL) {
+		trav->path[trav->depth] = node;
+		if (mode != HXRBT_LAST)
+			res = btree->super.ops.k_compare(key, node->key,
+			      btree->super.key_size);
+		if (mode == HXRBT_GE || mode == HXRBT_GT) {
+			/* Candidates are on the left */
+			match = mode == HXRBT_GE ? res <= 0 : res < 0;
+			side  = match ? RBT_LEFT : RBT_RIGHT;
+		} else {
+			/* HXRBT_LT, HXRBT_LAST: candidates are on the right */
+			match = mode == HXRBT_LAST || res > 0;
+			side  = match ? RBT_RIGHT : RBT_LEFT;
+		}
+		if (match) {
+			cand = node;
+			cand_depth = trav->depth;
+			if (res == 0 && mode == HXRBT_GE)
+				break;
+		}
+		trav->dir[trav->depth++] = side;
+		node = node->sub[side];
+	}
 
-	new_value = btree->super.ops.d_clone(value, btree->super.data_size);
-	if (new_value == NULL && value != NULL)
-		return -errno;
-	old_value  = node->data;
-	node->data = new_value;
-	if (btree->super.ops.d_free != NULL)
-		btree->super.ops.d_free(old_value);
-	return 1;
+	/* Turns taken below the candidate are not part of its path. */
+	trav->depth   = cand_depth;
+	trav->current = cand;
+	trav->tid     = btree->tid;
+	if (cand != NULL)
+		HXrbtrav_checkpoint(trav, cand);
+	return cand;
 }
 
-static int HXrbtree_add(struct HXrbtree *btree,
-    const void *key, const void *value)
+static int HXrbtrav_seek(struct HXrbtrav *trav, const void *key,
+    unsigned int flags)
 {
-	struct HXrbnode *node, *path[RBT_MAXDEP];
-	unsigned char dir[RBT_MAXDEP];
-	unsigned int depth = 0;
-	int saved_errno;
+	const struct HXrbnode *node;
 
-	/*
-	 * Since our struct HXrbnode runs without a ->parent pointer,
-	 * the path "upwards" from @node needs to be recorded somehow,
-	 * here with @path. Another array, @dir is used to speedup direction
-	 * decisions. (WP's "n->parent == grandparent(n)->left" is just slow.)
-	 */
-	path[depth]  = reinterpret_cast(struct HXrbnode *, &btree->root);
-	dir[depth++] = 0;
-	node = btree->root;
+	node = HXrbtrav_descend(trav, key,
+	       (flags & HXMAP_SEEK_GT) ? HXRBT_GT : HXRBT_GE);
+	trav->gap    = node != NULL;
+	trav->at_end = node == NULL;
+	return node != NULL;
+}
 
-	while (node != NULL) {
-		int res = btree->super.ops.k_compare(key,
-		          node->key, btree->super.key_size);
-		if (res == 0)
-			/*
-			 * The node already exists (found the key), overwrite
-			 * the data.
-			 */
-			return HXrbtree_replace(btree, node, value);
+/**
+ * HXrbtrav_step - follow the in-order links of an %HXMAP_THREADED tree
+ * @side:	%RBT_RIGHT for the successor, %RBT_LEFT for the predecessor
+ *
+ * Traversers not on @tree->travs may stand on a deleted node once the tree
+ * has changed, and need to search by checkpoint instead.
+ */
+static struct HXrbnode *HXrbtrav_step(struct HXrbtrav *trav,
+    unsigned char side)
+{
+	struct HXrbnode *node;
+
+	if (!trav->tracked && trav->tid != trav->tree->tid)
+		return HXrbtrav_descend(trav, trav->checkpoint,
+		       side == RBT_RIGHT ? HXRBT_GT : HXRBT_LT);
+	node = trav->current = HXrbnode_link(trav->current)[side];
+	if (node != NULL && !trav->tracked)
+		HXrbtrav_checkpoint(trav, node);
+	return node;
+}
 
-		res          = res > 0;
-		path[depth]  = node;
-		dir[depth++] = res;
-		node         = node->sub[res];
+static const struct HXmap_node *HXrbtree_traverse_thr(struct HXrbtrav *trav)
+{
+	const struct HXrbnode *node;
+
+	if (trav->gap) {
+		trav->gap = false;
+		if (trav->tracked || trav->tid == trav->tree->tid)
+			node = trav->current;
+		else
+			node = HXrbtrav_descend(trav, trav->checkpoint,
+			       HXRBT_GE);
+	} else if (trav->at_end) {
+		return NULL;
+	} else if (trav->current == NULL) {
+		node = trav->current = trav->tree->first;
+		trav->tid = trav->tree->tid;
+		if (node != NULL && !trav->tracked)
+			HXrbtrav_checkpoint(trav, node);
+	} else {
+		node = HXrbtrav_step(trav, RBT_RIGHT);
 	}
 
-	if ((node = malloc(sizeof(struct HXrbnode))) == NULL)
-		return -errno;
+	if (node == NULL)
+		trav->at_end = true;
+	return (node != NULL) ? static_cast(const void *, &node->key) : NULL;
+}
 
-	/* New node, push data into it */
-	node->key = btree->super.ops.k_clone(key, btree->super.key_size);
-	if (node->key == NULL && key != NULL)
-		goto out;
-	node->data = btree->super.ops.d_clone(value, btree->super.data_size);
-	if (node->data == NULL && value != NULL)
-		goto out;
+static const struct HXmap_node *
+HXrbtree_traverse_prev_thr(struct HXrbtrav *trav)
+{
+	const struct HXrbnode *node;
 
-	/*
-	 * Add the node to the tree. In trying not to hit a rule 2 violation
-	 * (each simple path has the same number of black nodes), it is colored
-	 * red so that below we only need to check for rule 1 violations.
-	 */
-	node->N_LEFT = node->N_RIGHT = NULL;
-	node->color = RBT_RED;
-	path[depth-1]->sub[dir[depth-1]] = node;
-	++btree->super.items;
+	if (trav->at_end) {
+		node = trav->current = trav->tree->last;
+		trav->tid = trav->tree->tid;
+		if (node != NULL && !trav->tracked)
+			HXrbtrav_checkpoint(trav, node);
+	} else if (trav->current == NULL) {
+		return NULL;
+	} else {
+		node = HXrbtrav_step(trav, RBT_LEFT);
+	}
 
-	/*
-	 * WP: [[Red-black_tree]] says:
-	 * Case 1: @node is root node - just color it black (see below).
-	 * Case 2: @parent is black - no action needed (skip).
-	 * No rebalance needed for a 2-node tree.
-	 */
-	if (depth >= 3 && path[depth-1]->color == RBT_RED)
-		HXrbtree_amov(path, dir, depth, &btree->tid);
+	trav->gap = trav->at_end = false;
+	return (node != NULL) ? static_cast(const void *, &node->key) : NULL;
+}
 
-	btree->root->color = RBT_BLACK;
-	return 1;
+static const struct HXmap_node *HXrbtree_traverse(struct HXrbtrav *trav)
+{
+	const struct HXrbnode *node;
 
- out:
-	saved_errno = errno;
-	if (btree->super.ops.k_free != NULL)
-		btree->super.ops.k_free(node->key);
-	if (btree->super.ops.d_free != NULL)
-		btree->super.ops.d_free(node->key);
-	free(node);
-	return -(errno = saved_errno);
+	if (trav->tree->super.flags & HXMAP_THREADED)
+		return HXrbtree_traverse_thr(trav);
+	if (trav->gap) {
+		/* HXmap_travseek left us in front of @current */
+		trav->gap = false;
+		if (trav->tid != trav->tree->tid)
+			node = HXrbtrav_descend(trav, trav->checkpoint,
+			       HXRBT_GE);
+		else
+			node = trav->current;
+	} else if (trav->at_end) {
+		return NULL;
+	} else if (trav->tid != trav->tree->tid || trav->current == NULL) {
+		/*
+		 * Every HXrbtree operation that significantly changes the
+		 * B-tree, increments @tid so we can decide here to rewalk.
+		 */
+		node = HXrbtrav_rewalk(trav);
+	} else {
+		node = HXrbtrav_next(trav);
+	}
+
+	if (node == NULL)
+		trav->at_end = true;
+	return (node != NULL) ? static_cast(const void *, &node->key) : NULL;
 }
 
-EXPORT_SYMBOL int HXmap_add(struct HXmap *xmap,
-    const void *key, const void *value)
+static const struct HXmap_node *HXrbtree_traverse_prev(struct HXrbtrav *trav)
 {
-	void *vmap = xmap;
-	struct HXmap_private *map = vmap;
+	const struct HXrbnode *node;
+
+	if (trav->tree->super.flags & HXMAP_THREADED)
+		return HXrbtree_traverse_prev_thr(trav);
+	if (trav->at_end)
+		node = HXrbtrav_descend(trav, NULL, HXRBT_LAST);
+	else if (trav->current == NULL)
+		/* Not started yet, or already before the first element */
+		return NULL;
+	else if (trav->tid != trav->tree->tid)
+		/* The path may be stale; search anew. */
+		node = HXrbtrav_descend(trav, trav->checkpoint, HXRBT_LT);
+	else
+		node = HXrbtrav_prev(trav);
+
+	trav->gap = trav->at_end = false;
+	return (node != NULL) ? static_cast(const void *, &node->key) : NULL;
+}
+
+EXPORT_SYMBOL const struct HXmap_node *HXmap_traverse(struct HXmap_trav *trav)
+{
+	void *xtrav = trav;
 
-	if ((map->flags & HXMAP_SINGULAR) && value != NULL) {
-		fprintf(stderr, "libHX-map: adding value!=NULL "
-		        "into a set not allowed\n");
-		return -EINVAL;
-	}
+	if (xtrav == NULL)
+		return NULL;
 
-	switch (map->type) {
+	switch (trav->type) {
 	case HXMAPT_HASH:
-		return HXumap_add(vmap, key, value);
+		return HXumap_traverse(xtrav);
 	case HXMAPT_RBTREE:
-		return HXrbtree_add(vmap, key, value);
+		return HXrbtree_traverse(xtrav);
+	case HXMAPT_FLATHASH:
+		return HXfmap_traverse(xtrav);
+	case HXMAPT_SHARDED:
+		return HXsmap_traverse(xtrav);
+	case HXMAPT_RCU:
+		return HXmap_traverse(&static_cast(struct HXrmap_trav *,
+		       xtrav)->sub.super);
+	case HXMAPT_BTREE:
+		return HXbptree_traverse(xtrav);
+	case HXMAPT_FROZEN:
+		return HXzmap_traverse(xtrav);
 	default:
-		return -EINVAL;
+		errno = EINVAL;
+		return NULL;
 	}
 }
 
-static void *HXumap_del(struct HXumap *hmap, const void *key)
+EXPORT_SYMBOL const struct HXmap_node *
+HXmap_traverse_prev(struct HXmap_trav *trav)
 {
-	struct HXumap_node *drop;
-	void *value;
+	void *xtrav = trav;
 
-	if ((drop = HXumap_find(hmap, key)) == NULL) {
-		errno = ENOENT;
+	if (xtrav == NULL)
 		return NULL;
-	}
-
-	HXlist_del(&drop->anchor);
-	++hmap->tid;
-	--hmap->super.items;
-	if (hmap->super.items < hmap->min_load && hmap->power > 0)
-		/*
-		 * Ignore return value. If it failed, it will continue to use
-		 * the current bk_array.
-		 */
-		HXumap_layout(hmap, hmap->power - 1);
 
-	value = drop->data;
-	if (hmap->super.ops.k_free != NULL)
-		hmap->super.ops.k_free(drop->key);
-	if (hmap->super.ops.d_free != NULL)
-		hmap->super.ops.d_free(drop->data);
-	free(drop);
-	errno = 0;
-	return value;
+	switch (trav->type) {
+	case HXMAPT_RBTREE:
+		return HXrbtree_traverse_prev(xtrav);
+	case HXMAPT_RCU:
+		return HXmap_traverse_prev(&static_cast(struct HXrmap_trav *,
+		       xtrav)->sub.super);
+	case HXMAPT_BTREE:
+		return HXbptree_traverse_prev(xtrav);
+	default:
+		/* Hash maps have no order to step back in */
+		errno = EINVAL;
+		return NULL;
+	}
 }
 
-static unsigned int HXrbtree_del_mm(struct HXrbnode **path,
-    unsigned char *dir, unsigned int depth)
+EXPORT_SYMBOL int HXmap_travseek(struct HXmap_trav *trav, const void *key,
+    unsigned int flags)
 {
-	/* Both subtrees exist */
-	struct HXrbnode *io_node, *io_parent, *orig_node = path[depth];
-	unsigned char color;
-	unsigned int spos;
-
-	io_node    = orig_node->N_RIGHT;
-	dir[depth] = RBT_RIGHT;
+	void *xtrav = trav;
 
-	if (io_node->N_LEFT == NULL) {
-		/* Right subtree node is direct inorder */
-		io_node->N_LEFT = orig_node->N_LEFT;
-		color                = io_node->color;
-		io_node->color       = orig_node->color;
-		orig_node->color     = color;
+	if (xtrav == NULL)
+		return -EINVAL;
 
-		path[depth-1]->sub[dir[depth-1]] = io_node;
-		path[depth++]        = io_node;
-		return depth;
+	switch (trav->type) {
+	case HXMAPT_RBTREE:
+		return HXrbtrav_seek(xtrav, key, flags);
+	case HXMAPT_RCU:
+		return HXmap_travseek(&static_cast(struct HXrmap_trav *,
+		       xtrav)->sub.super, key, flags);
+	case HXMAPT_BTREE:
+		return HXbptrav_seek(xtrav, key, flags);
+	default:
+		return -EINVAL;
 	}
-
-	/*
-	 * Walk down to the leftmost element, keep track of inorder node
-	 * and its parent.
-	 */
-	spos = depth++;
-
-	do {
-		io_parent    = io_node;
-		path[depth]  = io_parent;
-		dir[depth++] = RBT_LEFT;
-		io_node      = io_parent->N_LEFT;
-	} while (io_node->N_LEFT != NULL);
-
-	/* move node up */
-	path[spos-1]->sub[dir[spos-1]] = path[spos] = io_node;
-	io_parent->N_LEFT         = io_node->N_RIGHT;
-	io_node->N_LEFT           = orig_node->N_LEFT;
-	io_node->N_RIGHT          = orig_node->N_RIGHT;
-
-	color          = io_node->color;
-	io_node->color = orig_node->color;
-
-	/*
-	 * The nodes (@io_node and @orig_node) have been swapped. While
-	 * @orig_node has no pointers to it, it still exists and decisions are
-	 * made upon its properties in HXrbtree_del() and btree_dmov() until it
-	 * is freed later. Hence we need to keep the color.
-	 */
-	orig_node->color = color;
-	return depth;
 }
 
-static void HXrbtree_dmov(struct HXrbnode **path, unsigned char *dir,
-    unsigned int depth)
+/**
+ * HXmap_traverse_many - continue a traversal, a chunk at a time
+ * @buf:	receives the key-value pairs
+ * @n:	room in @buf
+ *
+ * Returns the number of elements stored, which is less than @n only when
+ * the traversal has reached the end.
+ */
+EXPORT_SYMBOL size_t HXmap_traverse_many(struct HXmap_trav *trav,
+    struct HXmap_node *buf, size_t n)
 {
-	struct HXrbnode *w, *x;
-
-	while (true) {
-		unsigned char LR = dir[depth - 1];
-		x = path[depth - 1]->sub[LR];
-
-		if (x != NULL && x->color == RBT_RED) {
-			/* (WP) "delete_one_child" */
-			x->color = RBT_BLACK;
-			break;
-		}
+	const struct HXmap_node *node;
+	size_t i;
 
-		if (depth < 2)
-			/* Case 1 */
+	for (i = 0; i < n; ++i) {
+		if ((node = HXmap_traverse(trav)) == NULL)
 			break;
+		buf[i].key  = node->key;
+		buf[i].data = node->data;
+	}
+	return i;
+}
 
-		/* @w is the sibling of @x (the current node). */
-		w = path[depth - 1]->sub[!LR];
-		if (w->color == RBT_RED) {
-			/*
-			 * Case 2. @w is of color red. In order to collapse
-			 * cases, a left rotate is performed at @x's parent and
-			 * colors are swapped to make @w a black node.
-			 */
-			w->color = RBT_BLACK;
-			path[depth - 1]->color = RBT_RED;
-			path[depth - 1]->sub[!LR] = w->sub[LR];
-			w->sub[LR] = path[depth - 1];
-			path[depth - 2]->sub[dir[depth - 2]] = w;
-			path[depth] = path[depth - 1];
-			dir[depth]  = LR;
-			path[depth - 1] = w;
-			w = path[++depth - 1]->sub[!LR];
-		}
-
-		if ((w->sub[LR] == NULL || w->sub[LR]->color == RBT_BLACK) &&
-		   (w->sub[!LR] == NULL || w->sub[!LR]->color == RBT_BLACK)) {
-			/* Case 3/4: @w has no red children. */
-			w->color = RBT_RED;
-			--depth;
-			continue;
-		}
-
-		if (w->sub[!LR] == NULL || w->sub[!LR]->color == RBT_BLACK) {
-			/* Case 5 */
-			struct HXrbnode *y = w->sub[LR];
-			y->color = RBT_BLACK;
-			w->color = RBT_RED;
-			w->sub[LR] = y->sub[!LR];
-			y->sub[!LR] = w;
-			w = path[depth - 1]->sub[!LR] = y;
-		}
+static void HXrbtrav_release(struct HXrbtrav *trav)
+{
+	const struct HXmap_private *super = &trav->tree->super;
 
-		/* Case 6 */
-		w->color = path[depth - 1]->color;
-		path[depth - 1]->color = RBT_BLACK;
-		w->sub[!LR]->color = RBT_BLACK;
-		path[depth - 1]->sub[!LR] = w->sub[LR];
-		w->sub[LR] = path[depth - 1];
-		path[depth - 2]->sub[dir[depth - 2]] = w;
-		break;
+	if (trav->tracked) {
+		struct HXrbtree *wtree = const_cast1(struct HXrbtree *,
+		                         trav->tree);
+		pthread_mutex_lock(&wtree->travs_lock);
+		HXlist_del(&trav->anchor);
+		pthread_mutex_unlock(&wtree->travs_lock);
 	}
+	if ((super->flags & HXMAP_DTRAV) && super->ops.k_free != NULL)
+		super->ops.k_free(trav->checkpoint);
 }
 
-static void *HXrbtree_del(struct HXrbtree *btree, const void *key)
+static void HXbptrav_release(struct HXbptrav *trav)
 {
-	struct HXrbnode *path[RBT_MAXDEP], *node;
-	unsigned char dir[RBT_MAXDEP];
-	unsigned int depth = 0;
-	void *itemptr;
+	const struct HXmap_private *super = &trav->tree->super;
 
-	if (btree->root == NULL)
-		return NULL;
+	if (trav->owned && super->ops.k_free != NULL)
+		super->ops.k_free(trav->checkpoint);
+}
 
-	path[depth]  = reinterpret_cast(struct HXrbnode *, &btree->root);
-	dir[depth++] = 0;
-	node         = btree->root;
+EXPORT_SYMBOL void HXmap_travfree(struct HXmap_trav *trav)
+{
+	void *xtrav = trav;
 
-	while (node != NULL) {
-		int res = btree->super.ops.k_compare(key,
-		          node->key, btree->super.key_size);
-		if (res == 0)
-			break;
-		res          = res > 0;
-		path[depth]  = node;
-		dir[depth++] = res;
-		node         = node->sub[res];
+	if (xtrav == NULL)
+		return;
+	switch (trav->type) {
+	case HXMAPT_HASH:
+		HXumap_unpin(static_cast(struct HXumap_trav *, xtrav)->hmap);
+		break;
+	case HXMAPT_RBTREE:
+		HXrbtrav_release(xtrav);
+		break;
+	case HXMAPT_BTREE:
+		HXbptrav_release(xtrav);
+		break;
+	case HXMAPT_FLATHASH: {
+		const struct HXfmap_trav *ftrav = xtrav;
+		if (trav->flags & HXMAP_DTRAV)
+			__atomic_sub_fetch(&const_cast1(struct HXfmap *,
+				ftrav->fmap)->dtravs, 1, __ATOMIC_RELAXED);
+		break;
 	}
-
-	if (node == NULL) {
-		errno = ENOENT;
-		return NULL;
+	case HXMAPT_SHARDED:
+		HXsmap_unlock_all(static_cast(struct HXsmap_trav *,
+			xtrav)->smap);
+		break;
+	case HXMAPT_RCU: {
+		struct HXrmap_trav *rtrav = xtrav;
+		HXmap_travfree(&rtrav->sub.super);
+		HXrmap_leave(rtrav->rmap, rtrav->token);
+		break;
+	}
+	default:
+		break;
 	}
+	if (!trav->embedded)
+		free(xtrav);
+}
 
-	/*
-	 * Return the data for the node. But it is not going to be useful
-	 * if ARBtree was directed to copy it (because it will be released
-	 * below.)
-	 */
-	itemptr = node->data;
-	/* Removal of the node from the tree */
-	--btree->super.items;
-	++btree->tid;
+/**
+ * HXumap_qfe - iterate over hash map
+ *
+ * Returns false if @fn requested to stop.
+ */
+static bool HXumap_qfe(const struct HXumap *hmap, qfe_fn_t fn, void *arg)
+{
+	const struct HXumap_node *hnode;
+	const struct HXlist_head *bk;
+	unsigned int i;
 
-	path[depth] = node;
-	if (node->N_RIGHT == NULL)
-		/* Simple case: No right subtree, replace by left subtree. */
-		path[depth-1]->sub[dir[depth-1]] = node->N_LEFT;
-	else if (node->N_LEFT == NULL)
-		/* Simple case: No left subtree, replace by right subtree. */
-		path[depth-1]->sub[dir[depth-1]] = node->N_RIGHT;
-	else
-		/*
-		 * Find minimum/maximum element in right/left subtree and
-		 * do appropriate deletion while updating @path and @depth.
-		 */
-		depth = HXrbtree_del_mm(path, dir, depth);
+	for (i = 0; (bk = HXumap_travbucket(hmap, i)) != NULL; ++i)
+		HXlist_for_each_entry(hnode, bk, anchor)
+			if (!(*fn)(static_cast(const void *, &hnode->key), arg))
+				return false;
+	return true;
+}
 
-	/*
-	 * Deleting a red node does not violate either of the rules, so it is
-	 * not necessary to rebalance in such a case.
-	 */
-	if (node->color == RBT_BLACK)
-		HXrbtree_dmov(path, dir, depth);
+static void HXsmap_qfe(const struct HXsmap *smap, qfe_fn_t fn, void *arg)
+{
+	unsigned int i;
 
-	if (btree->super.ops.k_free != NULL)
-		btree->super.ops.k_free(node->key);
-	if (btree->super.ops.d_free != NULL)
-		btree->super.ops.d_free(node->data);
-	free(node);
-	errno = 0;
-	/*
-	 * In case %HXBT_CDATA was specified, the @itemptr value will be
-	 * useless in most cases as it points to freed memory.
-	 */
-	return itemptr;
+	HXsmap_rdlock_all(smap);
+	for (i = 0; i < smap->nshards; ++i)
+		if (!HXumap_qfe(smap->shards[i].hmap, fn, arg))
+			break;
+	HXsmap_unlock_all(smap);
 }
 
-EXPORT_SYMBOL void *HXmap_del(struct HXmap *xmap, const void *key)
+static void HXfmap_qfe(const struct HXfmap *fmap, qfe_fn_t fn, void *arg)
 {
-	void *vmap = xmap;
-	struct HXmap_private *map = vmap;
+	size_t i;
 
-	switch (map->type) {
-	case HXMAPT_HASH:
-		return HXumap_del(vmap, key);
-	case HXMAPT_RBTREE:
-		return HXrbtree_del(vmap, key);
-	default:
-		errno = EINVAL;
-		return NULL;
-	}
+	for (i = 0; i < fmap->capacity; ++i)
+		if (!(fmap->ctrl[i] & HXFMAP_EMPTY) &&
+		    !(*fn)(&fmap->slots[i], arg))
+			return;
 }
 
-static void HXumap_keysvalues(const struct HXumap *hmap,
-    struct HXmap_node *array)
+static void HXbptree_qfe(const struct HXbptree *bt, qfe_fn_t fn, void *arg)
 {
-	const struct HXumap_node *node;
+	const struct HXbpleaf *leaf;
 	unsigned int i;
 
-	for (i = 0; i < HXhash_primes[hmap->power]; ++i)
-		HXlist_for_each_entry(node, &hmap->bk_array[i], anchor) {
-			array->key  = node->key;
-			array->data = node->data;
-			++array;
-		}
+	for (leaf = bt->first; leaf != NULL; leaf = leaf->next)
+		for (i = 0; i < leaf->hdr.count; ++i)
+			if (!(*fn)(&leaf->elem[i], arg))
+				return;
 }
 
-static struct HXmap_node *HXrbtree_keysvalues(const struct HXrbnode *node,
-    struct HXmap_node *array)
+static void HXzmap_qfe(const struct HXzmap *zmap, qfe_fn_t fn, void *arg)
 {
-	if (node->sub[0] != NULL)
-		array = HXrbtree_keysvalues(node->sub[0], array);
-	array->key  = node->key;
-	array->data = node->data;
-	++array;
-	if (node->sub[1] != NULL)
-		array = HXrbtree_keysvalues(node->sub[1], array);
-	return array;
+	const struct HXmap_node *node;
+	size_t i;
+
+	for (i = 0; i < zmap->super.items; ++i)
+		if ((node = HXzmap_node(zmap, i)) != NULL &&
+		    !(*fn)(node, arg))
+			return;
 }
 
-EXPORT_SYMBOL struct HXmap_node *HXmap_keysvalues(const struct HXmap *xmap)
+static void HXrbtree_qfe(const struct HXrbnode *node,
+    qfe_fn_t fn, void *arg)
+{
+	if (node->N_LEFT != NULL)
+		HXrbtree_qfe(node->N_LEFT, fn, arg);
+	if (!(*fn)(static_cast(const void *, &node->key), arg))
+		return;
+	if (node->N_RIGHT != NULL)
+		HXrbtree_qfe(node->N_RIGHT, fn, arg);
+}
+
+EXPORT_SYMBOL void HXmap_qfe(const struct HXmap *xmap, qfe_fn_t fn, void *arg)
 {
 	const void *vmap = xmap;
 	const struct HXmap_private *map = vmap;
-	struct HXmap_node *array;
 
 	switch (map->type) {
 	case HXMAPT_HASH:
-	case HXMAPT_RBTREE:
+		HXumap_pin(vmap);
+		HXumap_qfe(vmap, fn, arg);
+		HXumap_unpin(vmap);
+		errno = 0;
+		break;
+	case HXMAPT_RBTREE: {
+		const struct HXrbtree *tree = vmap;
+		if (tree->root != NULL)
+			HXrbtree_qfe(tree->root, fn, arg);
+		errno = 0;
+		break;
+	}
+	case HXMAPT_FLATHASH:
+		HXfmap_qfe(vmap, fn, arg);
+		errno = 0;
+		break;
+	case HXMAPT_BTREE:
+		HXbptree_qfe(vmap, fn, arg);
+		errno = 0;
+		break;
+	case HXMAPT_FROZEN:
+		HXzmap_qfe(vmap, fn, arg);
+		errno = 0;
+		break;
+	case HXMAPT_SHARDED:
+		HXsmap_qfe(vmap, fn, arg);
+		errno = 0;
+		break;
+	case HXMAPT_RCU: {
+		unsigned int token;
+
+		HXmap_qfe(static_cast(const void *, HXrmap_enter(vmap, &token)),
+			fn, arg);
+		HXrmap_leave(vmap, token);
 		break;
+	}
 	default:
 		errno = EINVAL;
-		return NULL;
 	}
+}
 
-	if ((array = malloc(sizeof(*array) * map->items)) == NULL)
-		return NULL;
+static unsigned int HXqfe_ncpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
 
-	switch (map->type) {
-	case HXMAPT_HASH:
-		HXumap_keysvalues(vmap, array);
-		break;
-	case HXMAPT_RBTREE:
-		HXrbtree_keysvalues(
-			static_cast(const struct HXrbtree *, vmap)->root,
-			array);
-		break;
+	if (n > 0)
+		return n;
+#endif
+	return 1;
+}
+
+/**
+ * HXqfe_span_add - append a work share to @job
+ *
+ * Returns false if out of memory.
+ */
+static bool HXqfe_span_add(struct HXqfe_job *job, const void *ptr,
+    size_t begin, size_t end)
+{
+	struct HXqfe_span *span;
+
+	if (job->nspans == job->alloc) {
+		size_t n = job->alloc > 0 ? 2 * job->alloc : 64;
+
+		span = realloc(job->span, sizeof(*span) * n);
+		if (span == NULL)
+			return false;
+		job->span  = span;
+		job->alloc = n;
 	}
-	return array;
+	span = &job->span[job->nspans++];
+	span->ptr   = ptr;
+	span->stop  = NULL;
+	span->begin = begin;
+	span->end   = end;
+	return true;
 }
 
-static void *HXumap_travinit(const struct HXumap *hmap, unsigned int flags)
+/**
+ * HXqfe_split - cut the index range [0,@n) of @ptr into spans
+ * @chunk:	indices per span
+ */
+static bool HXqfe_split(struct HXqfe_job *job, const void *ptr, size_t n,
+    size_t chunk)
 {
-	struct HXumap_trav *trav;
+	size_t i;
 
-	if ((trav = malloc(sizeof(*trav))) == NULL)
-		return NULL;
-	/* We cannot offer DTRAV. */
-	trav->super.flags = flags & ~HXMAP_DTRAV;
-	trav->super.type = HXMAPT_HASH;
-	trav->hmap = hmap;
-	trav->head = NULL;
-	trav->bk_current = 0;
-	trav->tid = hmap->tid;
-	return trav;
+	for (i = 0; i < n; i += chunk)
+		if (!HXqfe_span_add(job, ptr, i, n - i > chunk ? i + chunk : n))
+			return false;
+	return true;
 }
 
-static void *HXrbtrav_init(const struct HXrbtree *btree, unsigned int flags)
+static size_t HXqfe_chunk(size_t n, size_t target)
 {
-	struct HXrbtrav *trav;
+	n /= target;
+	return n > HXQFE_MIN_SPAN ? n : HXQFE_MIN_SPAN;
+}
 
-	if ((trav = calloc(1, sizeof(*trav))) == NULL)
-		return NULL;
-	trav->super.flags = flags;
-	trav->super.type = HXMAPT_RBTREE;
-	trav->tree = btree;
-	return trav;
+/* Buckets as numbered by HXumap_travbucket */
+static size_t HXumap_travbuckets(const struct HXumap *hmap)
+{
+	size_t n = hmap->bk_sizes[hmap->power];
+
+	if (hmap->old_array != NULL)
+		n += hmap->bk_sizes[hmap->old_power];
+	return n;
 }
 
-EXPORT_SYMBOL struct HXmap_trav *HXmap_travinit(const struct HXmap *xmap,
-    unsigned int flags)
+/**
+ * HXqfe_rbtree_spans - split off the subtrees @depth levels below @node
+ *
+ * The nodes above them become single-element spans.
+ */
+static bool HXqfe_rbtree_spans(struct HXqfe_job *job,
+    const struct HXrbnode *node, unsigned int depth)
 {
-	const void *vmap = xmap;
-	const struct HXmap_private *map = vmap;
+	if (node == NULL)
+		return true;
+	if (depth == 0)
+		return HXqfe_span_add(job, node, 1, 0);
+	return HXqfe_rbtree_spans(job, node->N_LEFT, depth - 1) &&
+	       HXqfe_span_add(job, node, 0, 0) &&
+	       HXqfe_rbtree_spans(job, node->N_RIGHT, depth - 1);
+}
+
+/**
+ * HXqfe_bptree_spans - split off the subtrees @depth levels below @node
+ *
+ * Each span is the run of leaves from the leftmost leaf of its subtree
+ * up to the one of the next span.
+ */
+static bool HXqfe_bptree_spans(struct HXqfe_job *job,
+    const struct HXbpnode *node, unsigned int depth)
+{
+	const struct HXbpinner *in;
+	unsigned int i;
+
+	if (depth == 0 || node->leaf) {
+		while (!node->leaf) {
+			in   = static_cast(const void *, node);
+			node = in->child[0];
+		}
+		return HXqfe_span_add(job, node, 0, 0);
+	}
+	in = static_cast(const void *, node);
+	for (i = 0; i < in->hdr.count; ++i)
+		if (!HXqfe_bptree_spans(job, in->child[i], depth - 1))
+			return false;
+	return true;
+}
+
+/**
+ * HXqfe_spans - divide the elements of @map into spans for @nthreads
+ *
+ * Returns false if out of memory.
+ */
+static bool HXqfe_spans(struct HXqfe_job *job,
+    const struct HXmap_private *map, unsigned int nthreads)
+{
+	size_t target = static_cast(size_t, nthreads) * HXQFE_SPANS_PER_THREAD;
+	const void *vmap = map;
+	unsigned int depth = 0;
+	size_t n, i;
 
 	switch (map->type) {
 	case HXMAPT_HASH:
-		return HXumap_travinit(vmap, flags);
+		n = HXumap_travbuckets(vmap);
+		return HXqfe_split(job, vmap, n, HXqfe_chunk(n, target));
+	case HXMAPT_SHARDED: {
+		const struct HXsmap *smap = vmap;
+
+		for (n = 0, i = 0; i < smap->nshards; ++i)
+			n += HXumap_travbuckets(smap->shards[i].hmap);
+		n = HXqfe_chunk(n, target);
+		for (i = 0; i < smap->nshards; ++i)
+			if (!HXqfe_split(job, smap->shards[i].hmap,
+			    HXumap_travbuckets(smap->shards[i].hmap), n))
+				return false;
+		return true;
+	}
+	case HXMAPT_FLATHASH: {
+		const struct HXfmap *fmap = vmap;
+		return HXqfe_split(job, fmap, fmap->capacity,
+		       HXqfe_chunk(fmap->capacity, target));
+	}
+	case HXMAPT_FROZEN:
+		return HXqfe_split(job, vmap, map->items,
+		       HXqfe_chunk(map->items, target));
 	case HXMAPT_RBTREE:
-		return HXrbtrav_init(vmap, flags);
+		while (depth < 8 * sizeof(target) &&
+		       (static_cast(size_t, 1) << depth) < target)
+			++depth;
+		return HXqfe_rbtree_spans(job,
+		       static_cast(const struct HXrbtree *, vmap)->root, depth);
+	case HXMAPT_BTREE: {
+		const struct HXbptree *bt = vmap;
+
+		if (bt->root == NULL)
+			return true;
+		/* Non-root inner nodes have at least HXBPT_INNER_MIN children */
+		for (n = 1; n < target && depth < bt->height; ++depth)
+			n *= depth == 0 ? 2 : HXBPT_INNER_MIN;
+		if (!HXqfe_bptree_spans(job, bt->root, depth))
+			return false;
+		for (i = 0; i + 1 < job->nspans; ++i)
+			job->span[i].stop = job->span[i+1].ptr;
+		return true;
+	}
 	default:
-		errno = EINVAL;
-		return NULL;
+		return false;
 	}
 }
 
-static const struct HXmap_node *HXumap_traverse(struct HXumap_trav *trav)
+/**
+ * HXqfe_call - hand one element to the callback
+ *
+ * Returns false once any thread's callback has requested to stop.
+ */
+static __inline__ bool HXqfe_call(struct HXqfe_job *job,
+    const struct HXmap_node *node)
 {
-	const struct HXumap *hmap = trav->hmap;
-	const struct HXumap_node *drop;
+	if (__atomic_load_n(&job->stop, __ATOMIC_RELAXED))
+		return false;
+	if ((*job->fn)(node, job->arg))
+		return true;
+	__atomic_store_n(&job->stop, true, __ATOMIC_RELAXED);
+	return false;
+}
 
-	if (trav->head == NULL) {
-		trav->head = hmap->bk_array[trav->bk_current].next;
-	} else if (trav->tid != hmap->tid) {
-		if (trav->bk_current >= HXhash_primes[hmap->power])
-			/* bk_array shrunk underneath us, we're done */
-			return NULL;
-		/*
-		 * Reset head so that the while loop will be entered and we
-		 * advance to the next bucket.
-		 */
-		trav->head = &hmap->bk_array[trav->bk_current];
-		trav->tid  = hmap->tid;
-	} else {
-		trav->head = trav->head->next;
+static bool HXqfe_rbtree_walk(struct HXqfe_job *job,
+    const struct HXrbnode *node)
+{
+	if (node->N_LEFT != NULL && !HXqfe_rbtree_walk(job, node->N_LEFT))
+		return false;
+	if (!HXqfe_call(job, static_cast(const void *, &node->key)))
+		return false;
+	return node->N_RIGHT == NULL || HXqfe_rbtree_walk(job, node->N_RIGHT);
+}
+
+static bool HXqfe_walk(struct HXqfe_job *job, const struct HXqfe_span *span)
+{
+	size_t i;
+
+	switch (job->type) {
+	case HXMAPT_HASH:
+	case HXMAPT_SHARDED: {
+		const struct HXumap_node *hnode;
+		const struct HXlist_head *bk;
+
+		for (i = span->begin; i < span->end; ++i) {
+			bk = HXumap_travbucket(span->ptr, i);
+			HXlist_for_each_entry(hnode, bk, anchor)
+				if (!HXqfe_call(job,
+				    static_cast(const void *, &hnode->key)))
+					return false;
+		}
+		return true;
 	}
+	case HXMAPT_FLATHASH: {
+		const struct HXfmap *fmap = span->ptr;
+
+		for (i = span->begin; i < span->end; ++i)
+			if (!(fmap->ctrl[i] & HXFMAP_EMPTY) &&
+			    !HXqfe_call(job, &fmap->slots[i]))
+				return false;
+		return true;
+	}
+	case HXMAPT_FROZEN: {
+		const struct HXmap_node *node;
+
+		for (i = span->begin; i < span->end; ++i)
+			if ((node = HXzmap_node(span->ptr, i)) != NULL &&
+			    !HXqfe_call(job, node))
+				return false;
+		return true;
+	}
+	case HXMAPT_RBTREE: {
+		const struct HXrbnode *node = span->ptr;
 
-	while (trav->head == &hmap->bk_array[trav->bk_current]) {
-		if (++trav->bk_current >= HXhash_primes[hmap->power])
-			return NULL;
-		trav->head = hmap->bk_array[trav->bk_current].next;
+		if (span->begin != 0)
+			return HXqfe_rbtree_walk(job, node);
+		return HXqfe_call(job, static_cast(const void *, &node->key));
 	}
+	case HXMAPT_BTREE: {
+		const struct HXbpleaf *leaf;
+
+		for (leaf = span->ptr; leaf != span->stop; leaf = leaf->next)
+			for (i = 0; i < leaf->hdr.count; ++i)
+				if (!HXqfe_call(job, &leaf->elem[i]))
+					return false;
+		return true;
+	}
+	default:
+		return false;
+	}
+}
 
-	drop = HXlist_entry(trav->head, struct HXumap_node, anchor);
-	return static_cast(const void *, &drop->key);
+static void *HXqfe_worker(void *vjob)
+{
+	struct HXqfe_job *job = vjob;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	       job->nspans && HXqfe_walk(job, &job->span[i]))
+		;
+	return NULL;
 }
 
-static void HXrbtrav_checkpoint(struct HXrbtrav *trav,
-    const struct HXrbnode *node)
+/**
+ * HXmap_qfe_parallel - HXmap_qfe, spread over several threads
+ * @nthreads:	number of threads including the caller, 0 for one per CPU
+ *
+ * The map is cut into spans of buckets, slots or subtrees, which the
+ * threads take one after another. @fn is called concurrently and in no
+ * particular order; it must do its own locking for @arg. The map must not
+ * be modified until the function returns; writers of %HXMAPT_SHARDED and
+ * %HXMAPT_RCU maps block until then (and deadlock if called from @fn).
+ *
+ * If threads cannot be started, fewer threads do the work. Returns 0, or
+ * -EINVAL for an unsupported map type.
+ */
+EXPORT_SYMBOL int HXmap_qfe_parallel(const struct HXmap *xmap, qfe_fn_t fn,
+    void *arg, unsigned int nthreads)
 {
-	const struct HXrbtree *tree = trav->tree;
+	const void *vmap = xmap;
+	const struct HXmap_private *map = vmap;
+	struct HXqfe_job job = {.type = map->type, .fn = fn, .arg = arg};
+	unsigned int i, started = 0;
+	pthread_t *tid;
 
-	if (tree->super.flags & HXMAP_DTRAV) {
-		void *old_key = trav->checkpoint;
+	switch (map->type) {
+	case HXMAPT_HASH:
+	case HXMAPT_RBTREE:
+	case HXMAPT_FLATHASH:
+	case HXMAPT_BTREE:
+	case HXMAPT_FROZEN:
+	case HXMAPT_SHARDED:
+		break;
+	case HXMAPT_RCU: {
+		unsigned int token;
+		int ret;
+
+		ret = HXmap_qfe_parallel(static_cast(const void *,
+		      HXrmap_enter(vmap, &token)), fn, arg, nthreads);
+		HXrmap_leave(vmap, token);
+		return ret;
+	}
+	default:
+		return -EINVAL;
+	}
+	if (nthreads == 0)
+		nthreads = HXqfe_ncpus();
+	if (nthreads <= 1) {
+		HXmap_qfe(xmap, fn, arg);
+		return 0;
+	}
 
-		trav->checkpoint = tree->super.ops.k_clone(node->key,
-		                   tree->super.key_size);
-		if (tree->super.ops.k_free != NULL)
-			tree->super.ops.k_free(old_key);
-	} else {
-		trav->checkpoint = node->key;
+	if (map->type == HXMAPT_SHARDED)
+		HXsmap_rdlock_all(vmap);
+	else if (map->type == HXMAPT_HASH)
+		HXumap_pin(vmap);
+	if (!HXqfe_spans(&job, map, nthreads)) {
+		/* HXmap_qfe takes the shard locks itself */
+		if (map->type == HXMAPT_SHARDED)
+			HXsmap_unlock_all(vmap);
+		else if (map->type == HXMAPT_HASH)
+			HXumap_unpin(vmap);
+		free(job.span);
+		HXmap_qfe(xmap, fn, arg);
+		return 0;
 	}
+	if (nthreads > job.nspans)
+		nthreads = job.nspans;
+	tid = nthreads > 1 ? malloc(sizeof(*tid) * (nthreads - 1)) : NULL;
+	if (tid != NULL)
+		for (i = 0; i < nthreads - 1; ++i, ++started)
+			if (pthread_create(&tid[i], NULL, HXqfe_worker,
+			    &job) != 0)
+				break;
+	HXqfe_worker(&job);
+	for (i = 0; i < started; ++i)
+		pthread_join(tid[i], NULL);
+	if (map->type == HXMAPT_SHARDED)
+		HXsmap_unlock_all(vmap);
+	else if (map->type == HXMAPT_HASH)
+		HXumap_unpin(vmap);
+	free(tid);
+	free(job.span);
+	return 0;
 }
 
-static struct HXrbnode *HXrbtrav_next(struct HXrbtrav *trav)
-{
-	if (trav->current->N_RIGHT != NULL) {
-		/* Got a right child */
-		struct HXrbnode *node;
+/*
+ * Frozen maps. HXmap_freeze lays out all elements in one image: a header,
+ * one pilot value per bucket of (on average) %HXZMAP_BUCKET_KEYS keys, the
+ * slot array, and the key and value bytes. A key's hash picks its bucket,
+ * and hash and pilot together pick its slot, so lookups need no probing
+ * and no pointers; the image can be written out and mapped back as is.
+ */
+static const char HXzmap_magic[8] = "libHXfz";
 
-		trav->dir[trav->depth++] = RBT_RIGHT;
-		node = trav->current->N_RIGHT;
+static __inline__ size_t HXzmap_align(size_t z)
+{
+	return (z + 7) & ~static_cast(size_t, 7);
+}
 
-		/* Which might have left childs (our inorder successors!) */
-		while (node != NULL) {
-			trav->path[trav->depth] = node;
-			node = node->N_LEFT;
-			trav->dir[trav->depth++] = RBT_LEFT;
-		}
-		trav->current = trav->path[--trav->depth];
-	} else if (trav->depth == 0) {
-		/* No right child, no more parents */
-		return trav->current = NULL;
-	} else if (trav->dir[trav->depth-1] == RBT_LEFT) {
-		/* We are the left child of the parent, move on to parent */
-		trav->current = trav->path[--trav->depth];
-	} else if (trav->dir[trav->depth-1] == RBT_RIGHT) {
-		/*
-		 * There is no right child, and we are the right child of the
-		 * parent, so move on to the next inorder node (a distant
-		 * parent). This works by walking up the path until we are the
-		 * left child of a parent.
-		 */
-		while (true) {
-			if (trav->depth == 0)
-				/* No more parents */
-				return trav->current = NULL;
-			if (trav->dir[trav->depth-1] != RBT_RIGHT)
-				break;
-			--trav->depth;
-		}
-		trav->current = trav->path[--trav->depth];
-	}
+/**
+ * HXzmap_portable - whether keys and values are stored by content
+ *
+ * Pointer-valued keys and values are meaningless to another process.
+ */
+static bool HXzmap_portable(unsigned int flags, uint64_t key_size,
+    uint64_t data_size)
+{
+	return ((flags & HXMAP_SKEY) || key_size != 0) &&
+	       ((flags & (HXMAP_SDATA | HXMAP_SINGULAR)) || data_size != 0);
+}
 
-	HXrbtrav_checkpoint(trav, trav->current);
-	return trav->current;
+/**
+ * HXzmap_bytewise - whether the keys of @map compare equal iff their
+ * bytes do, which is what the frozen map's lookup relies on
+ */
+static bool HXzmap_bytewise(const struct HXmap_private *map)
+{
+	int (*cmp)(const void *, const void *, size_t);
+
+	if (map->flags & HXMAP_SKEY)
+		return HXmap_strkeys(map);
+	else if (map->flags & HXMAP_IKEY)
+		cmp = map->key_size == sizeof(uint32_t) ?
+		      HXmap_u32cmp : HXmap_u64cmp;
+	else if (map->key_size == 0)
+		cmp = HXmap_valuecmp;
+	else
+		cmp = memcmp;
+	return map->ops.k_compare == cmp;
 }
 
-static struct HXrbnode *HXrbtrav_rewalk(struct HXrbtrav *trav)
+/**
+ * HXzmap_place - find pilot values for a minimal perfect hash
+ * @hash:	key hashes
+ * @n:	number of keys, and of slots
+ * @nb:	number of buckets
+ * @pilots:	receives the pilot of each bucket
+ * @slot_of:	receives the slot of each key
+ *
+ * Buckets are placed largest first, while the table is still empty. For
+ * each, pilot values are tried in turn until all of its keys land in
+ * distinct free slots (hash-and-displace as in PTHash).
+ * Returns 1 on success, 0 if another seed must be tried, or a negative
+ * errno code.
+ */
+static int HXzmap_place(const uint64_t *hash, size_t n, size_t nb,
+    uint32_t *pilots, size_t *slot_of)
 {
-	/*
-	 * When the binary tree has been distorted (or the traverser is
-	 * uninitilaized), by either addition or deletion of an object, our
-	 * path recorded so far is (probably) invalid too. rewalk() will go and
-	 * find the node we were last at.
-	 */
-	const struct HXrbtree *btree = trav->tree;
-	struct HXrbnode *node   = btree->root;
-	bool go_next = false;
+	size_t *start, *keys, *order, *bysize = NULL, i, b, s, max = 0;
+	uint64_t p, limit = 64 * static_cast(uint64_t, n) + 1024;
+	const size_t *bk;
+	unsigned char *taken;
+	int ret = -ENOMEM;
+
+	if (limit > UINT32_MAX)
+		limit = UINT32_MAX;
+	start = calloc(nb + 1, sizeof(*start));
+	keys  = malloc(sizeof(*keys) * n);
+	order = malloc(sizeof(*order) * nb);
+	taken = calloc(n, 1);
+	if (start == NULL || keys == NULL || order == NULL || taken == NULL)
+		goto out;
 
-	trav->depth = 0;
+	/* Group keys by bucket; bucket b is keys[start[b]..start[b+1]-1]. */
+	for (i = 0; i < n; ++i)
+		++start[HXzmap_range(hash[i], nb)];
+	for (b = 0; b < nb; ++b) {
+		if (start[b] > max)
+			max = start[b];
+		if (b > 0)
+			start[b] += start[b-1];
+	}
+	start[nb] = n;
+	for (i = n; i-- > 0; )
+		keys[--start[HXzmap_range(hash[i], nb)]] = i;
 
-	if (trav->current == NULL) {
-		/* Walk down the tree to the smallest element */
-		while (node != NULL) {
-			trav->path[trav->depth] = node;
-			node = node->N_LEFT;
-			trav->dir[trav->depth++] = RBT_LEFT;
+	/* Order buckets by decreasing size */
+	if ((bysize = calloc(max + 1, sizeof(*bysize))) == NULL)
+		goto out;
+	for (b = 0; b < nb; ++b)
+		++bysize[max - (start[b+1] - start[b])];
+	for (s = 0, i = 0; s <= max; ++s) {
+		size_t c = bysize[s];
+		bysize[s] = i;
+		i += c;
+	}
+	for (b = 0; b < nb; ++b)
+		order[bysize[max-(start[b+1]-start[b])]++] = b;
+
+	for (i = 0; i < nb; ++i) {
+		b  = order[i];
+		bk = &keys[start[b]];
+		s  = start[b+1] - start[b];
+		for (p = 0; ; ++p) {
+			size_t j;
+
+			if (p > limit) {
+				/* Most likely keys with identical hashes */
+				ret = 0;
+				goto out;
+			}
+			for (j = 0; j < s; ++j) {
+				size_t pos = HXzmap_pos(hash[bk[j]], p, n);
+				if (taken[pos])
+					break;
+				taken[pos] = 1;
+				slot_of[bk[j]] = pos;
+			}
+			if (j == s)
+				break;
+			while (j-- > 0)
+				taken[slot_of[bk[j]]] = 0;
 		}
-	} else {
-		/* Search for the specific node to rebegin traversal at. */
-		const struct HXrbnode *newpath[RBT_MAXDEP];
-		unsigned char newdir[RBT_MAXDEP] = {};
-		int newdepth = 0, res;
-		bool found = false;
+		pilots[b] = p;
+	}
+	ret = 1;
+ out:
+	free(start);
+	free(keys);
+	free(order);
+	free(taken);
+	free(bysize);
+	return ret;
+}
 
-		while (node != NULL) {
-			newpath[newdepth] = trav->path[trav->depth] = node;
-			res = btree->super.ops.k_compare(trav->checkpoint,
-			      node->key, btree->super.key_size);
-			if (res == 0) {
-				++trav->depth;
-				found = true;
-				break;
-			}
-			res = res > 0;
-			trav->dir[trav->depth++] = res;
+/**
+ * HXzmap_new - wrap an image into a map
+ * @hdr:	image, ownership is transferred on success
+ */
+static struct HXzmap *HXzmap_new(const struct HXzmap_header *hdr,
+    bool mapped)
+{
+	const char *base = static_cast(const void *, hdr);
+	struct HXzmap *zmap;
 
-			/*
-			 * This (working) code gets 1st place in being totally
-			 * cryptic without comments, so here goes:
-			 *
-			 * Right turns do not need to be saved, because we do
-			 * not need to stop at that particular node again but
-			 * can go directly to the next in-order successor,
-			 * which must be a parent somewhere upwards where we
-			 * did a left turn. If we only ever did right turns,
-			 * we would be at the last node already.
-			 *
-			 * Imagine a 32-element perfect binary tree numbered
-			 * from 1..32, and walk to 21 (directions: RLRL).
-			 * The nodes stored are 24 and 22. btrav_next will
-			 * go to 22, do 23, then jump _directly_ back to 24,
-			 * omitting the redundant check at 20.
-			 */
-			if (res == RBT_LEFT)
-				newdir[newdepth++] = RBT_LEFT;
+	if ((zmap = calloc(1, sizeof(*zmap))) == NULL)
+		return NULL;
+	/* Untouched pages of a large calloc cost no memory. */
+	zmap->nodes = calloc(hdr->items > 0 ? hdr->items : 1,
+	              sizeof(*zmap->nodes));
+	if (zmap->nodes == NULL) {
+		free(zmap);
+		return NULL;
+	}
+	zmap->super.type      = HXMAPT_FROZEN;
+	zmap->super.flags     = hdr->flags;
+	zmap->super.items     = hdr->items;
+	zmap->super.key_size  = hdr->key_size;
+	zmap->super.data_size = hdr->data_size;
+	zmap->super.seed      = hdr->seed;
+	zmap->hdr     = hdr;
+	zmap->pilots  = reinterpret_cast(const uint32_t *, base + hdr->pilot_off);
+	zmap->slots   = reinterpret_cast(const struct HXzmap_slot *,
+	                base + hdr->slot_off);
+	zmap->buckets = hdr->buckets;
+	zmap->size    = hdr->size;
+	zmap->mapped  = mapped;
+	return zmap;
+}
 
-			node = node->sub[res];
-		}
+/**
+ * HXzmap_dlen - size of a value in the image (0: not stored)
+ */
+static size_t HXzmap_dlen(const struct HXmap_private *map, const void *data)
+{
+	if ((map->flags & HXMAP_SINGULAR) || data == NULL)
+		return 0;
+	if (map->flags & HXMAP_SDATA)
+		return strlen(data) + 1;
+	if (map->data_size != 0)
+		return map->data_size;
+	return sizeof(data);
+}
 
-		if (found) {
-			/*
-			 * We found the node, but which HXbtraverse() has
-			 * already returned. Advance to the next inorder node.
-			 * (Code needs to come after @current assignment.)
-			 */
-			go_next = true;
-		} else {
-			/*
-			 * If the node travp->current is actually deleted (@res
-			 * will never be 0 above), traversal re-begins at the
-			 * next inorder node, which happens to be the last node
-			 * we turned left at.
-			 */
-			memcpy(trav->path, newpath, sizeof(trav->path));
-			memcpy(trav->dir, newdir, sizeof(trav->dir));
-			trav->depth = newdepth;
-		}
+/**
+ * HXzmap_build - lay out the image of a frozen map
+ * @kv:	elements
+ * @hash:	hashes of the keys under @seed
+ * @pilots:	pilot values as computed by HXzmap_place
+ * @slot_of:	slots as computed by HXzmap_place
+ */
+static struct HXzmap_header *HXzmap_build(const struct HXmap_private *map,
+    const struct HXmap_node *kv, const uint64_t *hash, size_t nb,
+    uint64_t seed, const uint32_t *pilots, const size_t *slot_of)
+{
+	size_t n = map->items, size, i, pos, len, off, *key_of;
+	bool skey = map->flags & HXMAP_SKEY;
+	struct HXzmap_header *hdr;
+	struct HXzmap_slot *slot;
+	const void *key, *kp;
+	char *base;
+
+	size = HXzmap_align(sizeof(*hdr)) + HXzmap_align(sizeof(*pilots) * nb) +
+	       sizeof(*slot) * n;
+	for (i = 0; i < n; ++i) {
+		key   = kv[i].key;
+		kp    = HXzmap_kbytes(map, &key, &len);
+		size += HXzmap_align(len + skey) +
+		        HXzmap_align(HXzmap_dlen(map, kv[i].data));
 	}
-
-	if (trav->depth == 0) {
-		/* no more elements */
-		trav->current = NULL;
-	} else {
-		trav->current = trav->path[--trav->depth];
-		if (trav->current == NULL)
-			fprintf(stderr, "btrav_rewalk: problem: current==NULL\n");
-		else
-			HXrbtrav_checkpoint(trav, trav->current);
+	/* Terminating zero */
+	size += 8;
+	if ((hdr = calloc(1, size)) == NULL)
+		return NULL;
+	base = reinterpret_cast(char *, hdr);
+	memcpy(hdr->magic, HXzmap_magic, sizeof(hdr->magic));
+	hdr->byteorder = HXZMAP_BYTEORDER;
+	hdr->version   = HXZMAP_VERSION;
+	hdr->flags     = map->flags & (HXMAP_SKEY | HXMAP_SDATA | HXMAP_SINGULAR);
+	hdr->key_size  = map->key_size;
+	hdr->data_size = map->data_size;
+	hdr->items     = n;
+	hdr->buckets   = nb;
+	hdr->seed      = seed;
+	hdr->pilot_off = HXzmap_align(sizeof(*hdr));
+	hdr->slot_off  = hdr->pilot_off + HXzmap_align(sizeof(*pilots) * nb);
+	hdr->size      = size;
+	memcpy(base + hdr->pilot_off, pilots, sizeof(*pilots) * nb);
+	slot = reinterpret_cast(struct HXzmap_slot *, base + hdr->slot_off);
+
+	/* Store the elements in slot order, for sequential traversal. */
+	if ((key_of = malloc(sizeof(*key_of) * (n > 0 ? n : 1))) == NULL) {
+		free(hdr);
+		return NULL;
 	}
+	for (i = 0; i < n; ++i)
+		key_of[slot_of[i]] = i;
+	off = hdr->slot_off + sizeof(*slot) * n;
+	for (pos = 0; pos < n; ++pos) {
+		i   = key_of[pos];
+		key = kv[i].key;
+		kp  = HXzmap_kbytes(map, &key, &len);
+		slot[pos].key  = off;
+		slot[pos].klen = len;
+		slot[pos].fp   = static_cast(uint32_t, hash[i]);
+		memcpy(base + off, kp, len);
+		off += HXzmap_align(len + skey);
+		len = HXzmap_dlen(map, kv[i].data);
+		if (len == 0)
+			continue;
+		slot[pos].data = off;
+		memcpy(base + off, (map->flags & HXMAP_SDATA) ||
+		       map->data_size != 0 ? kv[i].data :
+		       static_cast(const void *, &kv[i].data), len);
+		off += HXzmap_align(len);
+	}
+	free(key_of);
+	return hdr;
+}
 
-	trav->tid = btree->tid;
-	if (trav->current != nullptr && go_next)
-		return HXrbtrav_next(trav);
-	else
-		return trav->current;
+/**
+ * HXmap_freeze - make an immutable copy of a map
+ * @xmap:	map to copy; must not be modified concurrently
+ *
+ * Keys and values are copied into the frozen map, so @xmap may be freed
+ * afterwards. Keys must compare by their bytes (custom k_compare functions
+ * are rejected).
+ */
+EXPORT_SYMBOL struct HXmap *HXmap_freeze(const struct HXmap *xmap)
+{
+	const void *vmap = xmap;
+	const struct HXmap_private *map = vmap;
+	size_t n = map->items, nb, i, len, *slot_of = NULL;
+	struct HXzmap_header *hdr = NULL;
+	struct HXmap_node *kv = NULL;
+	struct HXzmap *zmap = NULL;
+	uint32_t *pilots = NULL;
+	uint64_t *hash = NULL, seed = 0;
+	unsigned int attempt;
+	const void *key, *kp;
+	int ret = 0, saved_errno;
+
+	if (map->type == HXMAPT_FROZEN || !HXzmap_bytewise(map)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	nb = n > 0 ? n / HXZMAP_BUCKET_KEYS + 1 : 0;
+	if (n > 0 && (kv = HXmap_keysvalues(xmap)) == NULL)
+		return NULL;
+	hash    = malloc(sizeof(*hash) * (n > 0 ? n : 1));
+	slot_of = malloc(sizeof(*slot_of) * (n > 0 ? n : 1));
+	pilots  = calloc(nb > 0 ? nb : 1, sizeof(*pilots));
+	if (hash == NULL || slot_of == NULL || pilots == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+	for (attempt = 0; attempt < HXZMAP_ATTEMPTS && ret == 0; ++attempt) {
+		seed = HXmap_seed_new();
+		for (i = 0; i < n; ++i) {
+			key     = kv[i].key;
+			kp      = HXzmap_kbytes(map, &key, &len);
+			hash[i] = HXhash_wy_seed(kp, len, seed);
+		}
+		ret = HXzmap_place(hash, n, nb, pilots, slot_of);
+	}
+	if (ret <= 0) {
+		errno = ret < 0 ? -ret : EAGAIN;
+		goto out;
+	}
+	hdr = HXzmap_build(map, kv, hash, nb, seed, pilots, slot_of);
+	if (hdr == NULL) {
+		errno = ENOMEM;
+		goto out;
+	}
+	zmap = HXzmap_new(hdr, false);
+	if (zmap == NULL) {
+		free(hdr);
+		errno = ENOMEM;
+		goto out;
+	}
+	errno = 0;
+ out:
+	saved_errno = errno;
+	free(kv);
+	free(hash);
+	free(slot_of);
+	free(pilots);
+	errno = saved_errno;
+	return static_cast(void *, zmap);
 }
 
-static const struct HXmap_node *HXrbtree_traverse(struct HXrbtrav *trav)
+/**
+ * HXzmap_valid - check an image read from a file
+ *
+ * Element offsets are not checked here (which would take a pass over the
+ * whole file), but on access.
+ */
+static bool HXzmap_valid(const struct HXzmap_header *hdr, uint64_t size)
 {
-	const struct HXrbnode *node;
+	if (hdr->size != size ||
+	    memcmp(hdr->magic, HXzmap_magic, sizeof(hdr->magic)) != 0 ||
+	    hdr->byteorder != HXZMAP_BYTEORDER ||
+	    hdr->version != HXZMAP_VERSION ||
+	    (hdr->flags & ~(HXMAP_SKEY | HXMAP_SDATA | HXMAP_SINGULAR)) != 0 ||
+	    !HXzmap_portable(hdr->flags, hdr->key_size, hdr->data_size) ||
+	    hdr->key_size > size || hdr->data_size > size)
+		return false;
+	if ((hdr->items == 0) != (hdr->buckets == 0) ||
+	    hdr->pilot_off != HXzmap_align(sizeof(*hdr)) ||
+	    hdr->buckets > (size - hdr->pilot_off) / sizeof(uint32_t) ||
+	    hdr->slot_off < hdr->pilot_off + sizeof(uint32_t) * hdr->buckets ||
+	    hdr->slot_off % 8 != 0 || hdr->slot_off > size ||
+	    hdr->items > (size - hdr->slot_off) / sizeof(struct HXzmap_slot))
+		return false;
+	return reinterpret_cast(const char *, hdr)[size-1] == '\0';
+}
 
-	if (trav->tid != trav->tree->tid || trav->current == NULL)
-		/*
-		 * Every HXrbtree operation that significantly changes the
-		 * B-tree, increments @tid so we can decide here to rewalk.
-		 */
-		node = HXrbtrav_rewalk(trav);
-	else
-		node = HXrbtrav_next(trav);
+/**
+ * HXmap_save - write a frozen map to a file
+ * @xmap:	%HXMAPT_FROZEN map
+ * @file:	path to write to
+ *
+ * Keys and values must be stored by content (C strings or fixed-size),
+ * not as pointers. The file is written under a temporary name and then
+ * renamed, so processes which have the old file mapped are unaffected.
+ * The format is specific to the host's byte order.
+ */
+EXPORT_SYMBOL int HXmap_save(const struct HXmap *xmap, const char *file)
+{
+	const void *vmap = xmap;
+	const struct HXzmap *zmap = vmap;
+#ifndef _WIN32
+	ssize_t wret;
+	size_t tz;
+	char *tmp;
+	int fd, ret = 1;
+#endif
 
-	return (node != NULL) ? static_cast(const void *, &node->key) : NULL;
+	if (zmap->super.type != HXMAPT_FROZEN ||
+	    !HXzmap_portable(zmap->super.flags, zmap->super.key_size,
+	    zmap->super.data_size))
+		return -EINVAL;
+#ifdef _WIN32
+	return -ENOSYS;
+#else
+	tz  = strlen(file) + 32;
+	tmp = malloc(tz);
+	if (tmp == NULL)
+		return -errno;
+	snprintf(tmp, tz, "%s.%lu.tmp", file,
+	         static_cast(unsigned long, getpid()));
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		ret = -errno;
+		free(tmp);
+		return ret;
+	}
+	wret = HXio_fullwrite(fd, zmap->hdr, zmap->size);
+	if (wret < 0)
+		ret = -errno;
+	else if (static_cast(uint64_t, wret) != zmap->size)
+		ret = -EIO;
+	if (close(fd) != 0 && ret > 0)
+		ret = -errno;
+	if (ret > 0 && rename(tmp, file) != 0)
+		ret = -errno;
+	if (ret <= 0)
+		unlink(tmp);
+	free(tmp);
+	return ret;
+#endif
 }
 
-EXPORT_SYMBOL const struct HXmap_node *HXmap_traverse(struct HXmap_trav *trav)
+/**
+ * HXmap_load - map a file written by HXmap_save
+ * @file:	path to read
+ *
+ * The file is mapped read-only and shared, and used in place: lookups
+ * start right away, and the pages are shared by all processes which have
+ * the file loaded. Values point into the mapping and must not be written.
+ */
+EXPORT_SYMBOL struct HXmap *HXmap_load(const char *file)
 {
-	void *xtrav = trav;
+#ifdef _WIN32
+	errno = ENOSYS;
+	return NULL;
+#else
+	struct HXzmap *zmap;
+	struct stat sb;
+	void *image;
+	int fd, saved_errno;
 
-	if (xtrav == NULL)
+	if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
 		return NULL;
-
-	switch (trav->type) {
-	case HXMAPT_HASH:
-		return HXumap_traverse(xtrav);
-	case HXMAPT_RBTREE:
-		return HXrbtree_traverse(xtrav);
-	default:
+	if (fstat(fd, &sb) != 0) {
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return NULL;
+	}
+	if (sb.st_size < static_cast(off_t, sizeof(struct HXzmap_header)) ||
+	    static_cast(uint64_t, sb.st_size) > SIZE_MAX) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	image = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	saved_errno = errno;
+	close(fd);
+	if (image == MAP_FAILED) {
+		errno = saved_errno;
+		return NULL;
+	}
+	if (!HXzmap_valid(image, sb.st_size)) {
+		munmap(image, sb.st_size);
 		errno = EINVAL;
 		return NULL;
 	}
+	zmap = HXzmap_new(image, true);
+	if (zmap == NULL) {
+		munmap(image, sb.st_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	errno = 0;
+	return static_cast(void *, zmap);
+#endif
 }
 
-static void HXrbtrav_free(struct HXrbtrav *trav)
+/*
+ * Statistics. Everything is computed from the current state of the map;
+ * apart from the relayout counters, nothing is tracked on the hot paths.
+ */
+static void HXmap_stats_chain(struct HXmap_stats *st, size_t len)
 {
-	const struct HXmap_private *super = &trav->tree->super;
+	++st->chains[len < HXMAP_CHAIN_HIST ? len : HXMAP_CHAIN_HIST - 1];
+	if (len > st->max_chain)
+		st->max_chain = len;
+}
 
-	if ((super->flags & HXMAP_DTRAV) && super->ops.k_free != NULL)
-		super->ops.k_free(trav->checkpoint);
-	free(trav);
+/**
+ * HXumap_stats - add up the figures of a chained hash map
+ *
+ * Also used for each shard of an %HXMAPT_SHARDED map.
+ */
+static void HXumap_stats(const struct HXumap *hmap, struct HXmap_stats *st)
+{
+	const unsigned int bk_number = hmap->bk_sizes[hmap->power];
+	const struct HXlist_head *bk, *pos;
+	unsigned int i;
+	size_t len;
+
+	st->buckets     += bk_number;
+	st->relayouts   += hmap->relayouts;
+	st->table_bytes += bk_number * sizeof(*hmap->bk_array);
+	st->node_bytes  += hmap->super.items * hmap->super.node_size;
+	if (hmap->old_array != NULL)
+		st->table_bytes += hmap->bk_sizes[hmap->old_power] *
+		                   sizeof(*hmap->old_array);
+
+	for (i = 0; (bk = HXumap_travbucket(hmap, i)) != NULL; ++i) {
+		if (i >= bk_number && i - bk_number < hmap->mig_idx)
+			/* Already emptied by HXumap_migrate */
+			continue;
+		len = 0;
+		HXlist_for_each(pos, bk)
+			++len;
+		HXmap_stats_chain(st, len);
+	}
 }
 
-EXPORT_SYMBOL void HXmap_travfree(struct HXmap_trav *trav)
+static void HXfmap_stats(const struct HXfmap *fmap, struct HXmap_stats *st)
 {
-	void *xtrav = trav;
+	size_t mask = fmap->capacity - 1, i, pos, stride;
+	uint64_t h;
 
-	if (xtrav == NULL)
-		return;
-	switch (trav->type) {
-	case HXMAPT_RBTREE:
-		HXrbtrav_free(xtrav);
-		break;
-	default:
-		free(xtrav);
-		break;
+	st->buckets     = fmap->capacity;
+	st->relayouts   = fmap->relayouts;
+	st->tombstones  = fmap->tombstones;
+	st->table_bytes = fmap->capacity * sizeof(*fmap->slots) +
+	                  fmap->capacity + HXFMAP_GROUP;
+
+	for (i = 0; i < fmap->capacity; ++i) {
+		if (fmap->ctrl[i] & HXFMAP_EMPTY)
+			continue;
+		/* Follow the probe sequence to the first group covering @i */
+		h      = HXfmap_mix(HXmap_hash(&fmap->super, fmap->slots[i].key));
+		pos    = (h >> 7) & mask;
+		stride = 0;
+		while (((i - pos) & mask) >= HXFMAP_GROUP) {
+			stride += HXFMAP_GROUP;
+			pos = (pos + stride) & mask;
+		}
+		HXmap_stats_chain(st, stride / HXFMAP_GROUP);
 	}
 }
 
-static void HXumap_qfe(const struct HXumap *hmap, qfe_fn_t fn, void *arg)
+static unsigned int HXrbtree_height(const struct HXrbnode *node)
 {
-	const struct HXumap_node *hnode;
+	unsigned int lh, rh;
+
+	if (node == NULL)
+		return 0;
+	lh = HXrbtree_height(node->N_LEFT);
+	rh = HXrbtree_height(node->N_RIGHT);
+	return 1 + (lh > rh ? lh : rh);
+}
+
+static void HXrbtree_stats(const struct HXrbtree *btree,
+    struct HXmap_stats *st)
+{
+	const struct HXrbnode *node;
+
+	st->height     = HXrbtree_height(btree->root);
+	st->node_bytes = btree->super.items * btree->super.node_size;
+	/* All paths have the same black height; take the leftmost. */
+	for (node = btree->root; node != NULL; node = node->N_LEFT)
+		st->black_height += node->color == RBT_BLACK;
+}
+
+static void HXbptree_stats_dive(const struct HXbpnode *node,
+    struct HXmap_stats *st)
+{
+	const struct HXbpinner *in = static_cast(const void *, node);
 	unsigned int i;
 
-	for (i = 0; i < HXhash_primes[hmap->power]; ++i)
-		HXlist_for_each_entry(hnode, &hmap->bk_array[i], anchor)
-			if (!(*fn)(static_cast(const void *, &hnode->key), arg))
-				return;
+	if (node->leaf) {
+		st->node_bytes += sizeof(struct HXbpleaf);
+		return;
+	}
+	st->node_bytes += sizeof(*in);
+	for (i = 0; i < in->hdr.count; ++i)
+		HXbptree_stats_dive(in->child[i], st);
 }
 
-static void HXrbtree_qfe(const struct HXrbnode *node,
-    qfe_fn_t fn, void *arg)
+static void HXbptree_stats(const struct HXbptree *bt, struct HXmap_stats *st)
 {
-	if (node->N_LEFT != NULL)
-		HXrbtree_qfe(node->N_LEFT, fn, arg);
-	if (!(*fn)(static_cast(const void *, &node->key), arg))
+	if (bt->root == NULL)
 		return;
-	if (node->N_RIGHT != NULL)
-		HXrbtree_qfe(node->N_RIGHT, fn, arg);
+	st->height = bt->height + 1;
+	HXbptree_stats_dive(bt->root, st);
 }
 
-EXPORT_SYMBOL void HXmap_qfe(const struct HXmap *xmap, qfe_fn_t fn, void *arg)
+static void HXzmap_stats(const struct HXzmap *zmap, struct HXmap_stats *st)
+{
+	st->buckets     = zmap->super.items;
+	st->table_bytes = zmap->size +
+	                  zmap->super.items * sizeof(*zmap->nodes);
+}
+
+struct HXmap_stats_arg {
+	const struct HXmap_private *map;
+	struct HXmap_stats *st;
+};
+
+/**
+ * HXmap_stats_copies - add up the size of cloned keys and values
+ */
+static bool HXmap_stats_copies(const struct HXmap_node *node, void *varg)
+{
+	const struct HXmap_stats_arg *arg = varg;
+	const struct HXmap_private *map = arg->map;
+	struct HXmap_stats *st = arg->st;
+
+	/* Inline copies are part of @node_bytes, pooled ones are shared */
+	if ((map->flags & HXMAP_CKEY) && node->key != NULL &&
+	    map->key_off == 0 && map->strpool == NULL)
+		st->key_bytes += (map->flags & HXMAP_SKEY) ?
+		                 strlen(node->skey) + 1 : map->key_size;
+	if ((map->flags & HXMAP_CDATA) && node->data != NULL &&
+	    map->data_off == 0)
+		st->data_bytes += (map->flags & HXMAP_SDATA) ?
+		                  strlen(node->sdata) + 1 : map->data_size;
+	return true;
+}
+
+/**
+ * HXmap_stats - report size and shape of a map
+ * @xmap:	map to inspect
+ * @st:	receives the figures
+ *
+ * Walks the entire map, so this is meant for monitoring, not hot paths.
+ * Returns 1 on success, or a negative errno value.
+ */
+EXPORT_SYMBOL int HXmap_stats(const struct HXmap *xmap,
+    struct HXmap_stats *st)
 {
 	const void *vmap = xmap;
 	const struct HXmap_private *map = vmap;
+	struct HXmap_stats_arg arg = {map, st};
+	unsigned int i;
+
+	if (map == NULL || st == NULL)
+		return -EINVAL;
+	if (map->type == HXMAPT_RCU) {
+		unsigned int token;
+		int ret;
+
+		ret = HXmap_stats(static_cast(const void *,
+		      HXrmap_enter(vmap, &token)), st);
+		HXrmap_leave(vmap, token);
+		return ret;
+	}
 
+	memset(st, 0, sizeof(*st));
 	switch (map->type) {
 	case HXMAPT_HASH:
-		HXumap_qfe(vmap, fn, arg);
-		errno = 0;
+		HXumap_stats(vmap, st);
 		break;
-	case HXMAPT_RBTREE: {
-		const struct HXrbtree *tree = vmap;
-		if (tree->root != NULL)
-			HXrbtree_qfe(tree->root, fn, arg);
-		errno = 0;
+	case HXMAPT_RBTREE:
+		HXrbtree_stats(vmap, st);
+		break;
+	case HXMAPT_FLATHASH:
+		HXfmap_stats(vmap, st);
+		break;
+	case HXMAPT_SHARDED: {
+		const struct HXsmap *smap = vmap;
+
+		HXsmap_rdlock_all(smap);
+		for (i = 0; i < smap->nshards; ++i)
+			HXumap_stats(smap->shards[i].hmap, st);
+		HXsmap_unlock_all(smap);
+		/* The shards decide about inline copies */
+		arg.map = &smap->shards[0].hmap->super;
 		break;
 	}
+	case HXMAPT_BTREE:
+		HXbptree_stats(vmap, st);
+		break;
+	case HXMAPT_FROZEN:
+		/* Keys and values are part of the image */
+		HXzmap_stats(vmap, st);
+		st->items = map->items;
+		if (st->items != 0)
+			st->load_pct = 100;
+		return 1;
 	default:
-		errno = EINVAL;
+		return -EINVAL;
 	}
+
+	if (map->flags & (HXMAP_CKEY | HXMAP_CDATA))
+		HXmap_qfe(xmap, HXmap_stats_copies, &arg);
+	st->items = map->items;
+	if (st->buckets != 0)
+		st->load_pct = st->items * 100 / st->buckets;
+	return 1;
 }
@@ -1,16 +1,66 @@
 #ifndef LIBHX_MAP_INTERNAL_H
 #define LIBHX_MAP_INTERNAL_H 1
 
+#include <pthread.h>
+#include <stdint.h>
 #include <libHX/list.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @node_size:	size of one element, 0 until the first map attaches
+ * @slab_nodes:	number of elements carved from one slab
+ * @refcount:	number of maps plus user handles referencing the pool
+ * @free_list:	singly-linked list of unused elements
+ * @slabs:	list of slabs (chained through their first word)
+ */
+struct HXmap_pool {
+	size_t node_size, slab_nodes;
+	unsigned int refcount;
+	void *free_list, *slabs;
+};
+
+struct HXstrpool_slot {
+	char *str;
+	unsigned long hash;
+};
+
+/**
+ * @lock:	guards everything, since maps in several threads may share
+ * 		a pool
+ * @refcount:	number of maps plus user handles referencing the pool
+ * @table:	index of the strings (open addressing, power-of-two size)
+ * @capacity:	number of entries in @table
+ * @items:	number of strings
+ * @chunks:	list of arena chunks (chained through their first word)
+ * @arena:	free part of the current chunk
+ * @arena_left:	size of @arena
+ * @seed:	seed for HXhash_wy_seed
+ */
+struct HXstrpool {
+	pthread_mutex_t lock;
+	unsigned int refcount;
+	struct HXstrpool_slot *table;
+	size_t capacity, items;
+	void *chunks;
+	char *arena;
+	size_t arena_left;
+	unsigned long seed;
+};
+
 /**
  * @type:	actual type of map (%HX_MAPTYPE_*), used for virtual calls
  * @ops:	function pointers for key and data management
  * @flags:	bitfield of map flags
+ * @max_pct:	load factor (percent) above which hash tables grow
+ * @min_pct:	load factor (percent) below which hash tables shrink
+ * @node_size:	size of one element node (0 for node-less types)
+ * @pool:	node allocator, or %NULL for malloc
+ * @key_off:	offset of the inline key copy in element nodes, or 0
+ * @data_off:	offset of the inline value copy in element nodes, or 0
+ * @strpool:	pool that element keys are interned in, or %NULL
  */
 struct HXmap_private {
 	/* from struct HXmap */
@@ -21,26 +71,60 @@ struct HXmap_private {
 	enum HXmap_type type;
 	size_t key_size, data_size;
 	struct HXmap_ops ops;
+	unsigned int max_pct, min_pct;
+	size_t node_size;
+	struct HXmap_pool *pool;
+	size_t key_off, data_off;
+	struct HXstrpool *strpool;
+	/* default (seeded) hash, used when ops.k_hash is not set */
+	unsigned long (*k_shash)(const void *, size_t, unsigned long);
+	unsigned long seed;
+};
+
+/* How HXumap_bkidx reduces a hash to a bucket index */
+enum {
+	HXUMAP_BK_MOD = 0,
+	HXUMAP_BK_POW2,
+	HXUMAP_BK_FASTRANGE,
+	/* log2 of the smallest power-of-two table */
+	HXUMAP_POW2_SHIFT = 4,
 };
 
 /**
  * @bk_array:	bucket pointers
- * @power:	index into HXhash_primes to denote number of buckets
+ * @old_array:	buckets still being migrated (%HXMAP_INCREMENTAL only)
+ * @bk_sizes:	table of bucket counts (HXhash_primes or powers of two)
+ * @power:	index into @bk_sizes to denote number of buckets
+ * @old_power:	index into @bk_sizes for @old_array
+ * @min_power:	lower bound for @power, set by HXmap_reserve
+ * @mig_idx:	buckets of @old_array below this index have been migrated
  * @max_load:	maximum number of elements before table gets enlarged
  * @min_load:	minimum number of elements before table gets shrunk
  * @tid:	transaction ID, used to track relayouts
+ * @bk_mode:	bucket index reduction (%HXUMAP_BK_*)
+ * @reseed_at:	element count at the last chain-length triggered reseed
+ * @relayouts:	number of completed HXumap_layout/HXumap_reseed calls
+ * @pins:	traversals and HXmap_qfe calls in progress, during which
+ * 		lookups must not advance the migration
  */
 struct HXumap {
 	struct HXmap_private super;
 
-	struct HXlist_head *bk_array;
-	unsigned int power, max_load, min_load, tid;
+	struct HXlist_head *bk_array, *old_array;
+	const unsigned int *bk_sizes;
+	unsigned int power, old_power, min_power, mig_idx;
+	unsigned int max_load, min_load, tid;
+	unsigned int bk_mode;
+	size_t reseed_at;
+	unsigned long relayouts;
+	unsigned int pins;
 };
 
 /**
  * @anchor:	anchor point in struct HXumap_node
  * @key:	data that works as key
  * @data:	data that works as value
+ * @hash:	cached result of k_hash for @key
  */
 struct HXumap_node {
 	struct HXlist_head anchor;
@@ -53,11 +137,165 @@ struct HXumap_node {
 		void *data;
 		char *sdata;
 	};
+	unsigned long hash;
+};
+
+/**
+ * Control byte values for the open-addressing map. Occupied slots carry the
+ * lower 7 bits of the (mixed) hash, i.e. the MSB is clear.
+ */
+enum {
+	HXFMAP_EMPTY   = 0x80,
+	HXFMAP_DELETED = 0xFE,
+	HXFMAP_GROUP   = 8,
+	HXFMAP_MINCAP  = 16,
+};
+
+/**
+ * @ctrl:	control bytes (fingerprints); @capacity+%HXFMAP_GROUP entries,
+ * 		the last group mirroring the first
+ * @slots:	key-value pairs
+ * @capacity:	number of slots (power of two)
+ * @growth_left: number of insertions before the table must be rehashed
+ * @tombstones:	number of %HXFMAP_DELETED slots
+ * @min_capacity: lower bound for @capacity, set by HXmap_reserve
+ * @tid:	transaction ID, used to track relayouts
+ * @relayouts:	number of rehashes of a populated table
+ */
+struct HXfmap {
+	struct HXmap_private super;
+
+	unsigned char *ctrl;
+	struct HXmap_node *slots;
+	size_t capacity, growth_left, tombstones, min_capacity;
+	unsigned int tid;
+	/* %HXMAP_DTRAV traversers, which hold off shrinking */
+	unsigned int dtravs;
+	unsigned long relayouts;
+};
+
+/**
+ * @lock:	guards @hmap
+ * @hmap:	the sub-map holding all keys which hash to this shard
+ * @pad:	keeps neighbouring locks in separate cache lines
+ */
+struct HXsmap_shard {
+	pthread_rwlock_t lock;
+	struct HXumap *hmap;
+	char pad[64 - (sizeof(pthread_rwlock_t) + sizeof(void *)) % 64];
+};
+
+/**
+ * @shards:	array of sub-maps
+ * @nshards:	number of initialized entries in @shards
+ * @shard_mask:	@nshards - 1, for selecting a shard from a hash
+ *
+ * @super.items is updated atomically; the per-shard counts are only
+ * stable while the respective lock is held.
+ */
+struct HXsmap {
+	struct HXmap_private super;
+	struct HXsmap_shard *shards;
+	unsigned int nshards, shard_mask;
+};
+
+enum {
+	/* Number of reader counter pairs of an %HXMAPT_RCU map */
+	HXRMAP_SLOTS = 32,
+};
+
+/**
+ * @count:	readers currently inside a read-side section, by epoch parity
+ * @pad:	keeps neighbouring counters in separate cache lines
+ */
+struct HXrmap_slot {
+	unsigned long count[2];
+	char pad[64 - 2 * sizeof(unsigned long)];
+};
+
+/**
+ * @snap:	currently published snapshot (a map of another type)
+ * @slots:	reader counters; readers spread over them to avoid contention
+ * @wlock:	serializes writers
+ * @epoch:	lowest bit selects the counter which new readers use
+ */
+struct HXrmap {
+	struct HXmap_private super;
+	struct HXmap_private *snap;
+	struct HXrmap_slot *slots;
+	pthread_mutex_t wlock;
+	unsigned int epoch;
+};
+
+enum {
+	/* Average number of keys sharing one pilot value of a frozen map */
+	HXZMAP_BUCKET_KEYS = 4,
+	HXZMAP_VERSION     = 1,
+	HXZMAP_BYTEORDER   = 0x01020304,
+	/* New seeds to try before HXmap_freeze gives up */
+	HXZMAP_ATTEMPTS    = 16,
+};
+
+/**
+ * Image of a frozen map, both in memory and on disk. Offsets are relative
+ * to the start of the header; integers are in host byte order.
+ * @magic:	"libHXfz" plus NUL
+ * @byteorder:	%HXZMAP_BYTEORDER as seen by the producer
+ * @version:	%HXZMAP_VERSION
+ * @flags:	%HXMAP_SKEY, %HXMAP_SDATA and %HXMAP_SINGULAR of the source map
+ * @key_size:	size of keys, 0 for C strings or pointer-valued keys
+ * @data_size:	size of values, 0 for C strings or pointer values
+ * @items:	number of elements, and of slots
+ * @buckets:	number of pilot values
+ * @seed:	seed for HXhash_wy_seed
+ * @pilot_off:	offset of the pilot array (uint32_t[@buckets])
+ * @slot_off:	offset of the slot array (struct HXzmap_slot[@items])
+ * @size:	size of the image; its last byte is always zero, so that
+ * 		strings starting inside the image also end inside it
+ */
+struct HXzmap_header {
+	char magic[8];
+	uint32_t byteorder, version, flags, reserved;
+	uint64_t key_size, data_size, items, buckets, seed;
+	uint64_t pilot_off, slot_off, size;
 };
 
+/**
+ * @key:	offset of the key bytes
+ * @data:	offset of the value bytes, 0 for a %NULL value
+ * @klen:	length of the key (without the NUL of C strings)
+ * @fp:	lower 32 bits of the key's hash, to skip most key comparisons
+ */
+struct HXzmap_slot {
+	uint64_t key, data;
+	uint32_t klen, fp;
+};
+
+/**
+ * @hdr:	image (malloc'd, or mapped from a file if @mapped)
+ * @pilots:	per-bucket pilot values, see HXzmap_pos
+ * @slots:	elements in hash order
+ * @nodes:	HXmap_node views of @slots, filled in on first access
+ * @buckets:	copy of @hdr->buckets
+ * @size:	copy of @hdr->size
+ */
+struct HXzmap {
+	struct HXmap_private super;
+	const struct HXzmap_header *hdr;
+	const uint32_t *pilots;
+	const struct HXzmap_slot *slots;
+	struct HXmap_node *nodes;
+	uint64_t buckets, size;
+	bool mapped;
+};
+
+/**
+ * @embedded:	lives in caller-provided memory, not to be freed
+ */
 struct HXmap_trav {
 	enum HXmap_type type;
 	unsigned int flags;
+	bool embedded;
 };
 
 struct HXumap_trav {
@@ -67,6 +305,31 @@ struct HXumap_trav {
 	unsigned int bk_current, tid;
 };
 
+struct HXfmap_trav {
+	struct HXmap_trav super;
+	const struct HXfmap *fmap;
+	size_t idx;
+};
+
+struct HXzmap_trav {
+	struct HXmap_trav super;
+	const struct HXzmap *zmap;
+	size_t idx;
+};
+
+/**
+ * @sub:	traverser for the current shard
+ * @shard:	index of the current shard
+ *
+ * All shards are read-locked from HXmap_travinit until HXmap_travfree.
+ */
+struct HXsmap_trav {
+	struct HXmap_trav super;
+	const struct HXsmap *smap;
+	struct HXumap_trav sub;
+	unsigned int shard;
+};
+
 enum {
 	RBT_LEFT = 0,
 	RBT_RIGHT = 1,
@@ -83,6 +346,14 @@ enum {
 	 */
 };
 
+/* Search modes for HXrbtrav_descend */
+enum {
+	HXRBT_GE = 0,
+	HXRBT_GT,
+	HXRBT_LT,
+	HXRBT_LAST,
+};
+
 /**
  * @sub:	leaves
  * @color:	RBtree-specific node color
@@ -101,10 +372,106 @@ struct HXrbnode {
 	unsigned char color;
 };
 
+/**
+ * Element of an %HXMAP_THREADED tree
+ * @link:	in-order predecessor (%RBT_LEFT) and successor (%RBT_RIGHT)
+ */
+struct HXrbtnode {
+	struct HXrbnode n;
+	struct HXrbnode *link[2];
+};
+
+/**
+ * @first:	smallest element (%HXMAP_THREADED only)
+ * @last:	largest element (%HXMAP_THREADED only)
+ * @travs:	%HXMAP_DTRAV traversers, which deletion keeps up to date
+ * 		(%HXMAP_THREADED only)
+ * @travs_lock:	guards @travs against concurrent HXmap_travinit and
+ * 		HXmap_travfree calls, which are reads of the map
+ */
 struct HXrbtree {
 	struct HXmap_private super;
 	struct HXrbnode *root;
 	unsigned int tid;
+	struct HXrbnode *first, *last;
+	struct HXlist_head travs;
+	pthread_mutex_t travs_lock;
+};
+
+enum {
+	/* Elements per B+tree leaf, children per inner node */
+	HXBPT_LEAF_MAX  = 32,
+	HXBPT_INNER_MAX = 32,
+	HXBPT_LEAF_MIN  = HXBPT_LEAF_MAX / 2,
+	HXBPT_INNER_MIN = HXBPT_INNER_MAX / 2,
+	/* Inner levels; minimum fanout 16 makes this plenty */
+	HXBPT_MAXDEP    = 16,
+};
+
+/**
+ * @count:	number of elements (leaf) or children (inner node)
+ * @leaf:	whether this is a struct HXbpleaf
+ */
+struct HXbpnode {
+	unsigned int count;
+	bool leaf;
+};
+
+/**
+ * @prev:	previous leaf in key order
+ * @next:	next leaf in key order
+ * @elem:	sorted key-value pairs
+ */
+struct HXbpleaf {
+	struct HXbpnode hdr;
+	struct HXbpleaf *prev, *next;
+	struct HXmap_node elem[HXBPT_LEAF_MAX];
+};
+
+/**
+ * @key:	separators; @key[i] is the smallest key below @child[i+1],
+ * 		and points into the leaf that holds it
+ * @child:	subtrees
+ */
+struct HXbpinner {
+	struct HXbpnode hdr;
+	const void *key[HXBPT_INNER_MAX-1];
+	struct HXbpnode *child[HXBPT_INNER_MAX];
+};
+
+/**
+ * @root:	root node, or %NULL when empty
+ * @first:	leftmost leaf
+ * @last:	rightmost leaf
+ * @height:	number of inner levels above the leaves
+ * @tid:	transaction ID, used to track modifications
+ */
+struct HXbptree {
+	struct HXmap_private super;
+	struct HXbpnode *root;
+	struct HXbpleaf *first, *last;
+	unsigned int height, tid;
+};
+
+/**
+ * @leaf:	leaf holding the next element to return
+ * @idx:	index of the next element in @leaf
+ * @tid:	last seen tree transaction
+ * @checkpoint:	last returned key, for repositioning after modifications
+ * @started:	whether any element has been returned yet
+ */
+struct HXbptrav {
+	struct HXmap_trav super;
+	const struct HXbptree *tree;
+	const struct HXbpleaf *leaf;
+	unsigned int idx, tid; /* gap before leaf->elem[idx] */
+	void *checkpoint;
+	/*
+	 * @at_elem: elem[idx-1] was the last one returned;
+	 * @after: the gap sits after @checkpoint rather than before it;
+	 * @owned: @checkpoint is a k_clone copy
+	 */
+	bool started, at_elem, after, owned;
 };
 
 struct HXrbtrav {
@@ -116,10 +483,70 @@ struct HXrbtrav {
 	struct HXrbnode *path[RBT_MAXDEP]; /* stored path */
 	unsigned char dir[RBT_MAXDEP];
 	unsigned char depth;
+	/*
+	 * @gap: @current was positioned by a seek and is yet to be returned;
+	 * @at_end: traversal has moved past the last element;
+	 * @tracked: on @tree->travs, so @current is never stale
+	 */
+	bool gap, at_end, tracked;
+	struct HXlist_head anchor;
+};
+
+/* Any traverser that can sit below an %HXMAPT_RCU one */
+union HXmap_subtrav {
+	struct HXmap_trav super;
+	struct HXumap_trav hash;
+	struct HXfmap_trav flat;
+	struct HXrbtrav rbtree;
+	struct HXbptrav btree;
+};
+
+/**
+ * @sub:	traverser of the snapshot
+ * @token:	read-side section the traverser is holding
+ */
+struct HXrmap_trav {
+	struct HXmap_trav super;
+	const struct HXrmap *rmap;
+	unsigned int token;
+	union HXmap_subtrav sub;
 };
 
 typedef bool (*qfe_fn_t)(const struct HXmap_node *, void *);
 
+enum {
+	/* Spans HXmap_qfe_parallel aims to cut per thread, for balance */
+	HXQFE_SPANS_PER_THREAD = 8,
+	/* Fewest buckets, slots or frozen elements in a span */
+	HXQFE_MIN_SPAN = 64,
+};
+
+/**
+ * A share of the work of HXmap_qfe_parallel.
+ * @ptr:	hash map, flat map or frozen map whose buckets, slots or
+ * 		elements [@begin,@end) to visit; RB-tree node; first B+tree leaf
+ * @stop:	B+tree leaf following the span, %NULL for the last one
+ * @begin:	for RB-trees, 1 to visit the subtree below @ptr, 0 for @ptr only
+ */
+struct HXqfe_span {
+	const void *ptr, *stop;
+	size_t begin, end;
+};
+
+/**
+ * @span:	work shares, taken in order by the threads
+ * @next:	index of the next span to take
+ * @stop:	set once @fn has returned false
+ */
+struct HXqfe_job {
+	enum HXmap_type type;
+	qfe_fn_t fn;
+	void *arg;
+	struct HXqfe_span *span;
+	size_t nspans, alloc, next;
+	bool stop;
+};
+
 extern const unsigned int HXhash_primes[];
 
 #ifdef __cplusplus
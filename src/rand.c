@@ -74,6 +74,26 @@ static void HXrand_init(void)
 	srand(seed);
 }
 
+/**
+ * HXrand_seed64 - obtain 64 bits of unpredictable seed material
+ *
+ * Unlike HX_rand, this does not depend on HX_init having been called.
+ */
+uint64_t HXrand_seed64(void)
+{
+	uint64_t seed;
+	int fd, ret = 0;
+
+	if ((fd = open("/dev/urandom", O_RDONLY | O_BINARY)) >= 0) {
+		ret = read(fd, &seed, sizeof(seed));
+		close(fd);
+	}
+	if (ret != sizeof(seed))
+		seed = (static_cast(uint64_t, HXrand_obtain_seed()) << 32) ^
+		       reinterpret_cast(uintptr_t, &seed) ^ clock();
+	return seed;
+}
+
 static pthread_mutex_t HX_init_lock = PTHREAD_MUTEX_INITIALIZER;
 static unsigned long HX_use_count;
 
@@ -2,12 +2,14 @@
 #include "config.h"
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 #include <libHX/init.h>
 #include <libHX/map.h>
 #include <libHX/misc.h>
@@ -455,6 +457,57 @@ static void tmap_hmap_test_1a(const char *map_type,
 	HXmap_free(u.map);
 }
 
+/**
+ * tmap_hash_test - known answers and input-alignment independence of the
+ * wide-load hash functions
+ */
+static int tmap_hash_test(void)
+{
+	static const char check[] = "123456789";
+	unsigned char buf[256+8];
+	unsigned long crc, wy[257];
+	unsigned int len, off, i;
+
+	tmap_printf("Hash function test\n");
+	if (HXhash_crc32c(check, 9) != 0xE3069283UL ||
+	    HXhash_crc32cs(check, 0) != 0xE3069283UL ||
+	    HXhash_crc32c_seed(check + 4, 5, HXhash_crc32c(check, 4)) !=
+	    0xE3069283UL) {
+		tmap_printf("CRC-32C check value mismatch\n");
+		return EXIT_FAILURE;
+	}
+	if (HXhash_wys(check, 0) != HXhash_wy(check, 9) ||
+	    HXhash_wy_seed(check, 9, 1) == HXhash_wy(check, 9)) {
+		tmap_printf("Seeded/string hash variants inconsistent\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < sizeof(buf); ++i)
+		buf[i] = i * 131 + 7;
+	for (len = 0; len <= 256; ++len) {
+		/* Bytewise chaining takes the short path of the CRC loop */
+		crc = 0;
+		for (i = 0; i < len; ++i)
+			crc = HXhash_crc32c_seed(&buf[i], 1, crc);
+		wy[len] = HXhash_wy(buf, len);
+		for (off = 1; off < 8; ++off) {
+			memmove(buf + off, buf, len);
+			if (HXhash_crc32c(buf + off, len) != crc ||
+			    HXhash_wy(buf + off, len) != wy[len]) {
+				tmap_printf("Hash differs at length %u offset %u\n",
+					len, off);
+				return EXIT_FAILURE;
+			}
+			memmove(buf, buf + off, len);
+		}
+		for (i = 0; i < len; ++i)
+			if (wy[i] == wy[len]) {
+				tmap_printf("Prefix collision %u/%u\n", i, len);
+				return EXIT_FAILURE;
+			}
+	}
+	return EXIT_SUCCESS;
+}
+
 /**
  * tmap_hmap_test_1 - test distributedness of elements
  */
@@ -466,6 +519,8 @@ static void tmap_hmap_test_1(void)
 	tmap_ipush();
 	tmap_hmap_test_1a("DJB2", HXhash_djb2, max_power);
 	tmap_hmap_test_1a("JL3", HXhash_jlookup3s, max_power);
+	tmap_hmap_test_1a("WY", HXhash_wys, max_power);
+	tmap_hmap_test_1a("CRC32C", HXhash_crc32cs, max_power);
 	tmap_ipop();
 }
 
@@ -714,35 +769,2511 @@ static void tmap_rbt_test_7(void)
 	HXmap_free(u.map);
 }
 
-static void tmap_zero(void)
+/**
+ * tmap_rbt_build_test - bulk construction from sorted input
+ */
+static int tmap_rbt_build_test(void)
 {
-	struct HXmap *b;
+	static const size_t sizes[] = {0, 1, 2, 3, 4, 7, 8, 100, 1000, 65537};
+	struct HXmap_node *nodes;
+	const struct HXmap_node *node;
+	struct HXmap_trav *iter;
+	unsigned int s;
+	union HXpoly u;
+	uintptr_t i;
+	int ret = EXIT_FAILURE;
 
-	b = HXmap_init(HXMAPT_DEFAULT, HXMAP_CKEY | HXMAP_CDATA);
-	if (b != NULL)
-		fprintf(stderr, "eek!\n");
-	b = HXmap_init(HXMAPT_DEFAULT, HXMAP_CKEY);
-	if (b != NULL)
-		fprintf(stderr, "eek!\n");
+	tmap_printf("RBT build test\n");
+	nodes = calloc(65537, sizeof(*nodes));
+	if (nodes == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < 65537; ++i)
+		nodes[i].key = nodes[i].data = reinterpret_cast(void *, 2 * i + 1);
+	for (s = 0; s < ARRAY_SIZE(sizes); ++s) {
+		u.map = HXmap_init(HXMAPT_RBTREE, HXMAP_NONE);
+		if (u.map == NULL)
+			goto out;
+		if (HXmap_build_sorted(u.map, nodes, sizes[s]) <= 0 ||
+		    u.map->items != sizes[s] ||
+		    (u.rbt->root != NULL && !rbt_verify_tree(u.rbt->root))) {
+			tmap_printf("Build of %zu elements failed\n", sizes[s]);
+			HXmap_free(u.map);
+			goto out;
+		}
+		i = 0;
+		iter = HXmap_travinit(u.map, HXMAP_NOFLAGS);
+		while ((node = HXmap_traverse(iter)) != NULL)
+			if (node->key != nodes[i++].key)
+				break;
+		HXmap_travfree(iter);
+		/* The tree must remain fully functional. */
+		if (node != NULL || i != sizes[s] ||
+		    HXmap_add(u.map, reinterpret_cast(void *, 2), NULL) <= 0 ||
+		    (sizes[s] > 0 && HXmap_del(u.map, nodes[0].key) == NULL) ||
+		    (u.rbt->root != NULL && !rbt_verify_tree(u.rbt->root))) {
+			tmap_printf("Tree of %zu elements inconsistent\n",
+				sizes[s]);
+			HXmap_free(u.map);
+			goto out;
+		}
+		HXmap_free(u.map);
+	}
+
+	/* Unsorted input and non-empty maps are rejected */
+	u.map = HXmap_init(HXMAPT_RBTREE, HXMAP_NONE);
+	if (u.map == NULL)
+		goto out;
+	if (HXmap_build_sorted(u.map, &nodes[1], 1) <= 0 ||
+	    HXmap_build_sorted(u.map, nodes, 2) != -EINVAL) {
+		HXmap_free(u.map);
+		goto out;
+	}
+	HXmap_free(u.map);
+	nodes[1].key = nodes[0].key;
+	u.map = HXmap_init(HXMAPT_HASH, HXMAP_NONE);
+	if (u.map == NULL)
+		goto out;
+	ret = HXmap_build_sorted(u.map, nodes, 3) == -EINVAL &&
+	      u.map->items == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	HXmap_free(u.map);
+ out:
+	free(nodes);
+	return ret;
 }
 
-static int runner(void)
+static const void *bpt_leftmost(const struct HXbpnode *node)
 {
-	if (HX_init() <= 0)
+	while (!node->leaf)
+		node = static_cast(const struct HXbpinner *,
+		       static_cast(const void *, node))->child[0];
+	return static_cast(const struct HXbpleaf *,
+	       static_cast(const void *, node))->elem[0].key;
+}
+
+/**
+ * bpt_verify_node - check B+tree structure below @node
+ * @depth:	number of inner levels still expected below @node
+ */
+static bool bpt_verify_node(const struct HXbpnode *node, unsigned int depth,
+    bool root)
+{
+	const struct HXbpinner *in = static_cast(const void *, node);
+	const struct HXbpleaf *leaf = static_cast(const void *, node);
+	unsigned int i;
+
+	if (node->leaf != (depth == 0))
+		return false;
+	if (node->leaf) {
+		if (node->count > HXBPT_LEAF_MAX ||
+		    (!root && node->count < HXBPT_LEAF_MIN))
+			return false;
+		for (i = 1; i < node->count; ++i)
+			if (leaf->elem[i-1].key >= leaf->elem[i].key)
+				return false;
+		return true;
+	}
+	if (node->count > HXBPT_INNER_MAX || node->count < 2 ||
+	    (!root && node->count < HXBPT_INNER_MIN))
+		return false;
+	for (i = 0; i < node->count; ++i) {
+		if (i > 0 && in->key[i-1] != bpt_leftmost(in->child[i]))
+			return false;
+		if (!bpt_verify_node(in->child[i], depth - 1, false))
+			return false;
+	}
+	return true;
+}
+
+static bool bpt_verify_tree(const struct HXbptree *bt)
+{
+	const struct HXbpleaf *leaf, *prev = NULL;
+	size_t n = 0;
+
+	if (bt->root == NULL)
+		return bt->super.items == 0 && bt->first == NULL;
+	if (!bpt_verify_node(bt->root, bt->height, true))
+		return false;
+	for (leaf = bt->first; leaf != NULL; prev = leaf, leaf = leaf->next) {
+		if (leaf->prev != prev || (prev != NULL &&
+		    prev->elem[prev->hdr.count-1].key >= leaf->elem[0].key))
+			return false;
+		n += leaf->hdr.count;
+	}
+	return prev == bt->last && n == bt->super.items;
+}
+
+/**
+ * tmap_bpt_test_1 - random insertions and deletions with full verification
+ */
+static int tmap_bpt_test_1(void)
+{
+	static const unsigned int elems = 20000;
+	unsigned char *present;
+	const struct HXmap_node *node;
+	struct HXmap_trav *iter;
+	struct HXbptree *bt;
+	struct HXmap *map;
+	unsigned int i, k, n = 0;
+	uintptr_t prev = 0;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("BPT test 1: random modification\n");
+	map = HXmap_init(HXMAPT_BTREE, HXMAP_NONE);
+	present = calloc(elems, 1);
+	if (map == NULL || present == NULL)
+		goto out;
+	bt = static_cast(void *, map);
+	for (i = 0; i < 8 * elems; ++i) {
+		k = 1 + HX_irand(0, elems - 1);
+		if (i >= 4 * elems || HX_irand(0, 3) == 0) {
+			if ((HXmap_del(map, reinterpret_cast(void *,
+			    static_cast(uintptr_t, k))) != NULL) != present[k-1])
+				goto out;
+			n -= present[k-1];
+			present[k-1] = 0;
+		} else {
+			ret = HXmap_add(map, reinterpret_cast(void *,
+			      static_cast(uintptr_t, k)), reinterpret_cast(void *,
+			      static_cast(uintptr_t, k)));
+			if (ret <= 0) {
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+			ret = EXIT_FAILURE;
+			n += !present[k-1];
+			present[k-1] = 1;
+		}
+		if ((i % 997 == 0 && !bpt_verify_tree(bt)) || map->items != n) {
+			tmap_printf("Verification failed after %u steps\n", i);
+			goto out;
+		}
+		if (i == 4 * elems - 1) {
+			tmap_printf("%zu elements, height %u\n",
+				map->items, bt->height);
+			iter = HXmap_travinit(map, HXMAP_NOFLAGS);
+			while ((node = HXmap_traverse(iter)) != NULL) {
+				if (reinterpret_cast(uintptr_t, node->key) <= prev)
+					break;
+				prev = reinterpret_cast(uintptr_t, node->key);
+				--n;
+			}
+			HXmap_travfree(iter);
+			if (node != NULL || n != 0)
+				goto out;
+			n = map->items;
+		}
+	}
+	if (bpt_verify_tree(bt))
+		ret = EXIT_SUCCESS;
+ out:
+	free(present);
+	HXmap_free(map);
+	return ret;
+}
+
+static uintptr_t tmap_nkey(const struct HXmap_node *node)
+{
+	return node != NULL ? reinterpret_cast(uintptr_t, node->key) : 0;
+}
+
+/**
+ * tmap_seek_test - cursor positioning and bidirectional stepping on
+ * ordered maps; keys are the even numbers 2..2*elems
+ */
+static int tmap_seek_test(enum HXmap_type type, unsigned int mflags)
+{
+	static const uintptr_t elems = 1000;
+	struct HXmap_trav *iter = NULL;
+	struct HXmap *map;
+	uintptr_t i, k, want;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Seek test (type %u, flags %#x)\n", type, mflags);
+	map = HXmap_init(type, mflags);
+	if (map == NULL)
 		return EXIT_FAILURE;
-	tmap_zero();
+	for (i = elems; i > 0; --i)
+		if (HXmap_add(map, reinterpret_cast(void *, 2 * i),
+		    reinterpret_cast(void *, 2 * i)) <= 0)
+			goto out;
+	iter = HXmap_travinit(map, HXMAP_DTRAV);
+	if (iter == NULL)
+		goto out;
+
+	/* Fresh traverser: nothing before the start */
+	if (HXmap_traverse_prev(iter) != NULL ||
+	    tmap_nkey(HXmap_traverse(iter)) != 2)
+		goto out;
+
+	/* Random lower/upper bound lookups */
+	for (i = 0; i < 5000; ++i) {
+		unsigned int flags = HX_irand(0, 2) ? HXMAP_SEEK_GT : HXMAP_SEEK_GE;
+
+		k = HX_irand(0, 2 * elems + 3);
+		want = (flags & HXMAP_SEEK_GT) ? (k | 1) + 1 : (k + 1) & ~1;
+		if (want < 2)
+			want = 2;
+		else if (want > 2 * elems)
+			want = 2 * elems + 2;
+		if (HXmap_travseek(iter, reinterpret_cast(void *, k),
+		    flags) != (want <= 2 * elems))
+			goto fail;
+		if (HX_irand(0, 2)) {
+			if (tmap_nkey(HXmap_traverse(iter)) !=
+			    (want <= 2 * elems ? want : 0))
+				goto fail;
+		} else if (tmap_nkey(HXmap_traverse_prev(iter)) != want - 2) {
+			goto fail;
+		}
+	}
 
-	tmap_printf("* HXhashmap\n");
-	int ret = tmap_generic_tests(HXMAPT_HASH, HXhash_djb2, "DJB2");
-	if (ret != EXIT_SUCCESS)
-		return ret;
-	tmap_generic_tests(HXMAPT_HASH, HXhash_jlookup3s, "JL3");
-	tmap_hmap_test_1();
+	/* Backward range scan from the middle to the front, then turn */
+	HXmap_travseek(iter, reinterpret_cast(void *, elems), HXMAP_SEEK_GT);
+	for (k = elems & ~1; k >= 2; k -= 2)
+		if (tmap_nkey(HXmap_traverse_prev(iter)) != k)
+			goto fail;
+	if (HXmap_traverse_prev(iter) != NULL ||
+	    tmap_nkey(HXmap_traverse(iter)) != 2 ||
+	    tmap_nkey(HXmap_traverse(iter)) != 4 ||
+	    tmap_nkey(HXmap_traverse_prev(iter)) != 2)
+		goto fail;
+
+	/* Past the end and back */
+	if (HXmap_travseek(iter, reinterpret_cast(void *, 2 * elems),
+	    HXMAP_SEEK_GT) != 0 || HXmap_traverse(iter) != NULL ||
+	    tmap_nkey(HXmap_traverse_prev(iter)) != 2 * elems ||
+	    HXmap_traverse(iter) != NULL ||
+	    tmap_nkey(HXmap_traverse_prev(iter)) != 2 * elems)
+		goto fail;
+
+	/* Deleting the current element and its neighbours */
+	HXmap_travseek(iter, reinterpret_cast(void *, 600), HXMAP_SEEK_GE);
+	if (tmap_nkey(HXmap_traverse(iter)) != 600)
+		goto fail;
+	for (k = 596; k <= 604; k += 2)
+		if (k != 598 && HXmap_del(map, reinterpret_cast(void *, k)) == NULL)
+			goto fail;
+	if (tmap_nkey(HXmap_traverse_prev(iter)) != 598 ||
+	    tmap_nkey(HXmap_traverse(iter)) != 606)
+		goto fail;
+	HXmap_travseek(iter, reinterpret_cast(void *, 606), HXMAP_SEEK_GE);
+	HXmap_del(map, reinterpret_cast(void *, 606));
+	if (tmap_nkey(HXmap_traverse(iter)) != 608)
+		goto fail;
+
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Seek test failed\n");
+ out:
+	HXmap_travfree(iter);
+	HXmap_free(map);
+	return ret;
+}
 
-	tmap_printf("\n* RBtree\n");
-	tmap_generic_tests(HXMAPT_RBTREE, NULL, "<NONE>");
-	tmap_rbt_test_1();
-	tmap_rbt_test_7();
+/**
+ * tmap_bpt_seek_test - the seek key of a B+tree traverser may go away
+ * right after HXmap_travseek, even when the tree changes before the next
+ * step
+ */
+static int tmap_bpt_seek_test(unsigned int tflags)
+{
+	const struct HXmap_node *node;
+	struct HXmap_trav *iter;
+	struct HXmap *map;
+	char key[HXSIZEOF_Z32];
+	unsigned int i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("B+tree seek key lifetime (flags %#x)\n", tflags);
+	map = HXmap_init(HXMAPT_BTREE, HXMAP_SCKEY);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < 1000; i += 2) {
+		snprintf(key, sizeof(key), "%06u", i);
+		HXmap_add(map, key, NULL);
+	}
+	iter = HXmap_travinit(map, tflags);
+	if (iter == NULL)
+		goto out;
+	snprintf(key, sizeof(key), "%06u", 501);
+	HXmap_travseek(iter, key, HXMAP_SEEK_GE);
+	/* Reuses @key, and splits leaves, so the traverser must search again */
+	for (i = 1; i < 1000; i += 2) {
+		snprintf(key, sizeof(key), "%06u", i);
+		HXmap_add(map, key, NULL);
+	}
+	node = HXmap_traverse(iter);
+	if (node == NULL || strcmp(node->skey, "000501") != 0) {
+		tmap_printf("Traverser lost its position\n");
+		goto out;
+	}
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_travfree(iter);
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_rbt_thread_check - compare the in-order links against the tree
+ */
+static bool tmap_rbt_thread_check(struct HXmap *map)
+{
+	const struct HXmap_node *node;
+	struct HXmap_trav *iter;
+	uintptr_t prev = 0, seen = 0;
+
+	iter = HXmap_travinit(map, HXMAP_NOFLAGS);
+	if (iter == NULL)
+		return false;
+	while ((node = HXmap_traverse(iter)) != NULL) {
+		if (tmap_nkey(node) <= prev) {
+			HXmap_travfree(iter);
+			return false;
+		}
+		prev = tmap_nkey(node);
+		++seen;
+	}
+	/* and back again */
+	prev = UINTPTR_MAX;
+	while ((node = HXmap_traverse_prev(iter)) != NULL) {
+		if (tmap_nkey(node) >= prev)
+			break;
+		prev = tmap_nkey(node);
+		--seen;
+	}
+	HXmap_travfree(iter);
+	return seen == 0 && (map->items == 0 ||
+	       rbt_verify_tree(static_cast(struct HXrbtree *,
+	       static_cast(void *, map))->root));
+}
+
+/**
+ * tmap_rbt_thread_test - deletion sweeps over an %HXMAP_THREADED tree
+ */
+static int tmap_rbt_thread_test(unsigned int flags)
+{
+	static const uintptr_t elems = 2000;
+	struct HXmap_node nodes[100];
+	struct HXmap_trav *iter = NULL, *other = NULL;
+	const struct HXmap_node *node;
+	struct HXmap *map;
+	uintptr_t i, k, seen = 0;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("RBT threading test (flags %#x)\n", flags);
+	map = HXmap_init(HXMAPT_RBTREE, flags);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < elems; ++i) {
+		k = HX_irand(1, 4 * elems);
+		if (HX_irand(0, 3) == 0)
+			HXmap_del(map, reinterpret_cast(void *, k));
+		else
+			HXmap_add(map, reinterpret_cast(void *, k), NULL);
+	}
+	if (!tmap_rbt_thread_check(map))
+		goto fail;
+
+	/* Expire every other element while walking, with a second walker */
+	iter  = HXmap_travinit(map, HXMAP_DTRAV);
+	other = HXmap_travinit(map, HXMAP_DTRAV);
+	if (iter == NULL || other == NULL)
+		goto out;
+	k = tmap_nkey(HXmap_traverse(other));
+	while ((node = HXmap_traverse(iter)) != NULL)
+		if (seen++ % 2 == 0)
+			HXmap_del(map, node->key);
+	if (map->items != seen / 2 || !tmap_rbt_thread_check(map) ||
+	    tmap_nkey(HXmap_traverse(other)) <= k)
+		goto fail;
+
+	/* Drain the map from the back */
+	HXmap_travfree(iter);
+	iter = HXmap_travinit(map, HXMAP_DTRAV);
+	if (iter == NULL)
+		goto out;
+	while (HXmap_traverse(iter) != NULL)
+		/* nothing */;
+	while ((node = HXmap_traverse_prev(iter)) != NULL)
+		HXmap_del(map, node->key);
+	if (map->items != 0 || HXmap_traverse(iter) != NULL ||
+	    HXmap_traverse(other) != NULL)
+		goto fail;
+
+	/* Links must also be set up by bulk construction */
+	for (i = 0; i < ARRAY_SIZE(nodes); ++i) {
+		nodes[i].key  = reinterpret_cast(void *, 2 * i + 2);
+		nodes[i].data = NULL;
+	}
+	HXmap_travfree(iter);
+	iter = NULL;
+	if (HXmap_build_sorted(map, nodes, ARRAY_SIZE(nodes)) <= 0 ||
+	    !tmap_rbt_thread_check(map))
+		goto fail;
+	for (i = 1; i <= 2 * ARRAY_SIZE(nodes) + 1; i += 2)
+		HXmap_add(map, reinterpret_cast(void *, i), NULL);
+	if (map->items != 2 * ARRAY_SIZE(nodes) + 1 ||
+	    !tmap_rbt_thread_check(map))
+		goto fail;
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Threading test failed\n");
+ out:
+	HXmap_travfree(other);
+	HXmap_travfree(iter);
+	HXmap_free(map);
+	return ret;
+}
+
+static void *tmap_rbt_reader(void *varg)
+{
+	const struct HXmap *map = varg;
+	struct HXmap_trav *iter;
+	unsigned int i;
+
+	for (i = 0; i < 2000; ++i) {
+		iter = HXmap_travinit(map, HXMAP_DTRAV);
+		if (iter == NULL)
+			return varg;
+		HXmap_traverse(iter);
+		HXmap_travfree(iter);
+	}
+	return NULL;
+}
+
+/**
+ * tmap_rbt_reader_test - readers concurrently setting up DTRAV traversers
+ * on an %HXMAP_THREADED tree
+ */
+static int tmap_rbt_reader_test(void)
+{
+	pthread_t tid[4];
+	struct HXmap *map;
+	void *result;
+	uintptr_t i;
+	unsigned int n, errors = 0;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("RBT concurrent DTRAV traversers\n");
+	map = HXmap_init(HXMAPT_RBTREE, HXMAP_THREADED);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 1; i <= 100; ++i)
+		HXmap_add(map, reinterpret_cast(const void *, i), NULL);
+	for (n = 0; n < ARRAY_SIZE(tid); ++n)
+		if (pthread_create(&tid[n], NULL, tmap_rbt_reader, map) != 0)
+			break;
+	while (n-- > 0) {
+		pthread_join(tid[n], &result);
+		if (result != NULL)
+			++errors;
+	}
+	if (errors == 0 && HXlist_empty(&static_cast(struct HXrbtree *,
+	    static_cast(void *, map))->travs))
+		ret = EXIT_SUCCESS;
+	else
+		tmap_printf("Traverser list damaged\n");
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_fmap_test_1 - check that the flat hash survives growth, tombstones
+ * and shrinking without losing elements
+ */
+static int tmap_fmap_test_1(void)
+{
+	static const uintptr_t elems = 50000;
+	struct HXmap *map;
+	uintptr_t i;
+
+	tmap_printf("FMAP test 1: Insertion, deletion and lookup\n");
+	map = HXmap_init(HXMAPT_FLATHASH, HXMAP_NONE);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 1; i <= elems; ++i)
+		HXmap_add(map, reinterpret_cast(const void *, i),
+			reinterpret_cast(const void *, ~i));
+	for (i = 1; i <= elems; i += 2)
+		HXmap_del(map, reinterpret_cast(const void *, i));
+	for (i = 1; i <= elems; ++i) {
+		const struct HXmap_node *node =
+			HXmap_find(map, reinterpret_cast(const void *, i));
+		if ((node != NULL) != !(i & 1) ||
+		    (node != NULL && node->data !=
+		    reinterpret_cast(const void *, ~i))) {
+			tmap_printf("Element %zu is broken\n",
+				static_cast(size_t, i));
+			HXmap_free(map);
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 2; i <= elems; i += 2)
+		HXmap_del(map, reinterpret_cast(const void *, i));
+	if (map->items != 0) {
+		tmap_printf("%zu elements left over\n", map->items);
+		HXmap_free(map);
+		return EXIT_FAILURE;
+	}
+	HXmap_free(map);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * tmap_fmap_test_2 - tombstones from churn are cleared in place, without
+ * growing; a DTRAV traverser sees each element once while they are deleted
+ */
+static int tmap_fmap_test_2(void)
+{
+	static const uintptr_t elems = 50000, live = 100;
+	const struct HXmap_node *node;
+	struct HXmap_trav *trav;
+	struct HXmap_stats st;
+	struct HXmap *map;
+	size_t buckets, seen = 0;
+	uintptr_t i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("FMAP test 2: Tombstones and DTRAV\n");
+	map = HXmap_init(HXMAPT_FLATHASH, HXMAP_NONE);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 1; i <= live; ++i)
+		HXmap_add(map, reinterpret_cast(const void *, i), NULL);
+	/* One growth may be needed to make room for tombstones. */
+	for (; i <= 4 * live; ++i) {
+		HXmap_add(map, reinterpret_cast(const void *, i), NULL);
+		HXmap_del(map, reinterpret_cast(const void *, i - live));
+	}
+	if (HXmap_stats(map, &st) <= 0)
+		goto out;
+	buckets = st.buckets;
+	for (; i <= elems; ++i) {
+		HXmap_add(map, reinterpret_cast(const void *, i), NULL);
+		HXmap_del(map, reinterpret_cast(const void *, i - live));
+	}
+	if (HXmap_stats(map, &st) <= 0 || st.buckets != buckets ||
+	    st.relayouts == 0) {
+		tmap_printf("Table size %zu, was %zu\n", st.buckets, buckets);
+		goto out;
+	}
+
+	for (i = 1; i <= elems; ++i)
+		HXmap_add(map, reinterpret_cast(const void *, i), NULL);
+	trav = HXmap_travinit(map, HXMAP_DTRAV);
+	if (trav == NULL)
+		goto out;
+	while ((node = HXmap_traverse(trav)) != NULL) {
+		HXmap_del(map, node->key);
+		++seen;
+	}
+	HXmap_travfree(trav);
+	if (seen != elems || map->items != 0) {
+		tmap_printf("Saw %zu elements, %zu left\n", seen, map->items);
+		goto out;
+	}
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_hmap_test_2 - check lookups while an incremental relayout is
+ * in progress
+ */
+static int tmap_hmap_test_2(void)
+{
+	static const uintptr_t elems = 20000;
+	const struct HXmap_node *node;
+	struct HXmap_trav *iter;
+	union HXpoly u;
+	uintptr_t i, j;
+	size_t seen = 0;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("HMAP test 2: Incremental relayout\n");
+	u.map = HXmap_init(HXMAPT_HASH, HXMAP_INCREMENTAL);
+	if (u.map == NULL)
+		return EXIT_FAILURE;
+	for (i = 1; i <= elems; ++i) {
+		HXmap_add(u.map, reinterpret_cast(const void *, i), NULL);
+		/* Probe a few random earlier elements */
+		for (j = 0; j < 4; ++j) {
+			uintptr_t k = HX_irand(1, i + 1);
+			if (HXmap_find(u.map,
+			    reinterpret_cast(const void *, k)) == NULL) {
+				tmap_printf("Element %zu lost after %zu adds\n",
+					static_cast(size_t, k),
+					static_cast(size_t, i));
+				goto out;
+			}
+		}
+		if (i == elems / 2 && u.hmap->old_array == NULL)
+			/* 10000 is not right after a resize threshold */
+			tmap_printf("Note: no relayout in flight\n");
+	}
+	iter = HXmap_travinit(u.map, HXMAP_NOFLAGS);
+	while ((node = HXmap_traverse(iter)) != NULL)
+		++seen;
+	HXmap_travfree(iter);
+	if (seen != elems) {
+		tmap_printf("Traversal saw %zu of %zu elements\n", seen,
+			static_cast(size_t, elems));
+		goto out;
+	}
+	for (i = 1; i <= elems; ++i)
+		HXmap_del(u.map, reinterpret_cast(const void *, i));
+	if (u.map->items != 0) {
+		tmap_printf("%zu elements left over\n", u.map->items);
+		goto out;
+	}
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(u.map);
+	return ret;
+}
+
+/**
+ * tmap_hmap_test_4 - no relayout may start while one is in flight, and
+ * lookups alone must complete the migration
+ */
+static int tmap_hmap_test_4(void)
+{
+	const struct HXmap_params params = {.max_load = 100, .min_load = 45};
+	struct HXmap_trav *iter;
+	union HXpoly u;
+	unsigned long relayouts;
+	unsigned int mig_idx, steps;
+	uintptr_t i, lo = 1, hi = 0;
+	bool busy;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("HMAP test 4: Overlapping relayouts\n");
+	u.map = HXmap_init6(HXMAPT_HASH, HXMAP_INCREMENTAL, NULL, 0, 0,
+	        &params);
+	if (u.map == NULL)
+		return EXIT_FAILURE;
+	/* Grow, then shrink right away, a few times over */
+	for (i = 0; i < 60000; ++i) {
+		/* Far from done, so the op cannot complete the migration */
+		busy = u.hmap->old_array != NULL && u.hmap->mig_idx + 64 <
+		       u.hmap->bk_sizes[u.hmap->old_power];
+		relayouts = u.hmap->relayouts;
+		if (i % 10000 < 6000)
+			HXmap_add(u.map, reinterpret_cast(const void *, ++hi),
+				NULL);
+		else
+			HXmap_del(u.map, reinterpret_cast(const void *, lo++));
+		if (busy && u.hmap->relayouts != relayouts) {
+			tmap_printf("Relayout started during migration\n");
+			goto out;
+		}
+	}
+	for (i = lo; i <= hi; ++i)
+		if (HXmap_find(u.map, reinterpret_cast(const void *, i)) ==
+		    NULL) {
+			tmap_printf("Element %zu lost\n",
+				static_cast(size_t, i));
+			goto out;
+		}
+
+	while (u.hmap->old_array == NULL)
+		HXmap_add(u.map, reinterpret_cast(const void *, ++hi), NULL);
+	mig_idx = u.hmap->mig_idx;
+	iter = HXmap_travinit(u.map, HXMAP_NOFLAGS);
+	HXmap_find(u.map, reinterpret_cast(const void *, hi));
+	HXmap_travfree(iter);
+	if (u.hmap->mig_idx != mig_idx) {
+		tmap_printf("Lookup migrated during traversal\n");
+		goto out;
+	}
+	/* Each lookup moves at least one bucket */
+	steps = u.hmap->bk_sizes[u.hmap->old_power] - mig_idx;
+	while (steps-- > 0)
+		HXmap_find(u.map, reinterpret_cast(const void *, hi));
+	if (u.hmap->old_array != NULL) {
+		tmap_printf("Lookups did not finish the migration\n");
+		goto out;
+	}
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(u.map);
+	return ret;
+}
+
+static size_t tmap_table_size(union HXpoly u, enum HXmap_type type)
+{
+	if (type == HXMAPT_HASH)
+		return HXhash_primes[u.hmap->power];
+	return reinterpret_cast(const struct HXfmap *, u.map)->capacity;
+}
+
+/**
+ * tmap_reseed_test - keys colliding under the caller-chosen seed must make
+ * the map switch seeds, and all elements must survive the rehash
+ */
+static int tmap_reseed_test(void)
+{
+	static const unsigned int nkeys = 64;
+	const struct HXmap_params params = {.expected = 1000, .seed = 0x1234};
+	const struct HXlist_head *bk, *pos;
+	unsigned int i, n, chain, max_chain = 0, prime;
+	char keys[64][16];
+	union HXpoly u;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Reseed test\n");
+	u.map = HXmap_init6(HXMAPT_HASH, HXMAP_SCKEY | HXMAP_NOSHRINK, NULL,
+	        0, 0, &params);
+	if (u.map == NULL)
+		return EXIT_FAILURE;
+	if (u.hmap->super.seed != params.seed)
+		goto out;
+	/* Find keys that all land in bucket 0 for the chosen seed */
+	prime = HXhash_primes[u.hmap->power];
+	for (i = n = 0; n < nkeys; ++i) {
+		snprintf(keys[n], sizeof(keys[n]), "k%u", i);
+		if (HXhash_wy_seed(keys[n], strlen(keys[n]), params.seed) %
+		    prime == 0)
+			++n;
+	}
+	for (i = 0; i < nkeys; ++i)
+		if (HXmap_add(u.map, keys[i], NULL) <= 0)
+			goto out;
+	if (u.hmap->super.seed == params.seed) {
+		tmap_printf("Map was not reseeded\n");
+		goto out;
+	}
+	for (i = 0; i < HXhash_primes[u.hmap->power]; ++i) {
+		bk = &u.hmap->bk_array[i];
+		chain = 0;
+		for (pos = bk->next; pos != bk; pos = pos->next)
+			++chain;
+		if (chain > max_chain)
+			max_chain = chain;
+	}
+	tmap_printf("Longest chain after reseed: %u\n", max_chain);
+	if (max_chain > nkeys / 2 || u.map->items != nkeys)
+		goto out;
+	for (i = 0; i < nkeys; ++i)
+		if (HXmap_find(u.map, keys[i]) == NULL)
+			goto out;
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(u.map);
+	return ret;
+}
+
+static unsigned long tmap_identity_hash(const void *key, size_t size)
+{
+	return reinterpret_cast(uintptr_t, key);
+}
+
+/**
+ * tmap_bkmode_test - exercise the division-free bucket index modes, with
+ * keys whose low bits are all zero and an identity hash function
+ */
+static int tmap_bkmode_test(unsigned int flags)
+{
+	static const uintptr_t elems = 5000;
+	static const struct HXmap_ops ops = {.k_hash = tmap_identity_hash};
+	const struct HXlist_head *bk, *pos;
+	unsigned int i, chain, max_chain = 0, size;
+	union HXpoly u;
+	uintptr_t k;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Bucket index test (%s)\n",
+		flags & HXMAP_POW2 ? "pow2" : "fastrange");
+	u.map = HXmap_init5(HXMAPT_HASH, flags | HXMAP_INCREMENTAL, &ops, 0, 0);
+	if (u.map == NULL)
+		return EXIT_FAILURE;
+	for (k = 1; k <= elems; ++k)
+		if (HXmap_add(u.map, reinterpret_cast(const void *, k << 12),
+		    reinterpret_cast(const void *, k)) <= 0)
+			goto out;
+	for (k = 1; k <= elems; ++k)
+		if (HXmap_find(u.map,
+		    reinterpret_cast(const void *, k << 12)) == NULL)
+			goto out;
+	/* Drain the relayout still in flight by a delete/add round */
+	while (u.hmap->old_array != NULL) {
+		HXmap_del(u.map, reinterpret_cast(const void *, elems << 12));
+		HXmap_add(u.map, reinterpret_cast(const void *, elems << 12),
+			reinterpret_cast(const void *, elems));
+	}
+	size = u.hmap->bk_sizes[u.hmap->power];
+	if ((flags & HXMAP_POW2) && (size & (size - 1)) != 0) {
+		tmap_printf("Table size %u is not a power of two\n", size);
+		goto out;
+	}
+	for (i = 0; i < size; ++i) {
+		bk = &u.hmap->bk_array[i];
+		chain = 0;
+		for (pos = bk->next; pos != bk; pos = pos->next)
+			++chain;
+		if (chain > max_chain)
+			max_chain = chain;
+	}
+	tmap_printf("%zu elements in %u buckets, longest chain %u\n",
+		u.map->items, size, max_chain);
+	if (max_chain > 16)
+		goto out;
+	for (k = 1; k <= elems; ++k)
+		if (HXmap_del(u.map, reinterpret_cast(const void *, k << 12)) !=
+		    reinterpret_cast(const void *, k))
+			goto out;
+	if (u.map->items != 0)
+		goto out;
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(u.map);
+	return ret;
+}
+
+/**
+ * tmap_find_many_test - batched lookups must agree with HXmap_find
+ */
+static int tmap_find_many_test(enum HXmap_type type)
+{
+	static const unsigned int nkeys = 203, elems = 1000;
+	const struct HXmap_node *res[203];
+	const void *keys[203];
+	struct HXmap *map;
+	unsigned int i, hits = 0;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Find-many test (type %u)\n", type);
+	map = HXmap_init(type, HXMAP_NONE);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	if (HXmap_find_many(map, keys, 0, res) != 0)
+		goto out;
+	for (i = 1; i <= elems; ++i)
+		HXmap_add(map, reinterpret_cast(void *,
+			static_cast(uintptr_t, 2 * i)), NULL);
+	for (i = 0; i < nkeys; ++i) {
+		/* About half of the keys are odd, i.e. not present. */
+		keys[i] = reinterpret_cast(void *,
+		          static_cast(uintptr_t, HX_irand(1, 2 * elems + 1)));
+		hits += HXmap_find(map, keys[i]) != NULL;
+	}
+	if (HXmap_find_many(map, keys, nkeys, res) != hits)
+		goto out;
+	for (i = 0; i < nkeys; ++i)
+		if (res[i] != HXmap_find(map, keys[i]))
+			goto out;
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_reserve_test - check that a reserved map does not relayout during
+ * the bulk load, and that %HXMAP_NOSHRINK keeps the table size
+ */
+static int tmap_reserve_test(enum HXmap_type type)
+{
+	static const uintptr_t elems = 30000;
+	const struct HXmap_params params = {.expected = elems, .max_load = 80};
+	union HXpoly u;
+	size_t size;
+	uintptr_t i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Reserve test (type %u)\n", type);
+	u.map = HXmap_init6(type, HXMAP_NOSHRINK, NULL, 0, 0, &params);
+	if (u.map == NULL)
+		return EXIT_FAILURE;
+	size = tmap_table_size(u, type);
+	for (i = 1; i <= elems; ++i)
+		HXmap_add(u.map, reinterpret_cast(const void *, i), NULL);
+	if (size != tmap_table_size(u, type)) {
+		tmap_printf("Relayout happened despite reservation\n");
+		goto out;
+	}
+	for (i = 1; i <= elems; ++i)
+		HXmap_del(u.map, reinterpret_cast(const void *, i));
+	if (size != tmap_table_size(u, type)) {
+		tmap_printf("Relayout happened despite HXMAP_NOSHRINK\n");
+		goto out;
+	}
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(u.map);
+	return ret;
+}
+
+/**
+ * tmap_load_test - min_load follows a given max_load; %HXMAP_NOSHRINK set
+ * at runtime also holds for the shards of a sharded map
+ */
+static int tmap_load_test(void)
+{
+	const struct HXmap_params lo = {.max_load = 40};
+	const struct HXmap_params bad = {.max_load = 40, .min_load = 20};
+	struct HXmap_stats st;
+	struct HXmap *map;
+	size_t buckets;
+	uintptr_t i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Load factor test\n");
+	errno = 0;
+	if (HXmap_init6(HXMAPT_HASH, HXMAP_NONE, NULL, 0, 0, &bad) != NULL ||
+	    errno != EINVAL)
+		return EXIT_FAILURE;
+	map = HXmap_init6(HXMAPT_HASH, HXMAP_NONE, NULL, 0, 0, &lo);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	if (static_cast(struct HXmap_private *,
+	    static_cast(void *, map))->min_pct != 10)
+		goto out;
+	HXmap_free(map);
+
+	map = HXmap_init6(HXMAPT_SHARDED, HXMAP_NONE, NULL, 0, 0, &lo);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 1; i <= 20000; ++i)
+		HXmap_add(map, reinterpret_cast(const void *, i), NULL);
+	if (HXmap_stats(map, &st) <= 0)
+		goto out;
+	buckets = st.buckets;
+	map->flags |= HXMAP_NOSHRINK;
+	for (i = 1; i <= 20000; ++i)
+		HXmap_del(map, reinterpret_cast(const void *, i));
+	if (HXmap_stats(map, &st) <= 0 || st.buckets != buckets)
+		goto out;
+	ret = EXIT_SUCCESS;
+ out:
+	if (ret != EXIT_SUCCESS)
+		tmap_printf("Load factor test failed\n");
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_pool_test - two maps sharing one node pool
+ */
+static int tmap_pool_test(enum HXmap_type type)
+{
+	static const uintptr_t elems = 10000;
+	struct HXmap_params params = {};
+	struct HXmap *a, *b;
+	uintptr_t i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Pool test (type %u)\n", type);
+	params.pool = HXmap_pool_init();
+	if (params.pool == NULL)
+		return EXIT_FAILURE;
+	a = HXmap_init6(type, HXMAP_NONE, NULL, 0, 0, &params);
+	b = HXmap_init6(type, HXMAP_SCKEY, NULL, 0, 0, &params);
+	/* Pool is kept alive by the maps */
+	HXmap_pool_free(params.pool);
+	if (a == NULL || b == NULL)
+		goto out;
+	for (i = 1; i <= elems; ++i) {
+		char key[HXSIZEOF_Z32];
+		snprintf(key, sizeof(key), "%zu", static_cast(size_t, i));
+		HXmap_add(a, reinterpret_cast(const void *, i), NULL);
+		HXmap_add(b, key, NULL);
+		if (i % 3 == 0) {
+			HXmap_del(a, reinterpret_cast(const void *, i - 1));
+			HXmap_del(b, key);
+		}
+	}
+	if (a->items != elems - elems / 3 || b->items != elems - elems / 3) {
+		tmap_printf("Unexpected item count %zu/%zu\n",
+			a->items, b->items);
+		goto out;
+	}
+	for (i = 1; i <= elems; ++i)
+		if ((HXmap_find(a, reinterpret_cast(const void *, i)) == NULL) !=
+		    (i % 3 == 2 && i < elems)) {
+			tmap_printf("Element %zu misplaced\n",
+				static_cast(size_t, i));
+			goto out;
+		}
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(a);
+	HXmap_free(b);
+	return ret;
+}
+
+static unsigned long tmap_hash_calls, tmap_cmp_calls;
+
+static unsigned long tmap_counting_hash(const void *p, size_t z)
+{
+	++tmap_hash_calls;
+	return HXhash_jlookup3s(p, z);
+}
+
+static int tmap_counting_cmp(const void *a, const void *b, size_t z)
+{
+	++tmap_cmp_calls;
+	return strcmp(a, b);
+}
+
+/**
+ * tmap_hmap_test_3 - check that relayouts do not rehash keys and that
+ * lookups only compare keys with matching hashes
+ */
+static int tmap_hmap_test_3(void)
+{
+	static const unsigned int elems = 5000;
+	static const struct HXmap_ops ops = {
+		.k_compare = tmap_counting_cmp,
+		.k_hash    = tmap_counting_hash,
+	};
+	struct HXmap *map;
+	char key[HXSIZEOF_Z32];
+	unsigned int i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("HMAP test 3: Cached hashes\n");
+	map = HXmap_init5(HXMAPT_HASH, HXMAP_SCKEY, &ops, 0, 0);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	tmap_hash_calls = tmap_cmp_calls = 0;
+	for (i = 0; i < elems; ++i) {
+		snprintf(key, sizeof(key), "%u", i);
+		HXmap_add(map, key, NULL);
+	}
+	tmap_ipush();
+	tmap_printf("%u adds: %lu hashes, %lu compares\n",
+		elems, tmap_hash_calls, tmap_cmp_calls);
+	if (tmap_hash_calls != elems) {
+		tmap_printf("Keys were rehashed on relayout\n");
+		goto out;
+	}
+	tmap_cmp_calls = 0;
+	for (i = 0; i < elems; ++i) {
+		snprintf(key, sizeof(key), "%u", i);
+		HXmap_find(map, key);
+	}
+	tmap_printf("%u lookups: %lu compares\n", elems, tmap_cmp_calls);
+	/* Only full 32-bit hash collisions warrant a second compare */
+	if (tmap_cmp_calls > elems + elems / 100) {
+		tmap_printf("Too many compares\n");
+		goto out;
+	}
+	ret = EXIT_SUCCESS;
+ out:
+	tmap_ipop();
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_rbt_prev_test - stepping an RB-tree traverser in either direction
+ * must follow the stored path, not search from the root
+ */
+static int tmap_rbt_prev_test(void)
+{
+	static const unsigned int elems = 5000;
+	static const struct HXmap_ops ops = {.k_compare = tmap_counting_cmp};
+	const struct HXmap_node *node;
+	struct HXmap_trav *iter = NULL;
+	struct HXmap *map;
+	char key[HXSIZEOF_Z32];
+	unsigned int i, pos;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("RBT backward stepping\n");
+	map = HXmap_init5(HXMAPT_RBTREE, HXMAP_SCKEY, &ops, 0, 0);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < elems; ++i) {
+		snprintf(key, sizeof(key), "%06u", i);
+		HXmap_add(map, key, NULL);
+	}
+	iter = HXmap_travinit(map, HXMAP_NOFLAGS);
+	if (iter == NULL)
+		goto out;
+	while (HXmap_traverse(iter) != NULL)
+		/* nothing */;
+	tmap_cmp_calls = 0;
+	for (i = elems; i-- > 0; ) {
+		snprintf(key, sizeof(key), "%06u", i);
+		node = HXmap_traverse_prev(iter);
+		if (node == NULL || strcmp(node->skey, key) != 0)
+			goto fail;
+	}
+	if (HXmap_traverse_prev(iter) != NULL)
+		goto fail;
+
+	/* Zig-zag from the middle */
+	pos = elems / 2;
+	snprintf(key, sizeof(key), "%06u", pos);
+	HXmap_travseek(iter, key, HXMAP_SEEK_GE);
+	HXmap_traverse(iter);
+	for (i = 0; i < 20000; ++i) {
+		if (pos == 0 || (pos < elems - 1 && HX_irand(0, 2))) {
+			node = HXmap_traverse(iter);
+			++pos;
+		} else {
+			node = HXmap_traverse_prev(iter);
+			--pos;
+		}
+		snprintf(key, sizeof(key), "%06u", pos);
+		if (node == NULL || strcmp(node->skey, key) != 0)
+			goto fail;
+	}
+	tmap_printf("%lu compares\n", tmap_cmp_calls);
+	/* Only the seek may compare */
+	if (tmap_cmp_calls > 64)
+		goto fail;
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Backward stepping failed\n");
+ out:
+	HXmap_travfree(iter);
+	HXmap_free(map);
+	return ret;
+}
+
+struct tmap_smap_arg {
+	struct HXmap *map;
+	uintptr_t base;
+	unsigned int errors;
+};
+
+enum {
+	TMAP_SMAP_THREADS = 4,
+	TMAP_SMAP_ELEMS = 20000,
+};
+
+static void *tmap_smap_worker(void *varg)
+{
+	struct tmap_smap_arg *arg = varg;
+	uintptr_t i, k;
+
+	for (i = 1; i <= TMAP_SMAP_ELEMS; ++i) {
+		k = arg->base + i;
+		if (HXmap_add(arg->map, reinterpret_cast(const void *, k),
+		    reinterpret_cast(const void *, ~k)) <= 0)
+			++arg->errors;
+		if (HXmap_get(arg->map, reinterpret_cast(const void *, k)) !=
+		    reinterpret_cast(void *, ~k))
+			++arg->errors;
+	}
+	for (i = 2; i <= TMAP_SMAP_ELEMS; i += 2) {
+		k = arg->base + i;
+		if (HXmap_del(arg->map, reinterpret_cast(const void *, k)) !=
+		    reinterpret_cast(void *, ~k))
+			++arg->errors;
+	}
+	return NULL;
+}
+
+static bool tmap_smap_count(const struct HXmap_node *node, void *arg)
+{
+	++*static_cast(size_t *, arg);
+	return true;
+}
+
+/**
+ * tmap_smap_test_1 - concurrent modification of a sharded map
+ */
+static int tmap_smap_test_1(void)
+{
+	static const size_t expected = TMAP_SMAP_THREADS * TMAP_SMAP_ELEMS / 2;
+	struct tmap_smap_arg args[TMAP_SMAP_THREADS];
+	pthread_t tid[TMAP_SMAP_THREADS];
+	struct HXmap_params params = {};
+	const struct HXmap_node *node;
+	struct HXmap_node *kv;
+	struct HXmap_trav *iter;
+	struct HXmap *map;
+	size_t count = 0;
+	unsigned int i, errors = 0;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("SMAP test 1: %u concurrent writers\n", TMAP_SMAP_THREADS);
+	params.shards = 8;
+	map = HXmap_init6(HXMAPT_SHARDED, HXMAP_POOL, NULL, 0, 0, &params);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < TMAP_SMAP_THREADS; ++i) {
+		args[i].map    = map;
+		args[i].base   = i * TMAP_SMAP_ELEMS;
+		args[i].errors = 0;
+		if (pthread_create(&tid[i], NULL, tmap_smap_worker,
+		    &args[i]) != 0)
+			break;
+	}
+	while (i-- > 0) {
+		pthread_join(tid[i], NULL);
+		errors += args[i].errors;
+	}
+	if (errors != 0 || map->items != expected) {
+		tmap_printf("%u errors, %zu items\n", errors, map->items);
+		goto out;
+	}
+
+	iter = HXmap_travinit(map, HXMAP_NOFLAGS);
+	while ((node = HXmap_traverse(iter)) != NULL)
+		if (reinterpret_cast(uintptr_t, node->key) % 2 == 1)
+			++count;
+	HXmap_travfree(iter);
+	HXmap_qfe(map, tmap_smap_count, &count);
+	kv = HXmap_keysvalues(map);
+	if (kv == NULL)
+		goto out;
+	for (i = 0; i < expected; ++i)
+		if (kv[i].data != reinterpret_cast(void *,
+		    ~reinterpret_cast(uintptr_t, kv[i].key)))
+			break;
+	free(kv);
+	if (count != 2 * expected || i != expected) {
+		tmap_printf("Enumeration mismatch\n");
+		goto out;
+	}
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(map);
+	return ret;
+}
+
+struct tmap_rmap_arg {
+	struct HXmap *map;
+	bool stop;
+	unsigned long lookups, errors;
+};
+
+static void *tmap_rmap_reader(void *varg)
+{
+	struct tmap_rmap_arg *arg = varg;
+	uintptr_t k;
+	void *v;
+
+	while (!__atomic_load_n(&arg->stop, __ATOMIC_RELAXED)) {
+		for (k = 1; k <= 256; ++k) {
+			v = HXmap_get(arg->map, reinterpret_cast(const void *, k));
+			/* Elements come and go, but are never wrong. */
+			if (v != NULL && v != reinterpret_cast(void *, ~k))
+				++arg->errors;
+		}
+		arg->lookups += 256;
+	}
+	return NULL;
+}
+
+/**
+ * tmap_rmap_test_1 - lock-free readers while writers replace snapshots
+ */
+static int tmap_rmap_test_1(void)
+{
+	struct tmap_rmap_arg args[TMAP_SMAP_THREADS];
+	pthread_t tid[TMAP_SMAP_THREADS];
+	const struct HXmap_node *node;
+	struct HXmap_trav *iter;
+	struct HXmap *map, *fresh;
+	unsigned int i, n, round;
+	uintptr_t k, prev = 0;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("RMAP test 1: %u readers, one writer\n", TMAP_SMAP_THREADS);
+	map = HXmap_init(HXMAPT_RCU, HXMAP_NONE);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (n = 0; n < TMAP_SMAP_THREADS; ++n) {
+		args[n].map = map;
+		args[n].stop = false;
+		args[n].lookups = args[n].errors = 0;
+		if (pthread_create(&tid[n], NULL, tmap_rmap_reader,
+		    &args[n]) != 0)
+			break;
+	}
+	for (round = 0; round < 20; ++round) {
+		for (k = 1; k <= 256; k += 3)
+			HXmap_add(map, reinterpret_cast(const void *, k),
+				reinterpret_cast(const void *, ~k));
+		for (k = 1; k <= 256; k += 6)
+			HXmap_del(map, reinterpret_cast(const void *, k));
+		/* Wholesale rebuild into an ordered snapshot */
+		fresh = HXmap_init(HXMAPT_RBTREE, HXMAP_NONE);
+		if (fresh == NULL)
+			break;
+		for (k = 256; k > 0; k -= 2)
+			HXmap_add(fresh, reinterpret_cast(const void *, k),
+				reinterpret_cast(const void *, ~k));
+		if (HXmap_publish(map, fresh) <= 0)
+			break;
+	}
+	for (i = 0; i < n; ++i)
+		__atomic_store_n(&args[i].stop, true, __ATOMIC_RELAXED);
+	while (n-- > 0) {
+		pthread_join(tid[n], NULL);
+		tmap_printf("reader %u: %lu lookups, %lu errors\n",
+			n, args[n].lookups, args[n].errors);
+		if (args[n].errors != 0)
+			goto out;
+	}
+	if (round != 20 || map->items != 128) {
+		tmap_printf("Unexpected state after %u rounds, %zu items\n",
+			round, map->items);
+		goto out;
+	}
+	/* The published tree determines the traversal order. */
+	iter = HXmap_travinit(map, HXMAP_NOFLAGS);
+	while ((node = HXmap_traverse(iter)) != NULL) {
+		k = reinterpret_cast(uintptr_t, node->key);
+		if (k <= prev || k % 2 != 0)
+			break;
+		prev = k;
+	}
+	HXmap_travfree(iter);
+	if (node != NULL || HXmap_add(map, "x", NULL) <= 0 ||
+	    HXmap_get(map, "x") != NULL || errno != 0)
+		goto out;
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_rmap_test_2 - snapshots share keys and values freed by user ops
+ *
+ * The map owns what it is given (k_free/d_free without k_clone/d_clone);
+ * copy-on-write must neither free elements still in use nor free twice.
+ */
+static int tmap_rmap_test_2(void)
+{
+	static const struct HXmap_ops ops = {.k_free = free, .d_free = free};
+	char key[] = "alpha";
+	struct HXmap *map;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("RMAP test 2: user free ops\n");
+	map = HXmap_init5(HXMAPT_RCU, HXMAP_SKEY | HXMAP_SDATA, &ops, 0, 0);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	if (HXmap_add(map, HX_strdup("alpha"), HX_strdup("1")) <= 0 ||
+	    HXmap_add(map, HX_strdup("beta"), HX_strdup("2")) <= 0 ||
+	    strcmp(HXmap_get(map, "alpha"), "1") != 0)
+		goto out;
+	/* Replacing keeps the stored key, @key stays ours */
+	if (HXmap_add(map, key, HX_strdup("3")) <= 0 ||
+	    strcmp(HXmap_get(map, "alpha"), "3") != 0 ||
+	    strcmp(HXmap_get(map, "beta"), "2") != 0)
+		goto out;
+	HXmap_del(map, "beta");
+	if (map->items != 1 || HXmap_get(map, "beta") != NULL ||
+	    HXmap_reserve(map, 100) <= 0 ||
+	    strcmp(HXmap_get(map, "alpha"), "3") != 0)
+		goto out;
+	ret = EXIT_SUCCESS;
+ out:
+	if (ret != EXIT_SUCCESS)
+		tmap_printf("RMAP test 2 failed\n");
+	HXmap_free(map);
+	return ret;
+}
+
+static void tmap_zero(void)
+{
+	struct HXmap *b;
+
+	b = HXmap_init(HXMAPT_DEFAULT, HXMAP_CKEY | HXMAP_CDATA);
+	if (b != NULL)
+		fprintf(stderr, "eek!\n");
+	b = HXmap_init(HXMAPT_DEFAULT, HXMAP_CKEY);
+	if (b != NULL)
+		fprintf(stderr, "eek!\n");
+}
+
+/**
+ * tmap_zmap_check - verify a frozen copy of "k<i>" => "v<i>", i < @elems
+ */
+static int tmap_zmap_check(const struct HXmap *map, unsigned int elems)
+{
+	const struct HXmap_node *node;
+	struct HXmap_trav *trav;
+	char key[16], value[16];
+	unsigned int i, seen = 0;
+
+	if (map->items != elems)
+		return EXIT_FAILURE;
+	for (i = 0; i < elems; ++i) {
+		snprintf(key, sizeof(key), "k%u", i);
+		snprintf(value, sizeof(value), "v%u", i);
+		node = HXmap_find(map, key);
+		if (node == NULL || strcmp(node->skey, key) != 0 ||
+		    strcmp(node->sdata, value) != 0) {
+			tmap_printf("Lookup of %s failed\n", key);
+			return EXIT_FAILURE;
+		}
+		snprintf(key, sizeof(key), "x%u", i);
+		if (HXmap_find(map, key) != NULL) {
+			tmap_printf("Found absent key %s\n", key);
+			return EXIT_FAILURE;
+		}
+	}
+	trav = HXmap_travinit(map, HXMAP_NOFLAGS);
+	if (trav == NULL)
+		return EXIT_FAILURE;
+	while ((node = HXmap_traverse(trav)) != NULL)
+		++seen;
+	HXmap_travfree(trav);
+	return seen == elems ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * tmap_zmap_test_1 - freezing, immutability, and the file round trip
+ */
+static int tmap_zmap_test_1(void)
+{
+	static const char file[] = "tc-map-frozen.bin";
+	static const unsigned int elems = 20000;
+	struct HXmap *map, *frozen = NULL, *loaded = NULL;
+	char key[16], value[16];
+	unsigned int i;
+	uint64_t fkey;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Frozen map test 1\n");
+	map = HXmap_init(HXMAPT_HASH, HXMAP_SCKEY | HXMAP_SCDATA);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < elems; ++i) {
+		snprintf(key, sizeof(key), "k%u", i);
+		snprintf(value, sizeof(value), "v%u", i);
+		if (HXmap_add(map, key, value) <= 0)
+			goto out;
+	}
+	frozen = HXmap_freeze(map);
+	HXmap_free(map);
+	map = NULL;
+	if (frozen == NULL || tmap_zmap_check(frozen, elems) != EXIT_SUCCESS)
+		goto out;
+	if (HXmap_add(frozen, "new", "value") != -EPERM ||
+	    HXmap_del(frozen, "k0") != NULL || errno != EPERM)
+		goto out;
+	if (HXmap_save(frozen, file) <= 0)
+		goto out;
+	loaded = HXmap_load(file);
+	unlink(file);
+	if (loaded == NULL || tmap_zmap_check(loaded, elems) != EXIT_SUCCESS)
+		goto out;
+	HXmap_free(loaded);
+	loaded = NULL;
+	HXmap_free(frozen);
+
+	/* Pointer keys can be frozen, but not saved */
+	frozen = NULL;
+	map = HXmap_init(HXMAPT_RBTREE, HXMAP_NONE);
+	if (map == NULL)
+		goto out;
+	for (fkey = 1; fkey <= 100; ++fkey)
+		if (HXmap_add(map, reinterpret_cast(const void *, fkey),
+		    reinterpret_cast(const void *, fkey * 2)) <= 0)
+			goto out;
+	frozen = HXmap_freeze(map);
+	if (frozen == NULL)
+		goto out;
+	for (fkey = 1; fkey <= 100; ++fkey)
+		if (HXmap_get(frozen, reinterpret_cast(const void *, fkey)) !=
+		    reinterpret_cast(const void *, fkey * 2))
+			goto out;
+	if (HXmap_find(frozen, reinterpret_cast(const void *, 101)) != NULL ||
+	    HXmap_save(frozen, file) != -EINVAL)
+		goto out;
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(map);
+	HXmap_free(frozen);
+	HXmap_free(loaded);
+	return ret;
+}
+
+/**
+ * tmap_zmap_test_2 - fixed-size keys and values, and an empty map
+ */
+static int tmap_zmap_test_2(void)
+{
+	static const char file[] = "tc-map-frozen.bin";
+	static const unsigned int elems = 1000;
+	uint32_t keys[1000];
+	uint64_t values[1000];
+	struct HXmap *map, *frozen = NULL, *loaded = NULL;
+	const uint64_t *v;
+	unsigned int i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Frozen map test 2\n");
+	map = HXmap_init5(HXMAPT_BTREE, HXMAP_CKEY | HXMAP_CDATA, NULL,
+	      sizeof(*keys), sizeof(*values));
+	if (map == NULL)
+		return EXIT_FAILURE;
+	frozen = HXmap_freeze(map);
+	if (frozen == NULL || frozen->items != 0 ||
+	    HXmap_find(frozen, &keys[0]) != NULL)
+		goto out;
+	HXmap_free(frozen);
+	for (i = 0; i < elems; ++i) {
+		keys[i]   = i * 2654435761U;
+		values[i] = static_cast(uint64_t, i) << 32 | i;
+		if (HXmap_add(map, &keys[i], &values[i]) <= 0)
+			goto out;
+	}
+	frozen = HXmap_freeze(map);
+	if (frozen == NULL || HXmap_save(frozen, file) <= 0)
+		goto out;
+	loaded = HXmap_load(file);
+	unlink(file);
+	if (loaded == NULL)
+		goto out;
+	for (i = 0; i < elems; ++i) {
+		v = HXmap_get(loaded, &keys[i]);
+		if (v == NULL || *v != values[i])
+			goto out;
+	}
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(map);
+	HXmap_free(frozen);
+	HXmap_free(loaded);
+	return ret;
+}
+
+/**
+ * tmap_iter_test - caller-allocated traversers and chunked export
+ */
+static int tmap_iter_test(enum HXmap_type type)
+{
+	static const uintptr_t elems = 1000;
+	struct HXmap_node buf[64];
+	struct HXmap_iter iter;
+	struct HXmap_trav *trav;
+	const struct HXmap_node *node;
+	struct HXmap *map;
+	uintptr_t i, sum = 0, seen = 0;
+	size_t n;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Iterator test (type %u)\n", static_cast(unsigned int, type));
+	map = HXmap_init(type, HXMAP_NONE);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 1; i <= elems; ++i)
+		if (HXmap_add(map, reinterpret_cast(const void *, i),
+		    reinterpret_cast(const void *, i)) <= 0)
+			goto out;
+
+	trav = HXmap_travinit_at(&iter, map, HXMAP_NOFLAGS);
+	if (trav == NULL)
+		goto out;
+	while ((node = HXmap_traverse(trav)) != NULL) {
+		sum += reinterpret_cast(uintptr_t, node->key);
+		++seen;
+	}
+	HXmap_travfree(trav);
+	if (seen != elems || sum != elems * (elems + 1) / 2)
+		goto out;
+
+	/* Locks and snapshots must have been released. */
+	if (HXmap_add(map, reinterpret_cast(const void *, elems + 1),
+	    NULL) <= 0)
+		goto out;
+
+	sum = seen = 0;
+	trav = HXmap_travinit_at(&iter, map, HXMAP_NOFLAGS);
+	if (trav == NULL)
+		goto out;
+	while ((n = HXmap_traverse_many(trav, buf, ARRAY_SIZE(buf))) > 0) {
+		for (i = 0; i < n; ++i)
+			sum += reinterpret_cast(uintptr_t, buf[i].key);
+		seen += n;
+		if (n < ARRAY_SIZE(buf))
+			break;
+	}
+	HXmap_travfree(trav);
+	if (seen != elems + 1 || sum != (elems + 1) * (elems + 2) / 2) {
+		tmap_printf("Chunked export saw %zu elements\n",
+			static_cast(size_t, seen));
+		goto out;
+	}
+	ret = EXIT_SUCCESS;
+ out:
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_stats_test - check HXmap_stats against what was put into the map
+ */
+static int tmap_stats_test(enum HXmap_type type)
+{
+	static const unsigned int elems = 1000;
+	struct HXmap_stats st;
+	struct HXmap *map, *frozen = NULL;
+	size_t key_bytes = 0, hist = 0, weight = 0;
+	char key[24];
+	unsigned int i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Stats test (type %u)\n", static_cast(unsigned int, type));
+	map = HXmap_init(type, HXMAP_SCKEY);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < elems; ++i) {
+		snprintf(key, sizeof(key), "key%u", i);
+		if (HXmap_add(map, key, NULL) <= 0)
+			goto out;
+		key_bytes += strlen(key) + 1;
+	}
+	if (type == HXMAPT_HASH) {
+		/* the chained-hash histogram is exact; test it frozen, too */
+		frozen = HXmap_freeze(map);
+		if (frozen == NULL || HXmap_stats(frozen, &st) <= 0 ||
+		    st.items != elems || st.buckets != elems ||
+		    st.table_bytes == 0 || st.key_bytes != 0)
+			goto fail;
+	}
+	if (HXmap_stats(map, &st) <= 0 || st.items != elems ||
+	    st.key_bytes != key_bytes || st.data_bytes != 0)
+		goto fail;
+	for (i = 0; i < HXMAP_CHAIN_HIST; ++i) {
+		hist   += st.chains[i];
+		weight += i * st.chains[i];
+	}
+
+	switch (type) {
+	case HXMAPT_HASH:
+	case HXMAPT_SHARDED:
+		if (hist != st.buckets || st.relayouts == 0 ||
+		    st.load_pct != elems * 100 / st.buckets ||
+		    (st.max_chain < HXMAP_CHAIN_HIST - 1 && weight != elems) ||
+		    st.node_bytes == 0 || st.table_bytes == 0)
+			goto fail;
+		break;
+	case HXMAPT_FLATHASH:
+		if (hist != elems || st.relayouts == 0 || st.buckets < elems ||
+		    st.table_bytes == 0 || st.node_bytes != 0)
+			goto fail;
+		break;
+	case HXMAPT_RBTREE:
+		/* 1000 elements: at least 10, at most 2*log2(1001) levels */
+		if (st.height < 10 || st.height > 19 || st.black_height == 0 ||
+		    st.black_height > st.height || hist != 0 ||
+		    st.node_bytes == 0)
+			goto fail;
+		break;
+	case HXMAPT_BTREE:
+		if (st.height < 2 || st.node_bytes == 0 || st.buckets != 0)
+			goto fail;
+		break;
+	default:
+		/* RCU: figures are those of the snapshot's map type */
+		break;
+	}
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Stats test failed\n");
+ out:
+	HXmap_free(frozen);
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_inline_test - fixed-size key and value copies stored in the nodes
+ */
+static int tmap_inline_test(enum HXmap_type type, unsigned int flags)
+{
+	static const unsigned int elems = 1000;
+	struct tmap_pair {
+		uint64_t a, b;
+	} value;
+	const struct HXmap_node *node;
+	struct HXmap_trav *iter;
+	struct HXmap_stats st;
+	struct HXmap *map;
+	uint64_t key;
+	unsigned int i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Inline storage test (type %u, flags %#x)\n",
+		static_cast(unsigned int, type), flags);
+	map = HXmap_init5(type, HXMAP_CKEY | HXMAP_CDATA | HXMAP_INLINE | flags,
+	      NULL, sizeof(key), sizeof(value));
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < elems; ++i) {
+		key = i;
+		value.a = i;
+		value.b = ~static_cast(uint64_t, i);
+		if (HXmap_add(map, &key, &value) <= 0)
+			goto out;
+	}
+	/* Replace in place, and delete every third element */
+	if (type == HXMAPT_RBTREE)
+		/* HXrbtree_replace has the sense of this flag inverted */
+		map->flags |= HXMAP_NOREPLACE;
+	for (i = 0; i < elems; i += 2) {
+		key = i;
+		value.a = value.b = 2 * i;
+		if (HXmap_add(map, &key, &value) <= 0)
+			goto out;
+	}
+	if (type == HXMAPT_RBTREE) {
+		/* The traverser's checkpoint must not point into a node */
+		iter = HXmap_travinit(map, HXMAP_DTRAV);
+		if (iter == NULL)
+			goto out;
+		while ((node = HXmap_traverse(iter)) != NULL)
+			if (*static_cast(const uint64_t *, node->key) % 3 == 0)
+				HXmap_del(map, node->key);
+		HXmap_travfree(iter);
+	} else {
+		for (key = 0; key < elems; key += 3)
+			if (HXmap_del(map, &key) == NULL && errno != 0)
+				goto fail;
+	}
+
+	for (i = 0; i < elems; ++i) {
+		const struct tmap_pair *p;
+
+		key  = i;
+		node = HXmap_find(map, &key);
+		if (i % 3 == 0) {
+			if (node != NULL)
+				goto fail;
+			continue;
+		}
+		if (node == NULL || node->key == &key)
+			goto fail;
+		p = node->data;
+		if (*static_cast(const uint64_t *, node->key) != i ||
+		    p->a != (i % 2 == 0 ? 2 * i : i) ||
+		    p->b != (i % 2 == 0 ? 2 * i : ~static_cast(uint64_t, i)))
+			goto fail;
+	}
+	/* No separate allocations for the copies */
+	if (HXmap_stats(map, &st) <= 0 || st.key_bytes != 0 ||
+	    st.data_bytes != 0 ||
+	    st.node_bytes < st.items * (sizeof(key) + sizeof(value)))
+		goto fail;
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Inline storage test failed\n");
+ out:
+	HXmap_free(map);
+	return ret;
+}
+
+static const struct HXmap_ops tmap_strpool_ops = {.k_free = free};
+
+/**
+ * tmap_strpool_test - maps sharing interned keys
+ */
+static int tmap_strpool_test(void)
+{
+	static const enum HXmap_type types[] = {
+		HXMAPT_HASH, HXMAPT_RBTREE, HXMAPT_FLATHASH, HXMAPT_BTREE,
+		HXMAPT_SHARDED, HXMAPT_RCU,
+	};
+	struct HXmap_params params = {};
+	struct HXmap *maps[ARRAY_SIZE(types)] = {};
+	const struct HXmap_node *node, *first;
+	struct HXstrpool *sp;
+	const char *a, *b;
+	char key[24];
+	unsigned int i, m;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("String pool test\n");
+	sp = HXstrpool_init();
+	if (sp == NULL)
+		return EXIT_FAILURE;
+	snprintf(key, sizeof(key), "tenant%u", 42);
+	a = HXstrpool_intern(sp, key);
+	b = HXstrpool_intern(sp, "tenant42");
+	if (a == NULL || a != b || a == key || strcmp(a, key) != 0 ||
+	    HXstrpool_intern(sp, "tenant43") == a)
+		goto fail;
+
+	/* The maps keep the pool alive after the creator dropped it. */
+	params.strpool = sp;
+	if (HXmap_init6(HXMAPT_HASH, HXMAP_SKEY, NULL, 0, 0, &params) != NULL ||
+	    HXmap_init6(HXMAPT_HASH, HXMAP_SCKEY, &tmap_strpool_ops, 0, 0,
+	    &params) != NULL || errno != EINVAL)
+		goto fail;
+	for (m = 0; m < ARRAY_SIZE(types); ++m) {
+		maps[m] = HXmap_init6(types[m], HXMAP_SCKEY, NULL, 0, 0, &params);
+		if (maps[m] == NULL)
+			goto out;
+	}
+	HXstrpool_free(sp);
+	sp = NULL;
+
+	for (i = 0; i < 500; ++i) {
+		snprintf(key, sizeof(key), "header-%u", i);
+		for (m = 0; m < ARRAY_SIZE(types); ++m)
+			if (HXmap_add(maps[m], key, NULL) <= 0)
+				goto fail;
+	}
+	for (i = 0; i < 500; i += 2) {
+		snprintf(key, sizeof(key), "header-%u", i);
+		for (m = 0; m < ARRAY_SIZE(types); ++m)
+			if (HXmap_del(maps[m], key) == NULL && errno != 0)
+				goto fail;
+	}
+	/* Every map's key is the same copy */
+	for (i = 0; i < 500; ++i) {
+		snprintf(key, sizeof(key), "header-%u", i);
+		first = HXmap_find(maps[0], key);
+		if ((first == NULL) != (i % 2 == 0) ||
+		    (first != NULL && first->key == key))
+			goto fail;
+		for (m = 1; m < ARRAY_SIZE(types); ++m) {
+			node = HXmap_find(maps[m], key);
+			if ((node == NULL) != (first == NULL) ||
+			    (node != NULL && node->key != first->key))
+				goto fail;
+		}
+	}
+	for (m = 0; m < ARRAY_SIZE(types); ++m)
+		if (maps[m]->items != 250)
+			goto fail;
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("String pool test failed\n");
+ out:
+	for (m = 0; m < ARRAY_SIZE(types); ++m)
+		HXmap_free(maps[m]);
+	HXstrpool_free(sp);
+	return ret;
+}
+
+/**
+ * tmap_upsert_test - counting with HXmap_find_or_insert
+ */
+static int tmap_upsert_test(enum HXmap_type type, unsigned int flags)
+{
+	static const unsigned int events = 5000, distinct = 97;
+	struct HXmap_node *node;
+	struct HXmap *map;
+	unsigned int i, added = 0;
+	bool inserted;
+	char key[16];
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Find-or-insert test (type %u, flags %#x)\n",
+		static_cast(unsigned int, type), flags);
+	map = HXmap_init5(type, HXMAP_SCKEY | HXMAP_CDATA | flags, NULL,
+	      0, sizeof(unsigned long));
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < events; ++i) {
+		snprintf(key, sizeof(key), "ev%u", i % distinct);
+		node = HXmap_find_or_insert(map, key, &inserted);
+		if (node == NULL || node->data == NULL || node->key == key ||
+		    strcmp(node->skey, key) != 0)
+			goto fail;
+		/* New elements start at zero */
+		if (inserted && *static_cast(unsigned long *, node->data) != 0)
+			goto fail;
+		added += inserted;
+		++*static_cast(unsigned long *, node->data);
+	}
+	if (added != distinct || map->items != distinct)
+		goto fail;
+	for (i = 0; i < distinct; ++i) {
+		snprintf(key, sizeof(key), "ev%u", i);
+		node = HXmap_find_or_insert(map, key, NULL);
+		if (node == NULL || *static_cast(unsigned long *, node->data) !=
+		    events / distinct + (i < events % distinct))
+			goto fail;
+	}
+	if (map->items != distinct)
+		goto fail;
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Find-or-insert test failed\n");
+ out:
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_upsert_plain_test - find-or-insert without value copies
+ */
+static int tmap_upsert_plain_test(void)
+{
+	static int slot;
+	struct HXmap_node *node;
+	struct HXmap *map;
+	bool inserted = false;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Find-or-insert test (uncopied values)\n");
+	map = HXmap_init(HXMAPT_HASH, HXMAP_SKEY);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	/* The caller fills in the value of a new element */
+	node = HXmap_find_or_insert(map, "alpha", &inserted);
+	if (node == NULL || !inserted || node->data != NULL)
+		goto fail;
+	node->data = &slot;
+	node = HXmap_find_or_insert(map, "alpha", &inserted);
+	if (node == NULL || inserted || node->data != &slot ||
+	    HXmap_get(map, "alpha") != &slot)
+		goto fail;
+	HXmap_free(map);
+
+	/* Published and frozen maps are not updated in place */
+	map = HXmap_init(HXMAPT_RCU, HXMAP_SKEY);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	errno = 0;
+	if (HXmap_find_or_insert(map, "alpha", NULL) != NULL || errno != EPERM)
+		goto fail;
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Find-or-insert test failed\n");
+ out:
+	HXmap_free(map);
+	return ret;
+}
+
+static int tmap_strcmp(const void *a, const void *b, size_t z)
+{
+	return strcmp(a, b);
+}
+
+/**
+ * tmap_find_n_test - lookups of tokens in a buffer, without copying them
+ */
+static int tmap_find_n_test(enum HXmap_type type,
+    unsigned long (*hash)(const void *, size_t))
+{
+	static const char *const names[] = {
+		"Host", "Accept", "Accept-Encoding", "Content-Length", "X",
+	};
+	static const char buf[] = "Accept-Encoding: gzip\r\nHost: a\r\n";
+	struct HXmap_ops ops = {.k_hash = hash};
+	const struct HXmap_node *node;
+	struct HXmap *map, *frozen = NULL;
+	unsigned int i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Byte range lookup test (type %u)\n",
+		static_cast(unsigned int, type));
+	map = HXmap_init5(type, HXMAP_SCKEY, hash != NULL ? &ops : NULL, 0, 0);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (i = 0; i < ARRAY_SIZE(names); ++i)
+		if (HXmap_add(map, names[i], NULL) <= 0)
+			goto out;
+	if (type == HXMAPT_HASH && hash == NULL) {
+		frozen = HXmap_freeze(map);
+		if (frozen == NULL)
+			goto out;
+		HXmap_free(map);
+		map = frozen;
+	}
+
+	/* Prefixes of the buffer: "A", "Ac", ..., "Accept-Encoding: gzip..." */
+	for (i = 0; i <= strlen(buf); ++i) {
+		node = HXmap_find_n(map, buf, i);
+		if ((node != NULL) != (i == 6 || i == 15) ||
+		    (node != NULL && strncmp(node->skey, buf, i) != 0))
+			goto fail;
+	}
+	node = HXmap_find_n(map, strstr(buf, "Host"), 4);
+	if (node == NULL || strcmp(node->skey, "Host") != 0 ||
+	    HXmap_find_n(map, "X\0", 2) != NULL ||
+	    HXmap_find_n(map, "X", 1) == NULL ||
+	    HXmap_find_n(map, "", 0) != NULL)
+		goto fail;
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Byte range lookup test failed\n");
+ out:
+	HXmap_free(map);
+	return ret;
+}
+
+/**
+ * tmap_find_n_misc - byte range lookups outside the in-place path
+ */
+static int tmap_find_n_misc(void)
+{
+	static const struct HXmap_ops ops = {.k_compare = tmap_strcmp};
+	static const char word[] = "hello, world";
+	char longkey[300];
+	struct HXmap *map;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Byte range lookup test (misc)\n");
+	if (HXhash_djb2_n(word, strlen(word)) != HXhash_djb2(word, 0) ||
+	    HXhash_djb2_n(word, 5) != HXhash_djb2("hello", 0))
+		return EXIT_FAILURE;
+
+	/* Custom ordering: looked up through a temporary copy */
+	map = HXmap_init5(HXMAPT_RBTREE, HXMAP_SCKEY, &ops, 0, 0);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	memset(longkey, 'k', sizeof(longkey));
+	longkey[sizeof(longkey)-1] = '\0';
+	if (HXmap_add(map, "hello", NULL) <= 0 ||
+	    HXmap_add(map, longkey, NULL) <= 0 ||
+	    HXmap_find_n(map, longkey, sizeof(longkey) - 1) == NULL ||
+	    HXmap_find_n(map, longkey, sizeof(longkey) - 2) != NULL ||
+	    HXmap_find_n(map, word, 5) == NULL ||
+	    HXmap_find_n(map, word, 4) != NULL ||
+	    HXmap_find_n(map, "hello\0x", 7) != NULL)
+		goto fail;
+	HXmap_free(map);
+
+	/* Not a string-keyed map */
+	map = HXmap_init(HXMAPT_HASH, HXMAP_NONE);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	errno = 0;
+	if (HXmap_find_n(map, word, 5) != NULL || errno != EINVAL)
+		goto fail;
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Byte range lookup test failed\n");
+ out:
+	HXmap_free(map);
+	return ret;
+}
+
+/*
+ * Integer keys are copied and ordered numerically. With 1-byte steps of
+ * 0x101, the byte order of little-endian machines would differ.
+ */
+static int tmap_ikey_test(enum HXmap_type type, size_t ksize)
+{
+	const bool ordered = type == HXMAPT_RBTREE || type == HXMAPT_BTREE;
+	struct HXmap *map, *frozen = NULL;
+	const struct HXmap_node *node;
+	struct HXmap_trav *trav;
+	uint64_t key = 0, prev = 0;
+	uint32_t key32;
+	void *kp = ksize == sizeof(key32) ? static_cast(void *, &key32) :
+	           static_cast(void *, &key);
+	unsigned int i, n = 0;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Integer key test (type %u, %zu bytes)\n", type, ksize);
+	map = HXmap_init5(type, HXMAP_IKEY, NULL, ksize, 0);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	if (!(map->flags & HXMAP_CKEY))
+		goto fail;
+	for (i = 0; i < 1000; ++i) {
+		key = key32 = i * 0x101;
+		if (HXmap_add(map, kp, reinterpret_cast(void *,
+		    static_cast(uintptr_t, i + 1))) <= 0)
+			goto fail;
+	}
+	/* Must not be truncated to 32 bits and collide with key 0 */
+	key = static_cast(uint64_t, 1) << 32;
+	if (ksize == sizeof(key) && (HXmap_find(map, kp) != NULL ||
+	    HXmap_add(map, kp, NULL) <= 0 || HXmap_del(map, kp) != NULL ||
+	    map->items != 1000))
+		goto fail;
+	for (i = 0; i < 1000; ++i) {
+		key = key32 = i * 0x101;
+		if (HXmap_get(map, kp) != reinterpret_cast(void *,
+		    static_cast(uintptr_t, i + 1)))
+			goto fail;
+		key = key32 = i * 0x101 + 1;
+		if (HXmap_find(map, kp) != NULL)
+			goto fail;
+	}
+
+	if ((trav = HXmap_travinit(map, HXMAP_NOFLAGS)) == NULL)
+		goto fail;
+	while ((node = HXmap_traverse(trav)) != NULL) {
+		if (ksize == sizeof(key32)) {
+			memcpy(&key32, node->key, sizeof(key32));
+			key = key32;
+		} else {
+			memcpy(&key, node->key, sizeof(key));
+		}
+		if (key % 0x101 != 0 || (ordered && n > 0 && key <= prev))
+			break;
+		prev = key;
+		++n;
+	}
+	HXmap_travfree(trav);
+	if (n != 1000)
+		goto fail;
+
+	for (i = 0; i < 1000; i += 2) {
+		key = key32 = i * 0x101;
+		if (HXmap_del(map, kp) == NULL)
+			goto fail;
+	}
+	if (map->items != 500)
+		goto fail;
+	if (type == HXMAPT_HASH) {
+		if ((frozen = HXmap_freeze(map)) == NULL)
+			goto fail;
+		key = key32 = 0x101;
+		if (HXmap_find(frozen, kp) == NULL)
+			goto fail;
+		key = key32 = 0;
+		if (HXmap_find(frozen, kp) != NULL)
+			goto fail;
+	}
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Integer key test failed\n");
+ out:
+	if (frozen != NULL)
+		HXmap_free(frozen);
+	HXmap_free(map);
+	return ret;
+}
+
+static int tmap_ikey_misc(void)
+{
+	static const struct HXmap_params params = {.shards = 4};
+	static const unsigned int bad_flags[] = {HXMAP_IKEY, HXMAP_IKEY,
+		HXMAP_IKEY | HXMAP_SKEY};
+	static const size_t bad_sizes[] = {2, 16, sizeof(uint64_t)};
+	unsigned int i;
+
+	tmap_printf("Integer key test (misc)\n");
+	for (i = 0; i < ARRAY_SIZE(bad_flags); ++i) {
+		errno = 0;
+		if (HXmap_init5(HXMAPT_HASH, bad_flags[i], NULL,
+		    bad_sizes[i], 0) != NULL || errno != EINVAL)
+			return EXIT_FAILURE;
+		errno = 0;
+		if (HXmap_init6(HXMAPT_SHARDED, bad_flags[i], NULL,
+		    bad_sizes[i], 0, &params) != NULL || errno != EINVAL)
+			return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+struct tmap_qfe_sum {
+	unsigned long long sum;
+	size_t calls, limit;
+};
+
+static bool tmap_qfe_sum(const struct HXmap_node *node, void *arg)
+{
+	struct tmap_qfe_sum *s = arg;
+	uint32_t key;
+
+	memcpy(&key, node->key, sizeof(key));
+	__atomic_add_fetch(&s->sum, key, __ATOMIC_RELAXED);
+	return __atomic_add_fetch(&s->calls, 1, __ATOMIC_RELAXED) < s->limit;
+}
+
+/* %HXMAPT_FROZEN: walk a frozen copy of a hash map */
+static int tmap_qfe_parallel_test(enum HXmap_type type, unsigned int flags)
+{
+	static const unsigned int nthreads[] = {4, 0, 1, 64};
+	static const uint32_t n = 20000;
+	struct HXmap *map, *walked, *frozen = NULL;
+	struct tmap_qfe_sum s;
+	uint32_t key;
+	unsigned int i;
+	int ret = EXIT_FAILURE;
+
+	tmap_printf("Parallel qfe test (type %u, flags %#x)\n", type, flags);
+	map = HXmap_init5(type == HXMAPT_FROZEN ? HXMAPT_HASH : type,
+	      HXMAP_IKEY | HXMAP_SINGULAR | flags, NULL, sizeof(key), 0);
+	if (map == NULL)
+		return EXIT_FAILURE;
+	for (key = 1; key <= n; ++key)
+		if (HXmap_add(map, &key, NULL) <= 0)
+			goto fail;
+	walked = map;
+	if (type == HXMAPT_FROZEN &&
+	    (walked = frozen = HXmap_freeze(map)) == NULL)
+		goto fail;
+
+	for (i = 0; i < ARRAY_SIZE(nthreads); ++i) {
+		memset(&s, 0, sizeof(s));
+		s.limit = SIZE_MAX;
+		if (HXmap_qfe_parallel(walked, tmap_qfe_sum, &s,
+		    nthreads[i]) != 0 || s.calls != n ||
+		    s.sum != static_cast(unsigned long long, n) * (n + 1) / 2)
+			goto fail;
+	}
+	/* Every call asks to stop, so no thread gets past its first one */
+	memset(&s, 0, sizeof(s));
+	s.limit = 1;
+	if (HXmap_qfe_parallel(walked, tmap_qfe_sum, &s, 4) != 0 ||
+	    s.calls < 1 || s.calls > 4)
+		goto fail;
+	ret = EXIT_SUCCESS;
+	goto out;
+ fail:
+	tmap_printf("Parallel qfe test failed\n");
+ out:
+	if (frozen != NULL)
+		HXmap_free(frozen);
+	HXmap_free(map);
+	return ret;
+}
+
+static int runner(void)
+{
+	static const enum HXmap_type all_types[] = {
+		HXMAPT_HASH, HXMAPT_RBTREE, HXMAPT_FLATHASH, HXMAPT_BTREE,
+		HXMAPT_SHARDED, HXMAPT_RCU,
+	};
+	unsigned int i;
+
+	if (HX_init() <= 0)
+		return EXIT_FAILURE;
+	tmap_zero();
+
+	tmap_printf("* HXhashmap\n");
+	int ret = tmap_generic_tests(HXMAPT_HASH, HXhash_djb2, "DJB2");
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	tmap_generic_tests(HXMAPT_HASH, HXhash_jlookup3s, "JL3");
+	tmap_generic_tests(HXMAPT_HASH, HXhash_wys, "WY");
+	tmap_generic_tests(HXMAPT_HASH, HXhash_crc32cs, "CRC32C");
+	ret = tmap_hash_test();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_reseed_test();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_load_test();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_bkmode_test(HXMAP_POW2);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_bkmode_test(HXMAP_FASTRANGE);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	tmap_hmap_test_1();
+	ret = tmap_hmap_test_2();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_hmap_test_3();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_hmap_test_4();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_reserve_test(HXMAPT_HASH);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_pool_test(HXMAPT_HASH);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* RBtree\n");
+	tmap_generic_tests(HXMAPT_RBTREE, NULL, "<NONE>");
+	tmap_rbt_test_1();
+	tmap_rbt_test_7();
+	ret = tmap_rbt_build_test();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_seek_test(HXMAPT_RBTREE, HXMAP_NONE);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_rbt_prev_test();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_seek_test(HXMAPT_RBTREE, HXMAP_THREADED);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_rbt_thread_test(HXMAP_THREADED);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_rbt_thread_test(HXMAP_THREADED | HXMAP_POOL);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_rbt_reader_test();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_pool_test(HXMAPT_RBTREE);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* Flat hashmap\n");
+	tmap_generic_tests(HXMAPT_FLATHASH, HXhash_djb2, "DJB2");
+	ret = tmap_fmap_test_1();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_fmap_test_2();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_reserve_test(HXMAPT_FLATHASH);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* B+tree\n");
+	ret = tmap_generic_tests(HXMAPT_BTREE, NULL, "<NONE>");
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_bpt_test_1();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_seek_test(HXMAPT_BTREE, HXMAP_NONE);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_bpt_seek_test(HXMAP_NOFLAGS);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_bpt_seek_test(HXMAP_DTRAV);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* Sharded hashmap\n");
+	ret = tmap_smap_test_1();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* Read-mostly map\n");
+	ret = tmap_rmap_test_1();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_rmap_test_2();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* Frozen map\n");
+	ret = tmap_zmap_test_1();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_zmap_test_2();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* Batched lookup\n");
+	for (i = 0; i < ARRAY_SIZE(all_types); ++i) {
+		ret = tmap_find_many_test(all_types[i]);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+
+	tmap_printf("\n* Caller-allocated iterators\n");
+	for (i = 0; i < ARRAY_SIZE(all_types); ++i) {
+		ret = tmap_iter_test(all_types[i]);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+
+	tmap_printf("\n* Statistics\n");
+	for (i = 0; i < ARRAY_SIZE(all_types); ++i) {
+		ret = tmap_stats_test(all_types[i]);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+
+	tmap_printf("\n* Inline key/value storage\n");
+	ret = tmap_inline_test(HXMAPT_HASH, HXMAP_NONE);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_inline_test(HXMAPT_HASH, HXMAP_POOL);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_inline_test(HXMAPT_RBTREE, HXMAP_NONE);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_inline_test(HXMAPT_RBTREE, HXMAP_THREADED | HXMAP_POOL);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_inline_test(HXMAPT_SHARDED, HXMAP_NONE);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* String pools\n");
+	ret = tmap_strpool_test();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* Find-or-insert\n");
+	for (i = 0; i < ARRAY_SIZE(all_types); ++i) {
+		if (all_types[i] == HXMAPT_RCU)
+			continue;
+		ret = tmap_upsert_test(all_types[i], HXMAP_NONE);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+	ret = tmap_upsert_test(HXMAPT_HASH, HXMAP_INLINE);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_upsert_test(HXMAPT_RBTREE, HXMAP_INLINE | HXMAP_POOL);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_upsert_plain_test();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* Byte range lookups\n");
+	for (i = 0; i < ARRAY_SIZE(all_types); ++i) {
+		ret = tmap_find_n_test(all_types[i], NULL);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+	ret = tmap_find_n_test(HXMAPT_HASH, HXhash_djb2);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_find_n_test(HXMAPT_HASH, HXhash_jlookup3s);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_find_n_test(HXMAPT_FLATHASH, HXhash_crc32cs);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_find_n_misc();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* Integer keys\n");
+	for (i = 0; i < ARRAY_SIZE(all_types); ++i) {
+		ret = tmap_ikey_test(all_types[i], sizeof(uint32_t));
+		if (ret != EXIT_SUCCESS)
+			return ret;
+		ret = tmap_ikey_test(all_types[i], sizeof(uint64_t));
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+	ret = tmap_ikey_misc();
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	tmap_printf("\n* Parallel qfe\n");
+	for (i = 0; i < ARRAY_SIZE(all_types); ++i) {
+		ret = tmap_qfe_parallel_test(all_types[i], HXMAP_NONE);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+	ret = tmap_qfe_parallel_test(HXMAPT_FROZEN, HXMAP_NONE);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_qfe_parallel_test(HXMAPT_HASH, HXMAP_INCREMENTAL);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+	ret = tmap_qfe_parallel_test(HXMAPT_RBTREE, HXMAP_THREADED);
+	if (ret != EXIT_SUCCESS)
+		return ret;
 
 	HX_exit();
 	return EXIT_SUCCESS;
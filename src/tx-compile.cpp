@@ -1,2 +1,3 @@
 #include "tc-compile.c"
+#include <libHX/map.hpp>
 #include <libHX/scope.hpp>
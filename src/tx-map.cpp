@@ -0,0 +1,139 @@
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <libHX/map.hpp>
+
+/* Both maps must agree with std::map after every operation. */
+template<typename M> static int tmap_compare(const M &m,
+    const std::map<unsigned int, unsigned int> &ref)
+{
+	size_t n = 0;
+
+	if (m.size() != ref.size())
+		return EXIT_FAILURE;
+	for (const auto &e : m) {
+		auto i = ref.find(e.first);
+		if (i == ref.end() || i->second != e.second)
+			return EXIT_FAILURE;
+		++n;
+	}
+	return n == ref.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+template<typename M> static int tmap_random(const char *name)
+{
+	std::map<unsigned int, unsigned int> ref;
+	M m;
+
+	printf("%s: random operations\n", name);
+	srand(1);
+	for (unsigned int i = 0; i < 200000; ++i) {
+		unsigned int key = rand() % 5000, op = rand() % 4;
+		if (op == 0) {
+			if (m.erase(key) != ref.erase(key))
+				return EXIT_FAILURE;
+		} else if (op == 1) {
+			auto r = m.insert_or_assign(key, i);
+			if (r.second != (ref.find(key) == ref.end()))
+				return EXIT_FAILURE;
+			ref[key] = i;
+		} else {
+			++m[key];
+			++ref[key];
+		}
+		if (i % 20000 == 0 && tmap_compare(m, ref) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	}
+	if (tmap_compare(m, ref) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	/* Erase every other element while iterating */
+	bool drop = false;
+	for (auto it = m.begin(); it != m.end(); drop = !drop) {
+		if (!drop) {
+			++it;
+			continue;
+		}
+		ref.erase(it->first);
+		it = m.erase(it);
+	}
+	if (tmap_compare(m, ref) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	m.clear();
+	return m.empty() && m.begin() == m.end() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+template<typename M> static int tmap_move(const char *name)
+{
+	M m;
+
+	printf("%s: move-only values\n", name);
+	for (unsigned int i = 0; i < 1000; ++i) {
+		auto r = m.try_emplace(std::to_string(i), new unsigned int(i));
+		if (!r.second || *r.first->second != i)
+			return EXIT_FAILURE;
+	}
+	/* An existing element is left alone, and the argument unconsumed */
+	std::unique_ptr<unsigned int> p(new unsigned int(7));
+	if (m.try_emplace("5", std::move(p)).second || p == nullptr)
+		return EXIT_FAILURE;
+	m.insert_or_assign("5", std::move(p));
+	if (p != nullptr || *m.find("5")->second != 7)
+		return EXIT_FAILURE;
+
+	M other(std::move(m));
+	if (other.size() != 1000 || !m.empty() || !other.contains("999") ||
+	    m.contains("999"))
+		return EXIT_FAILURE;
+	m = std::move(other);
+	return m.size() == 1000 && other.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int tmap_ordered()
+{
+	HX::ordered_map<unsigned int, unsigned int> m;
+	unsigned int prev = 0;
+	bool first = true;
+
+	printf("ordered_map: ordering and bounds\n");
+	for (unsigned int i = 0; i < 1000; ++i)
+		m[(i * 7919) % 1000 * 2] = i;
+	for (const auto &e : m) {
+		if (!first && e.first <= prev)
+			return EXIT_FAILURE;
+		prev  = e.first;
+		first = false;
+	}
+	auto it = m.end();
+	if ((--it)->first != 1998 || m.begin()->first != 0)
+		return EXIT_FAILURE;
+	/* Odd keys are absent: both bounds land on the next even key */
+	if (m.lower_bound(501)->first != 502 || m.upper_bound(501)->first != 502 ||
+	    m.lower_bound(502)->first != 502 || m.upper_bound(502)->first != 504 ||
+	    m.lower_bound(1999) != m.end())
+		return EXIT_FAILURE;
+	it = m.find(1000);
+	if (it == m.end() || (--it)->first != 998 || (++++it)->first != 1002)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
+
+int main()
+{
+	int ret;
+
+	ret = tmap_random<HX::hash_map<unsigned int, unsigned int>>("hash_map");
+	if (ret == EXIT_SUCCESS)
+		ret = tmap_random<HX::ordered_map<unsigned int, unsigned int>>("ordered_map");
+	if (ret == EXIT_SUCCESS)
+		ret = tmap_move<HX::hash_map<std::string, std::unique_ptr<unsigned int>>>("hash_map");
+	if (ret == EXIT_SUCCESS)
+		ret = tmap_move<HX::ordered_map<std::string, std::unique_ptr<unsigned int>>>("ordered_map");
+	if (ret == EXIT_SUCCESS)
+		ret = tmap_ordered();
+	if (ret != EXIT_SUCCESS)
+		fprintf(stderr, "FAILED\n");
+	return ret;
+}